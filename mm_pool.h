@@ -2,18 +2,73 @@
 #define MM_POOL_H
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
-/* 固定長要素を高速に確保/解放するシンプルなメモリプール */
-struct mm_pool {
-    void *mem;               /* 生メモリブロック */
-    size_t elem_size;        /* 1要素のサイズ */
-    size_t capacity;         /* 最大要素数 */
-    void *free_list;         /* 単方向リストで空き要素を管理（スロット先頭にnextを格納） */
-};
-
-int mm_pool_init(struct mm_pool *pool, size_t elem_size, size_t capacity);
-void mm_pool_destroy(struct mm_pool *pool);
-void *mm_pool_alloc(struct mm_pool *pool);
-void mm_pool_free(struct mm_pool *pool, void *ptr);
+/*
+ * 固定長要素を高速に確保/解放するシンプルなメモリプール。
+ * MM_POOL_DEFINE(name, type) で要素型ごとに特殊化したプールを生成する:
+ *   struct name と name_init / name_destroy / name_alloc / name_free / name_at / name_index
+ * 要素サイズが型から決まるので、確保時のゼロクリアやスロット位置の計算は定数になり、
+ * 呼び出し側へインライン展開される。空きスロットは要素の先頭にnextを重ねた単方向リストで管理する。
+ */
+#define MM_POOL_DEFINE(name, type)                                                  \
+    union name##_slot {                                                             \
+        type elem;                                                                  \
+        union name##_slot *next;                                                    \
+    };                                                                              \
+                                                                                    \
+    struct name {                                                                   \
+        union name##_slot *mem;       /* 生メモリブロック */                        \
+        size_t capacity;              /* 最大要素数 */                              \
+        union name##_slot *free_list; /* 空き要素 */                                \
+    };                                                                              \
+                                                                                    \
+    /* 確保したブロック上に空きスロットの単方向リストを構築。不正な引数なら-1 */    \
+    static inline int name##_init(struct name *pool, size_t capacity) {             \
+        if (!pool || capacity == 0) return -1;                                      \
+        pool->mem = (union name##_slot *)calloc(capacity, sizeof(*pool->mem));      \
+        if (!pool->mem) return -1;                                                  \
+        pool->capacity = capacity;                                                  \
+        pool->free_list = NULL;                                                     \
+        for (size_t i = 0; i < capacity; ++i) {                                     \
+            pool->mem[i].next = pool->free_list;                                    \
+            pool->free_list = &pool->mem[i];                                        \
+        }                                                                           \
+        return 0;                                                                   \
+    }                                                                               \
+                                                                                    \
+    static inline void name##_destroy(struct name *pool) {                          \
+        if (!pool) return;                                                          \
+        free(pool->mem);                                                            \
+        pool->mem = NULL;                                                           \
+        pool->free_list = NULL;                                                     \
+        pool->capacity = 0;                                                         \
+    }                                                                               \
+                                                                                    \
+    /* 空きがなければNULL。再利用時にゴミを残さないようゼロクリアして返す */          \
+    static inline type *name##_alloc(struct name *pool) {                           \
+        union name##_slot *s = pool->free_list;                                     \
+        if (!s) return NULL;                                                        \
+        pool->free_list = s->next;                                                  \
+        memset(s, 0, sizeof(*s));                                                   \
+        return &s->elem;                                                            \
+    }                                                                               \
+                                                                                    \
+    static inline void name##_free(struct name *pool, type *ptr) {                  \
+        if (!ptr) return;                                                           \
+        union name##_slot *s = (union name##_slot *)(void *)ptr;                    \
+        s->next = pool->free_list;                                                  \
+        pool->free_list = s;                                                        \
+    }                                                                               \
+                                                                                    \
+    /* スロット番号 i の要素（使用中かどうかは呼び出し側で見分ける） */              \
+    static inline type *name##_at(struct name *pool, size_t i) {                    \
+        return &pool->mem[i].elem;                                                  \
+    }                                                                               \
+                                                                                    \
+    static inline size_t name##_index(const struct name *pool, const type *ptr) {   \
+        return (size_t)((const union name##_slot *)(const void *)ptr - pool->mem);  \
+    }
 
 #endif
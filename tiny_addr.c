@@ -0,0 +1,81 @@
+#define _POSIX_C_SOURCE 200112L
+#include "tiny_addr.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+
+static void set_v4(struct nts_addr *out, const void *in4) {
+    memset(out->ip, 0, 10);
+    out->ip[10] = 0xff;
+    out->ip[11] = 0xff;
+    memcpy(out->ip + 12, in4, 4);
+}
+
+int nts_addr_from_sockaddr(struct nts_addr *out, const struct sockaddr *sa, socklen_t salen) {
+    if (!out || !sa) return -1;
+    if (sa->sa_family == AF_INET && salen >= (socklen_t)sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *)sa;
+        set_v4(out, &v4->sin_addr);
+        out->port = ntohs(v4->sin_port);
+        return 0;
+    }
+    if (sa->sa_family == AF_INET6 && salen >= (socklen_t)sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6 *v6 = (const struct sockaddr_in6 *)sa;
+        memcpy(out->ip, &v6->sin6_addr, sizeof(out->ip));
+        out->port = ntohs(v6->sin6_port);
+        return 0;
+    }
+    return -1;
+}
+
+socklen_t nts_addr_to_sockaddr(const struct nts_addr *a, struct sockaddr_storage *out) {
+    memset(out, 0, sizeof(*out));
+    if (nts_addr_is_v4(a)) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)out;
+        v4->sin_family = AF_INET;
+        memcpy(&v4->sin_addr, a->ip + 12, 4);
+        v4->sin_port = htons(a->port);
+        return (socklen_t)sizeof(*v4);
+    }
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)out;
+    v6->sin6_family = AF_INET6;
+    memcpy(&v6->sin6_addr, a->ip, sizeof(a->ip));
+    v6->sin6_port = htons(a->port);
+    return (socklen_t)sizeof(*v6);
+}
+
+int nts_addr_pton(struct nts_addr *out, const char *ip, uint16_t port) {
+    if (!out || !ip) return -1;
+    unsigned char buf[16];
+    if (inet_pton(AF_INET, ip, buf) == 1) {
+        set_v4(out, buf);
+    } else if (inet_pton(AF_INET6, ip, buf) == 1) {
+        memcpy(out->ip, buf, sizeof(out->ip));
+    } else {
+        return -1;
+    }
+    out->port = port;
+    return 0;
+}
+
+const char *nts_addr_ntop(const struct nts_addr *a, char *buf, size_t buflen) {
+    const char *r = nts_addr_is_v4(a) ? inet_ntop(AF_INET, a->ip + 12, buf, (socklen_t)buflen)
+                                      : inet_ntop(AF_INET6, a->ip, buf, (socklen_t)buflen);
+    if (!r && buflen > 0) snprintf(buf, buflen, "?");
+    return buf;
+}
+
+/* FNV-1a (IPの16バイト + ポート) */
+uint32_t nts_addr_hash(const struct nts_addr *a) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(a->ip); i++) {
+        h ^= a->ip[i];
+        h *= 16777619u;
+    }
+    h ^= (uint32_t)(a->port >> 8);
+    h *= 16777619u;
+    h ^= (uint32_t)(a->port & 0xffu);
+    h *= 16777619u;
+    return h;
+}
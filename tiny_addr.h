@@ -0,0 +1,46 @@
+#ifndef TINY_ADDR_H
+#define TINY_ADDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/*
+ * サーバが持つpeerのアドレス(IP + ポート)の固定長表現。
+ * IPv4も ::ffff:a.b.c.d (IPv4-mapped) の16バイトで持つので、比較とハッシュは
+ * ファミリによらず同じ長さの memcmp / バイト列で済み、文字列への変換は
+ * 応答の本文やログを作るときだけ行う。
+ */
+
+#define NTS_ADDR_STRLEN 46 /* INET6_ADDRSTRLEN */
+
+struct nts_addr {
+    uint8_t ip[16];
+    uint16_t port; /* host byte order。0は「アドレス無し」 */
+};
+
+static inline int nts_addr_is_set(const struct nts_addr *a) {
+    return a->port != 0;
+}
+
+static inline int nts_addr_is_v4(const struct nts_addr *a) {
+    static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return memcmp(a->ip, mapped, sizeof(mapped)) == 0;
+}
+
+static inline int nts_addr_equal(const struct nts_addr *a, const struct nts_addr *b) {
+    return a->port == b->port && memcmp(a->ip, b->ip, sizeof(a->ip)) == 0;
+}
+
+/* sockaddr_in / sockaddr_in6 から変換する。それ以外のファミリなら-1 */
+int nts_addr_from_sockaddr(struct nts_addr *out, const struct sockaddr *sa, socklen_t salen);
+/* sockaddr へ戻す（IPv4-mapped は sockaddr_in）。長さを返す */
+socklen_t nts_addr_to_sockaddr(const struct nts_addr *a, struct sockaddr_storage *out);
+/* 数値表記のIP文字列から作る。読めなければ-1 */
+int nts_addr_pton(struct nts_addr *out, const char *ip, uint16_t port);
+/* IP部分を数値表記で buf へ書き、buf を返す（IPv4はドット表記） */
+const char *nts_addr_ntop(const struct nts_addr *a, char *buf, size_t buflen);
+uint32_t nts_addr_hash(const struct nts_addr *a);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef TINY_CONFIG_H
+#define TINY_CONFIG_H
+
+/*
+ * ビルドプロファイルごとの大きさと間隔。Makefile のターゲットで選ぶ:
+ *   make small : -DNTS_PROFILE_SMALL  組み込み向け。IDを短くし、表・バッファ・キャッシュを小さくする
+ *   make fast  : -DNTS_PROFILE_FAST   多数のpeerを捌くサーバ向け。表とキャッシュを大きくする
+ *   make       : 既定値
+ * どの値も -D で個別に上書きできる。IDの幅やバッファの大きさは構造体の形を変えるので、
+ * プロファイルを変えるときは全体を作り直す（make small / make fast は clean してから作る）。
+ */
+
+#if defined(NTS_PROFILE_SMALL)
+
+#define NTS_CFG_ID_MAX            15
+#define NTS_CFG_TABLE_CAPACITY    16
+#define NTS_CFG_TABLE_BUCKETS     64
+#define NTS_CFG_BUF_SIZE          512
+#define NTS_CFG_BUF_POOL_COUNT    2
+#define NTS_CFG_KA_TICK_MS        2000
+#define NTS_CFG_QC_SLOTS          64
+#define NTS_CFG_QC_NOTIFY_SLOTS   16
+#define P2P_CFG_MAX_PEERS         16
+#define P2P_CFG_HASH_BUCKETS      16
+#define P2P_CFG_LINE_MAX          256
+
+#elif defined(NTS_PROFILE_FAST)
+
+#define NTS_CFG_ID_MAX            63
+#define NTS_CFG_TABLE_CAPACITY    4096
+#define NTS_CFG_TABLE_BUCKETS     65536
+#define NTS_CFG_BUF_SIZE          2048
+#define NTS_CFG_BUF_POOL_COUNT    64
+#define NTS_CFG_KA_TICK_MS        1000
+#define NTS_CFG_QC_SLOTS          16384
+#define NTS_CFG_QC_NOTIFY_SLOTS   1024
+#define P2P_CFG_MAX_PEERS         4096
+#define P2P_CFG_HASH_BUCKETS      4096
+#define P2P_CFG_LINE_MAX          512
+
+#else
+
+#define NTS_CFG_ID_MAX            63
+#define NTS_CFG_TABLE_CAPACITY    16
+#define NTS_CFG_TABLE_BUCKETS     1024
+#define NTS_CFG_BUF_SIZE          1024
+#define NTS_CFG_BUF_POOL_COUNT    8
+#define NTS_CFG_KA_TICK_MS        1000
+#define NTS_CFG_QC_SLOTS          1024
+#define NTS_CFG_QC_NOTIFY_SLOTS   256
+#define P2P_CFG_MAX_PEERS         1024
+#define P2P_CFG_HASH_BUCKETS      256
+#define P2P_CFG_LINE_MAX          512
+
+#endif
+
+/* サーバ */
+#ifndef NTS_ID_MAX
+#define NTS_ID_MAX             NTS_CFG_ID_MAX            /* IDの最大長（表のキーの幅） */
+#endif
+#ifndef NTS_TABLE_CAPACITY
+#define NTS_TABLE_CAPACITY     NTS_CFG_TABLE_CAPACITY    /* 登録できるID数の既定値（起動引数で変えられる） */
+#endif
+#ifndef NTS_TABLE_BUCKETS
+#define NTS_TABLE_BUCKETS      NTS_CFG_TABLE_BUCKETS     /* ID→ノードのハッシュ表の大きさ（2の冪） */
+#endif
+#ifndef NTS_BUF_SIZE
+#define NTS_BUF_SIZE           NTS_CFG_BUF_SIZE          /* 受信バッファ1つの大きさ */
+#endif
+#ifndef NTS_BUF_POOL_COUNT
+#define NTS_BUF_POOL_COUNT     NTS_CFG_BUF_POOL_COUNT    /* 受信バッファの数 */
+#endif
+#ifndef NTS_KA_MIN_MS
+#define NTS_KA_MIN_MS          10000                     /* keep-aliveをこれより短い間隔にはしない */
+#endif
+#ifndef NTS_KA_TICK_MS
+#define NTS_KA_TICK_MS         NTS_CFG_KA_TICK_MS        /* keep-aliveスレッドの起床間隔 */
+#endif
+#ifndef NTS_QC_SLOTS
+#define NTS_QC_SLOTS           NTS_CFG_QC_SLOTS          /* 問い合わせキャッシュのスロット数(直接写像) */
+#endif
+#ifndef NTS_QC_NOTIFY_SLOTS
+#define NTS_QC_NOTIFY_SLOTS    NTS_CFG_QC_NOTIFY_SLOTS   /* 通知をまとめる対象の数(直接写像) */
+#endif
+
+/* クライアント */
+#ifndef P2P_MAX_PEERS
+#define P2P_MAX_PEERS          P2P_CFG_MAX_PEERS         /* 同時に扱うセッション数の上限 */
+#endif
+#ifndef P2P_HASH_BUCKETS
+#define P2P_HASH_BUCKETS       P2P_CFG_HASH_BUCKETS      /* アドレス→セッションのハッシュ表サイズ */
+#endif
+#ifndef P2P_LINE_MAX
+#define P2P_LINE_MAX           P2P_CFG_LINE_MAX          /* 標準入力・サーバ応答の1行の上限 */
+#endif
+#ifndef P2P_KEEPALIVE_MS
+#define P2P_KEEPALIVE_MS       5000                      /* 送信がこの時間途絶えたらPROBEを送る */
+#endif
+
+#if (NTS_TABLE_BUCKETS & (NTS_TABLE_BUCKETS - 1)) != 0
+#error "NTS_TABLE_BUCKETS must be a power of two"
+#endif
+#if NTS_ID_MAX > 255
+#error "NTS_ID_MAX must fit the 1-byte id length of ROSTER entries"
+#endif
+
+#endif
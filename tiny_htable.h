@@ -0,0 +1,82 @@
+#ifndef TINY_HTABLE_H
+#define TINY_HTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 固定長キーのチェイン法ハッシュ索引を型ごとに生成する。
+ * NTS_HTABLE_DEFINE(name, node_type, key, link, nbuckets) で
+ *   struct name と name_init / name_destroy / name_hash / name_find / name_insert / name_remove
+ * を static inline で作る。
+ *   key      : ノード内の固定長配列のメンバ（例: info.id）。キーは常にこの幅全体で比べるので、
+ *              文字列なら末尾を0で埋めておく
+ *   link     : 同じバケットの次を指す node_type * のメンバ
+ *   nbuckets : バケット数（2の冪の定数）
+ * キー幅とバケット数がコンパイル時に決まるので、ハッシュのループと memcmp は定数長になり展開される。
+ * ノードの確保とロックは呼び出し側で行う。
+ */
+
+/* 8バイト単位のFNV-1aに最後の攪拌を足したもの。len は定数で呼ばれる前提 */
+static inline uint32_t nts_htable_hash_bytes(const void *key, size_t len) {
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+    }
+    for (; i < len; i++) h = (h ^ p[i]) * 1099511628211ull;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+#define NTS_HTABLE_DEFINE(name, node_type, key, link, nbuckets)                              \
+    enum { name##_KEY_LEN = sizeof(((node_type *)0)->key), name##_BUCKETS = (nbuckets) };     \
+                                                                                              \
+    struct name {                                                                             \
+        node_type **buckets;                                                                  \
+    };                                                                                        \
+                                                                                              \
+    static inline int name##_init(struct name *t) {                                           \
+        t->buckets = (node_type **)calloc(name##_BUCKETS, sizeof(*t->buckets));               \
+        return t->buckets ? 0 : -1;                                                           \
+    }                                                                                         \
+                                                                                              \
+    static inline void name##_destroy(struct name *t) {                                       \
+        free(t->buckets);                                                                     \
+        t->buckets = NULL;                                                                    \
+    }                                                                                         \
+                                                                                              \
+    static inline node_type **name##_bucket(struct name *t, const void *k) {                  \
+        return &t->buckets[nts_htable_hash_bytes(k, name##_KEY_LEN) & (name##_BUCKETS - 1)];  \
+    }                                                                                         \
+                                                                                              \
+    /* k (name##_KEY_LEN バイト) のノード。無ければNULL */                                   \
+    static inline node_type *name##_find(struct name *t, const void *k) {                     \
+        for (node_type *n = *name##_bucket(t, k); n; n = n->link)                             \
+            if (memcmp(n->key, k, name##_KEY_LEN) == 0) return n;                             \
+        return NULL;                                                                          \
+    }                                                                                         \
+                                                                                              \
+    static inline void name##_insert(struct name *t, node_type *n) {                          \
+        node_type **b = name##_bucket(t, n->key);                                             \
+        n->link = *b;                                                                         \
+        *b = n;                                                                               \
+    }                                                                                         \
+                                                                                              \
+    static inline void name##_remove(struct name *t, node_type *n) {                          \
+        for (node_type **pp = name##_bucket(t, n->key); *pp; pp = &(*pp)->link) {             \
+            if (*pp == n) {                                                                   \
+                *pp = n->link;                                                                \
+                return;                                                                       \
+            }                                                                                 \
+        }                                                                                     \
+    }
+
+#endif
@@ -0,0 +1,315 @@
+#define _POSIX_C_SOURCE 200112L
+#include "tiny_keepalive.h"
+
+#include <string.h>
+#include <time.h>
+
+/* NATの種類ごとの開始間隔と上限 */
+static const struct {
+    const char *name;
+    uint32_t start_ms;
+    uint32_t max_ms;
+} nat_defaults[NTS_NAT_CLASSES] = {
+    [NTS_NAT_NONE]   = { "none",   60000, 600000 },
+    [NTS_NAT_CGN]    = { "cgn",    20000, 120000 },
+    [NTS_NAT_PUBLIC] = { "public", 30000, 300000 },
+};
+
+uint64_t nts_ka_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+/* サーバから見た送信元アドレスの範囲でNATの種類を推定する */
+enum nts_nat_class nts_ka_classify(const struct nts_addr *addr)
+{
+    if (!addr)
+        return NTS_NAT_PUBLIC;
+    const uint8_t *a = addr->ip;
+    if (nts_addr_is_v4(addr)) {
+        uint32_t v = (uint32_t)a[12] << 24 | (uint32_t)a[13] << 16 | (uint32_t)a[14] << 8 | a[15];
+        if ((v >> 24) == 127 || (v >> 24) == 10 ||
+            (v >> 20) == (172u << 4 | 1) || (v >> 16) == (192u << 8 | 168) ||
+            (v >> 16) == (169u << 8 | 254))
+            return NTS_NAT_NONE;
+        if ((v >> 22) == (100u << 2 | 1)) /* 100.64.0.0/10 */
+            return NTS_NAT_CGN;
+        return NTS_NAT_PUBLIC;
+    }
+    static const uint8_t loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    if (memcmp(a, loopback, sizeof(loopback)) == 0 ||
+        (a[0] == 0xfe && (a[1] & 0xc0) == 0x80) || /* リンクローカル fe80::/10 */
+        (a[0] & 0xfe) == 0xfc)                     /* ULA fc00::/7 */
+        return NTS_NAT_NONE;
+    return NTS_NAT_PUBLIC;
+}
+
+const char *nts_ka_class_name(enum nts_nat_class c)
+{
+    return c < NTS_NAT_CLASSES ? nat_defaults[c].name : "?";
+}
+
+static uint32_t with_margin(uint32_t ms)
+{
+    uint32_t v = (uint32_t)((uint64_t)ms * (100 - NTS_KA_MARGIN_PCT) / 100);
+    return v < NTS_KA_MIN_MS ? NTS_KA_MIN_MS : v;
+}
+
+/* 探索をやめたら探索用マッピングは使わない（再開時に古いマッピングの無通信時間を測らない） */
+static void drop_probe(struct nts_ka_state *ka)
+{
+    memset(&ka->probe_addr, 0, sizeof(ka->probe_addr));
+    ka->probe_pending_ms = 0;
+    ka->probe_retry = 0;
+}
+
+/* lo/hi から次の間隔を決める */
+static void adjust(struct nts_ka_state *ka)
+{
+    uint32_t max_ms = nat_defaults[ka->nat_class].max_ms;
+
+    if (ka->hi_ms == 0) {
+        /* 上限未知: 倍々に伸ばす。クラスの上限に達したらそこで確定 */
+        if (ka->lo_ms >= max_ms) {
+            ka->phase = NTS_KA_LEARNED;
+            ka->interval_ms = max_ms;
+            drop_probe(ka);
+            return;
+        }
+        uint32_t next = ka->lo_ms ? ka->lo_ms * 2 : ka->interval_ms;
+        ka->interval_ms = next > max_ms ? max_ms : next;
+        return;
+    }
+
+    /* 上限既知: 幅が十分狭くなるまで二分探索 */
+    uint32_t resolution = ka->lo_ms / 8 > 5000 ? ka->lo_ms / 8 : 5000;
+    if (ka->hi_ms <= ka->lo_ms + resolution) {
+        ka->phase = NTS_KA_LEARNED;
+        ka->interval_ms = with_margin(ka->lo_ms);
+        drop_probe(ka);
+        return;
+    }
+    ka->phase = NTS_KA_PROBING;
+    ka->interval_ms = ka->lo_ms + (ka->hi_ms - ka->lo_ms) / 2;
+}
+
+/* 主マッピングへ送る間隔: 推定済みならその間隔、探索中は応答のあった無通信時間にマージンをかけたもの */
+static uint32_t refresh_policy(const struct nts_ka_state *ka)
+{
+    if (ka->phase == NTS_KA_NO_ACK)
+        return NTS_KA_LEGACY_MS;
+    if (ka->phase == NTS_KA_LEARNED)
+        return ka->interval_ms;
+    return with_margin(ka->lo_ms);
+}
+
+void nts_ka_init(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms)
+{
+    memset(ka, 0, sizeof(*ka));
+    ka->nat_class = (uint8_t)nts_ka_classify(addr);
+    ka->phase = NTS_KA_PROBING;
+    ka->interval_ms = nat_defaults[ka->nat_class].start_ms;
+    ka->refresh_ms = refresh_policy(ka);
+    ka->last_active_ms = now_ms;
+}
+
+uint64_t nts_ka_next_ms(const struct nts_ka_state *ka)
+{
+    if (ka->phase == NTS_KA_NO_ACK)
+        return ka->last_active_ms + NTS_KA_LEGACY_MS;
+    if (ka->retry && ka->pending_ms == 0)
+        return 0; /* 再送は即時 */
+    if (ka->pending_ms)
+        return ka->pending_ms + NTS_KA_ACK_TIMEOUT_MS;
+    return ka->last_active_ms + ka->refresh_ms;
+}
+
+uint32_t nts_ka_expect_ms(const struct nts_ka_state *ka)
+{
+    return refresh_policy(ka);
+}
+
+int nts_ka_want_probe(const struct nts_ka_state *ka)
+{
+    return ka->phase == NTS_KA_PROBING && !nts_addr_is_set(&ka->probe_addr);
+}
+
+int nts_ka_due(const struct nts_ka_state *ka, uint64_t now_ms)
+{
+    return ka->pending_ms == 0 && now_ms >= nts_ka_next_ms(ka);
+}
+
+void nts_ka_on_sent(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    if (st) st->sent++;
+    /* 予告した間隔で次を送る（途中で推定が進んでも予告より遅らせない） */
+    ka->refresh_ms = refresh_policy(ka);
+    if (ka->phase == NTS_KA_NO_ACK) {
+        /* 応答は来ないので待たない。次はここから固定間隔 */
+        ka->last_active_ms = now_ms;
+        return;
+    }
+    /* 再送時は最初の送信時点の無通信時間を評価し続ける */
+    if (!ka->retry)
+        ka->idle_ms = (uint32_t)(now_ms - ka->last_active_ms);
+    ka->pending_ms = now_ms;
+}
+
+void nts_ka_on_ack(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    ka->acked = 1;
+    if (ka->phase == NTS_KA_NO_ACK) {
+        /* ACKを返すようになった（クライアントの入れ替えなど）: 探索からやり直す */
+        ka->phase = NTS_KA_PROBING;
+        ka->unanswered = 0;
+        ka->interval_ms = nat_defaults[ka->nat_class].start_ms;
+        ka->refresh_ms = refresh_policy(ka);
+        ka->last_active_ms = now_ms;
+        if (st) st->acked++;
+        return;
+    }
+    ka->last_active_ms = now_ms;
+    if (ka->pending_ms == 0 && !ka->retry)
+        return;
+    ka->pending_ms = 0;
+    ka->retry = 0;
+    if (st) st->acked++;
+}
+
+void nts_ka_on_seen(struct nts_ka_state *ka, uint64_t now_ms)
+{
+    ka->last_active_ms = now_ms;
+}
+
+/* idle_ms の無通信でマッピングが失われたと判断した: 探索の上限を詰める */
+static void on_expired(struct nts_ka_state *ka, uint32_t idle_ms, struct nts_ka_stats *st)
+{
+    if (ka->hi_ms == 0 || idle_ms < ka->hi_ms)
+        ka->hi_ms = idle_ms;
+    if (ka->lo_ms >= ka->hi_ms)
+        ka->lo_ms = ka->hi_ms / 2;
+    if (ka->lo_ms == 0)
+        ka->lo_ms = NTS_KA_MIN_MS;
+    if (st) st->expired++;
+    adjust(ka);
+}
+
+/* 主マッピングが切れた: クライアントは登録し直してくる */
+static void on_primary_expired(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    ka->pending_ms = 0;
+    ka->retry = 0;
+    ka->last_active_ms = now_ms;
+    on_expired(ka, ka->idle_ms, st);
+}
+
+void nts_ka_on_rebind(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    /*
+     * KEEPALIVEの応答待ち中に別ポートから登録し直してきた = その無通信時間でマッピングが切れた。
+     * 応答待ちでなければクライアントの再起動などとみなし、寿命の推定には使わない。
+     */
+    if (ka->pending_ms || ka->retry) {
+        on_primary_expired(ka, now_ms, st);
+        return;
+    }
+    enum nts_nat_class c = nts_ka_classify(addr);
+    if (c != ka->nat_class)
+        nts_ka_init(ka, addr, now_ms);
+    else
+        ka->last_active_ms = now_ms;
+}
+
+int nts_ka_check_timeout(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    if (ka->pending_ms == 0 || now_ms < ka->pending_ms + NTS_KA_ACK_TIMEOUT_MS)
+        return 0;
+    if (!ka->retry) {
+        /* 1回目: 単なるパケット喪失かもしれないので再送する */
+        ka->retry = 1;
+        ka->pending_ms = 0;
+        return 1;
+    }
+    on_primary_expired(ka, now_ms, st);
+    if (!ka->acked && ++ka->unanswered >= NTS_KA_NOACK_CYCLES) {
+        /* 一度も応答が無い: 寿命ではなくACK非対応のクライアント。探索をやめて固定間隔にする */
+        ka->phase = NTS_KA_NO_ACK;
+        ka->interval_ms = NTS_KA_LEGACY_MS;
+        drop_probe(ka);
+    }
+    return 0;
+}
+
+/* ---------- 探索用マッピング ---------- */
+
+void nts_ka_on_probe_open(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms,
+                          struct nts_ka_stats *st)
+{
+    if (ka->phase != NTS_KA_PROBING)
+        return;
+    /* 応答待ちのまま作り直してきた = 前の探索用マッピングはその無通信時間で切れた */
+    if ((ka->probe_pending_ms || ka->probe_retry) && !nts_addr_equal(&ka->probe_addr, addr)) {
+        drop_probe(ka);
+        on_expired(ka, ka->probe_idle_ms, st);
+        if (ka->phase != NTS_KA_PROBING)
+            return;
+    }
+    ka->probe_addr = *addr;
+    ka->probe_active_ms = now_ms;
+}
+
+int nts_ka_probe_due(const struct nts_ka_state *ka, uint64_t now_ms)
+{
+    if (ka->phase != NTS_KA_PROBING || !nts_addr_is_set(&ka->probe_addr) || ka->probe_pending_ms)
+        return 0;
+    return ka->probe_retry || now_ms >= ka->probe_active_ms + ka->interval_ms;
+}
+
+uint32_t nts_ka_probe_expect_ms(const struct nts_ka_state *ka)
+{
+    uint32_t max_ms = nat_defaults[ka->nat_class].max_ms;
+    uint32_t v = ka->hi_ms ? ka->hi_ms : ka->interval_ms * 2;
+    return v > max_ms ? max_ms : v;
+}
+
+void nts_ka_on_probe_sent(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    if (st) st->sent++;
+    if (!ka->probe_retry)
+        ka->probe_idle_ms = (uint32_t)(now_ms - ka->probe_active_ms);
+    ka->probe_pending_ms = now_ms;
+}
+
+void nts_ka_on_probe_ack(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    ka->acked = 1;
+    ka->probe_active_ms = now_ms;
+    if (ka->probe_pending_ms == 0 && !ka->probe_retry)
+        return;
+    if (ka->probe_idle_ms > ka->lo_ms)
+        ka->lo_ms = ka->probe_idle_ms;
+    if (ka->hi_ms && ka->lo_ms >= ka->hi_ms)
+        ka->hi_ms = 0; /* 以前の失敗は一時的な喪失だった */
+    ka->probe_pending_ms = 0;
+    ka->probe_retry = 0;
+    if (st) st->acked++;
+    adjust(ka);
+}
+
+int nts_ka_check_probe_timeout(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st)
+{
+    if (ka->probe_pending_ms == 0 || now_ms < ka->probe_pending_ms + NTS_KA_ACK_TIMEOUT_MS)
+        return 0;
+    if (!ka->probe_retry) {
+        ka->probe_retry = 1;
+        ka->probe_pending_ms = 0;
+        return 1;
+    }
+    /* 探索用マッピングが切れただけで、主マッピングはそのまま。次のKEEPALIVEで作り直しを頼む */
+    uint32_t idle = ka->probe_idle_ms;
+    drop_probe(ka);
+    on_expired(ka, idle, st);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef TINY_KEEPALIVE_H
+#define TINY_KEEPALIVE_H
+
+#include <stdint.h>
+#include "tiny_addr.h"
+#include "tiny_config.h"
+
+/*
+ * peerごとのNATバインディング寿命の推定と keep-alive 間隔の決定。
+ *
+ * 「最後にそのマッピングで通信してから何ms無通信でもKEEPALIVEが届くか」を
+ * 間隔を倍々に伸ばしながら探り(クライアントは KEEPALIVE_ACK を返す)、
+ * 応答が途絶えた間隔を上限として二分探索で詰める。寿命が分かったら
+ * その (100 - NTS_KA_MARGIN_PCT)% の間隔で送る。
+ * 探りすぎるとそのマッピングは失われるので、探索はクライアントが別ソケットで作る探索用マッピング
+ * ("KAPROBE <id>" で知らせてくる) で行い、登録したマッピングには応答のあった無通信時間に
+ * マージンをかけた間隔で送り続ける。探索用マッピングが無い間は、主マッピングへのKEEPALIVEに
+ * " PROBE" を付けて作るよう頼む（作らないクライアントは探索が進まず、短い間隔のまま保つ）。
+ * 開始値と上限はNATの種類(送信元アドレスの範囲から推定)ごとに変える。
+ * 一度もACKを返さないまま NTS_KA_NOACK_CYCLES 回応答が途絶えたクライアントは
+ * KEEPALIVE_ACK を知らないとみなし、従来の固定間隔 (NTS_KA_LEGACY_MS) で応答を待たずに送る。
+ */
+
+#ifndef NTS_KA_ACK_TIMEOUT_MS
+#define NTS_KA_ACK_TIMEOUT_MS  3000  /* KEEPALIVE_ACK を待つ時間 */
+#endif
+#define NTS_KA_MARGIN_PCT      20    /* 推定寿命に対する安全マージン */
+#ifndef NTS_KA_NOACK_CYCLES
+#define NTS_KA_NOACK_CYCLES    2     /* ACKを一度も返さないまま途絶えたらACK非対応とみなす回数 */
+#endif
+#ifndef NTS_KA_LEGACY_MS
+#define NTS_KA_LEGACY_MS       15000 /* ACK非対応のクライアントへの固定間隔 */
+#endif
+
+enum nts_nat_class {
+    NTS_NAT_NONE,   /* ループバック/プライベート: 間にNATが無い想定 */
+    NTS_NAT_CGN,    /* 100.64.0.0/10: キャリアグレードNAT。寿命が短いことが多い */
+    NTS_NAT_PUBLIC, /* グローバルアドレス: 一般的な家庭用NATの外側 */
+    NTS_NAT_CLASSES
+};
+
+enum nts_ka_phase {
+    NTS_KA_PROBING, /* 寿命を探索中 */
+    NTS_KA_LEARNED, /* 推定済み: lo_ms にマージンをかけた間隔で送る */
+    NTS_KA_NO_ACK,  /* ACK非対応: NTS_KA_LEGACY_MS ごとに送り、応答を待たない */
+};
+
+struct nts_ka_state {
+    uint8_t nat_class;
+    uint8_t phase;
+    uint8_t retry;           /* 主マッピングへのKEEPALIVEに応答が無かったので再送済み */
+    uint8_t acked;           /* 一度でもACKを受けた */
+    uint8_t unanswered;      /* ACKを一度も受けないまま途絶えた回数 */
+    uint8_t probe_retry;     /* 探索用マッピングへのKEEPALIVEを再送済み */
+    uint32_t interval_ms;    /* 探索中: 探索用マッピングで試す無通信時間 / 推定済み: 送信間隔 */
+    uint32_t refresh_ms;     /* 主マッピングへの次のKEEPALIVEまでの間隔（送るたびに決めて予告する） */
+    uint32_t lo_ms;          /* 応答があった最大の無通信時間 */
+    uint32_t hi_ms;          /* 応答が途絶えた最小の無通信時間 (0は未知) */
+    uint32_t idle_ms;        /* 応答待ちの主KEEPALIVEを送った時点の無通信時間 */
+    uint32_t probe_idle_ms;  /* 応答待ちの探索用KEEPALIVEを送った時点の無通信時間 */
+    uint64_t last_active_ms; /* 最後に主マッピング(登録したアドレス)で通信した時刻 */
+    uint64_t pending_ms;     /* 応答待ちの主KEEPALIVEの送信時刻 (0は無し) */
+    struct nts_addr probe_addr;  /* 探索用マッピング（ポート0は無し） */
+    uint64_t probe_active_ms;    /* 最後に探索用マッピングで通信した時刻 */
+    uint64_t probe_pending_ms;   /* 応答待ちの探索用KEEPALIVEの送信時刻 (0は無し) */
+};
+
+/* 集計（ログ用） */
+struct nts_ka_stats {
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t expired; /* 寿命切れと判断した回数 */
+};
+
+uint64_t nts_ka_now_ms(void);
+enum nts_nat_class nts_ka_classify(const struct nts_addr *addr);
+const char *nts_ka_class_name(enum nts_nat_class c);
+
+void nts_ka_init(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms);
+/* 今主マッピングへKEEPALIVEを送るべきなら1 */
+int nts_ka_due(const struct nts_ka_state *ka, uint64_t now_ms);
+/* 主マッピングへ次に送るべき時刻 */
+uint64_t nts_ka_next_ms(const struct nts_ka_state *ka);
+/* 次のKEEPALIVEまでの最大の間隔（クライアントへ伝え、途絶えたら再登録させる） */
+uint32_t nts_ka_expect_ms(const struct nts_ka_state *ka);
+/* 探索用マッピングを作るよう頼むべきなら1（KEEPALIVEに " PROBE" を付ける） */
+int nts_ka_want_probe(const struct nts_ka_state *ka);
+void nts_ka_on_sent(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+void nts_ka_on_ack(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+/* 同じマッピングから register/query などが届いた */
+void nts_ka_on_seen(struct nts_ka_state *ka, uint64_t now_ms);
+/* 同じIDが別のIP/ポートから登録し直した */
+void nts_ka_on_rebind(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms, struct nts_ka_stats *st);
+/* 応答待ちの期限切れを処理する。再送すべきなら1 */
+int nts_ka_check_timeout(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+
+/* 探索用マッピング: 上の主マッピング用の関数と同じ役割 */
+void nts_ka_on_probe_open(struct nts_ka_state *ka, const struct nts_addr *addr, uint64_t now_ms,
+                          struct nts_ka_stats *st);
+int nts_ka_probe_due(const struct nts_ka_state *ka, uint64_t now_ms);
+uint32_t nts_ka_probe_expect_ms(const struct nts_ka_state *ka);
+void nts_ka_on_probe_sent(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+void nts_ka_on_probe_ack(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+int nts_ka_check_probe_timeout(struct nts_ka_state *ka, uint64_t now_ms, struct nts_ka_stats *st);
+
+#endif
@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200112L
+#include "tiny_netsim.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PUB_BASE   0xC6120000u /* 198.18.0.0/15: ベンチマーク用のアドレス範囲 */
+#define PRIV_BASE  0x0A000000u /* 10.0.0.0/8 */
+#define PUB_MAX    ((1u << 17) - 2)
+#define EXT_PORT_BASE 20000
+
+/* 配送待ちのパケット（イベントの引数） */
+struct netsim_pkt {
+    struct netsim *sim;
+    uint32_t src_ip;
+    uint16_t src_port;
+    uint32_t dst_ip;
+    uint16_t dst_port;
+    size_t len;
+    unsigned char data[];
+};
+
+static const char *const nat_names[NETSIM_NAT_TYPES] = {
+    [NETSIM_NAT_NONE]            = "none",
+    [NETSIM_NAT_FULL_CONE]       = "full-cone",
+    [NETSIM_NAT_RESTRICTED]      = "restricted",
+    [NETSIM_NAT_PORT_RESTRICTED] = "port-restricted",
+    [NETSIM_NAT_SYMMETRIC]       = "symmetric",
+};
+
+const char *netsim_nat_name(enum netsim_nat nat)
+{
+    return nat < NETSIM_NAT_TYPES ? nat_names[nat] : "?";
+}
+
+uint32_t netsim_rand(struct netsim *sim)
+{
+    uint64_t x = sim->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sim->rng = x;
+    return (uint32_t)((x * 2685821657736338717ull) >> 32);
+}
+
+uint64_t netsim_now(const struct netsim *sim)
+{
+    return sim->now;
+}
+
+/* ---------- イベントヒープ ---------- */
+
+static int ev_less(const struct netsim_event *a, const struct netsim_event *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+int netsim_at(struct netsim *sim, uint64_t at_us, void (*fn)(void *arg), void *arg)
+{
+    if (sim->nheap == sim->heapcap) {
+        size_t cap = sim->heapcap ? sim->heapcap * 2 : 1024;
+        struct netsim_event *h = (struct netsim_event *)realloc(sim->heap, cap * sizeof(*h));
+        if (!h)
+            return -1;
+        sim->heap = h;
+        sim->heapcap = cap;
+    }
+    if (at_us < sim->now)
+        at_us = sim->now;
+    size_t i = sim->nheap++;
+    struct netsim_event ev = { .at = at_us, .seq = sim->seq++, .fn = fn, .arg = arg };
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!ev_less(&ev, &sim->heap[parent]))
+            break;
+        sim->heap[i] = sim->heap[parent];
+        i = parent;
+    }
+    sim->heap[i] = ev;
+    return 0;
+}
+
+static struct netsim_event heap_pop(struct netsim *sim)
+{
+    struct netsim_event top = sim->heap[0];
+    struct netsim_event last = sim->heap[--sim->nheap];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= sim->nheap)
+            break;
+        if (child + 1 < sim->nheap && ev_less(&sim->heap[child + 1], &sim->heap[child]))
+            child++;
+        if (!ev_less(&sim->heap[child], &last))
+            break;
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+    if (sim->nheap > 0)
+        sim->heap[i] = last;
+    return top;
+}
+
+uint64_t netsim_run(struct netsim *sim, uint64_t until_us)
+{
+    uint64_t n = 0;
+    while (sim->nheap > 0 && sim->heap[0].at <= until_us) {
+        struct netsim_event ev = heap_pop(sim);
+        sim->now = ev.at;
+        ev.fn(ev.arg);
+        n++;
+    }
+    if (sim->now < until_us && until_us != UINT64_MAX)
+        sim->now = until_us;
+    sim->st.events += n;
+    return n;
+}
+
+/* ---------- NAT ---------- */
+
+static struct netsim_node *node_by_ip(struct netsim *sim, uint32_t ip)
+{
+    if (ip <= PUB_BASE || ip - PUB_BASE > sim->nnodes)
+        return NULL;
+    return sim->nodes[ip - PUB_BASE - 1];
+}
+
+static int mapping_alive(const struct netsim_node *n, const struct netsim_mapping *m, uint64_t now)
+{
+    return now - m->last_out_us <= (uint64_t)n->mapping_ms * 1000u;
+}
+
+static int perm_add(struct netsim_mapping *m, uint32_t ip, uint16_t port)
+{
+    for (size_t i = 0; i < m->nperms; i++) {
+        if (m->perms[i].ip == ip && m->perms[i].port == port)
+            return 0;
+    }
+    if (m->nperms == m->permcap) {
+        size_t cap = m->permcap ? m->permcap * 2 : 4;
+        struct netsim_perm *p = (struct netsim_perm *)realloc(m->perms, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        m->perms = p;
+        m->permcap = cap;
+    }
+    m->perms[m->nperms].ip = ip;
+    m->perms[m->nperms].port = port;
+    m->nperms++;
+    return 0;
+}
+
+/* 内側から dst へ送るときの外側ポートを決める（無ければ作る、期限切れなら付け替える） */
+static struct netsim_mapping *map_outbound(struct netsim_node *n, uint32_t dst_ip, uint16_t dst_port, uint64_t now)
+{
+    int sym = n->nat == NETSIM_NAT_SYMMETRIC;
+    struct netsim_mapping *m = NULL;
+    for (size_t i = 0; i < n->nmaps; i++) {
+        struct netsim_mapping *c = &n->maps[i];
+        if (!sym || (c->dst_ip == dst_ip && c->dst_port == dst_port)) {
+            m = c;
+            break;
+        }
+    }
+    if (m && !mapping_alive(n, m, now)) {
+        /* 寿命切れ: 新しいポートで作り直す（サーバからは別ポートに見える） */
+        m->ext_port = n->next_port++;
+        m->nperms = 0;
+    }
+    if (!m) {
+        if (n->nmaps == n->mapcap) {
+            size_t cap = n->mapcap ? n->mapcap * 2 : 2;
+            struct netsim_mapping *p = (struct netsim_mapping *)realloc(n->maps, cap * sizeof(*p));
+            if (!p)
+                return NULL;
+            n->maps = p;
+            n->mapcap = cap;
+        }
+        m = &n->maps[n->nmaps++];
+        memset(m, 0, sizeof(*m));
+        m->ext_port = n->next_port++;
+        m->dst_ip = dst_ip;
+        m->dst_port = dst_port;
+    }
+    m->last_out_us = now;
+    if (perm_add(m, dst_ip, dst_port) != 0)
+        return NULL;
+    return m;
+}
+
+/* 外から届いたパケットを通すか */
+static int map_inbound(struct netsim_node *n, uint16_t ext_port, uint32_t src_ip, uint16_t src_port, uint64_t now)
+{
+    if (n->nat == NETSIM_NAT_NONE)
+        return ext_port == n->port;
+    for (size_t i = 0; i < n->nmaps; i++) {
+        struct netsim_mapping *m = &n->maps[i];
+        if (m->ext_port != ext_port)
+            continue;
+        if (!mapping_alive(n, m, now))
+            return 0;
+        if (n->nat == NETSIM_NAT_FULL_CONE)
+            return 1;
+        for (size_t k = 0; k < m->nperms; k++) {
+            if (m->perms[k].ip != src_ip)
+                continue;
+            if (n->nat == NETSIM_NAT_RESTRICTED || m->perms[k].port == src_port)
+                return 1;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+/* ---------- 送受信 ---------- */
+
+static uint64_t link_delay(struct netsim *sim, const struct netsim_link *l)
+{
+    uint64_t d = l->latency_us;
+    if (l->jitter_us)
+        d += netsim_rand(sim) % (l->jitter_us + 1);
+    return d;
+}
+
+static int link_lost(struct netsim *sim, const struct netsim_link *l)
+{
+    return l->loss_ppm && netsim_rand(sim) % 1000000u < l->loss_ppm;
+}
+
+static void deliver(void *arg)
+{
+    struct netsim_pkt *p = (struct netsim_pkt *)arg;
+    struct netsim *sim = p->sim;
+    struct netsim_node *dst = node_by_ip(sim, p->dst_ip);
+
+    if (!dst) {
+        sim->st.unroutable++;
+    } else if (!map_inbound(dst, p->dst_port, p->src_ip, p->src_port, sim->now)) {
+        sim->st.filtered++;
+    } else {
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(p->src_ip);
+        src.sin_port = htons(p->src_port);
+        sim->st.delivered++;
+        dst->st.rx_pkts++;
+        dst->st.rx_bytes += p->len;
+        if (dst->recv)
+            dst->recv(dst->user, p->data, p->len, (struct sockaddr *)&src, sizeof(src));
+    }
+    free(p);
+}
+
+static ssize_t node_sendto(void *ctx, int sock, const void *buf, size_t len,
+                           const struct sockaddr *to, socklen_t tolen)
+{
+    (void)sock;
+    struct netsim_node *n = (struct netsim_node *)ctx;
+    struct netsim *sim = n->sim;
+    if (to->sa_family != AF_INET || tolen < (socklen_t)sizeof(struct sockaddr_in))
+        return -1;
+    const struct sockaddr_in *d = (const struct sockaddr_in *)to;
+    uint32_t dst_ip = ntohl(d->sin_addr.s_addr);
+    uint16_t dst_port = ntohs(d->sin_port);
+
+    uint16_t src_port = n->port;
+    if (n->nat != NETSIM_NAT_NONE) {
+        struct netsim_mapping *m = map_outbound(n, dst_ip, dst_port, sim->now);
+        if (!m)
+            return -1;
+        src_port = m->ext_port;
+    }
+    n->st.tx_pkts++;
+    n->st.tx_bytes += len;
+    sim->st.sent++;
+
+    /* 送信側と受信側のリンクを両方通る */
+    struct netsim_node *dst = node_by_ip(sim, dst_ip);
+    if (link_lost(sim, &n->link) || (dst && link_lost(sim, &dst->link))) {
+        sim->st.lost++;
+        return (ssize_t)len;
+    }
+    uint64_t delay = link_delay(sim, &n->link) + (dst ? link_delay(sim, &dst->link) : 0);
+
+    struct netsim_pkt *p = (struct netsim_pkt *)malloc(sizeof(*p) + len);
+    if (!p)
+        return -1;
+    p->sim = sim;
+    p->src_ip = n->pub_ip;
+    p->src_port = src_port;
+    p->dst_ip = dst_ip;
+    p->dst_port = dst_port;
+    p->len = len;
+    memcpy(p->data, buf, len);
+    if (netsim_at(sim, sim->now + delay, deliver, p) != 0) {
+        free(p);
+        return -1;
+    }
+    return (ssize_t)len;
+}
+
+static uint64_t node_now_us(void *ctx)
+{
+    return ((struct netsim_node *)ctx)->sim->now;
+}
+
+static void node_after(void *ctx, unsigned ms, void (*fn)(void *arg), void *arg)
+{
+    struct netsim *sim = ((struct netsim_node *)ctx)->sim;
+    netsim_at(sim, sim->now + (uint64_t)ms * 1000u, fn, arg);
+}
+
+/* ---------- 網の構築 ---------- */
+
+int netsim_init(struct netsim *sim, uint64_t seed)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->now = NETSIM_START_US;
+    /*
+     * 小さな seed をそのまま xorshift の状態にすると、最初の数十回は上位ビットの疎な状態が続き、
+     * 損失の抽選が偏る。splitmix64 で攪拌してから使う
+     */
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    sim->rng = z ? z : 0x9E3779B97F4A7C15ull;
+    return 0;
+}
+
+void netsim_dispose(struct netsim *sim)
+{
+    for (size_t i = 0; i < sim->nheap; i++) {
+        if (sim->heap[i].fn == deliver)
+            free(sim->heap[i].arg);
+    }
+    free(sim->heap);
+    for (size_t i = 0; i < sim->nnodes; i++) {
+        struct netsim_node *n = sim->nodes[i];
+        for (size_t k = 0; k < n->nmaps; k++)
+            free(n->maps[k].perms);
+        free(n->maps);
+        free(n);
+    }
+    free(sim->nodes);
+    memset(sim, 0, sizeof(*sim));
+}
+
+struct netsim_node *netsim_add_node(struct netsim *sim, enum netsim_nat nat, const struct netsim_link *link,
+                                    uint32_t mapping_ms, uint16_t port, netsim_recv_fn recv, void *user)
+{
+    if (nat >= NETSIM_NAT_TYPES || sim->nnodes >= PUB_MAX)
+        return NULL;
+    if (sim->nnodes == sim->nodecap) {
+        size_t cap = sim->nodecap ? sim->nodecap * 2 : 64;
+        struct netsim_node **p = (struct netsim_node **)realloc(sim->nodes, cap * sizeof(*p));
+        if (!p)
+            return NULL;
+        sim->nodes = p;
+        sim->nodecap = cap;
+    }
+    struct netsim_node *n = (struct netsim_node *)calloc(1, sizeof(*n));
+    if (!n)
+        return NULL;
+    uint32_t idx = (uint32_t)sim->nnodes + 1;
+    n->sim = sim;
+    n->nat = nat;
+    n->pub_ip = PUB_BASE + idx;
+    n->priv_ip = nat == NETSIM_NAT_NONE ? n->pub_ip : PRIV_BASE + idx;
+    n->port = port;
+    if (link)
+        n->link = *link;
+    n->mapping_ms = mapping_ms;
+    n->next_port = (uint16_t)(EXT_PORT_BASE + netsim_rand(sim) % 20000u);
+    n->recv = recv;
+    n->user = user;
+    n->tp.sendto = node_sendto;
+    n->tp.now_us = node_now_us;
+    n->tp.after = node_after;
+    n->tp.ctx = n;
+    sim->nodes[sim->nnodes++] = n;
+    return n;
+}
+
+void netsim_node_public_addr(const struct netsim_node *n, struct sockaddr_in *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_addr.s_addr = htonl(n->pub_ip);
+    out->sin_port = htons(n->port);
+}
@@ -0,0 +1,133 @@
+#ifndef TINY_NETSIM_H
+#define TINY_NETSIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "tiny_transport.h"
+
+/*
+ * 1プロセス内で動く決定的な仮想UDP網。
+ * イベントは仮想時刻の二分ヒープで順に処理するので、壁時計を待たずに実時間より速く進む。
+ * 乱数は seed から決まり、同じ seed と同じ操作列なら同じ結果になる。
+ *
+ * 各ノードは自分専用のNAT(または直結)の内側にあり、コア網との間に片道の遅延・ジッタ・損失を持つ。
+ * ノードごとの tiny_transport を nts_server / p2p_engine に渡すと、実ソケットの代わりにこの網で送受信する。
+ */
+
+#define NETSIM_START_US  1000000u /* 仮想時刻の開始値（0を「未設定」に使うコードがあるため） */
+
+enum netsim_nat {
+    NETSIM_NAT_NONE,            /* グローバルアドレス直結 */
+    NETSIM_NAT_FULL_CONE,       /* 1度外へ送ったマッピングへは誰からでも届く */
+    NETSIM_NAT_RESTRICTED,      /* 送ったことのあるIPからだけ受ける */
+    NETSIM_NAT_PORT_RESTRICTED, /* 送ったことのあるIP:ポートからだけ受ける */
+    NETSIM_NAT_SYMMETRIC,       /* 宛先ごとに別の外側ポートを割り当てる（ポート制限付き） */
+    NETSIM_NAT_TYPES
+};
+
+/* ノードとコア網の間の片道の性質 */
+struct netsim_link {
+    uint32_t latency_us;
+    uint32_t jitter_us;  /* 遅延に 0..jitter_us を足す（到着順は入れ替わりうる） */
+    uint32_t loss_ppm;   /* 百万分率の損失 */
+};
+
+struct netsim_perm {
+    uint32_t ip;
+    uint16_t port;
+};
+
+/* NATの1マッピング（host byte order） */
+struct netsim_mapping {
+    uint16_t ext_port;
+    uint32_t dst_ip;             /* 対称NATのときだけキーに使う */
+    uint16_t dst_port;
+    uint64_t last_out_us;        /* 最後に内側から外へ送った時刻 */
+    struct netsim_perm *perms;   /* 送ったことのある相手（フィルタ用） */
+    size_t nperms;
+    size_t permcap;
+};
+
+typedef void (*netsim_recv_fn)(void *user, const void *buf, size_t len,
+                               const struct sockaddr *src, socklen_t srclen);
+
+struct netsim_node_stats {
+    uint64_t tx_pkts;
+    uint64_t tx_bytes;
+    uint64_t rx_pkts;
+    uint64_t rx_bytes;
+};
+
+struct netsim;
+
+struct netsim_node {
+    struct netsim *sim;
+    enum netsim_nat nat;
+    uint32_t pub_ip;             /* 外から見えるIP */
+    uint32_t priv_ip;            /* NATの内側のIP（直結なら pub_ip） */
+    uint16_t port;               /* ノードが使うローカルポート */
+    struct netsim_link link;
+    uint32_t mapping_ms;         /* 外向きの通信がこの時間無いとマッピングが消える */
+    struct netsim_mapping *maps;
+    size_t nmaps;
+    size_t mapcap;
+    uint16_t next_port;          /* 次に割り当てる外側ポート */
+    netsim_recv_fn recv;
+    void *user;
+    struct tiny_transport tp;    /* ctx はこのノード */
+    struct netsim_node_stats st;
+};
+
+struct netsim_event {
+    uint64_t at;
+    uint64_t seq;                /* 同時刻のイベントは登録順 */
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct netsim_stats {
+    uint64_t events;
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t lost;               /* リンクの損失 */
+    uint64_t filtered;           /* NATが捨てた（マッピング無し/期限切れ/許可外） */
+    uint64_t unroutable;         /* 宛先IPが存在しない */
+};
+
+struct netsim {
+    uint64_t now;
+    uint64_t seq;
+    uint64_t rng;
+    struct netsim_event *heap;
+    size_t nheap;
+    size_t heapcap;
+    struct netsim_node **nodes;  /* 添字 = 公開IPの連番 */
+    size_t nnodes;
+    size_t nodecap;
+    struct netsim_stats st;
+};
+
+int netsim_init(struct netsim *sim, uint64_t seed);
+void netsim_dispose(struct netsim *sim);
+
+/*
+ * ノードを追加する。port はノード側のローカルポート。
+ * mapping_ms はNATのマッピング寿命（NETSIM_NAT_NONE では無視）。失敗でNULL
+ */
+struct netsim_node *netsim_add_node(struct netsim *sim, enum netsim_nat nat, const struct netsim_link *link,
+                                    uint32_t mapping_ms, uint16_t port, netsim_recv_fn recv, void *user);
+/* 外から見たアドレス（直結ノードの待ち受けアドレス。NAT内側のノードには使わない） */
+void netsim_node_public_addr(const struct netsim_node *n, struct sockaddr_in *out);
+
+uint64_t netsim_now(const struct netsim *sim);
+/* 仮想時刻 at_us に fn(arg) を呼ぶ。失敗で-1 */
+int netsim_at(struct netsim *sim, uint64_t at_us, void (*fn)(void *arg), void *arg);
+/* until_us までイベントを処理する（それより先のイベントは残す）。処理したイベント数を返す */
+uint64_t netsim_run(struct netsim *sim, uint64_t until_us);
+/* 網で使っている乱数（xorshift64*） */
+uint32_t netsim_rand(struct netsim *sim);
+
+const char *netsim_nat_name(enum netsim_nat nat);
+
+#endif
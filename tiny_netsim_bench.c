@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tiny_netsim.h"
+#include "tiny_stun_server.h"
+#include "tiny_query_cache.h"
+#include "tiny_p2p_session.h"
+#include "tiny_p2p_req.h"
+#include "tiny_trace.h"
+
+/*
+ * 仮想網(tiny_netsim.c)の上で、本物のサーバ処理(nts_server_dispatch)と
+ * クライアントの要求レイヤ/セッションエンジンを動かし、
+ * register → query → PUNCH → punch → 最初のチャット行 までを数千クライアントで測る。
+ *
+ * クライアントは2つずつ組になり、偶数番は登録して待ち、奇数番は登録後に相手を問い合わせる。
+ * -P では全ての問い合わせ側が0番(人気peer)を問い合わせる。
+ */
+
+#define SERVER_PORT     3478
+#define CLIENT_PORT     40000
+#define SERVER_LAT_US   2000    /* サーバ側リンクの片道遅延 */
+#define ID_BASE         1000
+#define HELLO           "hello\n"
+
+struct bench_opts {
+    unsigned pairs;
+    int nat;              /* -1 は混在 */
+    unsigned latency_ms;
+    unsigned jitter_ms;
+    double loss_pct;
+    unsigned binding_s;   /* NATのマッピング寿命 */
+    unsigned ramp_ms;     /* クライアントの起動をこの範囲に散らす */
+    unsigned duration_s;
+    uint64_t seed;
+    int popular;
+};
+
+struct bench_client {
+    struct netsim_node *node;
+    struct p2p_engine eng;
+    struct p2p_request rq[2];
+    size_t nreq;
+    struct p2p_rtt est;
+    uint32_t id;
+    uint32_t peer_id;     /* 問い合わせ側のみ */
+    int started;
+    int failed;           /* 要求が再送上限に達した/punchがタイムアウトした */
+    uint64_t start_us;
+    uint64_t resolved_us;
+    uint64_t established_us;
+    uint64_t hello_us;    /* 相手から最初のチャット行を受けた時刻 */
+    uint64_t timer_at;    /* 予約済みのタイマイベント（0は無し） */
+};
+
+struct bench {
+    struct bench_opts o;
+    struct netsim sim;
+    struct netsim_node *server_node;
+    struct sockaddr_in server_addr;
+    struct nts_ctx table;
+    struct nts_server srv;
+    struct bench_client *clients;
+    size_t nclients;
+    uint64_t end_us;
+};
+
+/* NATの混在比率（百分率）: 直結/フルコーン/制限/ポート制限/対称 */
+static const unsigned nat_mix_pct[NETSIM_NAT_TYPES] = { 10, 20, 20, 35, 15 };
+
+static enum netsim_nat pick_nat(struct bench *b)
+{
+    if (b->o.nat >= 0)
+        return (enum netsim_nat)b->o.nat;
+    unsigned r = netsim_rand(&b->sim) % 100u;
+    for (int i = 0; i < NETSIM_NAT_TYPES; i++) {
+        if (r < nat_mix_pct[i])
+            return (enum netsim_nat)i;
+        r -= nat_mix_pct[i];
+    }
+    return NETSIM_NAT_PORT_RESTRICTED;
+}
+
+/* ---------- クライアント ---------- */
+
+static void client_kick(struct bench_client *c);
+
+static void client_timer(void *arg)
+{
+    struct bench_client *c = (struct bench_client *)arg;
+    if (c->timer_at == netsim_now(c->node->sim))
+        c->timer_at = 0;
+    client_kick(c);
+}
+
+/* 要求の再送とエンジンのタイマを進め、次の期限でイベントを予約する */
+static void client_kick(struct bench_client *c)
+{
+    struct bench *b = (struct bench *)c->eng.user;
+    uint64_t now = netsim_now(&b->sim);
+    uint64_t wake = p2p_engine_timers(&c->eng);
+
+    for (size_t i = 0; i < c->nreq; i++) {
+        struct p2p_request *rq = &c->rq[i];
+        if (rq->done)
+            continue;
+        if (now >= rq->next_at) {
+            if (rq->tries >= P2P_REQ_MAX_TRIES) {
+                rq->done = P2P_REQ_FAILED;
+                c->failed = 1;
+                continue;
+            }
+            p2p_req_transmit(&c->node->tp, -1, rq, c->id, (struct sockaddr *)&b->server_addr,
+                             sizeof(b->server_addr), now);
+        }
+        if (rq->next_at < wake)
+            wake = rq->next_at;
+    }
+
+    if (wake != UINT64_MAX && wake < b->end_us && (c->timer_at == 0 || wake < c->timer_at)) {
+        c->timer_at = wake;
+        netsim_at(&b->sim, wake, client_timer, c);
+    }
+}
+
+static void client_recv(void *user, const void *buf, size_t len,
+                        const struct sockaddr *src, socklen_t srclen)
+{
+    struct bench_client *c = (struct bench_client *)user;
+    struct bench *b = (struct bench *)c->eng.user;
+    uint64_t now = netsim_now(&b->sim);
+    char text[P2P_BUF_SIZE + 1];
+    if (len > P2P_BUF_SIZE)
+        return;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+
+    int from_server = p2p_addr_equal(src, srclen, (struct sockaddr *)&b->server_addr, sizeof(b->server_addr));
+    if (from_server && p2p_req_match(c->rq, c->nreq, text, src, srclen, c->id, &c->est, now)) {
+        struct p2p_request *q = c->nreq > 1 ? &c->rq[1] : NULL;
+        if (q && q->done == P2P_REQ_OK && c->resolved_us == 0) {
+            struct sockaddr_storage addr;
+            socklen_t addrlen;
+            c->resolved_us = now;
+            if (p2p_make_addr(q->ip, q->port, c->eng.family, &addr, &addrlen) == 0) {
+                struct p2p_session *s = p2p_engine_connect(&c->eng, q->peer_id, (struct sockaddr *)&addr, addrlen);
+                if (s && !s->trace)
+                    s->trace = q->trace;
+            }
+        } else if (q && q->done == P2P_REQ_NOTFOUND) {
+            c->failed = 1;
+        }
+    } else {
+        p2p_engine_input(&c->eng, text, len, src, srclen);
+    }
+    client_kick(c);
+}
+
+static void client_start(void *arg)
+{
+    struct bench_client *c = (struct bench_client *)arg;
+    c->started = 1;
+    c->start_us = netsim_now(c->node->sim);
+    for (size_t i = 0; i < c->nreq; i++)
+        p2p_req_reset(&c->rq[i], &c->est);
+    client_kick(c);
+}
+
+static void on_established(struct p2p_engine *eng, struct p2p_session *s)
+{
+    struct bench_client *c = (struct bench_client *)((char *)eng - offsetof(struct bench_client, eng));
+    if (c->established_us == 0)
+        c->established_us = s->established_us;
+    p2p_engine_send(eng, s, HELLO, sizeof(HELLO) - 1);
+}
+
+static void on_data(struct p2p_engine *eng, struct p2p_session *s, const char *buf, size_t len)
+{
+    (void)s;
+    struct bench_client *c = (struct bench_client *)((char *)eng - offsetof(struct bench_client, eng));
+    if (c->hello_us == 0 && len == sizeof(HELLO) - 1 && memcmp(buf, HELLO, len) == 0)
+        c->hello_us = netsim_now(c->node->sim);
+}
+
+static void on_closed(struct p2p_engine *eng, struct p2p_session *s, const char *reason)
+{
+    (void)reason;
+    struct bench_client *c = (struct bench_client *)((char *)eng - offsetof(struct bench_client, eng));
+    if (s->state == P2P_PUNCHING && c->peer_id == s->peer_id)
+        c->failed = 1;
+}
+
+static const struct p2p_engine_ops bench_ops = {
+    .on_established = on_established,
+    .on_data = on_data,
+    .on_closed = on_closed,
+};
+
+/* ---------- サーバ ---------- */
+
+static void server_recv(void *user, const void *buf, size_t len,
+                        const struct sockaddr *src, socklen_t srclen)
+{
+    struct bench *b = (struct bench *)user;
+    nts_server_dispatch(&b->srv, buf, len, src, srclen);
+}
+
+static void server_tick(void *arg)
+{
+    struct bench *b = (struct bench *)arg;
+    nts_server_tick(&b->srv);
+    uint64_t next = netsim_now(&b->sim) + NTS_KA_TICK_MS * 1000u;
+    if (next < b->end_us)
+        netsim_at(&b->sim, next, server_tick, b);
+}
+
+/* ---------- 集計 ---------- */
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_ms(const uint64_t *v, size_t n, double p)
+{
+    if (n == 0)
+        return 0.0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)v[i] / 1000.0;
+}
+
+static void report(struct bench *b, double wall_s)
+{
+    size_t inits = 0, ok = 0, hello = 0, failed = 0;
+    size_t by_ok[NETSIM_NAT_TYPES][NETSIM_NAT_TYPES] = {{0}};
+    size_t by_n[NETSIM_NAT_TYPES][NETSIM_NAT_TYPES] = {{0}};
+    uint64_t *tte = (uint64_t *)calloc(b->nclients, sizeof(uint64_t));
+    uint64_t *ttr = (uint64_t *)calloc(b->nclients, sizeof(uint64_t));
+    size_t ntte = 0, nttr = 0;
+
+    for (size_t i = 1; i < b->nclients; i += 2) {
+        struct bench_client *c = &b->clients[i];
+        struct bench_client *peer = &b->clients[c->peer_id - ID_BASE];
+        /* 相手がまだ起動していない間の待ちは数えない */
+        uint64_t t0 = c->start_us > peer->start_us ? c->start_us : peer->start_us;
+        inits++;
+        by_n[c->node->nat][peer->node->nat]++;
+        if (c->established_us) {
+            ok++;
+            by_ok[c->node->nat][peer->node->nat]++;
+            if (tte) tte[ntte++] = c->established_us > t0 ? c->established_us - t0 : 0;
+        } else if (c->failed) {
+            failed++;
+        }
+        if (c->resolved_us && ttr)
+            ttr[nttr++] = c->resolved_us > t0 ? c->resolved_us - t0 : 0;
+        if (c->hello_us)
+            hello++;
+    }
+    if (tte) qsort(tte, ntte, sizeof(*tte), cmp_u64);
+    if (ttr) qsort(ttr, nttr, sizeof(*ttr), cmp_u64);
+
+    double sim_s = (double)(b->end_us - NETSIM_START_US) / 1e6;
+    printf("netsim: clients=%zu nat=%s latency=%ums jitter=%ums loss=%.2f%% binding=%us seed=%llu%s\n",
+           b->nclients, b->o.nat < 0 ? "mix" : netsim_nat_name((enum netsim_nat)b->o.nat),
+           b->o.latency_ms, b->o.jitter_ms, b->o.loss_pct, b->o.binding_s,
+           (unsigned long long)b->o.seed, b->o.popular ? " popular" : "");
+    printf("simulated %.1f s in %.3f s wall (%.0fx real time), events=%llu\n",
+           sim_s, wall_s, wall_s > 0 ? sim_s / wall_s : 0.0, (unsigned long long)b->sim.st.events);
+    printf("established: %zu/%zu initiators (%.1f%%), failed=%zu, hello received=%zu\n",
+           ok, inits, inits ? 100.0 * (double)ok / (double)inits : 0.0, failed, hello);
+    printf("time-to-resolve   (ms): p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           pct_ms(ttr, nttr, 0.5), pct_ms(ttr, nttr, 0.9), pct_ms(ttr, nttr, 0.99), pct_ms(ttr, nttr, 1.0));
+    printf("time-to-establish (ms): p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           pct_ms(tte, ntte, 0.5), pct_ms(tte, ntte, 0.9), pct_ms(tte, ntte, 0.99), pct_ms(tte, ntte, 1.0));
+
+    if (b->o.nat < 0) {
+        printf("success by NAT (initiator \\ responder):\n%-16s", "");
+        for (int j = 0; j < NETSIM_NAT_TYPES; j++)
+            printf(" %15s", netsim_nat_name((enum netsim_nat)j));
+        printf("\n");
+        for (int i = 0; i < NETSIM_NAT_TYPES; i++) {
+            printf("%-16s", netsim_nat_name((enum netsim_nat)i));
+            for (int j = 0; j < NETSIM_NAT_TYPES; j++) {
+                if (by_n[i][j])
+                    printf(" %8zu/%-6zu", by_ok[i][j], by_n[i][j]);
+                else
+                    printf(" %15s", "-");
+            }
+            printf("\n");
+        }
+    }
+
+    const struct netsim_node_stats *ss = &b->server_node->st;
+    struct nts_qc_stats qs;
+    nts_qc_get_stats(b->srv.qc, &qs);
+    printf("server: rx=%llu tx=%llu pkts (%.1f rx/s, %.2f rx per client), cache hits=%llu misses=%llu, "
+           "punch lines=%llu datagrams=%llu\n",
+           (unsigned long long)ss->rx_pkts, (unsigned long long)ss->tx_pkts,
+           sim_s > 0 ? (double)ss->rx_pkts / sim_s : 0.0,
+           b->nclients ? (double)ss->rx_pkts / (double)b->nclients : 0.0,
+           (unsigned long long)qs.hits, (unsigned long long)qs.misses,
+           (unsigned long long)qs.notify_lines, (unsigned long long)qs.notify_datagrams);
+    printf("network: sent=%llu delivered=%llu lost=%llu nat-filtered=%llu unroutable=%llu\n",
+           (unsigned long long)b->sim.st.sent, (unsigned long long)b->sim.st.delivered,
+           (unsigned long long)b->sim.st.lost, (unsigned long long)b->sim.st.filtered,
+           (unsigned long long)b->sim.st.unroutable);
+    free(tte);
+    free(ttr);
+}
+
+/* ---------- main ---------- */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n pairs] [-m none|full|restricted|port|symmetric|mix] [-l latency_ms]\n"
+            "          [-j jitter_ms] [-p loss_pct] [-b binding_s] [-r ramp_ms] [-t duration_s]\n"
+            "          [-s seed] [-P]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_nat(const char *s)
+{
+    static const char *const names[NETSIM_NAT_TYPES] = { "none", "full", "restricted", "port", "symmetric" };
+    if (strcmp(s, "mix") == 0)
+        return -1;
+    for (int i = 0; i < NETSIM_NAT_TYPES; i++) {
+        if (strcmp(s, names[i]) == 0)
+            return i;
+    }
+    return -2;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.o.pairs = 500;
+    b.o.nat = -1;
+    b.o.latency_ms = 20;
+    b.o.jitter_ms = 5;
+    b.o.loss_pct = 1.0;
+    b.o.binding_s = 30;
+    b.o.ramp_ms = 2000;
+    b.o.duration_s = 30;
+    b.o.seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:l:j:p:b:r:t:s:P")) != -1) {
+        switch (opt) {
+        case 'n': b.o.pairs = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'm': b.o.nat = parse_nat(optarg); if (b.o.nat < -1) usage(argv[0]); break;
+        case 'l': b.o.latency_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'j': b.o.jitter_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'p': b.o.loss_pct = strtod(optarg, NULL); break;
+        case 'b': b.o.binding_s = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'r': b.o.ramp_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 't': b.o.duration_s = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 's': b.o.seed = strtoull(optarg, NULL, 10); break;
+        case 'P': b.o.popular = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (b.o.pairs == 0 || b.o.duration_s == 0)
+        usage(argv[0]);
+
+    /* TINY_TRACE=<dir> なら仮想時間で全接続の段階を記録し、ヒストグラムを表示する */
+    ttr_open_env("netsim");
+    netsim_init(&b.sim, b.o.seed);
+    p2p_rand_seed((uint32_t)(b.o.seed * 2654435761u));
+    b.end_us = NETSIM_START_US + (uint64_t)b.o.duration_s * 1000000u;
+    b.nclients = (size_t)b.o.pairs * 2;
+
+    /* サーバ: 直結、リンクは短く損失無し */
+    struct netsim_link slink = { .latency_us = SERVER_LAT_US };
+    b.server_node = netsim_add_node(&b.sim, NETSIM_NAT_NONE, &slink, 0, SERVER_PORT, server_recv, &b);
+    netsim_node_public_addr(b.server_node, &b.server_addr);
+    if (nts_init(&b.table, b.nclients + 16) != 0 ||
+        nts_server_init(&b.srv, -1, &b.table, &b.server_node->tp) != 0) {
+        fprintf(stderr, "server init failed\n");
+        return 1;
+    }
+
+    struct netsim_link clink = {
+        .latency_us = b.o.latency_ms * 1000u / 2, /* -l は往復のクライアント側遅延 */
+        .jitter_us = b.o.jitter_ms * 1000u,
+        .loss_ppm = (uint32_t)(b.o.loss_pct * 10000.0),
+    };
+    b.clients = (struct bench_client *)calloc(b.nclients, sizeof(*b.clients));
+    if (!b.clients) {
+        perror("calloc");
+        return 1;
+    }
+    for (size_t i = 0; i < b.nclients; i++) {
+        struct bench_client *c = &b.clients[i];
+        c->id = ID_BASE + (uint32_t)i;
+        c->node = netsim_add_node(&b.sim, pick_nat(&b), &clink, b.o.binding_s * 1000u,
+                                  CLIENT_PORT, client_recv, c);
+        size_t cap = (b.o.popular && i == 0) ? b.nclients : 4;
+        if (!c->node ||
+            p2p_engine_init_transport(&c->eng, &c->node->tp, c->id, (struct sockaddr *)&b.server_addr,
+                                      sizeof(b.server_addr), cap, &bench_ops, &b) != 0) {
+            fprintf(stderr, "client init failed\n");
+            return 1;
+        }
+        c->eng.quiet = 1;
+        p2p_rtt_init(&c->est);
+        c->rq[0].kind = P2P_REQ_REGISTER;
+        c->nreq = 1;
+        if (i % 2 == 1) {
+            c->peer_id = b.o.popular ? ID_BASE : c->id - 1;
+            c->rq[1].kind = P2P_REQ_QUERY;
+            c->rq[1].peer_id = c->peer_id;
+            c->rq[1].trace = ttr_new_id();
+            c->nreq = 2;
+        }
+        uint64_t at = NETSIM_START_US + (b.o.ramp_ms ? (uint64_t)(netsim_rand(&b.sim) % b.o.ramp_ms) * 1000u : 0);
+        netsim_at(&b.sim, at, client_start, c);
+    }
+    netsim_at(&b.sim, NETSIM_START_US + NTS_KA_TICK_MS * 1000u, server_tick, &b);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    netsim_run(&b.sim, b.end_us);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    report(&b, wall);
+    if (ttr_enabled()) {
+        ttr_print_histograms(stdout);
+        ttr_write();
+        ttr_close();
+    }
+
+    for (size_t i = 0; i < b.nclients; i++)
+        p2p_engine_dispose(&b.clients[i].eng);
+    free(b.clients);
+    nts_server_dispose(&b.srv);
+    nts_dispose(&b.table);
+    netsim_dispose(&b.sim);
+    return 0;
+}
@@ -0,0 +1,2253 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_pool.h"
+#include "tiny_htable.h"
+#include "tiny_netsim.h"
+#include "tiny_keepalive.h"
+#include "tiny_timer_wheel.h"
+#include "tiny_p2p_session.h"
+#include "tiny_p2p_cache.h"
+#include "tiny_p2p_req.h"
+#include "tiny_p2p_rel.h"
+#include "tiny_p2p_xfer.h"
+#include "tiny_peer_table.h"
+#include "tiny_query_cache.h"
+#include "tiny_roster.h"
+#include "tiny_stun_server.h"
+#include "tiny_trace.h"
+
+/*
+ * 仮想網(tiny_netsim.c)の上で動かす回帰テスト。`make test` で実行する。
+ * 偽のサーバや攻撃者のノードから任意のデータグラムを送り、
+ * 要求レイヤ・セッションエンジン・信頼性レイヤが受け付けてはいけないものを受け付けないことを確かめる。
+ * 時刻だけで決まる部品(keep-alive・転送の受け入れ・タイマホイール)やサーバの表も同じ実行ファイルで確かめる。
+ * 失敗したCHECKを表示し、1つでもあれば終了コード1を返す。
+ */
+
+#define SERVER_PORT   3478
+#define CLIENT_PORT   40000
+#define ATTACKER_PORT 6666
+#define LINK_US       1000
+
+static int failures;
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                               \
+        }                                                                             \
+    } while (0)
+
+static const struct netsim_link test_link = { LINK_US, 0, 0 };
+
+/* from から to へ文字列を1つ送る */
+static void send_text(struct netsim_node *from, const struct sockaddr_in *to, const char *text)
+{
+    tiny_tp_sendto(&from->tp, -1, text, strlen(text), (const struct sockaddr *)to, sizeof(*to));
+}
+
+/* 送ったデータが届くまで仮想時刻を進める */
+static void settle(struct netsim *sim)
+{
+    netsim_run(sim, netsim_now(sim) + 10 * LINK_US);
+}
+
+/* 送信を横取りして覚えておく transport。仮想網を通さずに送信側の部品を動かすときに使う */
+#define CAP_MAX 256
+
+struct capture {
+    size_t n;
+    size_t len[CAP_MAX];
+    unsigned char buf[CAP_MAX][NTS_ROSTER_CHUNK_MAX];
+};
+
+static ssize_t capture_sendto(void *ctx, int sock, const void *buf, size_t len,
+                              const struct sockaddr *to, socklen_t tolen)
+{
+    struct capture *c = (struct capture *)ctx;
+    (void)sock;
+    (void)to;
+    (void)tolen;
+    if (c->n < CAP_MAX && len <= sizeof(c->buf[0])) {
+        memcpy(c->buf[c->n], buf, len);
+        c->len[c->n] = len;
+        c->n++;
+    }
+    return (ssize_t)len;
+}
+
+static uint64_t capture_now_us(void *ctx)
+{
+    (void)ctx;
+    return NETSIM_START_US;
+}
+
+static void capture_after(void *ctx, unsigned ms, void (*fn)(void *arg), void *arg)
+{
+    (void)ctx;
+    (void)ms;
+    fn(arg);
+}
+
+static struct capture captured;
+
+/* ---------- 要求レイヤ: サーバ以外からの応答・txidの無い応答 ---------- */
+
+struct req_fixture {
+    struct netsim sim;
+    struct netsim_node *server;
+    struct netsim_node *attacker;
+    struct netsim_node *client;
+    struct sockaddr_in server_addr;
+    struct sockaddr_in client_addr;
+    struct p2p_request rq;
+    struct p2p_rtt est;
+    uint32_t seen_txid; /* サーバが最後に受けた query の txid */
+    int matched;
+};
+
+static void req_server_recv(void *user, const void *buf, size_t len,
+                            const struct sockaddr *src, socklen_t srclen)
+{
+    struct req_fixture *f = (struct req_fixture *)user;
+    (void)src;
+    (void)srclen;
+    uint32_t q[3];
+    if (len < sizeof(q))
+        return;
+    memcpy(q, buf, sizeof(q));
+    f->seen_txid = ntohl(q[2]);
+}
+
+static void req_client_recv(void *user, const void *buf, size_t len,
+                            const struct sockaddr *src, socklen_t srclen)
+{
+    struct req_fixture *f = (struct req_fixture *)user;
+    char text[P2P_LINE_MAX];
+    if (len >= sizeof(text))
+        return;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    f->matched += p2p_req_match(&f->rq, 1, text, src, srclen, 1, &f->est, netsim_now(&f->sim));
+}
+
+static void test_req_stray_reply(void)
+{
+    struct req_fixture f;
+    memset(&f, 0, sizeof(f));
+    netsim_init(&f.sim, 1);
+    f.server = netsim_add_node(&f.sim, NETSIM_NAT_NONE, &test_link, 0, SERVER_PORT, req_server_recv, &f);
+    f.attacker = netsim_add_node(&f.sim, NETSIM_NAT_NONE, &test_link, 0, ATTACKER_PORT, NULL, NULL);
+    f.client = netsim_add_node(&f.sim, NETSIM_NAT_NONE, &test_link, 0, CLIENT_PORT, req_client_recv, &f);
+    netsim_node_public_addr(f.server, &f.server_addr);
+    netsim_node_public_addr(f.client, &f.client_addr);
+
+    p2p_rtt_init(&f.est);
+    f.rq.kind = P2P_REQ_QUERY;
+    f.rq.peer_id = 2;
+    p2p_req_reset(&f.rq, &f.est);
+    CHECK(p2p_req_transmit(&f.client->tp, -1, &f.rq, 1, (struct sockaddr *)&f.server_addr,
+                           sizeof(f.server_addr), netsim_now(&f.sim)) == 0);
+    settle(&f.sim);
+    CHECK(f.seen_txid == f.rq.txid);
+
+    char line[128];
+    /* 攻撃者は txid を知っていてもサーバのアドレスからは送れない */
+    snprintf(line, sizeof(line), "PEER 10.6.6.6 6666 %u\n", f.rq.txid);
+    send_text(f.attacker, &f.client_addr, line);
+    snprintf(line, sizeof(line), "NOTFOUND %u\n", f.rq.txid);
+    send_text(f.attacker, &f.client_addr, line);
+    settle(&f.sim);
+    CHECK(f.matched == 0);
+    CHECK(f.rq.done == 0 && f.rq.notfound == 0);
+
+    /* サーバからでも txid の無い・違う応答は照合しない */
+    send_text(f.server, &f.client_addr, "PEER 10.0.0.9 4000\n");
+    send_text(f.server, &f.client_addr, "NOTFOUND\n");
+    snprintf(line, sizeof(line), "PEER 10.0.0.9 4000 %u\n", f.rq.txid + 1);
+    send_text(f.server, &f.client_addr, line);
+    settle(&f.sim);
+    CHECK(f.matched == 0);
+    CHECK(f.rq.done == 0 && f.rq.notfound == 0);
+
+    snprintf(line, sizeof(line), "PEER 10.0.0.9 4000 %u\n", f.rq.txid);
+    send_text(f.server, &f.client_addr, line);
+    settle(&f.sim);
+    CHECK(f.matched == 1);
+    CHECK(f.rq.done == P2P_REQ_OK);
+    CHECK(strcmp(f.rq.ip, "10.0.0.9") == 0 && f.rq.port == 4000);
+
+    netsim_dispose(&f.sim);
+}
+
+/* ---------- 要求レイヤ: 損失のある経路での再送・応答しないサーバ ---------- */
+
+/* 本物のサーバ処理(nts_server_dispatch)を載せた仮想網。クライアントは要求レイヤで登録・問い合わせする */
+#define SRV_CLIENTS 4
+
+struct srv_fixture;
+
+struct srv_client {
+    struct srv_fixture *f;
+    struct netsim_node *node;
+    struct sockaddr_in addr;
+    uint32_t id;
+    struct p2p_request rq[2];
+    size_t nreq;
+    struct p2p_rtt est;
+    unsigned punch_datagrams; /* 受けたPUNCHのデータグラム数 */
+    unsigned punch_lines;     /* その中のPUNCH行の数 */
+};
+
+struct srv_fixture {
+    struct netsim sim;
+    struct netsim_node *server;
+    struct sockaddr_in server_addr;
+    struct nts_ctx table;
+    struct nts_server srv;
+    struct srv_client c[SRV_CLIENTS];
+    unsigned drop;        /* サーバが読まずに捨てる残りのデータグラム数 */
+    uint64_t end_us;
+};
+
+static void srv_fixture_recv(void *user, const void *buf, size_t len,
+                             const struct sockaddr *src, socklen_t srclen)
+{
+    struct srv_fixture *f = (struct srv_fixture *)user;
+    if (f->drop > 0) {
+        f->drop--;
+        return;
+    }
+    nts_server_dispatch(&f->srv, buf, len, src, srclen);
+}
+
+static void srv_client_recv(void *user, const void *buf, size_t len,
+                            const struct sockaddr *src, socklen_t srclen)
+{
+    struct srv_client *c = (struct srv_client *)user;
+    char text[P2P_LINE_MAX];
+    if (len >= sizeof(text))
+        return;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    if (strncmp(text, "PUNCH ", 6) == 0) {
+        c->punch_datagrams++;
+        for (char *p = text; (p = strchr(p, '\n')) != NULL; p++)
+            c->punch_lines++;
+        return;
+    }
+    p2p_req_match(c->rq, c->nreq, text, src, srclen, c->id, &c->est, netsim_now(&c->f->sim));
+}
+
+/* 各クライアントの未完了の要求を、チャット/ベンチと同じ規則で送る・諦める */
+static void srv_client_tick(void *arg)
+{
+    struct srv_fixture *f = (struct srv_fixture *)arg;
+    uint64_t now = netsim_now(&f->sim);
+    for (size_t i = 0; i < SRV_CLIENTS; i++) {
+        struct srv_client *c = &f->c[i];
+        for (size_t k = 0; k < c->nreq; k++) {
+            struct p2p_request *rq = &c->rq[k];
+            if (rq->done || now < rq->next_at)
+                continue;
+            if (rq->tries >= P2P_REQ_MAX_TRIES) {
+                rq->done = P2P_REQ_FAILED;
+                continue;
+            }
+            p2p_req_transmit(&c->node->tp, -1, rq, c->id, (struct sockaddr *)&f->server_addr,
+                             sizeof(f->server_addr), now);
+        }
+    }
+    if (now + 1000 < f->end_us)
+        netsim_at(&f->sim, now + 1000, srv_client_tick, f);
+}
+
+/* サーバと SRV_CLIENTS 個のクライアント(ID 1..)を置く。link はクライアント側のリンク */
+static int srv_setup(struct srv_fixture *f, uint32_t seed, const struct netsim_link *link)
+{
+    memset(f, 0, sizeof(*f));
+    netsim_init(&f->sim, seed);
+    f->server = netsim_add_node(&f->sim, NETSIM_NAT_NONE, &test_link, 0, SERVER_PORT, srv_fixture_recv, f);
+    if (!f->server || nts_init(&f->table, 16) != 0)
+        return -1;
+    if (nts_server_init(&f->srv, -1, &f->table, &f->server->tp) != 0) {
+        nts_dispose(&f->table);
+        return -1;
+    }
+    netsim_node_public_addr(f->server, &f->server_addr);
+    f->srv.verbose = getenv("TNT_V") != NULL;
+    for (size_t i = 0; i < SRV_CLIENTS; i++) {
+        struct srv_client *c = &f->c[i];
+        c->f = f;
+        c->id = (uint32_t)i + 1;
+        c->node = netsim_add_node(&f->sim, NETSIM_NAT_NONE, link, 0, (uint16_t)(CLIENT_PORT + i), srv_client_recv, c);
+        if (!c->node)
+            return -1;
+        netsim_node_public_addr(c->node, &c->addr);
+        p2p_rtt_init(&c->est);
+    }
+    f->end_us = NETSIM_START_US + 600 * 1000000u;
+    netsim_at(&f->sim, netsim_now(&f->sim), srv_client_tick, f);
+    return 0;
+}
+
+static void srv_teardown(struct srv_fixture *f)
+{
+    nts_server_dispose(&f->srv);
+    nts_dispose(&f->table);
+    netsim_dispose(&f->sim);
+}
+
+/* c の要求を登録(と target への問い合わせ)にして送り始める */
+static void srv_client_start(struct srv_client *c, uint32_t target)
+{
+    c->rq[0].kind = P2P_REQ_REGISTER;
+    c->rq[1].kind = P2P_REQ_QUERY;
+    c->rq[1].peer_id = target;
+    c->nreq = target ? 2 : 1;
+    for (size_t k = 0; k < c->nreq; k++)
+        p2p_req_reset(&c->rq[k], &c->est);
+}
+
+static void test_req_retransmit(void)
+{
+    /*
+     * 行きと帰りがそれぞれ10%落ちる経路で、さらにサーバが最初の数個を捨てても、
+     * 登録と(相手がまだ居ない間はNOTFOUNDの)問い合わせが完了する
+     */
+    const struct netsim_link lossy = { 20000, 0, 100000 };
+    struct srv_fixture *f = malloc(sizeof(*f));
+    CHECK(f && srv_setup(f, 4, &lossy) == 0);
+    if (!f)
+        return;
+    f->drop = SRV_CLIENTS;
+    struct srv_client *b = &f->c[1];
+    for (size_t i = 0; i < SRV_CLIENTS; i++) {
+        if (&f->c[i] != b)
+            srv_client_start(&f->c[i], b->id);
+    }
+    uint64_t until = netsim_now(&f->sim) + 5 * 1000000u;
+    while (netsim_now(&f->sim) < until && f->c[0].rq[1].notfound == 0)
+        netsim_run(&f->sim, netsim_now(&f->sim) + 10000);
+    CHECK(f->c[0].rq[1].notfound > 0 && f->c[0].rq[1].done == 0);
+    srv_client_start(b, 0);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 30 * 1000000u);
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &b->addr.sin_addr, ip, sizeof(ip));
+    unsigned sends = 0, reqs = 0;
+    for (size_t i = 0; i < SRV_CLIENTS; i++) {
+        struct srv_client *c = &f->c[i];
+        CHECK(c->rq[0].done == P2P_REQ_OK);
+        if (c->nreq > 1) {
+            CHECK(c->rq[1].done == P2P_REQ_OK);
+            CHECK(strcmp(c->rq[1].ip, ip) == 0 && c->rq[1].port == ntohs(b->addr.sin_port));
+        }
+        for (size_t k = 0; k < c->nreq; k++) {
+            sends += c->rq[k].sends - c->rq[k].notfound;
+            reqs++;
+        }
+    }
+    /* 捨てられた分は再送している */
+    CHECK(sends >= reqs + SRV_CLIENTS);
+    srv_teardown(f);
+    free(f);
+
+    /*
+     * 応答しないサーバ: 再送間隔は倍々に伸び(±25%のジッタ)、P2P_REQ_MAX_TRIES 回で諦める。
+     * 送信は横取りするだけなので、どこへも届かない
+     */
+    const struct tiny_transport tp = { capture_sendto, capture_now_us, capture_after, &captured };
+    struct sockaddr_in dead;
+    memset(&dead, 0, sizeof(dead));
+    dead.sin_family = AF_INET;
+    dead.sin_port = htons(SERVER_PORT);
+    struct p2p_rtt est;
+    p2p_rtt_init(&est);
+    struct p2p_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.kind = P2P_REQ_REGISTER;
+    p2p_req_reset(&rq, &est);
+    captured.n = 0;
+    uint64_t now = NETSIM_START_US, prev_gap = 0;
+    int bad_gap = 0;
+    while (!rq.done) {
+        if (rq.tries >= P2P_REQ_MAX_TRIES) {
+            rq.done = P2P_REQ_FAILED;
+            break;
+        }
+        uint64_t at = rq.next_at > now ? rq.next_at : now;
+        CHECK(p2p_req_transmit(&tp, -1, &rq, 1, (struct sockaddr *)&dead, sizeof(dead), at) == 0);
+        uint64_t gap = rq.next_at - at;
+        /* 前の間隔の1.2倍(=2×0.75/1.25)以上に伸びるか、上限のジッタの範囲に収まる */
+        if (gap > P2P_REQ_RTO_MAX_MS * 1250u || (gap * 5 < prev_gap * 6 && gap < P2P_REQ_RTO_MAX_MS * 750u))
+            bad_gap = 1;
+        prev_gap = gap;
+        now = at;
+    }
+    CHECK(rq.done == P2P_REQ_FAILED && rq.sends == P2P_REQ_MAX_TRIES);
+    CHECK(captured.n == P2P_REQ_MAX_TRIES);
+    CHECK(!bad_gap);
+}
+
+/* ---------- 問い合わせキャッシュとPUNCHのまとめ送り ---------- */
+
+static void test_qc_cache(void)
+{
+    struct nts_qcache *qc = malloc(sizeof(*qc));
+    CHECK(qc && nts_qc_init(qc) == 0);
+    if (!qc)
+        return;
+    struct nts_addr from, other;
+    nts_addr_pton(&from, "198.51.100.7", 4000);
+    nts_addr_pton(&other, "198.51.100.7", 4001);
+    char reply[NTS_QC_REPLY_MAX];
+
+    /* 同じ要求者・同じ送信元の問い合わせだけが窓の間ヒットする */
+    nts_qc_store(qc, 1, 2, &from, 1000, "PEER 10.0.0.2 5000", 18);
+    CHECK(nts_qc_lookup(qc, 1, 2, &from, 1000 + NTS_QC_WINDOW_MS - 1, reply, sizeof(reply)) == 18);
+    CHECK(memcmp(reply, "PEER 10.0.0.2 5000", 18) == 0);
+    CHECK(nts_qc_lookup(qc, 1, 2, &other, 1001, reply, sizeof(reply)) == 0);
+    CHECK(nts_qc_lookup(qc, 3, 2, &from, 1001, reply, sizeof(reply)) == 0);
+    CHECK(nts_qc_lookup(qc, 1, 2, &from, 1000 + NTS_QC_WINDOW_MS, reply, sizeof(reply)) == 0);
+    /* 対象が登録し直したら古い応答は使わない */
+    nts_qc_store(qc, 1, 2, &from, 2000, "PEER 10.0.0.2 5000", 18);
+    nts_qc_invalidate_target(qc, 2);
+    CHECK(nts_qc_lookup(qc, 1, 2, &from, 2001, reply, sizeof(reply)) == 0);
+
+    /* 通知: 最初は即送り、続く分は溜めて1データグラムにまとめ、同じ行は捨てる */
+    const struct tiny_transport tp = { capture_sendto, capture_now_us, capture_after, &captured };
+    struct sockaddr_storage to;
+    socklen_t tolen = nts_addr_to_sockaddr(&other, &to);
+    const char *l1 = "PUNCH 10.0.0.1 1 1 2\n", *l2 = "PUNCH 10.0.0.3 3 3 2\n", *l3 = "PUNCH 10.0.0.4 4 4 2\n";
+    uint64_t seq = 0;
+    unsigned wait_ms = 0;
+    captured.n = 0;
+    CHECK(nts_qc_notify(qc, &tp, -1, 2, (struct sockaddr *)&to, tolen, l1, strlen(l1), 5000, &seq, &wait_ms) == NTS_QC_SENT);
+    CHECK(nts_qc_notify(qc, &tp, -1, 2, (struct sockaddr *)&to, tolen, l2, strlen(l2), 5002, &seq, &wait_ms) == NTS_QC_LEADER);
+    CHECK(wait_ms == NTS_QC_NOTIFY_HOLD_MS - 2);
+    CHECK(nts_qc_notify(qc, &tp, -1, 2, (struct sockaddr *)&to, tolen, l2, strlen(l2), 5003, NULL, NULL) == NTS_QC_DUP);
+    CHECK(nts_qc_notify(qc, &tp, -1, 2, (struct sockaddr *)&to, tolen, l3, strlen(l3), 5004, NULL, NULL) == NTS_QC_QUEUED);
+    CHECK(captured.n == 1);
+    CHECK(nts_qc_flush(qc, &tp, 2, seq, 5000 + NTS_QC_NOTIFY_HOLD_MS) == 2);
+    CHECK(captured.n == 2 && captured.len[1] == strlen(l2) + strlen(l3));
+    CHECK(captured.n == 2 && memcmp(captured.buf[1], l2, strlen(l2)) == 0);
+    /* 送った後の flush は何もしない */
+    CHECK(nts_qc_flush(qc, &tp, 2, seq, 5000 + NTS_QC_NOTIFY_HOLD_MS) == 0);
+    struct nts_qc_stats st;
+    nts_qc_get_stats(qc, &st);
+    CHECK(st.notify_lines == 4 && st.notify_dups == 1 && st.notify_datagrams == 2);
+
+    nts_qc_dispose(qc);
+    free(qc);
+}
+
+/* 同時に届いた問い合わせ: 対象へのPUNCHはまとめられ、再送はキャッシュから答える */
+static void test_qc_coalesce(void)
+{
+    struct srv_fixture *f = malloc(sizeof(*f));
+    CHECK(f && srv_setup(f, 5, &test_link) == 0);
+    if (!f)
+        return;
+    struct srv_client *t = &f->c[0];
+    srv_client_start(t, 0);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 100000);
+    CHECK(t->rq[0].done == P2P_REQ_OK);
+
+    /* 3人が同じ時刻に問い合わせる: 1つ目は即送り、残り2つは1データグラムにまとまる */
+    for (size_t i = 1; i < SRV_CLIENTS; i++)
+        srv_client_start(&f->c[i], t->id);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 100000);
+    for (size_t i = 1; i < SRV_CLIENTS; i++)
+        CHECK(f->c[i].rq[1].done == P2P_REQ_OK);
+    CHECK(t->punch_datagrams == 2 && t->punch_lines == SRV_CLIENTS - 1);
+    struct nts_qc_stats st;
+    nts_qc_get_stats(f->srv.qc, &st);
+    CHECK(st.hits == 0 && st.notify_lines == SRV_CLIENTS - 1 && st.notify_datagrams == 2);
+
+    /* 窓の中の問い合わせ直し（新しいtxid）はキャッシュから答え、PUNCHは送り直さない */
+    struct srv_client *r = &f->c[1];
+    p2p_req_reset(&r->rq[1], &r->est);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 100000);
+    CHECK(r->rq[1].done == P2P_REQ_OK);
+    nts_qc_get_stats(f->srv.qc, &st);
+    CHECK(st.hits == 1);
+    CHECK(t->punch_datagrams == 2);
+
+    /* 対象が登録し直すとキャッシュは使わず、新しいPUNCHを送る */
+    srv_client_start(t, 0);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 50000);
+    p2p_req_reset(&r->rq[1], &r->est);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 100000);
+    CHECK(r->rq[1].done == P2P_REQ_OK);
+    nts_qc_get_stats(f->srv.qc, &st);
+    CHECK(st.hits == 1);
+    CHECK(t->punch_datagrams == 3);
+
+    srv_teardown(f);
+    free(f);
+}
+
+/* ---------- 問い合わせ応答はPUNCHのまとめ送りより先に出る ---------- */
+
+static int due_calls;
+
+static void count_due(void *arg)
+{
+    (void)arg;
+    due_calls++;
+}
+
+static void qc_query(struct nts_server *srv, const char *ip, uint32_t req, uint32_t target, uint32_t txid)
+{
+    struct sockaddr_in from;
+    memset(&from, 0, sizeof(from));
+    from.sin_family = AF_INET;
+    from.sin_port = htons((uint16_t)(4000 + req));
+    inet_pton(AF_INET, ip, &from.sin_addr);
+    uint32_t pkt[3] = { htonl(req), htonl(target), htonl(txid) };
+    nts_server_dispatch(srv, pkt, target ? sizeof(pkt) : sizeof(pkt[0]), (struct sockaddr *)&from, sizeof(from));
+}
+
+static void test_qc_reply_first(void)
+{
+    /* capture_after はその場で呼ぶので、まとめ役の待ちは呼び出しの中で終わる（眠る実装と同じ順序） */
+    const struct tiny_transport tp = { capture_sendto, capture_now_us, capture_after, &captured };
+    struct nts_ctx table;
+    struct nts_server srv;
+    CHECK(nts_init(&table, 8) == 0);
+    CHECK(nts_server_init(&srv, -1, &table, &tp) == 0);
+    qc_query(&srv, "198.18.0.1", 7, 0, 0);
+
+    /* 1つ目のPUNCHは即送り、2つ目はまとめ役になる。どちらも問い合わせの応答が先 */
+    for (uint32_t req = 8; req <= 9; req++) {
+        captured.n = 0;
+        qc_query(&srv, "198.18.0.2", req, 7, 100 + req);
+        CHECK(captured.n == 2);
+        CHECK(captured.n == 2 && memcmp(captured.buf[0], "PEER ", 5) == 0);
+        CHECK(captured.n == 2 && memcmp(captured.buf[1], "PUNCH ", 6) == 0);
+    }
+    struct nts_qc_stats st;
+    nts_qc_get_stats(srv.qc, &st);
+    CHECK(st.notify_lines == 2 && st.notify_datagrams == 2);
+    nts_server_dispose(&srv);
+    nts_dispose(&table);
+
+    /* 実ソケット版の after は呼び出し側を眠らせず、期限は run_due を呼ぶスレッドで走る */
+    due_calls = 0;
+    uint64_t t0 = tiny_tp_now_us(&tiny_transport_udp);
+    tiny_transport_udp.after(NULL, 30, count_due, NULL);
+    CHECK(tiny_tp_now_us(&tiny_transport_udp) - t0 < 20000);
+    CHECK(due_calls == 0);
+    int wait_ms = tiny_tp_udp_run_due();
+    CHECK(wait_ms > 0 && wait_ms <= 30);
+    CHECK(due_calls == 0);
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 40 * 1000000L };
+    nanosleep(&ts, NULL);
+    CHECK(tiny_tp_udp_run_due() == -1);
+    CHECK(due_calls == 1);
+}
+
+/* ---------- セッションエンジン: PROBEによるアドレスの乗っ取り ---------- */
+
+#define PEER_A 1
+#define PEER_B 2
+
+struct eng_peer {
+    struct netsim_node *node;
+    struct p2p_engine eng;
+    struct sockaddr_in addr;
+};
+
+struct eng_fixture {
+    struct netsim sim;
+    struct eng_peer a, b;
+    struct netsim_node *attacker;
+    struct sockaddr_in attacker_addr;
+    char attacker_rx[8][64]; /* 攻撃者が受けたデータ */
+    size_t attacker_nrx;
+    uint64_t end_us;
+};
+
+static void eng_peer_recv(void *user, const void *buf, size_t len,
+                          const struct sockaddr *src, socklen_t srclen)
+{
+    struct eng_peer *p = (struct eng_peer *)user;
+    char text[P2P_BUF_SIZE + 1];
+    if (len > P2P_BUF_SIZE)
+        return;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    p2p_engine_input(&p->eng, text, len, src, srclen);
+}
+
+static void attacker_recv(void *user, const void *buf, size_t len,
+                          const struct sockaddr *src, socklen_t srclen)
+{
+    struct eng_fixture *f = (struct eng_fixture *)user;
+    (void)src;
+    (void)srclen;
+    if (f->attacker_nrx < 8 && len < sizeof(f->attacker_rx[0])) {
+        memcpy(f->attacker_rx[f->attacker_nrx], buf, len);
+        f->attacker_rx[f->attacker_nrx][len] = '\0';
+    }
+    f->attacker_nrx++;
+}
+
+/* 両エンジンのタイマを一定間隔で進める */
+static void eng_tick(void *arg)
+{
+    struct eng_fixture *f = (struct eng_fixture *)arg;
+    p2p_engine_timers(&f->a.eng);
+    p2p_engine_timers(&f->b.eng);
+    uint64_t next = netsim_now(&f->sim) + 5000;
+    if (next < f->end_us)
+        netsim_at(&f->sim, next, eng_tick, f);
+}
+
+static int eng_peer_init(struct eng_fixture *f, struct eng_peer *p, uint32_t id, uint16_t port)
+{
+    p->node = netsim_add_node(&f->sim, NETSIM_NAT_NONE, &test_link, 0, port, eng_peer_recv, p);
+    if (!p->node || p2p_engine_init_transport(&p->eng, &p->node->tp, id, NULL, 0, 8, NULL, NULL) != 0)
+        return -1;
+    p->eng.quiet = 1;
+    netsim_node_public_addr(p->node, &p->addr);
+    return 0;
+}
+
+/* A と B を確立させる */
+static int eng_setup(struct eng_fixture *f)
+{
+    memset(f, 0, sizeof(*f));
+    netsim_init(&f->sim, 2);
+    if (eng_peer_init(f, &f->a, PEER_A, CLIENT_PORT) != 0 || eng_peer_init(f, &f->b, PEER_B, CLIENT_PORT + 1) != 0)
+        return -1;
+    f->attacker = netsim_add_node(&f->sim, NETSIM_NAT_NONE, &test_link, 0, ATTACKER_PORT, attacker_recv, f);
+    netsim_node_public_addr(f->attacker, &f->attacker_addr);
+    f->end_us = NETSIM_START_US + 60 * 1000000u;
+    netsim_at(&f->sim, netsim_now(&f->sim), eng_tick, f);
+    p2p_engine_connect(&f->a.eng, PEER_B, (struct sockaddr *)&f->b.addr, sizeof(f->b.addr));
+    netsim_run(&f->sim, netsim_now(&f->sim) + 100000);
+    return 0;
+}
+
+static int session_at(const struct p2p_session *s, const struct sockaddr_in *addr)
+{
+    return s && p2p_addr_equal((const struct sockaddr *)&s->addr, s->addrlen,
+                               (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+static void test_probe_hijack(void)
+{
+    struct eng_fixture f;
+    CHECK(eng_setup(&f) == 0);
+    struct p2p_session *s = p2p_engine_find_id(&f.a.eng, PEER_B);
+    CHECK(s && s->state == P2P_ESTABLISHED);
+    CHECK(session_at(s, &f.b.addr));
+    if (!s)
+        return;
+
+    /* 確立済みのセッションへ第三者がBを名乗ってPROBEを送っても付け替えない。ACKはBへ返す */
+    char line[64];
+    snprintf(line, sizeof(line), "PROBE %u %u 0\n", PEER_B, PEER_A);
+    send_text(f.attacker, &f.a.addr, line);
+    settle(&f.sim);
+    CHECK(session_at(s, &f.b.addr));
+    CHECK(f.attacker_nrx == 0);
+
+    /* nonceの違うACKも付け替えない */
+    snprintf(line, sizeof(line), "PROBE_ACK %u %u %u\n", PEER_B, PEER_A, s->nonce + 1);
+    send_text(f.attacker, &f.a.addr, line);
+    settle(&f.sim);
+    CHECK(session_at(s, &f.b.addr));
+
+    /* 確立は保たれ、Bとの通信は続く */
+    netsim_run(&f.sim, netsim_now(&f.sim) + (P2P_KEEPALIVE_MS + 1000) * 1000u);
+    CHECK(s->state == P2P_ESTABLISHED && session_at(s, &f.b.addr));
+    CHECK(f.attacker_nrx == 0);
+
+    /* こちらのnonceを返したACKなら別のマッピングへ付け替える（peer-reflexive） */
+    snprintf(line, sizeof(line), "PROBE_ACK %u %u %u\n", PEER_B, PEER_A, s->nonce);
+    send_text(f.attacker, &f.a.addr, line);
+    settle(&f.sim);
+    CHECK(session_at(s, &f.attacker_addr));
+
+    p2p_engine_dispose(&f.a.eng);
+    p2p_engine_dispose(&f.b.eng);
+    netsim_dispose(&f.sim);
+}
+
+static void test_probe_challenge(void)
+{
+    struct eng_fixture f;
+    CHECK(eng_setup(&f) == 0);
+
+    /* 応答しないアドレスへpunch中のセッションに、第三者がPROBEを送る */
+    struct sockaddr_in dead = f.b.addr;
+    dead.sin_port = htons(CLIENT_PORT + 100);
+    struct p2p_session *s = p2p_engine_connect(&f.a.eng, 3, (struct sockaddr *)&dead, sizeof(dead));
+    CHECK(s && s->state == P2P_PUNCHING);
+    if (!s)
+        return;
+    send_text(f.attacker, &f.a.addr, "PROBE 3 1 77\n");
+    settle(&f.sim);
+
+    /* 付け替えず、確立もせず、送信元へはこちらのnonceのPROBEだけを返す */
+    CHECK(s->state == P2P_PUNCHING && session_at(s, &dead));
+    CHECK(f.attacker_nrx == 1);
+    int is_ack = -1;
+    uint32_t from = 0, to = 0, nonce = 0;
+    CHECK(p2p_parse_probe(f.attacker_rx[0], &is_ack, &from, &to, &nonce) == 1);
+    CHECK(is_ack == 0 && from == PEER_A && to == 3 && nonce == s->nonce);
+
+    p2p_engine_dispose(&f.a.eng);
+    p2p_engine_dispose(&f.b.eng);
+    netsim_dispose(&f.sim);
+}
+
+/* 破棄するときも残っているセッションごとに on_closed を呼び、s->user を解放させる */
+static unsigned dispose_closed;
+
+static void dispose_on_closed(struct p2p_engine *eng, struct p2p_session *s, const char *reason)
+{
+    (void)eng;
+    if (strcmp(reason, "dispose") == 0)
+        dispose_closed++;
+    free(s->user);
+    s->user = NULL;
+}
+
+static const struct p2p_engine_ops dispose_ops = { .on_closed = dispose_on_closed };
+
+static void test_engine_dispose(void)
+{
+    struct eng_fixture f;
+    CHECK(eng_setup(&f) == 0);
+    struct sockaddr_in dead = f.b.addr;
+    dead.sin_port = htons(CLIENT_PORT + 100);
+    CHECK(p2p_engine_connect(&f.a.eng, 3, (struct sockaddr *)&dead, sizeof(dead)) != NULL);
+    CHECK(f.a.eng.count == 2);
+    for (struct p2p_session *s = f.a.eng.head; s; s = s->next)
+        s->user = malloc(16);
+    f.a.eng.ops = &dispose_ops;
+    dispose_closed = 0;
+    p2p_engine_dispose(&f.a.eng);
+    CHECK(dispose_closed == 2 && f.a.eng.count == 0);
+    p2p_engine_dispose(&f.b.eng);
+    netsim_dispose(&f.sim);
+}
+
+/* ゲートウェイも同じ規則で判断する（実ソケットで動くので判断の表だけを確かめる） */
+static void test_probe_decide(void)
+{
+    const uint32_t ours = 1234;
+    /* 登録済みのアドレス */
+    CHECK(p2p_probe_decide(1, 0, 0, 99, ours) == P2P_PROBE_ACCEPT);
+    CHECK(p2p_probe_decide(1, 1, 0, 99, ours) == P2P_PROBE_ACCEPT);
+    CHECK(p2p_probe_decide(1, 1, 1, ours, ours) == P2P_PROBE_ACCEPT);
+    CHECK(p2p_probe_decide(1, 1, 1, 99, ours) == P2P_PROBE_IGNORE);
+    /* 未知のアドレス: 付け替えるのはこちらのnonceを返したACKだけ */
+    CHECK(p2p_probe_decide(0, 0, 1, ours, ours) == P2P_PROBE_REKEY);
+    CHECK(p2p_probe_decide(0, 1, 1, ours, ours) == P2P_PROBE_REKEY);
+    CHECK(p2p_probe_decide(0, 0, 1, 99, ours) == P2P_PROBE_IGNORE);
+    CHECK(p2p_probe_decide(0, 1, 1, 99, ours) == P2P_PROBE_IGNORE);
+    CHECK(p2p_probe_decide(0, 0, 0, ours, ours) == P2P_PROBE_CHALLENGE);
+    CHECK(p2p_probe_decide(0, 1, 0, ours, ours) == P2P_PROBE_ANSWER);
+}
+
+/* ---------- エンドポイントキャッシュ: ファイルの形式・期限・追い出し ---------- */
+
+static struct p2p_cache_entry cache_entry(uint32_t self_id, uint32_t peer_id, uint64_t updated_s, uint16_t port)
+{
+    struct p2p_cache_entry e;
+    memset(&e, 0, sizeof(e));
+    e.self_id = self_id;
+    e.peer_id = peer_id;
+    e.updated_s = updated_s;
+    struct sockaddr_in *a = (struct sockaddr_in *)&e.addr;
+    a->sin_family = AF_INET;
+    a->sin_addr.s_addr = htonl(0xc6120000u | peer_id); /* 198.18.x.x */
+    a->sin_port = htons(port);
+    e.addrlen = sizeof(*a);
+    e.local_port = (uint16_t)(CLIENT_PORT + self_id);
+    return e;
+}
+
+static uint16_t cache_port(const struct p2p_cache_entry *e)
+{
+    return e ? ntohs(((const struct sockaddr_in *)&e->addr)->sin_port) : 0;
+}
+
+/* 書いたエントリがファイルを開き直しても残るか */
+static int cache_reopened_has(struct p2p_cache *c, const char *path, uint32_t self_id, uint32_t peer_id, uint64_t now_s)
+{
+    p2p_cache_close(c);
+    if (p2p_cache_open(c, path) != 0)
+        return -1;
+    return p2p_cache_get(c, self_id, peer_id, now_s) != NULL;
+}
+
+static void test_cache_file(void)
+{
+    char dir[] = "/tmp/tiny_cache_XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/cache", dir);
+
+    const uint64_t t = 1700000000;
+    struct p2p_cache c;
+    CHECK(p2p_cache_open(&c, path) == 0);
+    if (!c.map)
+        return;
+    CHECK(c.map->magic == P2P_CACHE_MAGIC && c.map->version == P2P_CACHE_VERSION);
+    struct p2p_cache_entry e = cache_entry(1, 2, t, 5000);
+    p2p_cache_put(&c, &e);
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 1);
+
+    /* 形式の違うファイルは空にしてから使う */
+    p2p_cache_put(&c, &e);
+    c.map->magic ^= 1;
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 0);
+    CHECK(c.map->magic == P2P_CACHE_MAGIC);
+    p2p_cache_put(&c, &e);
+    c.map->version = P2P_CACHE_VERSION + 1;
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 0);
+    CHECK(c.map->version == P2P_CACHE_VERSION);
+    p2p_cache_put(&c, &e);
+    c.map->slots = P2P_CACHE_SLOTS / 2;
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 0);
+    CHECK(c.map->slots == P2P_CACHE_SLOTS);
+    p2p_cache_put(&c, &e);
+    CHECK(truncate(path, (off_t)sizeof(struct p2p_cache_file) - 1) == 0);
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 0);
+    p2p_cache_put(&c, &e);
+    CHECK(truncate(path, (off_t)sizeof(struct p2p_cache_file) * 2) == 0);
+    CHECK(cache_reopened_has(&c, path, 1, 2, t) == 0);
+
+    /* 書きかけ・形の合わないエントリは無いものとして扱う */
+    p2p_cache_put(&c, &e);
+    struct p2p_cache_entry *raw = (struct p2p_cache_entry *)p2p_cache_get(&c, 1, 2, t);
+    CHECK(raw != NULL);
+    if (raw) {
+        raw->addrlen = sizeof(struct sockaddr_in6);
+        CHECK(p2p_cache_get(&c, 1, 2, t) == NULL);
+        CHECK(p2p_cache_local_port(&c, 1, t) == 0);
+        raw->addrlen = sizeof(struct sockaddr_in);
+        raw->addr.ss_family = AF_UNIX;
+        CHECK(p2p_cache_get(&c, 1, 2, t) == NULL);
+        CHECK(p2p_cache_local_port(&c, 1, t) == 0);
+        raw->addr.ss_family = AF_INET;
+        raw->updated_s = 0; /* p2p_cache_put の途中で落ちた */
+        CHECK(p2p_cache_get(&c, 1, 2, t) == NULL);
+        CHECK(p2p_cache_local_port(&c, 1, t) == 0);
+    }
+
+    /* 有効期限: ちょうど P2P_CACHE_TTL_S までは使う */
+    p2p_cache_put(&c, &e);
+    struct p2p_cache_entry old = cache_entry(1, 3, t - 100, 5001);
+    old.local_port = 7000;
+    p2p_cache_put(&c, &old);
+    CHECK(p2p_cache_local_port(&c, 1, t) == CLIENT_PORT + 1);
+    CHECK(p2p_cache_get(&c, 1, 2, t + P2P_CACHE_TTL_S) != NULL);
+    CHECK(p2p_cache_get(&c, 1, 2, t + P2P_CACHE_TTL_S + 1) == NULL);
+    CHECK(p2p_cache_local_port(&c, 1, t + P2P_CACHE_TTL_S) == CLIENT_PORT + 1);
+    CHECK(p2p_cache_local_port(&c, 1, t + P2P_CACHE_TTL_S + 1) == 0);
+    CHECK(p2p_cache_local_port(&c, 2, t) == 0);
+
+    /* 時刻の更新は P2P_CACHE_REFRESH_S 経ってから */
+    p2p_cache_touch(&c, 1, 2, t + P2P_CACHE_REFRESH_S - 1);
+    CHECK(p2p_cache_get(&c, 1, 2, t)->updated_s == t);
+    p2p_cache_touch(&c, 1, 2, t + P2P_CACHE_REFRESH_S);
+    CHECK(p2p_cache_get(&c, 1, 2, t)->updated_s == t + P2P_CACHE_REFRESH_S);
+    p2p_cache_touch(&c, 1, 9, t + P2P_CACHE_REFRESH_S); /* 無いエントリは作らない */
+    CHECK(p2p_cache_get(&c, 1, 9, t) == NULL);
+
+    /*
+     * 追い出し: 同じスロットから探し始める P2P_CACHE_PROBE+1 個の相手を集め、
+     * 探す範囲が埋まっていれば最も古いもの(先頭とは限らない)を上書きする
+     */
+    uint32_t peers[P2P_CACHE_PROBE + 1];
+    size_t npeers = 0;
+    ptrdiff_t home = -1;
+    for (uint32_t p = 1; p < 100000 && npeers < P2P_CACHE_PROBE + 1; p++) {
+        memset(c.map->e, 0, sizeof(c.map->e));
+        struct p2p_cache_entry x = cache_entry(1, p, t, 5000);
+        p2p_cache_put(&c, &x);
+        const struct p2p_cache_entry *got = p2p_cache_get(&c, 1, p, t);
+        ptrdiff_t slot = got ? got - c.map->e : -1;
+        if (home < 0)
+            home = slot;
+        if (slot == home)
+            peers[npeers++] = p;
+    }
+    CHECK(npeers == P2P_CACHE_PROBE + 1);
+    memset(c.map->e, 0, sizeof(c.map->e));
+    const size_t oldest = 3;
+    for (size_t i = 0; i < P2P_CACHE_PROBE && i < npeers; i++) {
+        struct p2p_cache_entry x = cache_entry(1, peers[i], t + (i == oldest ? 0 : 10 + i), (uint16_t)(5000 + i));
+        p2p_cache_put(&c, &x);
+    }
+    if (npeers == P2P_CACHE_PROBE + 1) {
+        struct p2p_cache_entry x = cache_entry(1, peers[P2P_CACHE_PROBE], t + 50, 6000);
+        p2p_cache_put(&c, &x);
+        CHECK(p2p_cache_get(&c, 1, peers[oldest], t) == NULL);
+        CHECK(p2p_cache_get(&c, 1, peers[P2P_CACHE_PROBE], t) == &c.map->e[(size_t)home + oldest]);
+        for (size_t i = 0; i < P2P_CACHE_PROBE; i++) {
+            if (i != oldest)
+                CHECK(cache_port(p2p_cache_get(&c, 1, peers[i], t)) == 5000 + i);
+        }
+        /* 既にあるキーは追い出さずにその場で書き換える */
+        x.updated_s = t + 60;
+        x.local_port = 6001;
+        p2p_cache_put(&c, &x);
+        CHECK(p2p_cache_get(&c, 1, peers[0], t) != NULL);
+        CHECK(p2p_cache_local_port(&c, 1, t) == 6001);
+    }
+
+    p2p_cache_close(&c);
+    CHECK(c.map == NULL && c.fd == -1);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* ---------- エンドポイントキャッシュ: 再起動したクライアントの直接punchとサーバ経由の競争 ---------- */
+
+/*
+ * チャットと同じ手順で動くクライアント: エンジンを起こし、キャッシュにあれば直接punchし、
+ * 同時にサーバへ登録・問い合わせて、PEER が返ればそのアドレスへ p2p_engine_connect する。
+ * サーバは遠い(往復約40ms)がpeer同士は近い(往復約4ms)
+ */
+#define CACHE_SRV_LINK_US 20000
+
+struct cache_fixture;
+
+struct cache_peer {
+    struct cache_fixture *f;
+    struct netsim_node *node;
+    struct sockaddr_in addr;
+    uint32_t id;
+    struct p2p_engine eng;
+    int up;                 /* エンジンが動いている */
+    struct p2p_request rq[2];
+    size_t nreq;
+    int resolved;           /* 問い合わせの結果へ connect した */
+    struct p2p_rtt est;
+};
+
+struct cache_fixture {
+    struct netsim sim;
+    struct netsim_node *server;
+    struct sockaddr_in server_addr;
+    struct nts_ctx table;
+    struct nts_server srv;
+    struct cache_peer a, a2, b; /* a2 は別のポートで起動し直したA */
+    uint64_t end_us;
+};
+
+static void cache_server_recv(void *user, const void *buf, size_t len,
+                              const struct sockaddr *src, socklen_t srclen)
+{
+    struct cache_fixture *f = (struct cache_fixture *)user;
+    nts_server_dispatch(&f->srv, buf, len, src, srclen);
+}
+
+static void cache_peer_recv(void *user, const void *buf, size_t len,
+                            const struct sockaddr *src, socklen_t srclen)
+{
+    struct cache_peer *p = (struct cache_peer *)user;
+    char text[P2P_BUF_SIZE + 1];
+    if (!p->up || len > P2P_BUF_SIZE)
+        return;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    if (p2p_req_match(p->rq, p->nreq, text, src, srclen, p->id, &p->est, netsim_now(&p->f->sim)))
+        return;
+    p2p_engine_input(&p->eng, text, len, src, srclen);
+}
+
+static void cache_peer_tick(struct cache_peer *p, uint64_t now)
+{
+    if (!p->up)
+        return;
+    for (size_t k = 0; k < p->nreq; k++) {
+        struct p2p_request *rq = &p->rq[k];
+        if (rq->done || now < rq->next_at || rq->tries >= P2P_REQ_MAX_TRIES)
+            continue;
+        p2p_req_transmit(&p->node->tp, -1, rq, p->id, (struct sockaddr *)&p->f->server_addr,
+                         sizeof(p->f->server_addr), now);
+    }
+    if (p->nreq > 1 && p->rq[1].done == P2P_REQ_OK && !p->resolved) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        p->resolved = 1;
+        if (p2p_make_addr(p->rq[1].ip, p->rq[1].port, AF_INET, &addr, &addrlen) == 0)
+            p2p_engine_connect(&p->eng, p->rq[1].peer_id, (struct sockaddr *)&addr, addrlen);
+    }
+    p2p_engine_timers(&p->eng);
+}
+
+static void cache_tick(void *arg)
+{
+    struct cache_fixture *f = (struct cache_fixture *)arg;
+    uint64_t now = netsim_now(&f->sim);
+    cache_peer_tick(&f->a, now);
+    cache_peer_tick(&f->a2, now);
+    cache_peer_tick(&f->b, now);
+    if (now + 1000 < f->end_us)
+        netsim_at(&f->sim, now + 1000, cache_tick, f);
+}
+
+/* p のエンジンを(起動し直して)動かし、登録と target への問い合わせを始める */
+static int cache_peer_start(struct cache_peer *p, uint32_t target)
+{
+    if (p->up)
+        p2p_engine_dispose(&p->eng);
+    p->up = 0;
+    if (p2p_engine_init_transport(&p->eng, &p->node->tp, p->id, (struct sockaddr *)&p->f->server_addr,
+                                  sizeof(p->f->server_addr), 8, NULL, NULL) != 0)
+        return -1;
+    p->eng.quiet = 1;
+    p->up = 1;
+    p->resolved = 0;
+    memset(p->rq, 0, sizeof(p->rq));
+    p->rq[0].kind = P2P_REQ_REGISTER;
+    p->rq[1].kind = P2P_REQ_QUERY;
+    p->rq[1].peer_id = target;
+    p->nreq = target ? 2 : 1;
+    p2p_rtt_init(&p->est);
+    for (size_t k = 0; k < p->nreq; k++)
+        p2p_req_reset(&p->rq[k], &p->est);
+    return 0;
+}
+
+static void cache_peer_stop(struct cache_peer *p)
+{
+    if (p->up)
+        p2p_engine_dispose(&p->eng);
+    p->up = 0;
+}
+
+static int cache_setup(struct cache_fixture *f)
+{
+    static const struct netsim_link far = { CACHE_SRV_LINK_US, 0, 0 };
+    memset(f, 0, sizeof(*f));
+    netsim_init(&f->sim, 7);
+    f->server = netsim_add_node(&f->sim, NETSIM_NAT_NONE, &far, 0, SERVER_PORT, cache_server_recv, f);
+    if (!f->server || nts_init(&f->table, 16) != 0)
+        return -1;
+    if (nts_server_init(&f->srv, -1, &f->table, &f->server->tp) != 0) {
+        nts_dispose(&f->table);
+        return -1;
+    }
+    netsim_node_public_addr(f->server, &f->server_addr);
+    struct cache_peer *peers[] = { &f->a, &f->b, &f->a2 };
+    const uint32_t ids[] = { PEER_A, PEER_B, PEER_A };
+    for (size_t i = 0; i < 3; i++) {
+        struct cache_peer *p = peers[i];
+        p->f = f;
+        p->id = ids[i];
+        p->node = netsim_add_node(&f->sim, NETSIM_NAT_NONE, &test_link, 0, (uint16_t)(CLIENT_PORT + i),
+                                  cache_peer_recv, p);
+        if (!p->node)
+            return -1;
+        netsim_node_public_addr(p->node, &p->addr);
+    }
+    f->end_us = NETSIM_START_US + 120 * 1000000u;
+    netsim_at(&f->sim, netsim_now(&f->sim), cache_tick, f);
+    return 0;
+}
+
+static void cache_teardown(struct cache_fixture *f)
+{
+    cache_peer_stop(&f->a);
+    cache_peer_stop(&f->a2);
+    cache_peer_stop(&f->b);
+    nts_server_dispose(&f->srv);
+    nts_dispose(&f->table);
+    netsim_dispose(&f->sim);
+}
+
+/* B から A へのセッションが確立するまで1msずつ進める。確立したセッションを返す */
+static struct p2p_session *cache_wait_established(struct cache_fixture *f, uint64_t limit_us)
+{
+    uint64_t until = netsim_now(&f->sim) + limit_us;
+    while (netsim_now(&f->sim) < until) {
+        struct p2p_session *s = p2p_engine_find_id(&f->b.eng, PEER_A);
+        if (s && s->state == P2P_ESTABLISHED)
+            return s;
+        netsim_run(&f->sim, netsim_now(&f->sim) + 1000);
+    }
+    return NULL;
+}
+
+/* 確立したセッションをチャットの cache_store と同じ形で書き残す */
+static void cache_store_session(struct p2p_cache *c, const struct cache_fixture *f, const struct p2p_session *s)
+{
+    struct p2p_cache_entry e;
+    memset(&e, 0, sizeof(e));
+    e.self_id = f->b.id;
+    e.peer_id = s->peer_id;
+    e.updated_s = netsim_now(&f->sim) / 1000000u;
+    memcpy(&e.addr, &s->addr, s->addrlen);
+    e.addrlen = s->addrlen;
+    e.local_port = ntohs(f->b.addr.sin_port);
+    e.punch_us = (uint32_t)(s->established_us - s->start_us);
+    p2p_cache_put(c, &e);
+}
+
+/* 起動し直したBがキャッシュのアドレスへ直接punchする。返り値はそのセッション */
+static struct p2p_session *cache_restart_b(struct p2p_cache *c, struct cache_fixture *f)
+{
+    if (cache_peer_start(&f->b, PEER_A) != 0)
+        return NULL;
+    const struct p2p_cache_entry *ce = p2p_cache_get(c, PEER_B, PEER_A, netsim_now(&f->sim) / 1000000u);
+    if (!ce)
+        return NULL;
+    return p2p_engine_connect(&f->b.eng, PEER_A, (const struct sockaddr *)&ce->addr, (socklen_t)ce->addrlen);
+}
+
+static void test_cache_restart_race(void)
+{
+    char dir[] = "/tmp/tiny_cache_XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/cache", dir);
+    struct p2p_cache c;
+    CHECK(p2p_cache_open(&c, path) == 0);
+
+    struct cache_fixture *f = malloc(sizeof(*f));
+    CHECK(f && cache_setup(f) == 0);
+    if (!f || !c.map)
+        return;
+
+    /* 初回: サーバ経由で確立し、Aのアドレスを書き残す */
+    CHECK(cache_peer_start(&f->a, 0) == 0);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 200000);
+    CHECK(f->a.rq[0].done == P2P_REQ_OK);
+    CHECK(cache_peer_start(&f->b, PEER_A) == 0);
+    struct p2p_session *s = cache_wait_established(f, 2000000);
+    CHECK(s && session_at(s, &f->a.addr));
+    if (s)
+        cache_store_session(&c, f, s);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 5 * 1000000u);
+
+    /* Bを起動し直す: Aはまだ同じアドレスに居るので、サーバの応答より先に直接つながる */
+    uint64_t t0 = netsim_now(&f->sim);
+    CHECK(cache_restart_b(&c, f) != NULL);
+    s = cache_wait_established(f, 2000000);
+    CHECK(s && session_at(s, &f->a.addr));
+    CHECK(f->b.rq[1].done == 0); /* 問い合わせはまだ返っていない */
+    if (s)
+        CHECK(s->established_us - t0 < 2 * CACHE_SRV_LINK_US);
+    /* 後から届いたサーバの答えも同じアドレスなので、確立したセッションはそのまま */
+    netsim_run(&f->sim, netsim_now(&f->sim) + 500000);
+    CHECK(f->b.rq[1].done == P2P_REQ_OK && f->b.resolved);
+    s = p2p_engine_find_id(&f->b.eng, PEER_A);
+    CHECK(s && s->state == P2P_ESTABLISHED && session_at(s, &f->a.addr));
+    CHECK(f->b.eng.count == 1);
+
+    /* Aが別のポートで起動し直した: キャッシュのアドレスは応答せず、サーバ経由のアドレスへ付け替えて確立する */
+    cache_peer_stop(&f->a);
+    CHECK(cache_peer_start(&f->a2, 0) == 0);
+    netsim_run(&f->sim, netsim_now(&f->sim) + 200000);
+    CHECK(f->a2.rq[0].done == P2P_REQ_OK);
+    t0 = netsim_now(&f->sim);
+    s = cache_restart_b(&c, f);
+    CHECK(s && session_at(s, &f->a.addr) && s->state == P2P_PUNCHING);
+    s = cache_wait_established(f, 2000000);
+    CHECK(s && session_at(s, &f->a2.addr));
+    if (s) {
+        CHECK(s->established_us - t0 < 10 * CACHE_SRV_LINK_US);
+        cache_store_session(&c, f, s);
+    }
+    CHECK(f->b.eng.count == 1);
+    CHECK(cache_port(p2p_cache_get(&c, PEER_B, PEER_A, netsim_now(&f->sim) / 1000000u)) ==
+          ntohs(f->a2.addr.sin_port));
+    CHECK(p2p_cache_local_port(&c, PEER_B, netsim_now(&f->sim) / 1000000u) == ntohs(f->b.addr.sin_port));
+
+    cache_teardown(f);
+    free(f);
+    p2p_cache_close(&c);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* ---------- 信頼性レイヤ: 古いACKのSACKビット ---------- */
+
+struct rel_end {
+    struct netsim_node *node;
+    struct rel_conn *rc;
+    struct sockaddr_in peer;
+    uint64_t delivered;
+    uint64_t misordered; /* 積んだ順と違う順で渡されたDATA */
+    uint32_t first;      /* 最初に渡された番号（相手の起動し直し後はUINT32_MAXで次に決める） */
+    unsigned resets;     /* peer_reset の回数 */
+    uint64_t dropped;    /* その時に捨てられた未ACKの数 */
+    unsigned char last_ack[REL_ACK_SIZE]; /* 最後に受けたACK */
+};
+
+struct rel_fixture {
+    struct netsim sim;
+    struct rel_end tx, rx;
+    size_t queued;  /* tx に積んだ数 */
+    size_t total;   /* tx に積む目標 */
+    uint64_t end_us;
+};
+
+static int rel_end_output(void *arg, const void *buf, size_t len)
+{
+    struct rel_end *e = (struct rel_end *)arg;
+    ssize_t r = tiny_tp_sendto(&e->node->tp, -1, buf, len, (struct sockaddr *)&e->peer, sizeof(e->peer));
+    return r == (ssize_t)len ? 0 : -1;
+}
+
+static void rel_end_deliver(void *arg, const void *buf, size_t len)
+{
+    struct rel_end *e = (struct rel_end *)arg;
+    uint32_t idx;
+    if (len < sizeof(idx)) {
+        e->misordered++;
+        return;
+    }
+    memcpy(&idx, buf, sizeof(idx));
+    if (e->first == UINT32_MAX)
+        e->first = idx;
+    if (idx != e->first + e->delivered)
+        e->misordered++;
+    e->delivered++;
+}
+
+/* 相手が起動し直した: 渡された数を数え直す */
+static void rel_end_reset(void *arg, uint32_t dropped)
+{
+    struct rel_end *e = (struct rel_end *)arg;
+    e->resets++;
+    e->dropped += dropped;
+    e->delivered = 0;
+    e->first = UINT32_MAX;
+}
+
+static const struct rel_ops rel_test_ops = { rel_end_output, rel_end_deliver, NULL, NULL, rel_end_reset };
+
+static void rel_end_recv(void *user, const void *buf, size_t len,
+                         const struct sockaddr *src, socklen_t srclen)
+{
+    struct rel_end *e = (struct rel_end *)user;
+    (void)src;
+    (void)srclen;
+    if (len == REL_ACK_SIZE && rel_is_frame(buf, len))
+        memcpy(e->last_ack, buf, len);
+    rel_input(e->rc, buf, len, netsim_now(e->node->sim));
+}
+
+/* 目標数まで送信キューへ積み、両端のタイマを進める */
+static void rel_tick(void *arg)
+{
+    struct rel_fixture *f = (struct rel_fixture *)arg;
+    uint64_t now = netsim_now(&f->sim);
+    char payload[100];
+    memset(payload, 'x', sizeof(payload));
+    while (f->queued < f->total && rel_send_space(f->tx.rc) > 0) {
+        uint32_t idx = (uint32_t)f->queued;
+        memcpy(payload, &idx, sizeof(idx));
+        if (rel_send(f->tx.rc, payload, sizeof(payload), now) != 0)
+            break;
+        f->queued++;
+    }
+    rel_timer(f->tx.rc, now);
+    rel_timer(f->rx.rc, now);
+    if (now + 1000 < f->end_us)
+        netsim_at(&f->sim, now + 1000, rel_tick, f);
+}
+
+static int rel_end_init(struct rel_fixture *f, struct rel_end *e, const struct netsim_link *link, uint16_t port)
+{
+    e->node = netsim_add_node(&f->sim, NETSIM_NAT_NONE, link, 0, port, rel_end_recv, e);
+    e->rc = rel_create(&rel_test_ops, e);
+    return e->node && e->rc ? 0 : -1;
+}
+
+/* link で繋いだ送信側と受信側を置き、1msごとのタイマを始める */
+static int rel_setup(struct rel_fixture *f, uint32_t seed, const struct netsim_link *link)
+{
+    memset(f, 0, sizeof(*f));
+    netsim_init(&f->sim, seed);
+    if (rel_end_init(f, &f->tx, link, CLIENT_PORT) != 0 || rel_end_init(f, &f->rx, link, CLIENT_PORT + 1) != 0)
+        return -1;
+    netsim_node_public_addr(f->rx.node, &f->tx.peer);
+    netsim_node_public_addr(f->tx.node, &f->rx.peer);
+    f->end_us = NETSIM_START_US + 600 * 1000000u;
+    netsim_at(&f->sim, netsim_now(&f->sim), rel_tick, f);
+    return 0;
+}
+
+static void rel_teardown(struct rel_fixture *f)
+{
+    rel_destroy(f->tx.rc);
+    rel_destroy(f->rx.rc);
+    netsim_dispose(&f->sim);
+}
+
+/* 全部ACKされるか期限まで進める */
+static void rel_run_idle(struct rel_fixture *f, uint64_t limit_us)
+{
+    uint64_t until = netsim_now(&f->sim) + limit_us;
+    while (netsim_now(&f->sim) < until && !(f->queued == f->total && rel_send_idle(f->tx.rc)))
+        netsim_run(&f->sim, netsim_now(&f->sim) + 10000);
+}
+
+static void test_rel_stale_sack(void)
+{
+    struct rel_fixture f;
+    CHECK(rel_setup(&f, 3, &test_link) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+
+    /* ウィンドウを一周以上送り切る */
+    const uint32_t first = REL_WINDOW + 76;
+    f.total = first;
+    rel_run_idle(&f, 30 * 1000000u);
+    CHECK(rel_send_idle(f.tx.rc) && f.rx.delivered == first);
+
+    /*
+     * 次の64個を送り出した直後（まだACKが返らないうち）に、一周前の cum と全ビット立てたSACKを持つ
+     * 古いACKを届ける。seq = cum+1+i のスロットは今飛んでいる seq = first+i と同じ位置にある。
+     * epochは本物のACKから写す
+     */
+    f.total = first + 64;
+    netsim_run(&f.sim, netsim_now(&f.sim) + 1000);
+    struct rel_stats before, after;
+    rel_get_stats(f.tx.rc, &before);
+    CHECK(before.acked == first);
+
+    unsigned char ack[REL_ACK_SIZE];
+    uint32_t cum = htonl(first - REL_WINDOW - 1), ts = htonl((uint32_t)netsim_now(&f.sim));
+    memcpy(ack, f.tx.last_ack, sizeof(ack));
+    CHECK(ack[1] == REL_ACK);
+    memcpy(ack + 4, &cum, 4);
+    memcpy(ack + 8, &ts, 4);
+    memset(ack + 12, 0xff, 8);
+    rel_input(f.tx.rc, ack, sizeof(ack), netsim_now(&f.sim));
+    rel_get_stats(f.tx.rc, &after);
+    CHECK(after.acked == before.acked);
+
+    /* 本物のACKで残りが完了する */
+    rel_run_idle(&f, 30 * 1000000u);
+    rel_get_stats(f.tx.rc, &after);
+    CHECK(rel_send_idle(f.tx.rc));
+    CHECK(after.acked == first + 64 && f.rx.delivered == first + 64);
+    CHECK(f.rx.misordered == 0);
+
+    rel_teardown(&f);
+}
+
+/* ---------- 信頼性レイヤ: 損失・並び替えのある経路での回復とcwnd ---------- */
+
+#define REL_LOSS_TOTAL 3000
+
+static void test_rel_recovery(void)
+{
+    /* 損失無し: 再送せずに送り切り、cwndはスロースタートで伸びる */
+    const struct netsim_link clean = { 10000, 0, 0 };
+    struct rel_fixture f;
+    struct rel_stats st;
+    CHECK(rel_setup(&f, 8, &clean) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+    f.total = REL_LOSS_TOTAL;
+    rel_run_idle(&f, 60 * 1000000u);
+    rel_get_stats(f.tx.rc, &st);
+    CHECK(f.rx.delivered == REL_LOSS_TOTAL && f.rx.misordered == 0);
+    CHECK(st.acked == REL_LOSS_TOTAL && st.retransmits == 0);
+    CHECK(st.cwnd > 4 * REL_INIT_CWND);
+    /* 片道は両端のリンクを通るので往復40ms */
+    CHECK(st.srtt_us >= 40000 && st.srtt_us < 60000);
+    double clean_cwnd = st.cwnd;
+    rel_teardown(&f);
+
+    /* 各リンク3%の損失と2msのジッタ: 喪失分を再送して順序通りに渡し、cwndは絞られる */
+    const struct netsim_link lossy = { 10000, 2000, 30000 };
+    CHECK(rel_setup(&f, 9, &lossy) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+    f.total = REL_LOSS_TOTAL;
+    rel_run_idle(&f, 120 * 1000000u);
+    rel_get_stats(f.tx.rc, &st);
+    CHECK(rel_send_idle(f.tx.rc));
+    CHECK(f.rx.delivered == REL_LOSS_TOTAL && f.rx.misordered == 0);
+    CHECK(st.acked == REL_LOSS_TOTAL);
+    /* 再送は網で落ちたデータグラム(DATAとACK)の数を超えない（RTOでまとめて送り直していない） */
+    CHECK(st.retransmits > 0 && st.retransmits <= f.sim.st.lost);
+    CHECK(st.data_sent == REL_LOSS_TOTAL + st.retransmits);
+    CHECK(st.cwnd < clean_cwnd);
+    rel_teardown(&f);
+}
+
+/* ---------- 信頼性レイヤ: 同じアドレスのまま起動し直した相手 ---------- */
+
+/* end の接続を作り直す（プロセスを起動し直したのと同じ。アドレスは変わらない） */
+static int rel_end_restart(struct rel_end *e)
+{
+    rel_destroy(e->rc);
+    e->rc = rel_create(&rel_test_ops, e);
+    e->delivered = 0;
+    e->first = 0;
+    return e->rc ? 0 : -1;
+}
+
+/* rx が n 個受け取るまで進める */
+static void rel_run_until_delivered(struct rel_fixture *f, uint64_t n, uint64_t limit_us)
+{
+    uint64_t until = netsim_now(&f->sim) + limit_us;
+    while (netsim_now(&f->sim) < until && f->rx.delivered < n)
+        netsim_run(&f->sim, netsim_now(&f->sim) + 1000);
+}
+
+static void test_rel_restart(void)
+{
+    /* 送信側が流れの途中で起動し直し、seq 0 から送り直す。受信側は古い rcv_nxt で待たずに受け取る */
+    const struct netsim_link link = { 5000, 1000, 0 };
+    struct rel_fixture f;
+    struct rel_stats st;
+    CHECK(rel_setup(&f, 10, &link) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+    f.total = 2000;
+    rel_run_until_delivered(&f, 500, 10 * 1000000u);
+    CHECK(f.rx.delivered >= 500 && f.rx.delivered < 2000);
+    CHECK(rel_end_restart(&f.tx) == 0);
+    f.queued = 0;
+    f.total = 300;
+    rel_run_idle(&f, 10 * 1000000u);
+    rel_get_stats(f.tx.rc, &st);
+    CHECK(rel_send_idle(f.tx.rc) && st.acked == 300);
+    CHECK(f.rx.resets == 1 && f.rx.first == 0);
+    CHECK(f.rx.delivered == 300 && f.rx.misordered == 0);
+    CHECK(f.tx.resets == 0);
+    rel_get_stats(f.rx.rc, &st);
+    CHECK(st.peer_resets == 1);
+    rel_teardown(&f);
+
+    /*
+     * 受信側が起動し直す: 送信側の古い流れのDATAは受け取らずにACKで自分のepochを知らせ、
+     * 送信側は未ACKの分を捨てて次のseqから新しい流れを始める
+     */
+    CHECK(rel_setup(&f, 11, &link) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+    f.total = 3000;
+    rel_run_until_delivered(&f, 500, 10 * 1000000u);
+    CHECK(rel_end_restart(&f.rx) == 0);
+    f.rx.first = UINT32_MAX;
+    rel_run_idle(&f, 10 * 1000000u);
+    CHECK(rel_send_idle(f.tx.rc) && f.queued == f.total);
+    CHECK(f.tx.resets == 1 && f.tx.dropped > 0);
+    CHECK(f.rx.resets == 0 && f.rx.misordered == 0);
+    CHECK(f.rx.first != UINT32_MAX && f.rx.first + f.rx.delivered == f.total);
+    rel_teardown(&f);
+
+    /* 遅れて届いた前の相手のフレームで戻らない */
+    CHECK(rel_setup(&f, 12, &link) == 0);
+    if (!f.tx.rc || !f.rx.rc)
+        return;
+    f.total = 100;
+    rel_run_idle(&f, 10 * 1000000u);
+    unsigned char old_ack[REL_ACK_SIZE];
+    memcpy(old_ack, f.tx.last_ack, sizeof(old_ack));
+    CHECK(rel_end_restart(&f.rx) == 0);
+    f.rx.first = UINT32_MAX;
+    f.total = 200;
+    rel_run_idle(&f, 10 * 1000000u);
+    CHECK(f.tx.resets == 1 && f.tx.dropped + f.rx.delivered == 100); /* 捨てた分以外は届く */
+    uint64_t before = f.rx.delivered;
+    rel_input(f.tx.rc, old_ack, sizeof(old_ack), netsim_now(&f.sim));
+    f.total = 300;
+    rel_run_idle(&f, 10 * 1000000u);
+    CHECK(f.tx.resets == 1 && f.rx.delivered == before + 100 && f.rx.misordered == 0);
+    rel_teardown(&f);
+}
+
+/* ---------- 転送: 相手の申告したサイズ ---------- */
+
+static size_t xfer_meta(unsigned char *msg, uint64_t size, const char *name)
+{
+    size_t nlen = strlen(name);
+    msg[0] = XFER_META;
+    for (int i = 0; i < 8; i++)
+        msg[1 + i] = (unsigned char)(size >> (56 - 8 * i));
+    memcpy(msg + XFER_HDR, name, nlen);
+    return XFER_HDR + nlen;
+}
+
+static void test_xfer_meta_limit(void)
+{
+    char dir[] = "/tmp/tiny_netsim_test.XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/out", dir);
+
+    struct xfer_recv x;
+    memset(&x, 0, sizeof(x));
+    x.fd = -1;
+    unsigned char msg[XFER_HDR + 16];
+
+    /* 上限を超えるサイズは ftruncate せずに断り、続くDATAは捨てる */
+    size_t len = xfer_meta(msg, XFER_RECV_MAX + 1, "big");
+    errno = 0;
+    CHECK(xfer_recv_input(&x, path, msg, len, 1) == -1 && errno == EFBIG);
+    CHECK(access(path, F_OK) != 0);
+    msg[0] = XFER_DATA;
+    CHECK(xfer_recv_input(&x, path, msg, XFER_HDR + 4, 2) == 0);
+    CHECK(x.received == 0);
+
+    /* 上限内なら受ける */
+    len = xfer_meta(msg, 4, "small");
+    CHECK(xfer_recv_input(&x, path, msg, len, 3) == 0);
+    memset(msg, 0, XFER_HDR);
+    msg[0] = XFER_DATA;
+    memcpy(msg + XFER_HDR, "data", 4);
+    CHECK(xfer_recv_input(&x, path, msg, XFER_HDR + 4, 4) == 1);
+    xfer_recv_close(&x);
+    CHECK(access(path, F_OK) == 0);
+
+    unlink(path);
+    rmdir(dir);
+}
+
+/* ---------- keep-alive: KEEPALIVE_ACK を返さないクライアント ---------- */
+
+/* 1秒刻みで keep-alive を回し、送った時刻を sent に記録する。ack なら送るたびにすぐACKを返す */
+static size_t ka_drive(struct nts_ka_state *ka, uint64_t from_ms, uint64_t to_ms, int ack,
+                       uint64_t *sent, size_t max)
+{
+    size_t n = 0;
+    for (uint64_t now = from_ms; now < to_ms; now += 1000) {
+        int resend = nts_ka_check_timeout(ka, now, NULL);
+        if (resend || nts_ka_due(ka, now)) {
+            nts_ka_on_sent(ka, now, NULL);
+            if (n < max)
+                sent[n] = now;
+            n++;
+            if (ack)
+                nts_ka_on_ack(ka, now + 50, NULL);
+        }
+    }
+    return n;
+}
+
+static void test_ka_no_ack(void)
+{
+    struct nts_addr addr;
+    CHECK(nts_addr_pton(&addr, "203.0.113.7", 40000) == 0);
+    uint64_t sent[64];
+
+    /* ACKを返さない: 数回途絶えたら固定間隔・再送無しに落ち着く */
+    struct nts_ka_state legacy;
+    nts_ka_init(&legacy, &addr, 0);
+    ka_drive(&legacy, 0, 300000, 0, sent, 64);
+    CHECK(legacy.phase == NTS_KA_NO_ACK);
+    CHECK(nts_ka_expect_ms(&legacy) == NTS_KA_LEGACY_MS);
+    size_t n = ka_drive(&legacy, 300000, 600000, 0, sent, 64);
+    CHECK(n == 300000 / NTS_KA_LEGACY_MS);
+    for (size_t i = 1; i < n && i < 64; i++)
+        CHECK(sent[i] - sent[i - 1] == NTS_KA_LEGACY_MS);
+
+    /* ACKを返すようになったら探索に戻る */
+    nts_ka_on_ack(&legacy, 600000, NULL);
+    CHECK(legacy.phase == NTS_KA_PROBING);
+
+    /* ACKを返すクライアントは固定間隔に落とさず、間隔を伸ばしていく */
+    struct nts_ka_state modern;
+    nts_ka_init(&modern, &addr, 0);
+    ka_drive(&modern, 0, 600000, 1, sent, 64);
+    CHECK(modern.phase != NTS_KA_NO_ACK);
+    CHECK(modern.interval_ms > NTS_KA_LEGACY_MS);
+}
+
+/* ---------- keep-alive: NATの寿命の探索 ---------- */
+
+/*
+ * 無通信 life_ms でマッピングが消えるNATの外側のクライアント（1秒刻みで模擬する）。
+ * KEEPALIVE はマッピングが生きていれば届いてACKが返り、消えていれば届かない。
+ * " PROBE" を頼まれたら探索用ソケットから KAPROBE を送る（消えていれば新しいマッピングになる）。
+ * 主マッピングが消えていたら数えたうえで登録し直したとみなす
+ */
+struct ka_client {
+    uint64_t out_ms;       /* 主マッピングで最後に外へ送った時刻 */
+    uint64_t probe_out_ms; /* 探索用マッピングで最後に外へ送った時刻 */
+    uint16_t probe_port;   /* 探索用マッピングの外側ポート（作り直すと変わる） */
+    unsigned primary_lost; /* 主マッピングが寿命切れになった回数 */
+};
+
+static void ka_nat_drive(struct nts_ka_state *ka, struct nts_ka_stats *st, uint64_t from_ms, uint64_t until_ms,
+                         uint32_t life_ms, struct ka_client *c)
+{
+    for (uint64_t now = from_ms; now < until_ms; now += 1000) {
+        int resend = nts_ka_check_timeout(ka, now, st);
+        if (resend || nts_ka_due(ka, now)) {
+            int want_probe = nts_ka_want_probe(ka);
+            nts_ka_on_sent(ka, now, st);
+            if (now - c->out_ms < life_ms) {
+                c->out_ms = now + 50;
+                nts_ka_on_ack(ka, now + 100, st);
+                if (want_probe) {
+                    if (now - c->probe_out_ms >= life_ms)
+                        c->probe_port++;
+                    c->probe_out_ms = now + 50;
+                    struct nts_addr probe;
+                    nts_addr_pton(&probe, "203.0.113.7", c->probe_port);
+                    nts_ka_on_probe_open(ka, &probe, now + 100, st);
+                }
+            } else {
+                c->primary_lost++;
+                c->out_ms = now;
+            }
+        }
+        int probe_resend = nts_ka_check_probe_timeout(ka, now, st);
+        if (probe_resend || nts_ka_probe_due(ka, now)) {
+            nts_ka_on_probe_sent(ka, now, st);
+            if (now - c->probe_out_ms < life_ms) {
+                c->probe_out_ms = now + 50;
+                nts_ka_on_probe_ack(ka, now + 100, st);
+            }
+        }
+    }
+}
+
+static void test_ka_search(void)
+{
+    static const struct {
+        const char *ip;
+        uint32_t life_ms;
+    } cases[] = {
+        { "203.0.113.7", 45000 },
+        { "203.0.113.7", 200000 },
+        { "100.64.1.2", 25000 },
+        { "203.0.113.7", 1000000 }, /* クラスの上限(300秒)より長い */
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct nts_addr addr;
+        struct nts_ka_state ka;
+        struct nts_ka_stats st;
+        struct ka_client c = { .probe_port = 50000 };
+        uint32_t life = cases[i].life_ms;
+        memset(&st, 0, sizeof(st));
+        CHECK(nts_addr_pton(&addr, cases[i].ip, 40000) == 0);
+        nts_ka_init(&ka, &addr, 0);
+
+        /* 数時間で寿命を挟み込み、マージンをかけた間隔に落ち着く。探りすぎても失うのは探索用マッピングだけ */
+        const uint64_t learn_ms = 4 * 3600 * 1000ull;
+        ka_nat_drive(&ka, &st, 0, learn_ms, life, &c);
+        CHECK(ka.phase == NTS_KA_LEARNED);
+        CHECK(ka.interval_ms < life);
+        CHECK(c.primary_lost == 0);
+        CHECK(!nts_addr_is_set(&ka.probe_addr));
+        if (life < 300000) {
+            uint32_t resolution = life / 8 > 5000 ? life / 8 : 5000;
+            CHECK(ka.hi_ms >= life && ka.lo_ms < life);
+            CHECK(ka.interval_ms >= (uint64_t)(life - resolution) * (100 - NTS_KA_MARGIN_PCT) / 100);
+            CHECK(st.expired > 0 && c.probe_port > 50000);
+        } else {
+            CHECK(ka.interval_ms == 300000 && st.expired == 0);
+        }
+
+        /* 学習後は寿命切れを起こさずに保ち続ける */
+        uint64_t expired = st.expired, sent = st.sent;
+        ka_nat_drive(&ka, &st, learn_ms, learn_ms + 3600 * 1000ull, life, &c);
+        CHECK(st.expired == expired);
+        CHECK(c.primary_lost == 0);
+        CHECK(ka.phase == NTS_KA_LEARNED);
+        CHECK(st.sent - sent <= 3600 * 1000ull / ka.interval_ms + 1);
+    }
+
+    /* 探索用マッピングを作らないクライアントは探索せず、下限の間隔で主マッピングを保つ */
+    struct nts_addr addr;
+    struct nts_ka_state ka;
+    uint64_t sent[64];
+    CHECK(nts_addr_pton(&addr, "203.0.113.7", 40000) == 0);
+    nts_ka_init(&ka, &addr, 0);
+    size_t n = ka_drive(&ka, 0, 600000, 1, sent, 64);
+    CHECK(ka.phase == NTS_KA_PROBING && ka.lo_ms == 0 && ka.hi_ms == 0);
+    CHECK(n > 1);
+    for (size_t i = 1; i < n && i < 64; i++)
+        CHECK(sent[i] - sent[i - 1] <= NTS_KA_MIN_MS + 1000);
+    CHECK(nts_ka_want_probe(&ka));
+
+    /* 別IPや主マッピングと同じポートは探索用マッピングとして受け付けない */
+    struct nts_ctx table;
+    struct nts_addr other;
+    CHECK(nts_init(&table, 4) == 0);
+    CHECK(nts_upsert_client(&table, "9", &addr, 0) == 0);
+    CHECK(nts_addr_pton(&other, "198.51.100.1", 40001) == 0);
+    CHECK(nts_client_probe_open(&table, "9", &other, 1000, NULL) == -1);
+    CHECK(nts_client_probe_open(&table, "9", &addr, 1000, NULL) == -1);
+    CHECK(nts_addr_pton(&other, "203.0.113.7", 40001) == 0);
+    uint32_t probe_expect = 0;
+    CHECK(nts_client_probe_open(&table, "9", &other, 1000, &probe_expect) == 0);
+    /* 探索用マッピングからのACKは探索の応答として記録する */
+    struct client_info *ci = nts_find_client(&table, "9");
+    CHECK(ci && nts_addr_equal(&ci->ka.probe_addr, &other));
+    CHECK(ci && probe_expect > ci->ka.interval_ms);
+    if (ci) {
+        nts_ka_on_probe_sent(&ci->ka, 1000 + ci->ka.interval_ms, NULL);
+        CHECK(nts_client_seen(&table, "9", &other, 1, 1100 + ci->ka.interval_ms) == 0);
+        CHECK(ci->ka.lo_ms == ci->ka.interval_ms / 2 && ci->ka.probe_pending_ms == 0);
+    }
+    nts_dispose(&table);
+}
+
+/* ---------- タイマホイール: 次の期限 ---------- */
+
+#define TW_TEST_TIMERS 300
+
+static void tw_test_fire(struct tw_timer *t, void *arg)
+{
+    (void)t;
+    (*(size_t *)arg)++;
+}
+
+/* 登録・取り消し・進めるを乱数で繰り返し、tw_next_us が全タイマの最も早い期限と一致するか確かめる */
+static void test_tw_next(void)
+{
+    struct tw_wheel w;
+    struct tw_timer timers[TW_TEST_TIMERS];
+    size_t fired = 0;
+    const uint64_t tick = 10000;
+    uint64_t now = NETSIM_START_US;
+    tw_init(&w, tick, now);
+    for (size_t i = 0; i < TW_TEST_TIMERS; i++)
+        tw_timer_init(&timers[i], tw_test_fire, &fired);
+    CHECK(tw_next_us(&w) == UINT64_MAX);
+
+    p2p_rand_seed(7);
+    int mismatches = 0;
+    for (int step = 0; step < 20000; step++) {
+        struct tw_timer *t = &timers[p2p_rand() % TW_TEST_TIMERS];
+        uint32_t r = p2p_rand() % 10;
+        if (r < 5) {
+            /* 1周以内と数周先を混ぜる */
+            uint64_t span = (r < 3 ? TW_SLOTS : 4 * TW_SLOTS) * tick;
+            tw_schedule(&w, t, now + p2p_rand() % span);
+        } else if (r < 7) {
+            tw_cancel(&w, t);
+        } else {
+            now += p2p_rand() % (r == 9 ? 2 * TW_SLOTS * tick : 20 * tick);
+            tw_advance(&w, now);
+        }
+
+        uint64_t want = UINT64_MAX;
+        for (size_t i = 0; i < TW_TEST_TIMERS; i++) {
+            if (tw_pending(&timers[i]) && timers[i].expire * tick < want)
+                want = timers[i].expire * tick;
+        }
+        if (tw_next_us(&w) != want)
+            mismatches++;
+    }
+    CHECK(mismatches == 0);
+    CHECK(fired > 0);
+}
+
+/* ---------- アドレス: IPv4-mapped とデュアルスタックの登録 ---------- */
+
+static void test_addr_dual_stack(void)
+{
+    struct nts_addr a4, a6, m4, bad;
+    char buf[NTS_ADDR_STRLEN];
+    CHECK(nts_addr_pton(&a4, "192.0.2.1", 5000) == 0);
+    CHECK(nts_addr_pton(&a6, "2001:db8::1", 5000) == 0);
+    CHECK(nts_addr_pton(&bad, "not-an-ip", 5000) == -1);
+    CHECK(nts_addr_is_v4(&a4) && !nts_addr_is_v4(&a6));
+    CHECK(strcmp(nts_addr_ntop(&a4, buf, sizeof(buf)), "192.0.2.1") == 0);
+    CHECK(strcmp(nts_addr_ntop(&a6, buf, sizeof(buf)), "2001:db8::1") == 0);
+
+    /* 文字列の ::ffff:a.b.c.d と sockaddr_in は同じアドレスになる */
+    CHECK(nts_addr_pton(&m4, "::ffff:192.0.2.1", 5000) == 0);
+    CHECK(nts_addr_equal(&a4, &m4));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(5000);
+    inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr);
+    CHECK(nts_addr_from_sockaddr(&m4, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    CHECK(nts_addr_equal(&a4, &m4) && nts_addr_hash(&a4) == nts_addr_hash(&m4));
+    m4.port = 5001;
+    CHECK(!nts_addr_equal(&a4, &m4));
+    CHECK(nts_addr_from_sockaddr(&m4, (struct sockaddr *)&sin, sizeof(sin) - 1) == -1);
+
+    /* sockaddr へ戻すとファミリごとの形になる */
+    struct sockaddr_storage ss;
+    CHECK(nts_addr_to_sockaddr(&a4, &ss) == sizeof(struct sockaddr_in) && ss.ss_family == AF_INET);
+    CHECK(nts_addr_to_sockaddr(&a6, &ss) == sizeof(struct sockaddr_in6) && ss.ss_family == AF_INET6);
+    CHECK(nts_addr_from_sockaddr(&m4, (struct sockaddr *)&ss, sizeof(struct sockaddr_in6)) == 0);
+    CHECK(nts_addr_equal(&a6, &m4));
+
+    /* 両方のファミリで登録したIDは欄が別々に埋まり、keep-aliveはIPv4側へ送る */
+    struct nts_ctx ctx;
+    CHECK(nts_init(&ctx, 4) == 0);
+    CHECK(nts_upsert_client(&ctx, "dual", &a6, 0) == 0);
+    CHECK(nts_upsert_client(&ctx, "dual", &a4, 0) == 0);
+    CHECK(nts_count(&ctx) == 1);
+    struct client_info *c = nts_find_client(&ctx, "dual");
+    CHECK(c && nts_addr_equal(&c->v4, &a4) && nts_addr_equal(&c->v6, &a6));
+    CHECK(c && nts_client_ka_addr(c) == &c->v4);
+    /* 経路選びに使う写しはロック下で両ファミリとも取り出せる */
+    struct nts_addr got4, got6;
+    CHECK(nts_get_client_addrs(&ctx, "dual", &got4, &got6) == 0);
+    CHECK(nts_addr_equal(&got4, &a4) && nts_addr_equal(&got6, &a6));
+    CHECK(nts_get_client_addrs(&ctx, "nobody", &got4, &got6) == -1);
+    /* 別ファミリのアドレスからの通信も本人として扱い、知らないアドレスは断る */
+    CHECK(nts_client_seen(&ctx, "dual", &a6, 0, 1000) == 0);
+    CHECK(nts_addr_pton(&bad, "192.0.2.9", 5000) == 0);
+    CHECK(nts_client_seen(&ctx, "dual", &bad, 0, 1000) == -1);
+    nts_dispose(&ctx);
+}
+
+/* ---------- 名簿: カーソルで続きから読む ---------- */
+
+/*
+ * 名簿はプライベートアドレスからの要求にしか返さないが、仮想網のアドレスはグローバルなので、
+ * 送信を横取りする transport で nts_server_dispatch を直接呼ぶ
+ */
+
+#define ROSTER_IDS 600
+
+struct roster_walk {
+    unsigned seen[ROSTER_IDS + 100];
+    size_t entries;
+    uint64_t version;
+    int broken;       /* 塊の cursor が前の next_cursor と合わない・壊れた塊 */
+};
+
+/* from から "ROSTER cursor max [since]" を送り、返った塊を w に集める。next_cursor を返す */
+static uint32_t roster_request(struct nts_server *srv, const struct sockaddr_in *from, uint32_t cursor,
+                               unsigned max_chunks, uint64_t since, struct roster_walk *w)
+{
+    char line[64];
+    int n = since ? snprintf(line, sizeof(line), "ROSTER %u %u %llu", cursor, max_chunks, (unsigned long long)since)
+                  : snprintf(line, sizeof(line), "ROSTER %u %u", cursor, max_chunks);
+    captured.n = 0;
+    nts_server_dispatch(srv, line, (size_t)n, (const struct sockaddr *)from, sizeof(*from));
+    uint32_t next = cursor;
+    for (size_t i = 0; i < captured.n; i++) {
+        struct nts_roster_hdr h;
+        if (nts_roster_parse_hdr(captured.buf[i], captured.len[i], &h) != 0 || h.cursor != next) {
+            w->broken = 1;
+            return NTS_ROSTER_END;
+        }
+        size_t off = NTS_ROSTER_HDR_LEN;
+        for (uint16_t k = 0; k < h.count; k++) {
+            struct nts_roster_item it;
+            unsigned idx;
+            if (nts_roster_next(captured.buf[i], captured.len[i], &off, &it) != 0 ||
+                sscanf(it.id, "peer%u", &idx) != 1 || idx >= ROSTER_IDS + 100) {
+                w->broken = 1;
+                return NTS_ROSTER_END;
+            }
+            if (it.family == AF_INET)
+                w->seen[idx]++;
+            w->entries++;
+        }
+        w->version = h.version;
+        next = h.next_cursor;
+    }
+    return next;
+}
+
+static void roster_add(struct nts_ctx *table, unsigned idx, uint16_t port)
+{
+    char id[NTS_ID_MAX + 1];
+    struct nts_addr a;
+    snprintf(id, sizeof(id), "peer%u", idx);
+    nts_addr_pton(&a, "198.51.100.1", port);
+    nts_upsert_client(table, id, &a, 0);
+}
+
+static void test_roster_cursor(void)
+{
+    struct capture *cap = &captured;
+    const struct tiny_transport tp = { capture_sendto, capture_now_us, capture_after, cap };
+    struct nts_ctx table;
+    struct nts_server srv;
+    CHECK(nts_init(&table, ROSTER_IDS + 100) == 0);
+    CHECK(nts_server_init(&srv, -1, &table, &tp) == 0);
+    for (unsigned i = 0; i < ROSTER_IDS; i++)
+        roster_add(&table, i, (uint16_t)(1000 + i));
+    /* 1つおきにIPv6でも登録する（同じ塊に2エントリ続く） */
+    for (unsigned i = 0; i < ROSTER_IDS; i += 2) {
+        char id[NTS_ID_MAX + 1];
+        struct nts_addr a6;
+        snprintf(id, sizeof(id), "peer%u", i);
+        nts_addr_pton(&a6, "2001:db8::5", (uint16_t)(1000 + i));
+        nts_upsert_client(&table, id, &a6, 0);
+    }
+
+    struct sockaddr_in inside, outside;
+    memset(&inside, 0, sizeof(inside));
+    inside.sin_family = AF_INET;
+    inside.sin_port = htons(7000);
+    outside = inside;
+    inet_pton(AF_INET, "10.1.2.3", &inside.sin_addr);
+    inet_pton(AF_INET, "198.18.0.9", &outside.sin_addr);
+
+    /* 外からの要求には何も返さない */
+    struct roster_walk *w = calloc(1, sizeof(*w));
+    CHECK(w != NULL);
+    if (!w)
+        return;
+    roster_request(&srv, &outside, 0, 4, 0, w);
+    CHECK(cap->n == 0);
+
+    /*
+     * 2塊ずつ続きを読み、途中で一部を削除・追加する。
+     * 走査の間ずっと登録されていたIDはちょうど1回ずつ返る
+     */
+    uint32_t cursor = 0;
+    int round = 0;
+    while (cursor != NTS_ROSTER_END && !w->broken && round < 1000) {
+        cursor = roster_request(&srv, &inside, cursor, 2, 0, w);
+        CHECK(cap->n > 0 && cap->n <= 2);
+        if (round++ == 1) {
+            for (unsigned i = 1; i < ROSTER_IDS; i += 50) {
+                char id[NTS_ID_MAX + 1];
+                snprintf(id, sizeof(id), "peer%u", i);
+                nts_remove_client(&table, id);
+            }
+            for (unsigned i = ROSTER_IDS; i < ROSTER_IDS + 10; i++)
+                roster_add(&table, i, 2000);
+        }
+    }
+    CHECK(!w->broken && cursor == NTS_ROSTER_END);
+    CHECK(round > 2);
+    int dups = 0, missing = 0;
+    for (unsigned i = 0; i < ROSTER_IDS + 10; i++) {
+        if (w->seen[i] > 1)
+            dups++;
+        if (i < ROSTER_IDS && i % 50 != 1 && w->seen[i] != 1)
+            missing++;
+    }
+    CHECK(dups == 0 && missing == 0);
+
+    /* since を付けると、その version より後に変わったIDだけが返る */
+    uint64_t since = w->version;
+    memset(w, 0, sizeof(*w));
+    roster_add(&table, 7, 3000);
+    roster_add(&table, 303, 3000);
+    roster_add(&table, ROSTER_IDS + 50, 3000);
+    cursor = roster_request(&srv, &inside, 0, NTS_ROSTER_MAX_CHUNKS, since, w);
+    CHECK(!w->broken && cursor == NTS_ROSTER_END);
+    CHECK(w->entries == 3 && w->seen[7] == 1 && w->seen[303] == 1 && w->seen[ROSTER_IDS + 50] == 1);
+    CHECK(w->version > since);
+
+    free(w);
+    nts_server_dispose(&srv);
+    nts_dispose(&table);
+}
+
+/* ---------- プールとハッシュ索引 (mm_pool.h / tiny_htable.h) ---------- */
+
+struct ht_test_node {
+    char key[NTS_ID_MAX + 1];
+    struct ht_test_node *next;
+    unsigned value;
+};
+
+#define HT_TEST_NODES 200
+
+MM_POOL_DEFINE(ht_test_pool, struct ht_test_node)
+/* バケットを少なくして衝突の連鎖を通す */
+NTS_HTABLE_DEFINE(ht_test_index, struct ht_test_node, key, next, 8)
+
+static void ht_test_key(char *key, unsigned i)
+{
+    memset(key, 0, NTS_ID_MAX + 1);
+    snprintf(key, NTS_ID_MAX + 1, "k%u", i);
+}
+
+static void test_pool_htable(void)
+{
+    struct ht_test_pool pool;
+    struct ht_test_index index;
+    CHECK(ht_test_pool_init(&pool, 0) == -1);
+    int ready = ht_test_pool_init(&pool, HT_TEST_NODES) == 0 && ht_test_index_init(&index) == 0;
+    CHECK(ready);
+    if (!ready)
+        return;
+
+    /* 容量ぶんだけ確保でき、番号と要素が対応する */
+    struct ht_test_node *nodes[HT_TEST_NODES];
+    for (unsigned i = 0; i < HT_TEST_NODES; i++) {
+        nodes[i] = ht_test_pool_alloc(&pool);
+        CHECK(nodes[i] != NULL);
+        if (!nodes[i])
+            return;
+        CHECK(ht_test_pool_at(&pool, ht_test_pool_index(&pool, nodes[i])) == nodes[i]);
+        ht_test_key(nodes[i]->key, i);
+        nodes[i]->value = i;
+        ht_test_index_insert(&index, nodes[i]);
+    }
+    CHECK(ht_test_pool_alloc(&pool) == NULL);
+
+    char key[NTS_ID_MAX + 1];
+    int wrong = 0;
+    for (unsigned i = 0; i < HT_TEST_NODES; i++) {
+        ht_test_key(key, i);
+        struct ht_test_node *n = ht_test_index_find(&index, key);
+        if (!n || n->value != i)
+            wrong++;
+    }
+    CHECK(wrong == 0);
+    ht_test_key(key, HT_TEST_NODES);
+    CHECK(ht_test_index_find(&index, key) == NULL);
+
+    /* 連鎖の途中と先頭を外しても、残りは引ける。返した要素は0で埋めて再利用される */
+    for (unsigned i = 0; i < HT_TEST_NODES; i += 3) {
+        ht_test_index_remove(&index, nodes[i]);
+        ht_test_pool_free(&pool, nodes[i]);
+    }
+    wrong = 0;
+    for (unsigned i = 0; i < HT_TEST_NODES; i++) {
+        ht_test_key(key, i);
+        struct ht_test_node *n = ht_test_index_find(&index, key);
+        if (i % 3 == 0 ? n != NULL : (!n || n->value != i))
+            wrong++;
+    }
+    CHECK(wrong == 0);
+    struct ht_test_node *n = ht_test_pool_alloc(&pool);
+    CHECK(n && n->key[0] == 0 && n->next == NULL && n->value == 0);
+
+    ht_test_index_destroy(&index);
+    ht_test_pool_destroy(&pool);
+}
+
+/* ---------- トレース: ヒストグラム・あふれ・JSONの書き出し ---------- */
+
+/* path の中身を読む（NUL終端。呼び出し側で free） */
+static char *read_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    size_t r;
+    while (buf && (r = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+        len += r;
+        if (len + 1 == cap) {
+            char *nb = realloc(buf, cap * 2);
+            if (!nb) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = nb;
+            cap *= 2;
+        }
+    }
+    fclose(fp);
+    if (buf)
+        buf[len] = '\0';
+    return buf;
+}
+
+static size_t count_str(const char *s, const char *needle)
+{
+    size_t n = 0;
+    for (const char *p = s; (p = strstr(p, needle)) != NULL; p += strlen(needle))
+        n++;
+    return n;
+}
+
+/* ttr_print_histograms の phase の行 */
+static int trace_hist_line(enum ttr_phase ph, char *line, size_t linelen)
+{
+    FILE *fp = tmpfile();
+    if (!fp)
+        return -1;
+    ttr_print_histograms(fp);
+    rewind(fp);
+    char want[32];
+    snprintf(want, sizeof(want), "trace %s ", ttr_phase_name(ph));
+    int found = -1;
+    while (fgets(line, (int)linelen, fp)) {
+        if (strncmp(line, want, strlen(want)) == 0) {
+            found = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void test_trace_buckets(void)
+{
+    /* 8未満はそのまま、以降は2のべきを8分割する */
+    for (uint64_t v = 0; v < 8; v++)
+        CHECK(ttr_bucket_of(v) == v && ttr_bucket_mid((unsigned)v) == v);
+    CHECK(ttr_bucket_of(8) == 8 && ttr_bucket_of(15) == 15);
+    CHECK(ttr_bucket_of(16) == 16 && ttr_bucket_of(17) == 16 && ttr_bucket_of(18) == 17);
+    CHECK(ttr_bucket_mid(16) == 17);
+    CHECK(ttr_bucket_of(960) == ttr_bucket_of(1023) && ttr_bucket_of(1024) == ttr_bucket_of(1023) + 1);
+    CHECK(ttr_bucket_mid(ttr_bucket_of(1000)) == 992);
+    CHECK(ttr_bucket_of(UINT64_MAX) == TTR_BUCKETS - 17);
+    CHECK(ttr_bucket_of(UINT64_MAX) < TTR_BUCKETS);
+
+    /* 単調で、中央の値は元の値から幅の半分(1/16)以内・同じバケットに戻る */
+    unsigned bad = 0;
+    for (uint64_t v = 1; v < UINT64_MAX / 8; v += v / 7 + 1) {
+        unsigned b = ttr_bucket_of(v);
+        uint64_t mid = ttr_bucket_mid(b);
+        uint64_t err = mid > v ? mid - v : v - mid;
+        if (ttr_bucket_of(v + 1) < b || ttr_bucket_of(mid) != b || err > v / 16 + 1)
+            bad++;
+    }
+    CHECK(bad == 0);
+}
+
+static void test_trace_output(void)
+{
+    char dir[] = "/tmp/tiny_trace_XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/t.json", dir);
+
+    CHECK(ttr_new_id() == 0 && ttr_write() == -1);
+    CHECK(ttr_open(dir, "t") == 0);
+    CHECK(ttr_open(dir, "t") == -1);
+    CHECK(ttr_new_id() != 0);
+
+    /* 百分位: 50件が1us、40件が3us、9件が6us、1件が1ms。小さい値は正確なバケットに入る */
+    for (unsigned i = 0; i < 100; i++) {
+        uint64_t d = i < 50 ? 1 : i < 90 ? 3 : i < 99 ? 6 : 1000;
+        ttr_span(TTR_PUNCH, 0xabcdu, 2, 5000, 5000 + d, i);
+    }
+    char line[256];
+    CHECK(trace_hist_line(TTR_PUNCH, line, sizeof(line)) == 0);
+    CHECK(strstr(line, "n=100 ") && strstr(line, "p50=0.001 ms p90=0.003 ms p99=0.006 ms max=1.000 ms"));
+    /* 1件だけなら全部その値。バケットの中央(992)が実際の値を超える分は最大に抑える */
+    ttr_span(TTR_QUERY, 1, 2, 0, 961, 0);
+    CHECK(trace_hist_line(TTR_QUERY, line, sizeof(line)) == 0);
+    CHECK(strstr(line, "p50=0.961 ms p90=0.961 ms p99=0.961 ms max=0.961 ms"));
+    /* 瞬間のイベントはヒストグラムに積まない */
+    ttr_instant(TTR_NOTIFY, 0xabcdu, 2, 7000, 1);
+    CHECK(trace_hist_line(TTR_NOTIFY, line, sizeof(line)) == -1);
+    CHECK(trace_hist_line(TTR_REGISTER, line, sizeof(line)) == -1);
+
+    /* JSON: メタデータ1件とイベント102件。区間は dur 付き、瞬間は "s":"t" */
+    CHECK(ttr_write() == 0);
+    char *json = read_file(path);
+    CHECK(json != NULL);
+    if (json) {
+        CHECK(strncmp(json, "{\"traceEvents\":[\n", 17) == 0);
+        CHECK(count_str(json, "\"pid\":") == 103);
+        CHECK(count_str(json, "\"name\":\"punch\",\"cat\":\"p2p\",\"ph\":\"X\",\"ts\":5000,") == 100);
+        CHECK(strstr(json, "\"ts\":5000,\"dur\":1000,") != NULL);
+        CHECK(strstr(json, "\"name\":\"notify_rx\",\"cat\":\"p2p\",\"ph\":\"i\",\"s\":\"t\",\"ts\":7000,\"pid\":") != NULL);
+        CHECK(strstr(json, "\"tid\":43981,\"args\":{\"trace\":\"0000abcd\",\"peer\":2,\"arg\":99}}") != NULL);
+        CHECK(strstr(json, "\"otherData\":{\"dropped\":0}}\n") != NULL);
+        free(json);
+    }
+    char tmp[sizeof(path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    CHECK(access(tmp, F_OK) != 0);
+
+    /* 増えていなければ書き直さない。増えたら前回の分も含めて書き直す */
+    unlink(path);
+    CHECK(ttr_write() == 0 && access(path, F_OK) != 0);
+    ttr_instant(TTR_NOTIFY, 5, 3, 8000, 0);
+    CHECK(ttr_write() == 0);
+    json = read_file(path);
+    CHECK(json && count_str(json, "\"pid\":") == 104);
+    free(json);
+
+    /* あふれ: TTR_MAX_EVENTS を超えた分は捨てて数える（ヒストグラムには積む） */
+    for (unsigned i = 0; i < TTR_MAX_EVENTS; i++)
+        ttr_span(TTR_FIRST_DATA, 7, 3, 0, 2, 0);
+    const unsigned dropped = 103; /* ここまでに記録した分だけ空きが足りない */
+    CHECK(trace_hist_line(TTR_FIRST_DATA, line, sizeof(line)) == 0);
+    char want[32];
+    snprintf(want, sizeof(want), "n=%u ", TTR_MAX_EVENTS);
+    CHECK(strstr(line, want) != NULL);
+    CHECK(ttr_write() == 0);
+    json = read_file(path);
+    CHECK(json && count_str(json, "\"pid\":") == 1 + TTR_MAX_EVENTS);
+    char other[64];
+    snprintf(other, sizeof(other), "\"otherData\":{\"dropped\":%u}}", dropped);
+    CHECK(json && strstr(json, other) != NULL);
+    free(json);
+    FILE *fp = tmpfile();
+    if (fp) {
+        ttr_print_histograms(fp);
+        rewind(fp);
+        snprintf(want, sizeof(want), "trace: %u event(s) dropped", dropped);
+        int seen = 0;
+        while (fgets(line, sizeof(line), fp))
+            seen |= strncmp(line, want, strlen(want)) == 0;
+        CHECK(seen);
+        fclose(fp);
+    }
+
+    /* 開き直すと記録もヒストグラムも空から */
+    ttr_close();
+    CHECK(ttr_open(dir, "t") == 0);
+    CHECK(trace_hist_line(TTR_PUNCH, line, sizeof(line)) == -1);
+    CHECK(ttr_write() == 0);
+    ttr_close();
+    CHECK(ttr_new_id() == 0);
+
+    unlink(path);
+    rmdir(dir);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "req_stray_reply", test_req_stray_reply },
+    { "req_retransmit", test_req_retransmit },
+    { "qc_cache", test_qc_cache },
+    { "qc_coalesce", test_qc_coalesce },
+    { "qc_reply_first", test_qc_reply_first },
+    { "probe_hijack", test_probe_hijack },
+    { "probe_challenge", test_probe_challenge },
+    { "probe_decide", test_probe_decide },
+    { "engine_dispose", test_engine_dispose },
+    { "cache_file", test_cache_file },
+    { "cache_restart_race", test_cache_restart_race },
+    { "rel_stale_sack", test_rel_stale_sack },
+    { "rel_recovery", test_rel_recovery },
+    { "rel_restart", test_rel_restart },
+    { "xfer_meta_limit", test_xfer_meta_limit },
+    { "ka_no_ack", test_ka_no_ack },
+    { "ka_search", test_ka_search },
+    { "tw_next", test_tw_next },
+    { "addr_dual_stack", test_addr_dual_stack },
+    { "roster_cursor", test_roster_cursor },
+    { "pool_htable", test_pool_htable },
+    { "trace_buckets", test_trace_buckets },
+    { "trace_output", test_trace_output },
+};
+
+int main(void)
+{
+    p2p_rand_seed(1);
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].fn();
+        printf("%s %s\n", failures == before ? "ok  " : "FAIL", tests[i].name);
+    }
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+#define _DEFAULT_SOURCE
+#include "tiny_p2p_cache.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t slot_of(uint32_t self_id, uint32_t peer_id)
+{
+    uint32_t h = self_id * 2654435761u ^ peer_id * 2246822519u;
+    h ^= h >> 15;
+    return h % P2P_CACHE_SLOTS;
+}
+
+/* 別プロセスが書きかけたエントリなどを弾く */
+static int entry_valid(const struct p2p_cache_entry *e)
+{
+    if (e->updated_s == 0)
+        return 0;
+    if (e->addr.ss_family == AF_INET)
+        return e->addrlen == sizeof(struct sockaddr_in);
+    if (e->addr.ss_family == AF_INET6)
+        return e->addrlen == sizeof(struct sockaddr_in6);
+    return 0;
+}
+
+int p2p_cache_open(struct p2p_cache *c, const char *path)
+{
+    c->fd = -1;
+    c->map = NULL;
+    if (!path || !*path)
+        return -1;
+
+    c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (c->fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(c->fd, &st) != 0)
+        goto fail;
+    int fresh = (size_t)st.st_size != sizeof(struct p2p_cache_file);
+    if (fresh && ftruncate(c->fd, (off_t)sizeof(struct p2p_cache_file)) != 0)
+        goto fail;
+
+    void *m = mmap(NULL, sizeof(struct p2p_cache_file), PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (m == MAP_FAILED)
+        goto fail;
+    c->map = (struct p2p_cache_file *)m;
+
+    if (fresh || c->map->magic != P2P_CACHE_MAGIC || c->map->version != P2P_CACHE_VERSION ||
+        c->map->slots != P2P_CACHE_SLOTS) {
+        memset(c->map, 0, sizeof(*c->map));
+        c->map->magic = P2P_CACHE_MAGIC;
+        c->map->version = P2P_CACHE_VERSION;
+        c->map->slots = P2P_CACHE_SLOTS;
+    }
+    return 0;
+
+fail:
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+int p2p_cache_open_default(struct p2p_cache *c)
+{
+    const char *path = getenv(P2P_CACHE_ENV);
+    char buf[512];
+    if (!path) {
+        const char *home = getenv("HOME");
+        if (!home || !*home)
+            home = ".";
+        snprintf(buf, sizeof(buf), "%s/%s", home, P2P_CACHE_DEFAULT);
+        path = buf;
+    }
+    return p2p_cache_open(c, path);
+}
+
+void p2p_cache_close(struct p2p_cache *c)
+{
+    if (c->map)
+        munmap(c->map, sizeof(*c->map));
+    if (c->fd >= 0)
+        close(c->fd);
+    c->map = NULL;
+    c->fd = -1;
+}
+
+static struct p2p_cache_entry *find(const struct p2p_cache *c, uint32_t self_id, uint32_t peer_id)
+{
+    size_t h = slot_of(self_id, peer_id);
+    for (size_t i = 0; i < P2P_CACHE_PROBE; i++) {
+        struct p2p_cache_entry *e = &c->map->e[(h + i) % P2P_CACHE_SLOTS];
+        if (e->updated_s && e->self_id == self_id && e->peer_id == peer_id)
+            return e;
+    }
+    return NULL;
+}
+
+const struct p2p_cache_entry *p2p_cache_get(const struct p2p_cache *c, uint32_t self_id,
+                                            uint32_t peer_id, uint64_t now_s)
+{
+    if (!c->map)
+        return NULL;
+    const struct p2p_cache_entry *e = find(c, self_id, peer_id);
+    if (!e || !entry_valid(e) || e->updated_s + P2P_CACHE_TTL_S < now_s)
+        return NULL;
+    return e;
+}
+
+void p2p_cache_put(struct p2p_cache *c, const struct p2p_cache_entry *src)
+{
+    if (!c->map)
+        return;
+    struct p2p_cache_entry *e = find(c, src->self_id, src->peer_id);
+    if (!e) {
+        /* 空きが無ければ探す範囲で最も古いものを追い出す */
+        size_t h = slot_of(src->self_id, src->peer_id);
+        for (size_t i = 0; i < P2P_CACHE_PROBE; i++) {
+            struct p2p_cache_entry *cand = &c->map->e[(h + i) % P2P_CACHE_SLOTS];
+            if (!e || cand->updated_s < e->updated_s)
+                e = cand;
+            if (cand->updated_s == 0)
+                break;
+        }
+    }
+    /* 時刻は最後に書く（途中で落ちたら空きのまま） */
+    e->updated_s = 0;
+    uint64_t updated = src->updated_s;
+    struct p2p_cache_entry tmp = *src;
+    tmp.updated_s = 0;
+    *e = tmp;
+    __atomic_store_n(&e->updated_s, updated, __ATOMIC_RELEASE);
+}
+
+void p2p_cache_touch(struct p2p_cache *c, uint32_t self_id, uint32_t peer_id, uint64_t now_s)
+{
+    if (!c->map)
+        return;
+    struct p2p_cache_entry *e = find(c, self_id, peer_id);
+    if (e && e->updated_s + P2P_CACHE_REFRESH_S <= now_s)
+        e->updated_s = now_s;
+}
+
+uint16_t p2p_cache_local_port(const struct p2p_cache *c, uint32_t self_id, uint64_t now_s)
+{
+    if (!c->map)
+        return 0;
+    const struct p2p_cache_entry *best = NULL;
+    for (size_t i = 0; i < P2P_CACHE_SLOTS; i++) {
+        const struct p2p_cache_entry *e = &c->map->e[i];
+        if (e->self_id != self_id || !entry_valid(e) || e->updated_s + P2P_CACHE_TTL_S < now_s)
+            continue;
+        if (!best || e->updated_s > best->updated_s)
+            best = e;
+    }
+    return best ? best->local_port : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef TINY_P2P_CACHE_H
+#define TINY_P2P_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * 最近つながったpeerの外向きアドレスとセッションの条件を覚えておくディスク上のキャッシュ。
+ * ファイルを MAP_SHARED で mmap して直接書き換えるので、プロセスが落ちても書いた分は残る。
+ * キーは (self_id, peer_id)。開番地法で P2P_CACHE_PROBE スロットまで探し、
+ * 満杯なら最も古いエントリを上書きする。
+ *
+ * 起動時は、サーバへの register/query と並行してキャッシュのアドレスへ直接punchする。
+ * 同じローカルポートを使えば自分側のNATマッピングも残っていることが多いので、
+ * 最後に使ったローカルポートも一緒に覚えておく。
+ *
+ * 複数のプロセスが同じファイルを同時に書くと1エントリが混ざることがあるが、
+ * 読む側で形式を検査し、壊れたエントリは無いものとして扱う。
+ */
+
+#define P2P_CACHE_MAGIC    0x31435054u /* "TPC1" */
+#define P2P_CACHE_VERSION  1
+#define P2P_CACHE_SLOTS    256
+#define P2P_CACHE_PROBE    8     /* 探すスロット数 */
+#define P2P_CACHE_TTL_S    600   /* これより古いエントリは使わない（NATマッピングがもう無い） */
+#define P2P_CACHE_REFRESH_S 30   /* 確立中のセッションはこの間隔で時刻を更新する */
+#define P2P_CACHE_ENV      "TINY_P2P_CACHE" /* ファイルのパス。空文字列で無効 */
+#define P2P_CACHE_DEFAULT  ".tiny_p2p_cache" /* $HOME 以下の既定のファイル名 */
+
+struct p2p_cache_entry {
+    uint32_t self_id;
+    uint32_t peer_id;
+    uint64_t updated_s;              /* 最後に通信できた時刻(UNIX秒)。0は空き */
+    struct sockaddr_storage addr;    /* 相手の外向きアドレス */
+    uint32_t addrlen;
+    uint16_t local_port;             /* その時に使っていたローカルポート (host byte order) */
+    uint16_t reserved;
+    uint32_t server_srtt_us;         /* サーバとのsrtt。0は未計測 */
+    uint32_t punch_us;               /* punch開始から確立までの時間 */
+};
+
+struct p2p_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    struct p2p_cache_entry e[P2P_CACHE_SLOTS];
+};
+
+struct p2p_cache {
+    int fd;
+    struct p2p_cache_file *map;
+};
+
+/* path のファイルを開いて(無ければ作って) mmap する。形式が違えば空にする。失敗で-1 */
+int p2p_cache_open(struct p2p_cache *c, const char *path);
+/* 環境変数 TINY_P2P_CACHE、無ければ $HOME/.tiny_p2p_cache を開く。無効なら-1 */
+int p2p_cache_open_default(struct p2p_cache *c);
+void p2p_cache_close(struct p2p_cache *c);
+
+/* 有効期限内のエントリを返す。無ければNULL */
+const struct p2p_cache_entry *p2p_cache_get(const struct p2p_cache *c, uint32_t self_id,
+                                            uint32_t peer_id, uint64_t now_s);
+/* e->self_id / e->peer_id のエントリを e の内容で書き換える（無ければ追加） */
+void p2p_cache_put(struct p2p_cache *c, const struct p2p_cache_entry *e);
+/* 相手とまだ通信できている: 時刻だけ進める（P2P_CACHE_REFRESH_S 未満なら何もしない） */
+void p2p_cache_touch(struct p2p_cache *c, uint32_t self_id, uint32_t peer_id, uint64_t now_s);
+/* self_id が最後に使ったローカルポート。無ければ0 */
+uint16_t p2p_cache_local_port(const struct p2p_cache *c, uint32_t self_id, uint64_t now_s);
+
+#endif
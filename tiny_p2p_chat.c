@@ -7,10 +7,17 @@
 #include <string.h>
 #include <stdint.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "tiny_p2p_session.h"
+#include "tiny_p2p_req.h"
+#include "tiny_p2p_rel.h"
+#include "tiny_p2p_xfer.h"
+#include "tiny_p2p_cache.h"
+#include "tiny_trace.h"
+
 #ifndef NI_MAXHOST
 #define NI_MAXHOST 1025
 #endif
@@ -18,9 +25,9 @@
 #define NI_MAXSERV 32
 #endif
 
-#define PUNCH_COUNT  10
-#define PUNCH_INTERVAL_NS (30 * 1000 * 1000)
-#define BUF_SIZE 512
+#define GSO_MAX_SEGS  64    /* 1回のGSO送信にまとめる最大データグラム数 */
+#define GSO_MAX_BYTES 60000
+#define XFER_SOCKBUF  (8 << 20) /* 転送時のソケットバッファ */
 
 static void die(const char *msg)
 {
@@ -28,109 +35,564 @@ static void die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
-static void sleep_ns(long ns)
-{
-    struct timespec ts = {0, ns};
-    nanosleep(&ts, NULL);
-}
-
+/*
+ * デュアルスタックのソケット(AF_INET6, IPV6_V6ONLY=0)を作る。IPv4の相手とも ::ffff:a.b.c.d で話せるので、
+ * 1つのソケット（= 1つのNATマッピング/ポート）のまま両方のファミリを使える。
+ * IPv6の無い環境ではIPv4のソケットにする。
+ */
 static int udp_socket(void)
 {
-    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    int s = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (s >= 0) {
+        int off = 0;
+        if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == 0)
+            return s;
+        close(s);
+    }
+    s = socket(AF_INET, SOCK_DGRAM, 0);
     if (s < 0) die("socket");
     return s;
 }
 
+static int socket_family(int sock)
+{
+    struct sockaddr_storage me;
+    socklen_t melen = sizeof(me);
+    if (getsockname(sock, (struct sockaddr *)&me, &melen) != 0)
+        return AF_INET;
+    return me.ss_family;
+}
+
 /* ---------- サーバ ---------- */
 
-static void server_addr(struct sockaddr_in *srv, const char *host, uint16_t port)
+/*
+ * サーバのアドレス。addr[0] に問い合わせを送り、addr[1] (もう一方のファミリ) があればそちらにも登録して、
+ * サーバに両方のアドレスを知らせる（相手もIPv6を持っていれば PEER/PUNCH がIPv6になる）。
+ */
+struct server_addrs {
+    struct sockaddr_storage addr[2];
+    socklen_t len[2];
+    size_t n;
+};
+
+/*
+ * "host" または "host4,host6" のように区切ったサーバ名を解決する。
+ * ファミリごとに最初のアドレスを使い、順序は getaddrinfo の優先順位(RFC 6724)に従う。
+ * アドレスはソケットのファミリで使える形にする。1つも得られなければ-1
+ */
+static int server_addrs_resolve(struct server_addrs *srv, const char *hosts, uint16_t port, int family)
 {
+    char list[NI_MAXHOST];
+    snprintf(list, sizeof(list), "%s", hosts);
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%u", port);
+    int seen4 = 0, seen6 = 0;
     memset(srv, 0, sizeof(*srv));
-    srv->sin_family = AF_INET;
-    srv->sin_port   = htons(port);
-    inet_pton(AF_INET, host, &srv->sin_addr);
+
+    char *save = NULL;
+    for (char *h = strtok_r(list, ",", &save); h && srv->n < 2; h = strtok_r(NULL, ",", &save)) {
+        struct addrinfo hints = {0}, *res = NULL;
+        hints.ai_family = family == AF_INET6 ? AF_UNSPEC : AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        if (getaddrinfo(h, portstr, &hints, &res) != 0)
+            continue;
+        for (struct addrinfo *ai = res; ai && srv->n < 2; ai = ai->ai_next) {
+            int *seen = ai->ai_family == AF_INET6 ? &seen6 : &seen4;
+            if (*seen)
+                continue;
+            if (p2p_addr_map(family, ai->ai_addr, ai->ai_addrlen, &srv->addr[srv->n], &srv->len[srv->n]) != 0)
+                continue;
+            *seen = 1;
+            srv->n++;
+        }
+        freeaddrinfo(res);
+    }
+    return srv->n > 0 ? 0 : -1;
 }
 
-static void register_self(int sock, uint32_t self_id, const char *host, uint16_t port)
+/* ---------- 要求/応答レイヤ ---------- */
+
+/* ログ用の要求の名前 */
+static const char *req_name(const struct p2p_request *rq, char *out, size_t outlen)
 {
-    uint32_t id = htonl(self_id);
-    struct sockaddr_in srv;
-    server_addr(&srv, host, port);
+    if (rq->kind == P2P_REQ_REGISTER)
+        snprintf(out, outlen, "register");
+    else
+        snprintf(out, outlen, "query peer=%u", rq->peer_id);
+    return out;
+}
 
-    if (sendto(sock, &id, sizeof(id), 0,
-               (struct sockaddr *)&srv, sizeof(srv)) != sizeof(id))
-        die("register");
+/*
+ * 要求群がすべて完了するまで送受信する。rqs[i] は srv->addr[via[i]] へ送る。
+ * 照合できなかったPUNCH/PROBEはその場でエンジンへ渡し、エンジンのタイマも進めるので、
+ * キャッシュしたアドレスへのpunchは register/query と並行して進む。
+ * サーバが応答し続けた場合は0（相手未登録の query は P2P_REQ_NOTFOUND で終わる）、
+ * どれかが再送上限に達したら-1。ただし2つ目のサーバアドレスへの要求は、届かなくても
+ * そのファミリが使えないだけなので P2P_REQ_FAILED にして続ける。
+ * 送信の失敗（ENOBUFS など一時的なこともある）は警告だけ出し、再送に任せる。
+ */
+static int run_requests(int sock, const struct server_addrs *srv, const uint8_t *via,
+                        struct p2p_request *rqs, size_t n, uint32_t self_id,
+                        struct p2p_rtt *est, struct p2p_engine *eng)
+{
+    for (size_t i = 0; i < n; i++)
+        p2p_req_reset(&rqs[i], est);
+
+    for (;;) {
+        uint64_t now = p2p_now_us();
+        uint64_t wake = UINT64_MAX;
+        size_t pending = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            struct p2p_request *rq = &rqs[i];
+            if (rq->done)
+                continue;
+            pending++;
+            if (now >= rq->next_at) {
+                if (rq->tries >= P2P_REQ_MAX_TRIES) {
+                    rq->done = P2P_REQ_FAILED;
+                    if (via[i] != 0)
+                        continue;
+                    return -1;
+                }
+                if (p2p_req_transmit(&tiny_transport_udp, sock, rq, self_id,
+                                     (const struct sockaddr *)&srv->addr[via[i]], srv->len[via[i]], now) != 0) {
+                    char name[32];
+                    fprintf(stderr, "%s: send failed: %s (retrying)\n",
+                            req_name(rq, name, sizeof(name)), strerror(errno));
+                }
+            }
+            if (rq->next_at < wake)
+                wake = rq->next_at;
+        }
+        if (pending == 0)
+            return 0;
+
+        uint64_t t = p2p_engine_timers(eng);
+        if (t < wake)
+            wake = t;
+        now = p2p_now_us();
+
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int wait_ms = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        if (poll(&pfd, 1, wait_ms) <= 0)
+            continue;
+
+        char buf[P2P_LINE_MAX];
+        struct sockaddr_storage src;
+        socklen_t slen = sizeof(src);
+        ssize_t r = recvfrom(sock, buf, sizeof(buf) - 1, 0,
+                             (struct sockaddr *)&src, &slen);
+        if (r <= 0)
+            continue;
+        buf[r] = '\0';
+
+        if (p2p_req_match(rqs, n, buf, (struct sockaddr *)&src, slen, self_id, est, p2p_now_us()))
+            continue;
+
+        p2p_engine_input(eng, buf, (size_t)r, (struct sockaddr *)&src, slen);
+    }
 }
 
-static int query_peer(int sock, uint32_t self_id, uint32_t peer_id,
-                      char *ip, unsigned *port,
-                      const char *host, uint16_t server_port)
+/* ---------- チャット ---------- */
+
+static void print_addr(const struct p2p_session *s, char *out, size_t outlen)
 {
-    uint32_t q[2] = { htonl(self_id), htonl(peer_id) };
-    char resp[128];
-    struct sockaddr_storage src;
-    socklen_t slen = sizeof(src);
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    if (getnameinfo((const struct sockaddr *)&s->addr, s->addrlen,
+                    host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        snprintf(out, outlen, "?");
+    else
+        snprintf(out, outlen, "%s:%s", host, serv);
+}
 
-    struct sockaddr_in srv;
-    server_addr(&srv, host, server_port);
+/* -R: チャット行を信頼性レイヤ経由で送る（受信側は最初のフレームで自動的に有効になる） */
+static int reliable_mode;
+/* -s: 確立した各peerへ送るファイル / -a: 届いたファイルを受け取る / -o: 受信ファイルの保存先(-a を含む) */
+static const char *send_path;
+static const char *recv_path;
+static int recv_accept;
+static size_t xfer_pending; /* 送信中の転送数。0になったら終了する */
 
-    sendto(sock, q, sizeof(q), 0, (struct sockaddr *)&srv, sizeof(srv));
+/* ---------- エンドポイントキャッシュ ---------- */
 
-    ssize_t r = recvfrom(sock, resp, sizeof(resp) - 1, 0,
-                         (struct sockaddr *)&src, &slen);
-    if (r <= 0) return -1;
+static struct p2p_cache peer_cache;  /* 開けなかったら map==NULL のまま何もしない */
+static struct p2p_rtt server_rtt;
+static uint16_t local_port;          /* 0なら未取得 */
+
+/* 確立したpeerのアドレスと条件を次回の起動のために書き残す */
+static void cache_store(struct p2p_engine *eng, const struct p2p_session *s)
+{
+    if (!peer_cache.map)
+        return;
+    if (local_port == 0) {
+        struct sockaddr_storage me;
+        socklen_t melen = sizeof(me);
+        if (getsockname(eng->sock, (struct sockaddr *)&me, &melen) == 0) {
+            if (me.ss_family == AF_INET)
+                local_port = ntohs(((struct sockaddr_in *)&me)->sin_port);
+            else if (me.ss_family == AF_INET6)
+                local_port = ntohs(((struct sockaddr_in6 *)&me)->sin6_port);
+        }
+    }
+    struct p2p_cache_entry e;
+    memset(&e, 0, sizeof(e));
+    e.self_id = eng->self_id;
+    e.peer_id = s->peer_id;
+    e.updated_s = (uint64_t)time(NULL);
+    memcpy(&e.addr, &s->addr, s->addrlen);
+    e.addrlen = s->addrlen;
+    e.local_port = local_port;
+    e.server_srtt_us = (uint32_t)server_rtt.srtt;
+    e.punch_us = (uint32_t)(s->established_us - s->start_us);
+    p2p_cache_put(&peer_cache, &e);
+}
 
-    resp[r] = '\0';
-    char tag[16];
-    if (sscanf(resp, "%15s %63s %u", tag, ip, port) == 3 &&
-        strcmp(tag, "PEER") == 0)
+/* 前回と同じローカルポートを使えば自分側のNATマッピングも残っている見込みが高い */
+static void bind_cached_port(int sock, uint32_t self_id)
+{
+    uint16_t port = p2p_cache_local_port(&peer_cache, self_id, (uint64_t)time(NULL));
+    if (port == 0)
+        return;
+    struct sockaddr_storage me;
+    socklen_t melen;
+    memset(&me, 0, sizeof(me));
+    if (socket_family(sock) == AF_INET6) {
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&me;
+        v6->sin6_family = AF_INET6;
+        v6->sin6_addr = in6addr_any;
+        v6->sin6_port = htons(port);
+        melen = sizeof(*v6);
+    } else {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)&me;
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = htonl(INADDR_ANY);
+        v4->sin_port = htons(port);
+        melen = sizeof(*v4);
+    }
+    if (bind(sock, (struct sockaddr *)&me, melen) == 0)
+        local_port = port;
+    else
+        printf("cache: local port %u is busy, using a new one\n", port);
+}
+
+/* セッションごとの信頼性レイヤと転送状態（s->user に保持） */
+struct rel_peer {
+    struct p2p_engine *eng;
+    struct p2p_session *s;
+    struct rel_conn *conn;
+    struct xfer_send *tx;
+    struct xfer_recv rx;
+    /* GSO用: 同じサイズのフレームを連結してまとめて送る */
+    size_t batch_len;
+    uint16_t seg_size;
+    unsigned nseg;
+    unsigned char batch[P2P_GRO_BUF_SIZE];
+};
+
+static void rel_output_flush(void *arg)
+{
+    struct rel_peer *rp = (struct rel_peer *)arg;
+    if (rp->batch_len == 0)
+        return;
+    p2p_engine_send_gso(rp->eng, rp->s, rp->batch, rp->batch_len, rp->seg_size);
+    rp->batch_len = 0;
+    rp->nseg = 0;
+}
+
+/* フレームをバッチに積む。サイズが変わる・満杯になる時は先に吐き出す */
+static int rel_output(void *arg, const void *buf, size_t len)
+{
+    struct rel_peer *rp = (struct rel_peer *)arg;
+    if (rp->batch_len &&
+        (len > rp->seg_size || rp->batch_len + len > GSO_MAX_BYTES || rp->nseg >= GSO_MAX_SEGS))
+        rel_output_flush(rp);
+    if (rp->batch_len == 0)
+        rp->seg_size = (uint16_t)len;
+    memcpy(rp->batch + rp->batch_len, buf, len);
+    rp->batch_len += len;
+    rp->nseg++;
+    /* 短いフレームはGSOの最後の1個にしかなれない */
+    if (len < rp->seg_size)
+        rel_output_flush(rp);
+    return 0;
+}
+
+static void rel_deliver(void *arg, const void *buf, size_t len)
+{
+    struct rel_peer *rp = (struct rel_peer *)arg;
+    printf("\n[peer %u] %.*s\n> ", rp->s->peer_id, (int)len, (const char *)buf);
+    fflush(stdout);
+}
+
+/* 転送データは順序を待たずにその場でファイルへ書き込む */
+static int rel_deliver_seg(void *arg, uint32_t seq, const void *buf, size_t len)
+{
+    (void)seq;
+    struct rel_peer *rp = (struct rel_peer *)arg;
+    if (!xfer_is_msg(buf, len))
         return 0;
+    if (!recv_accept) {
+        /* 受け取ると言っていないファイルは書かずに捨てる */
+        if (((const unsigned char *)buf)[0] == XFER_META)
+            fprintf(stderr, "xfer: ignoring a file from peer %u (start with -a or -o to accept)\n", rp->s->peer_id);
+        return 1;
+    }
 
-    return -1;
+    int rc = xfer_recv_input(&rp->rx, recv_path, buf, len, p2p_now_us());
+    if (rc < 0 && ((const unsigned char *)buf)[0] == XFER_META) {
+        fprintf(stderr, "xfer: refusing a file from peer %u: %s\n", rp->s->peer_id, strerror(errno));
+    } else if (rc < 0) {
+        fprintf(stderr, "xfer: cannot write received data\n");
+    } else if (rc == 1) {
+        xfer_report("received", rp->rx.path, rp->rx.received, rp->rx.end_us - rp->rx.start_us, NULL);
+        if (rp->rx.first_us)
+            printf("  first data after %.3f ms\n", (double)(rp->rx.first_us - rp->rx.start_us) / 1000.0);
+        printf("> ");
+        fflush(stdout);
+        xfer_recv_close(&rp->rx);
+    }
+    return 1;
 }
 
-/* ---------- P2P ---------- */
+static void start_send(struct p2p_engine *eng, struct p2p_session *s);
 
-static void punch_peer(int sock,
-                       const struct sockaddr *peer, socklen_t peerlen)
+/*
+ * 相手が同じアドレスのまま起動し直した。信頼性レイヤは新しい流れになっているので、
+ * 受信途中のファイルは閉じ、送信途中のファイルは新しい相手へ最初から送り直す
+ */
+static void rel_peer_reset(void *arg, uint32_t dropped)
 {
-    for (int i = 0; i < PUNCH_COUNT; i++) {
-        sendto(sock, NULL, 0, 0, peer, peerlen);
-        sleep_ns(PUNCH_INTERVAL_NS);
+    struct rel_peer *rp = (struct rel_peer *)arg;
+    printf("\npeer=%u restarted. reliable stream reset (%u unacked frame%s dropped)\n",
+           rp->s->peer_id, dropped, dropped == 1 ? "" : "s");
+    if (rp->rx.active) {
+        fprintf(stderr, "xfer: discarding the partial file '%s'\n", rp->rx.path);
+        xfer_recv_close(&rp->rx);
+    }
+    if (rp->tx && !rp->tx->done) {
+        printf("xfer: resending '%s' from the start\n", rp->tx->name);
+        xfer_send_close(rp->tx);
+        free(rp->tx);
+        rp->tx = NULL;
+        xfer_pending--;
+        start_send(rp->eng, rp->s);
+        if (!rp->tx && xfer_pending == 0)
+            p2p_engine_stop(rp->eng);
     }
+    printf("> ");
+    fflush(stdout);
 }
 
-static int make_peer_addr(const char *ip, unsigned port,
-                          struct sockaddr_storage *out, socklen_t *outlen)
+static const struct rel_ops chat_rel_ops = {
+    .output = rel_output,
+    .deliver = rel_deliver,
+    .deliver_seg = rel_deliver_seg,
+    .output_flush = rel_output_flush,
+    .peer_reset = rel_peer_reset,
+};
+
+static struct rel_peer *rel_peer_get(struct p2p_engine *eng, struct p2p_session *s)
 {
-    struct addrinfo hints = {0}, *ai = NULL;
-    char portstr[16];
-    snprintf(portstr, sizeof(portstr), "%u", port);
+    if (s->user)
+        return (struct rel_peer *)s->user;
+    struct rel_peer *rp = (struct rel_peer *)calloc(1, sizeof(*rp));
+    if (!rp)
+        return NULL;
+    rp->eng = eng;
+    rp->s = s;
+    rp->rx.fd = -1;
+    rp->conn = rel_create(&chat_rel_ops, rp);
+    if (!rp->conn) {
+        free(rp);
+        return NULL;
+    }
+    s->user = rp;
+    return rp;
+}
 
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+static void start_send(struct p2p_engine *eng, struct p2p_session *s)
+{
+    struct rel_peer *rp = rel_peer_get(eng, s);
+    if (!rp || rp->tx)
+        return;
+    rp->tx = (struct xfer_send *)calloc(1, sizeof(*rp->tx));
+    if (!rp->tx || xfer_send_open(rp->tx, send_path) != 0) {
+        perror(send_path);
+        free(rp->tx);
+        rp->tx = NULL;
+        return;
+    }
+    xfer_pending++;
+    printf("xfer: sending '%s' (%llu bytes) to peer=%u\n",
+           rp->tx->name, (unsigned long long)rp->tx->size, s->peer_id);
+}
 
-    if (getaddrinfo(ip, portstr, &hints, &ai) != 0)
-        return -1;
+static void on_established(struct p2p_engine *eng, struct p2p_session *s)
+{
+    char a[NI_MAXHOST + NI_MAXSERV];
+    print_addr(s, a, sizeof(a));
+    printf("\np2p established with peer=%u %s in %.1f ms (%u probes). start chat.\n> ",
+           s->peer_id, a, (double)(s->established_us - s->start_us) / 1000.0, s->probes);
+    fflush(stdout);
+    cache_store(eng, s);
+    if (send_path)
+        start_send(eng, s);
+}
 
-    memcpy(out, ai->ai_addr, ai->ai_addrlen);
-    *outlen = ai->ai_addrlen;
-    freeaddrinfo(ai);
-    return 0;
+static void on_data(struct p2p_engine *eng, struct p2p_session *s, const char *buf, size_t len)
+{
+    if (rel_is_frame(buf, len)) {
+        struct rel_peer *rp = rel_peer_get(eng, s);
+        if (rp)
+            rel_input(rp->conn, buf, len, p2p_now_us());
+        return;
+    }
+    printf("\n[peer %u] %.*s\n> ", s->peer_id, (int)len, buf);
+    fflush(stdout);
+}
+
+static uint64_t on_timer(struct p2p_engine *eng, struct p2p_session *s, uint64_t now)
+{
+    p2p_cache_touch(&peer_cache, eng->self_id, s->peer_id, (uint64_t)time(NULL));
+
+    struct rel_peer *rp = (struct rel_peer *)s->user;
+    if (!rp)
+        return UINT64_MAX;
+
+    /* 送信キューに空きができた分だけファイルのチャンクを積む */
+    if (rp->tx && !rp->tx->done && xfer_send_pump(rp->tx, rp->conn, now)) {
+        struct rel_stats st;
+        rel_get_stats(rp->conn, &st);
+        xfer_report("sent", rp->tx->name, rp->tx->size, rp->tx->end_us - rp->tx->start_us, &st);
+        printf("  gso=%s\n", eng->gso ? "on" : "off");
+        xfer_send_close(rp->tx);
+        if (--xfer_pending == 0)
+            p2p_engine_stop(eng);
+    }
+    return rel_timer(rp->conn, now);
+}
+
+static void on_closed(struct p2p_engine *eng, struct p2p_session *s, const char *reason)
+{
+    (void)eng;
+    printf("\npeer=%u closed (%s)\n", s->peer_id, reason);
+    struct rel_peer *rp = (struct rel_peer *)s->user;
+    if (rp) {
+        struct rel_stats st;
+        rel_get_stats(rp->conn, &st);
+        printf("  reliable: sent=%llu retx=%llu acked=%llu delivered=%llu srtt=%.1f ms cwnd=%.1f\n",
+               (unsigned long long)st.data_sent, (unsigned long long)st.retransmits,
+               (unsigned long long)st.acked, (unsigned long long)st.delivered,
+               (double)st.srtt_us / 1000.0, st.cwnd);
+        if (rp->tx) {
+            if (!rp->tx->done && xfer_pending > 0)
+                xfer_pending--;
+            xfer_send_close(rp->tx);
+            free(rp->tx);
+        }
+        xfer_recv_close(&rp->rx);
+        rel_destroy(rp->conn);
+        free(rp);
+        s->user = NULL;
+    }
+    printf("> ");
+    fflush(stdout);
+}
+
+/* 標準入力の1行を確立済みの全peerへ送る */
+static void on_stdin(struct p2p_engine *eng, int fd)
+{
+    (void)fd;
+    char buf[P2P_LINE_MAX];
+    if (!fgets(buf, sizeof(buf), stdin)) {
+        p2p_engine_stop(eng);
+        return;
+    }
+
+    size_t sent = 0;
+    if (reliable_mode) {
+        uint64_t now = p2p_now_us();
+        for (struct p2p_session *s = eng->head; s; s = s->next) {
+            if (s->state != P2P_ESTABLISHED)
+                continue;
+            struct rel_peer *rp = rel_peer_get(eng, s);
+            if (rp && rel_send(rp->conn, buf, strlen(buf), now) == 0)
+                sent++;
+        }
+    } else {
+        sent = p2p_engine_broadcast(eng, buf, strlen(buf));
+    }
+    printf("[send -> %zu peer%s]\n> ", sent, sent == 1 ? "" : "s");
+    fflush(stdout);
+}
+
+static const struct p2p_engine_ops chat_ops = {
+    .on_established = on_established,
+    .on_data = on_data,
+    .on_closed = on_closed,
+    .on_fd = on_stdin,
+    .on_timer = on_timer,
+};
+
+/* "200,300,400" のようなカンマ区切りIDを読み取る。読めた数を返す */
+static size_t parse_peer_ids(const char *arg, uint32_t *ids, size_t max)
+{
+    size_t n = 0;
+    const char *p = arg;
+    while (*p && n < max) {
+        char *end = NULL;
+        unsigned long v = strtoul(p, &end, 10);
+        if (end == p)
+            break;
+        ids[n++] = (uint32_t)v;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/* トレースを書き出して段階ごとの所要時間を表示する（無効なら何もしない） */
+static void trace_finish(void)
+{
+    if (!ttr_enabled())
+        return;
+    printf("\n");
+    ttr_print_histograms(stdout);
+    if (ttr_write() != 0)
+        perror("trace write");
+    ttr_close();
 }
 
 /* ---------- main ---------- */
 
 int main(int argc, char **argv)
 {
-    if (argc != 6) {
-        fprintf(stderr, "usage: %s <self_id> <peer_id> <server_host> <server_port> <-r|-c>\n", argv[0]);
+    int bad_opt = argc < 6;
+    for (int i = 6; i < argc && !bad_opt; i++) {
+        if (strcmp(argv[i], "-R") == 0)
+            reliable_mode = 1;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            send_path = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0)
+            recv_accept = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            recv_path = argv[++i];
+            recv_accept = 1;
+        } else {
+            bad_opt = 1;
+        }
+    }
+    if (bad_opt) {
+        fprintf(stderr, "usage: %s <self_id> <peer_id[,peer_id...]> <server_host[,server_host6]> <server_port> <-r|-c> [-R] [-s file] [-a] [-o path]\n", argv[0]);
         return 1;
     }
 
     uint32_t self_id = atoi(argv[1]);
-    uint32_t peer_id = atoi(argv[2]);
+    static uint32_t peer_ids[P2P_MAX_PEERS];
+    size_t npeers = parse_peer_ids(argv[2], peer_ids, P2P_MAX_PEERS);
     const char *cli_host = argv[3];
 
     char *end = NULL;
@@ -148,139 +610,151 @@ int main(int argc, char **argv)
         fprintf(stderr, "invalid mode\n");
         return 1;
     }
+    if (is_client && npeers == 0) {
+        fprintf(stderr, "invalid peer_id\n");
+        return 1;
+    }
 
     uint16_t server_port = (uint16_t)cli_port;
     char server_host[NI_MAXHOST];
     strncpy(server_host, cli_host, sizeof(server_host) - 1);
     server_host[sizeof(server_host) - 1] = '\0';
 
-    int sock = udp_socket();
-
-    /* 1. register */
-    register_self(sock, self_id, server_host, server_port);
-    printf("registered id=%u\n", self_id);
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-    struct sockaddr_storage peer_addr;
-    socklen_t peer_len = 0;
-    int peer_ready = 0;
-
-    /* ========== -r : 受信待機ノード ========== */
-    if (is_receiver) {
-        printf("receiver mode. waiting server notify...\n");
-
-        for (;;) {
-            char buf[BUF_SIZE];
-            struct sockaddr_storage src;
-            socklen_t slen = sizeof(src);
-
-            ssize_t r = recvfrom(sock, buf, sizeof(buf) - 1, 0,
-                                 (struct sockaddr *)&src, &slen);
-            if (r <= 0)
-                continue;
-
-            buf[r] = '\0';
-
-            /* サーバ通知: PUNCH ip port peer_id */
-            char tag[16], ip[64];
-            unsigned port, rid;
-
-            if (sscanf(buf, "%15s %63s %u %u", tag, ip, &port, &rid) == 4 &&
-                strcmp(tag, "PUNCH") == 0) {
-
-                printf("server notify: peer=%u %s:%u\n", rid, ip, port);
-
-                if (make_peer_addr(ip, port, &peer_addr, &peer_len) == 0) {
-                    peer_ready = 1;
-                    punch_peer(sock,
-                               (struct sockaddr *)&peer_addr,
-                               peer_len);
-                    printf("punch sent to peer\n");
-                    break;
-                }
-            }
-        }
+    int sock = udp_socket();
+    p2p_cache_open_default(&peer_cache);
+    bind_cached_port(sock, self_id);
+    if (send_path || recv_accept) {
+        int sz = XFER_SOCKBUF;
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
     }
+    p2p_rand_seed((uint32_t)(p2p_now_us() ^ ((uint64_t)getpid() * 2654435761u) ^ self_id));
 
-    /* ========== -c : 探索ノード ========== */
-    if (is_client) {
-        char peer_ip[64];
-        unsigned peer_port = 0;
-
-        printf("client mode. querying peer...\n");
-
-        for (int i = 0; i < 20; i++) {
-            if (query_peer(sock, self_id, peer_id,
-                           peer_ip, &peer_port,
-                           server_host, server_port) == 0)
-                break;
-            sleep_ns(100 * 1000 * 1000);
-        }
-
-        printf("peer resolved: %s:%u\n", peer_ip, peer_port);
-
-        if (make_peer_addr(peer_ip, peer_port,
-                           &peer_addr, &peer_len) != 0)
-            die("peer addr");
-
-        peer_ready = 1;
+    int family = socket_family(sock);
+    struct server_addrs srv;
+    if (server_addrs_resolve(&srv, server_host, server_port, family) != 0) {
+        fprintf(stderr, "invalid server_host\n");
+        return 1;
+    }
 
-        punch_peer(sock,
-                   (struct sockaddr *)&peer_addr,
-                   peer_len);
-        printf("punch sent to peer\n");
+    p2p_rtt_init(&server_rtt);
+
+    /* TINY_TRACE=<dir> なら <dir>/chat-<self_id>.json へ接続の段階ごとのトレースを書き出す */
+    char trace_name[32];
+    snprintf(trace_name, sizeof(trace_name), "chat-%u", self_id);
+    ttr_open_env(trace_name);
+
+    /*
+     * 1. セッションエンジンを先に起動し、キャッシュに残っているpeerへはすぐpunchを始める。
+     *    サーバ経由で得たアドレスの方が先に応答すればそちらを使う（p2p_engine_connect）。
+     */
+    struct p2p_engine eng;
+    if (p2p_engine_init(&eng, sock, self_id, (struct sockaddr *)&srv.addr[0], srv.len[0],
+                        P2P_MAX_PEERS, &chat_ops, NULL) != 0)
+        die("engine");
+    if (srv.n > 1)
+        p2p_engine_set_server_alt(&eng, (struct sockaddr *)&srv.addr[1], srv.len[1]);
+
+    uint64_t now_s = (uint64_t)time(NULL);
+    for (size_t i = 0; i < npeers; i++) {
+        const struct p2p_cache_entry *ce = p2p_cache_get(&peer_cache, self_id, peer_ids[i], now_s);
+        if (!ce)
+            continue;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        if (p2p_addr_map(family, (const struct sockaddr *)&ce->addr, (socklen_t)ce->addrlen, &addr, &addrlen) != 0)
+            continue;
+        struct p2p_session *s = p2p_engine_connect(&eng, peer_ids[i], (const struct sockaddr *)&addr, addrlen);
+        if (!s)
+            continue;
+        char a[NI_MAXHOST + NI_MAXSERV];
+        print_addr(s, a, sizeof(a));
+        printf("trying cached endpoint: peer=%u %s (%llus old, punch %.1f ms)\n", peer_ids[i], a,
+               (unsigned long long)(now_s - ce->updated_s), (double)ce->punch_us / 1000.0);
+        /* サーバまでのRTTも前回の値から始める */
+        if (ce->server_srtt_us && server_rtt.srtt == 0)
+            p2p_rtt_sample(&server_rtt, ce->server_srtt_us);
     }
 
-    if (!peer_ready) {
-        fprintf(stderr, "peer address not resolved.\n");
-        close(sock);
-        return 1;
+    /*
+     * 2. register (-c では全peerへの query も同時に投げる)
+     *    サーバのアドレスが2つ(IPv4/IPv6)あれば両方へ登録する。
+     *    どれも応答を待ち、失われた場合はバックオフ付きで再送する。
+     */
+    size_t nreg = srv.n;
+    size_t nreq = nreg + (is_client ? npeers : 0);
+    struct p2p_request *rqs = (struct p2p_request *)calloc(nreq, sizeof(*rqs));
+    uint8_t *via = (uint8_t *)calloc(nreq, 1);
+    if (!rqs || !via) die("calloc");
+    for (size_t i = 0; i < nreg; i++) {
+        rqs[i].kind = P2P_REQ_REGISTER;
+        via[i] = (uint8_t)i;
+    }
+    for (size_t i = nreg; i < nreq; i++) {
+        rqs[i].kind = P2P_REQ_QUERY;
+        rqs[i].peer_id = peer_ids[i - nreg];
+        rqs[i].trace = ttr_new_id(); /* トレース無効なら0で、queryには載せない */
     }
+    uint64_t t0 = p2p_now_us();
 
-    /* ========== 共通: チャット ========== */
-    printf("p2p established. start chat.\n> ");
-    fflush(stdout);
+    if (is_client)
+        printf("client mode. querying %zu peer%s...\n", npeers, npeers == 1 ? "" : "s");
 
-    for (;;) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(sock, &rfds);
-        FD_SET(STDIN_FILENO, &rfds);
-
-        select(sock + 1, &rfds, NULL, NULL, NULL);
-
-        /* 受信処理 */
-        if (FD_ISSET(sock, &rfds)) {
-            char buf[BUF_SIZE];
-            ssize_t n = recvfrom(sock, buf, sizeof(buf) - 1, 0, NULL, NULL);
-            if (n > 0) {
-                buf[n] = '\0';
-                printf("\n[peer] %s\n> ", buf);
-                fflush(stdout);
-            }
+    if (run_requests(sock, &srv, via, rqs, nreq, self_id, &server_rtt, &eng) != 0) {
+        for (size_t i = 0; i < nreq; i++) {
+            char name[32];
+            if (rqs[i].done == P2P_REQ_FAILED && via[i] == 0)
+                fprintf(stderr, "%s failed (no response from server)\n", req_name(&rqs[i], name, sizeof(name)));
         }
-        /* 送信処理 */
-        if (FD_ISSET(STDIN_FILENO, &rfds)) {
-            char buf[BUF_SIZE];
-            if (!fgets(buf, sizeof(buf), stdin))
-                break;
-
-            sendto(sock, buf, strlen(buf), 0,
-                   (struct sockaddr *)&peer_addr, peer_len);
-
-            char host[NI_MAXHOST];
-            char serv[NI_MAXSERV];
-
-            if (getnameinfo((struct sockaddr *)&peer_addr, peer_len,
-                            host, sizeof(host), serv, sizeof(serv),
-                            NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
-                printf("[send -> %s:%s]\n", host, serv);
-            }
+        /* キャッシュ経由のセッションが残っていればサーバ無しで続ける */
+        if (eng.count == 0) {
+            trace_finish();
+            p2p_engine_dispose(&eng);
+            p2p_cache_close(&peer_cache);
+            close(sock);
+            return 1;
+        }
+    } else {
+        printf("registered id=%u (%.1f ms, srtt=%.1f ms)%s\n", self_id,
+               (double)(p2p_now_us() - t0) / 1000.0, (double)server_rtt.srtt / 1000.0,
+               nreg > 1 && rqs[1].done == P2P_REQ_OK ? " on both address families" : "");
+    }
 
-            printf("> ");
-            fflush(stdout);
+    /* 3. 解決できたpeerへのpunchを始める */
+    /* 通常ファイルや/dev/nullはepollで待てない(EPERM)ので、その場合は入力なしで動かす */
+    if (p2p_engine_watch_fd(&eng, STDIN_FILENO) != 0 && errno != EPERM)
+        die("epoll stdin");
+
+    for (size_t i = nreg; i < nreq; i++) {
+        if (rqs[i].done != P2P_REQ_OK) {
+            if (p2p_engine_find_id(&eng, rqs[i].peer_id))
+                continue; /* キャッシュ経由で試している */
+            printf("peer=%u not found. waiting for its notify.\n", rqs[i].peer_id);
+            continue;
         }
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        printf("peer resolved: peer=%u %s:%u\n", rqs[i].peer_id, rqs[i].ip, rqs[i].port);
+        if (p2p_make_addr(rqs[i].ip, rqs[i].port, family, &addr, &addrlen) != 0)
+            continue;
+        struct p2p_session *s = p2p_engine_connect(&eng, rqs[i].peer_id, (struct sockaddr *)&addr, addrlen);
+        if (s && !s->trace)
+            s->trace = rqs[i].trace;
     }
+    free(rqs);
+    free(via);
 
+    if (is_receiver)
+        printf("receiver mode. waiting server notify...\n");
+
+    /* ========== 共通: チャット（stdinのEOFで終了） ========== */
+    int rc = p2p_engine_run(&eng);
+
+    trace_finish();
+    p2p_engine_dispose(&eng);
+    p2p_cache_close(&peer_cache);
     close(sock);
-    return 0;
+    return rc == 0 ? 0 : 1;
 }
@@ -0,0 +1,691 @@
+#define _GNU_SOURCE
+#include "tiny_p2p_gateway.h"
+#include "tiny_p2p_session.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GW_SOCKBUF (1 << 20) /* 多数のIDの通知が一度に来るので受信バッファを広げる */
+
+static size_t pow2_at_least(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static size_t id_hash(const struct p2p_gateway *gw, uint32_t id)
+{
+    return (size_t)(id * 2654435761u) & gw->id_mask;
+}
+
+static size_t addr_hash(const struct p2p_gateway *gw, uint16_t sock_idx, const struct sockaddr_in *a)
+{
+    uint32_t h = a->sin_addr.s_addr * 2654435761u;
+    h ^= ((uint32_t)a->sin_port << 16 | sock_idx) * 2246822519u;
+    h ^= h >> 15;
+    return (size_t)h & gw->addr_mask;
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void gw_sendto(struct p2p_gateway *gw, uint16_t sock_idx, const void *buf, size_t len,
+                      const struct sockaddr_in *to)
+{
+    if (sendto(gw->socks[sock_idx], buf, len, 0, (const struct sockaddr *)to, sizeof(*to)) >= 0)
+        gw->st.tx_pkts++;
+}
+
+/* ---------- 索引 ---------- */
+
+struct p2p_gw_ident *p2p_gw_find_ident(struct p2p_gateway *gw, uint32_t id)
+{
+    for (struct p2p_gw_ident *i = gw->id_index[id_hash(gw, id)]; i; i = i->hnext) {
+        if (i->id == id)
+            return i;
+    }
+    return NULL;
+}
+
+static struct p2p_gw_session *find_addr(struct p2p_gateway *gw, uint16_t sock_idx, const struct sockaddr_in *a)
+{
+    for (struct p2p_gw_session *s = gw->addr_index[addr_hash(gw, sock_idx, a)]; s; s = s->hnext) {
+        if (s->ident->sock_idx == sock_idx && same_addr(&s->addr, a))
+            return s;
+    }
+    return NULL;
+}
+
+static void addr_insert(struct p2p_gateway *gw, struct p2p_gw_session *s)
+{
+    size_t h = addr_hash(gw, s->ident->sock_idx, &s->addr);
+    s->hnext = gw->addr_index[h];
+    gw->addr_index[h] = s;
+}
+
+static void addr_remove(struct p2p_gateway *gw, struct p2p_gw_session *s)
+{
+    struct p2p_gw_session **pp = &gw->addr_index[addr_hash(gw, s->ident->sock_idx, &s->addr)];
+    while (*pp && *pp != s)
+        pp = &(*pp)->hnext;
+    if (*pp)
+        *pp = s->hnext;
+    s->hnext = NULL;
+}
+
+/* 1つのIDが持つセッションは少数なので線形探索 */
+static struct p2p_gw_session *find_peer(struct p2p_gw_ident *ident, uint32_t peer_id)
+{
+    for (struct p2p_gw_session *s = ident->sessions; s; s = s->inext) {
+        if (s->peer_id == peer_id)
+            return s;
+    }
+    return NULL;
+}
+
+/* 相手が別のアドレスから応答してきたら付け替える。そのアドレスを同じソケットの別IDが使っていれば-1 */
+static int rekey(struct p2p_gateway *gw, struct p2p_gw_session *s, const struct sockaddr_in *a)
+{
+    if (same_addr(&s->addr, a))
+        return 0;
+    if (find_addr(gw, s->ident->sock_idx, a)) {
+        gw->st.addr_conflicts++;
+        return -1;
+    }
+    addr_remove(gw, s);
+    s->addr = *a;
+    addr_insert(gw, s);
+    return 0;
+}
+
+/* ---------- セッション ---------- */
+
+static void send_probe_to(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *tag, uint32_t nonce,
+                          const struct sockaddr_in *addr)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%s %u %u %u\n", tag, s->ident->id, s->peer_id, nonce);
+    gw_sendto(gw, s->ident->sock_idx, buf, (size_t)len, addr);
+    s->last_tx_us = p2p_now_us();
+}
+
+static void send_probe(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *tag, uint32_t nonce)
+{
+    send_probe_to(gw, s, tag, nonce, &s->addr);
+}
+
+/*
+ * セッションの期限をまとめて1つのタイマで見る（tiny_p2p_session.c の run_timers と同じ規則）。
+ *   punch中 : PROBE再送（間隔を倍々）、P2P_PUNCH_TIMEOUT_MS で打ち切り
+ *   確立後  : 送信が P2P_KEEPALIVE_MS 途絶えたらPROBE、受信が P2P_DEAD_MS 途絶えたら切断
+ */
+static void session_timer(struct tw_timer *t, void *arg)
+{
+    (void)t;
+    struct p2p_gw_session *s = (struct p2p_gw_session *)arg;
+    struct p2p_gateway *gw = s->ident->gw;
+    uint64_t now = p2p_now_us();
+    uint64_t due;
+
+    if (s->state == P2P_GW_PUNCHING) {
+        uint64_t deadline = s->start_us + (uint64_t)P2P_PUNCH_TIMEOUT_MS * 1000u;
+        if (now >= deadline) {
+            p2p_gw_close(gw, s, "punch timeout");
+            return;
+        }
+        if (now >= s->next_probe_us) {
+            send_probe(gw, s, "PROBE", s->nonce);
+            s->probes++;
+            s->next_probe_us = now + (uint64_t)s->probe_interval_ms * 1000u;
+            s->probe_interval_ms *= 2;
+            if (s->probe_interval_ms > P2P_PUNCH_INTERVAL_MAX_MS)
+                s->probe_interval_ms = P2P_PUNCH_INTERVAL_MAX_MS;
+        }
+        due = s->next_probe_us < deadline ? s->next_probe_us : deadline;
+    } else {
+        uint64_t dead_at = s->last_rx_us + (uint64_t)P2P_DEAD_MS * 1000u;
+        if (now >= dead_at) {
+            p2p_gw_close(gw, s, "timeout");
+            return;
+        }
+        uint64_t ka_at = s->last_tx_us + (uint64_t)P2P_KEEPALIVE_MS * 1000u;
+        if (now >= ka_at) {
+            send_probe(gw, s, "PROBE", s->nonce);
+            ka_at = s->last_tx_us + (uint64_t)P2P_KEEPALIVE_MS * 1000u;
+        }
+        due = ka_at < dead_at ? ka_at : dead_at;
+    }
+    tw_schedule(&gw->wheel, &s->timer, due);
+}
+
+static struct p2p_gw_session *session_new(struct p2p_gateway *gw, struct p2p_gw_ident *ident,
+                                          uint32_t peer_id, const struct sockaddr_in *a)
+{
+    if (find_addr(gw, ident->sock_idx, a)) {
+        gw->st.addr_conflicts++;
+        return NULL;
+    }
+    struct p2p_gw_session *s = p2p_gw_session_pool_alloc(&gw->sess_pool);
+    if (!s)
+        return NULL;
+    uint64_t now = p2p_now_us();
+    s->ident = ident;
+    s->peer_id = peer_id;
+    s->addr = *a;
+    s->state = P2P_GW_PUNCHING;
+    s->nonce = p2p_rand();
+    s->probe_interval_ms = P2P_PUNCH_INTERVAL_MIN_MS;
+    s->start_us = now;
+    s->next_probe_us = now;
+    s->last_rx_us = now;
+    s->last_tx_us = now;
+    tw_timer_init(&s->timer, session_timer, s);
+    s->inext = ident->sessions;
+    ident->sessions = s;
+    addr_insert(gw, s);
+    gw->nsessions++;
+    /* 最初のPROBEは目盛りを待たずに送る */
+    session_timer(&s->timer, s);
+    return s;
+}
+
+static void set_established(struct p2p_gateway *gw, struct p2p_gw_session *s)
+{
+    if (s->state == P2P_GW_ESTABLISHED)
+        return;
+    s->state = P2P_GW_ESTABLISHED;
+    s->established_us = p2p_now_us();
+    gw->st.established++;
+    /* punch用の期限から keep-alive/生存確認の期限へ */
+    session_timer(&s->timer, s);
+    if (gw->ops && gw->ops->on_established)
+        gw->ops->on_established(gw, s);
+}
+
+void p2p_gw_close(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *reason)
+{
+    if (gw->ops && gw->ops->on_closed)
+        gw->ops->on_closed(gw, s, reason);
+    tw_cancel(&gw->wheel, &s->timer);
+    addr_remove(gw, s);
+    struct p2p_gw_session **pp = &s->ident->sessions;
+    while (*pp && *pp != s)
+        pp = &(*pp)->inext;
+    if (*pp)
+        *pp = s->inext;
+    gw->nsessions--;
+    gw->st.closed++;
+    p2p_gw_session_pool_free(&gw->sess_pool, s);
+}
+
+int p2p_gw_send(struct p2p_gateway *gw, struct p2p_gw_session *s, const void *buf, size_t len)
+{
+    ssize_t n = sendto(gw->socks[s->ident->sock_idx], buf, len, 0,
+                       (const struct sockaddr *)&s->addr, sizeof(s->addr));
+    if (n < 0)
+        return -1;
+    gw->st.tx_pkts++;
+    s->last_tx_us = p2p_now_us();
+    return 0;
+}
+
+/* ---------- サーバ宛ての送信 ---------- */
+
+static int queue_push(struct p2p_gw_queue *q, struct p2p_gw_ident *ident)
+{
+    if (q->len == q->cap)
+        return -1;
+    q->q[(q->head + q->len) % q->cap] = ident;
+    q->len++;
+    return 0;
+}
+
+static struct p2p_gw_ident *queue_pop(struct p2p_gw_queue *q)
+{
+    struct p2p_gw_ident *ident = q->q[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->len--;
+    return ident;
+}
+
+static void regq_push(struct p2p_gateway *gw, struct p2p_gw_ident *ident)
+{
+    if (!ident->reg_queued && queue_push(&gw->regq, ident) == 0)
+        ident->reg_queued = 1;
+}
+
+static void ackq_push(struct p2p_gateway *gw, struct p2p_gw_ident *ident)
+{
+    if (!ident->ack_queued && queue_push(&gw->ackq, ident) == 0)
+        ident->ack_queued = 1;
+}
+
+/*
+ * 未登録: 応答が来なかったので積み直す。
+ * 登録済み: 予告されたKEEPALIVEが来なかった = マッピングが切れたとみなして登録し直す
+ */
+static void ident_timer(struct tw_timer *t, void *arg)
+{
+    (void)t;
+    struct p2p_gw_ident *ident = (struct p2p_gw_ident *)arg;
+    struct p2p_gateway *gw = ident->gw;
+    if (ident->registered) {
+        ident->registered = 0;
+        ident->reg_tries = 0;
+        gw->st.registered--;
+        gw->st.reregisters++;
+    }
+    regq_push(gw, ident);
+}
+
+/*
+ * 2つの待ち行列から合わせて最大 P2P_GW_SERVER_BATCH 件を取り出し、ソケットごとに sendmmsg で
+ * まとめて送る。KEEPALIVE_ACK はサーバが待っているので登録より先に出す
+ */
+static void flush_server(struct p2p_gateway *gw)
+{
+    if ((gw->regq.len == 0 && gw->ackq.len == 0) || gw->send_tick == gw->wheel.now)
+        return;
+    gw->send_tick = gw->wheel.now;
+
+    struct p2p_gw_ident *batch[P2P_GW_SERVER_BATCH];
+    size_t n = 0, nacks;
+    while (n < P2P_GW_SERVER_BATCH && gw->ackq.len > 0) {
+        batch[n] = queue_pop(&gw->ackq);
+        batch[n++]->ack_queued = 0;
+    }
+    nacks = n;
+    while (n < P2P_GW_SERVER_BATCH && gw->regq.len > 0) {
+        batch[n] = queue_pop(&gw->regq);
+        batch[n++]->reg_queued = 0;
+    }
+
+    char bufs[P2P_GW_SERVER_BATCH][24];
+    uint8_t is_ack[P2P_GW_SERVER_BATCH];
+    struct iovec iov[P2P_GW_SERVER_BATCH];
+    struct mmsghdr msgs[P2P_GW_SERVER_BATCH];
+    uint64_t now = p2p_now_us();
+    for (size_t k = 0; k < gw->nsocks; k++) {
+        unsigned m = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i]->sock_idx != k)
+                continue;
+            is_ack[m] = i < nacks;
+            iov[m].iov_base = bufs[m];
+            if (is_ack[m]) {
+                iov[m].iov_len = (size_t)snprintf(bufs[m], sizeof(bufs[m]), "KEEPALIVE_ACK %u\n", batch[i]->id);
+            } else {
+                uint32_t id = htonl(batch[i]->id);
+                memcpy(bufs[m], &id, sizeof(id));
+                iov[m].iov_len = sizeof(id);
+            }
+            memset(&msgs[m], 0, sizeof(msgs[m]));
+            msgs[m].msg_hdr.msg_name = &gw->server;
+            msgs[m].msg_hdr.msg_namelen = sizeof(gw->server);
+            msgs[m].msg_hdr.msg_iov = &iov[m];
+            msgs[m].msg_hdr.msg_iovlen = 1;
+            m++;
+        }
+        unsigned off = 0;
+        while (off < m) {
+            int r = sendmmsg(gw->socks[k], msgs + off, m - off, 0);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR)
+                    continue;
+                break; /* 送れなかった登録は再送タイマで、ACKは次のKEEPALIVEで取り戻す */
+            }
+            gw->st.reg_batches++;
+            gw->st.tx_pkts += (uint64_t)r;
+            for (unsigned j = off; j < off + (unsigned)r; j++) {
+                if (is_ack[j])
+                    gw->st.acks_sent++;
+                else
+                    gw->st.reg_sent++;
+            }
+            off += (unsigned)r;
+        }
+    }
+
+    for (size_t i = nacks; i < n; i++) {
+        struct p2p_gw_ident *ident = batch[i];
+        unsigned shift = ident->reg_tries < 8 ? ident->reg_tries : 8;
+        uint64_t rto = (uint64_t)P2P_GW_REG_RTO_MS << shift;
+        if (rto > P2P_GW_REG_RTO_MAX_MS)
+            rto = P2P_GW_REG_RTO_MAX_MS;
+        if (ident->reg_tries < UINT8_MAX)
+            ident->reg_tries++;
+        tw_schedule(&gw->wheel, &ident->timer, now + rto * 1000u);
+    }
+}
+
+int p2p_gw_add_ident(struct p2p_gateway *gw, uint32_t id)
+{
+    if (p2p_gw_find_ident(gw, id))
+        return 0;
+    struct p2p_gw_ident *ident = p2p_gw_ident_pool_alloc(&gw->ident_pool);
+    if (!ident)
+        return -1;
+    ident->id = id;
+    ident->sock_idx = (uint16_t)(gw->nidents % gw->nsocks);
+    ident->gw = gw;
+    tw_timer_init(&ident->timer, ident_timer, ident);
+    size_t h = id_hash(gw, id);
+    ident->hnext = gw->id_index[h];
+    gw->id_index[h] = ident;
+    gw->nidents++;
+    regq_push(gw, ident);
+    return 0;
+}
+
+/* ---------- 受信 ---------- */
+
+/* サーバの KEEPALIVE を待つ期限を張り直す */
+static void arm_watch(struct p2p_gateway *gw, struct p2p_gw_ident *ident)
+{
+    if (ident->server_expect_ms == 0) {
+        tw_cancel(&gw->wheel, &ident->timer); /* 最初のKEEPALIVEが来るまでは見張らない */
+        return;
+    }
+    tw_schedule(&gw->wheel, &ident->timer,
+                p2p_now_us() + ((uint64_t)ident->server_expect_ms + P2P_SERVER_GRACE_MS) * 1000u);
+}
+
+static void handle_server_line(struct p2p_gateway *gw, uint16_t sock_idx, const char *line)
+{
+    char ip[64];
+    unsigned a, b, rid, target;
+    struct p2p_gw_ident *ident;
+
+    if (sscanf(line, "TABLE_REGISTER %u", &a) == 1) {
+        ident = p2p_gw_find_ident(gw, a);
+        if (!ident || ident->sock_idx != sock_idx)
+            return;
+        if (!ident->registered) {
+            ident->registered = 1;
+            gw->st.registered++;
+        }
+        ident->reg_tries = 0;
+        arm_watch(gw, ident);
+        return;
+    }
+    if (sscanf(line, "KEEPALIVE %u %u", &a, &b) == 2) {
+        ident = p2p_gw_find_ident(gw, b);
+        if (!ident || ident->sock_idx != sock_idx) {
+            gw->st.unknown_id++;
+            return;
+        }
+        ackq_push(gw, ident);
+        ident->server_expect_ms = a * 1000u;
+        if (ident->registered)
+            arm_watch(gw, ident);
+        return;
+    }
+    if (sscanf(line, "PUNCH %63s %u %u %u", ip, &a, &rid, &target) == 4) {
+        ident = p2p_gw_find_ident(gw, target);
+        if (!ident || ident->sock_idx != sock_idx) {
+            gw->st.unknown_id++;
+            return;
+        }
+        gw->st.punches++;
+        struct sockaddr_in peer;
+        memset(&peer, 0, sizeof(peer));
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons((uint16_t)a);
+        if (inet_pton(AF_INET, ip, &peer.sin_addr) != 1)
+            return;
+        struct p2p_gw_session *s = find_peer(ident, rid);
+        if (!s) {
+            session_new(gw, ident, rid, &peer);
+        } else if (s->state == P2P_GW_PUNCHING && rekey(gw, s, &peer) == 0) {
+            s->next_probe_us = p2p_now_us();
+            tw_schedule(&gw->wheel, &s->timer, s->next_probe_us);
+        }
+    }
+}
+
+/* サーバは同じIDへの PUNCH を複数行まとめて送ってくるので1行ずつ処理する */
+static void handle_server(struct p2p_gateway *gw, uint16_t sock_idx, const char *buf)
+{
+    char line[128];
+    while (*buf) {
+        size_t n = strcspn(buf, "\n");
+        if (n > 0 && n < sizeof(line)) {
+            memcpy(line, buf, n);
+            line[n] = '\0';
+            handle_server_line(gw, sock_idx, line);
+        }
+        buf += n;
+        if (*buf == '\n')
+            buf++;
+    }
+}
+
+static void handle_peer(struct p2p_gateway *gw, uint16_t sock_idx, const char *buf, size_t len,
+                        const struct sockaddr_in *src)
+{
+    struct p2p_gw_session *s = find_addr(gw, sock_idx, src);
+    int is_ack;
+    uint32_t from, to, nonce;
+
+    if (p2p_parse_probe(buf, &is_ack, &from, &to, &nonce)) {
+        struct p2p_gw_ident *ident = p2p_gw_find_ident(gw, to);
+        if (!ident || ident->sock_idx != sock_idx) {
+            gw->st.unknown_id++;
+            return;
+        }
+        if (s && s->ident != ident) {
+            gw->st.addr_conflicts++; /* このアドレスは同じソケットの別IDが使っている */
+            return;
+        }
+        int known = s && s->peer_id == from;
+        if (!known) {
+            s = find_peer(ident, from);
+            if (!s) {
+                /* 未知のID: 相手発のセッションとして作る */
+                if (is_ack || !(s = session_new(gw, ident, from, src)))
+                    return;
+                known = 1;
+            }
+        }
+
+        /* 付け替えの規則はエンジンと共通 (p2p_probe_decide) */
+        switch (p2p_probe_decide(known, s->state == P2P_GW_ESTABLISHED, is_ack, nonce, s->nonce)) {
+        case P2P_PROBE_IGNORE:
+            return;
+        case P2P_PROBE_CHALLENGE:
+            send_probe_to(gw, s, "PROBE", s->nonce, src);
+            return;
+        case P2P_PROBE_ANSWER:
+            send_probe(gw, s, "PROBE_ACK", nonce);
+            return;
+        case P2P_PROBE_REKEY:
+            if (rekey(gw, s, src) != 0)
+                return;
+            break;
+        case P2P_PROBE_ACCEPT:
+            break;
+        }
+
+        s->last_rx_us = p2p_now_us();
+        if (!is_ack)
+            send_probe(gw, s, "PROBE_ACK", nonce);
+        set_established(gw, s);
+        return;
+    }
+
+    if (!s)
+        return;
+    s->last_rx_us = p2p_now_us();
+    set_established(gw, s);
+    if (gw->ops && gw->ops->on_data)
+        gw->ops->on_data(gw, s, buf, len);
+}
+
+/* ソケットを recvmmsg でまとめて読み切る */
+static void read_socket(struct p2p_gateway *gw, uint16_t sock_idx)
+{
+    static char bufs[P2P_GW_RECV_BATCH][P2P_GW_BUF_SIZE + 1];
+    struct sockaddr_in srcs[P2P_GW_RECV_BATCH];
+    struct iovec iov[P2P_GW_RECV_BATCH];
+    struct mmsghdr msgs[P2P_GW_RECV_BATCH];
+
+    for (;;) {
+        for (unsigned i = 0; i < P2P_GW_RECV_BATCH; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = P2P_GW_BUF_SIZE;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &srcs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(gw->socks[sock_idx], msgs, P2P_GW_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            return;
+        gw->st.rx_batches++;
+        gw->st.rx_pkts += (uint64_t)n;
+        for (int i = 0; i < n; i++) {
+            size_t len = msgs[i].msg_len;
+            if (len == 0 || msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_in))
+                continue;
+            bufs[i][len] = '\0';
+            if (same_addr(&srcs[i], &gw->server))
+                handle_server(gw, sock_idx, bufs[i]);
+            else
+                handle_peer(gw, sock_idx, bufs[i], len, &srcs[i]);
+        }
+        if (n < P2P_GW_RECV_BATCH)
+            return;
+    }
+}
+
+/* ---------- 初期化・ループ ---------- */
+
+int p2p_gw_init(struct p2p_gateway *gw, size_t nsocks, const struct sockaddr_in *server,
+                size_t max_ids, size_t max_sessions, const struct p2p_gw_ops *ops, void *user)
+{
+    if (!gw || !server || nsocks == 0 || nsocks > P2P_GW_MAX_SOCKS || max_ids == 0 || max_sessions == 0)
+        return -1;
+    memset(gw, 0, sizeof(*gw));
+    gw->epfd = -1;
+    gw->server = *server;
+    gw->ops = ops;
+    gw->user = user;
+    for (size_t i = 0; i < P2P_GW_MAX_SOCKS; i++)
+        gw->socks[i] = -1;
+
+    size_t id_buckets = pow2_at_least(max_ids);
+    size_t addr_buckets = pow2_at_least(max_sessions);
+    gw->id_mask = id_buckets - 1;
+    gw->addr_mask = addr_buckets - 1;
+    gw->id_index = (struct p2p_gw_ident **)calloc(id_buckets, sizeof(*gw->id_index));
+    gw->addr_index = (struct p2p_gw_session **)calloc(addr_buckets, sizeof(*gw->addr_index));
+    gw->regq.q = (struct p2p_gw_ident **)calloc(max_ids, sizeof(*gw->regq.q));
+    gw->regq.cap = max_ids;
+    gw->ackq.q = (struct p2p_gw_ident **)calloc(max_ids, sizeof(*gw->ackq.q));
+    gw->ackq.cap = max_ids;
+    if (!gw->id_index || !gw->addr_index || !gw->regq.q || !gw->ackq.q)
+        goto fail;
+    if (p2p_gw_ident_pool_init(&gw->ident_pool, max_ids) != 0)
+        goto fail;
+    if (p2p_gw_session_pool_init(&gw->sess_pool, max_sessions) != 0)
+        goto fail;
+    tw_init(&gw->wheel, (uint64_t)P2P_GW_TICK_MS * 1000u, p2p_now_us());
+
+    gw->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (gw->epfd < 0)
+        goto fail;
+    for (size_t i = 0; i < nsocks; i++) {
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s < 0)
+            goto fail;
+        gw->socks[i] = s;
+        gw->nsocks = i + 1;
+        int sz = GW_SOCKBUF;
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.u32 = (uint32_t)i;
+        if (epoll_ctl(gw->epfd, EPOLL_CTL_ADD, s, &ev) != 0)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    p2p_gw_dispose(gw);
+    return -1;
+}
+
+void p2p_gw_dispose(struct p2p_gateway *gw)
+{
+    if (!gw) return;
+    for (size_t i = 0; i < gw->nsocks; i++) {
+        if (gw->socks[i] >= 0)
+            close(gw->socks[i]);
+        gw->socks[i] = -1;
+    }
+    gw->nsocks = 0;
+    if (gw->epfd >= 0)
+        close(gw->epfd);
+    gw->epfd = -1;
+    p2p_gw_ident_pool_destroy(&gw->ident_pool);
+    p2p_gw_session_pool_destroy(&gw->sess_pool);
+    free(gw->id_index);
+    free(gw->addr_index);
+    free(gw->regq.q);
+    free(gw->ackq.q);
+    gw->id_index = NULL;
+    gw->addr_index = NULL;
+    gw->regq.q = NULL;
+    gw->ackq.q = NULL;
+}
+
+int p2p_gw_run(struct p2p_gateway *gw)
+{
+    gw->running = 1;
+    while (gw->running) {
+        uint64_t now = p2p_now_us();
+        gw->st.timers_fired += tw_advance(&gw->wheel, now);
+        if (!gw->running)
+            break; /* タイマのコールバックが止めた */
+        flush_server(gw);
+
+        /* 送り残しがあれば次の目盛りで続きを送る */
+        uint64_t wake = tw_next_us(&gw->wheel);
+        if (gw->regq.len > 0 || gw->ackq.len > 0) {
+            uint64_t next_tick = (gw->wheel.now + 1) * gw->wheel.tick_us;
+            if (next_tick < wake)
+                wake = next_tick;
+        }
+        int timeout = -1;
+        if (wake != UINT64_MAX) {
+            now = p2p_now_us();
+            timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        }
+
+        struct epoll_event evs[P2P_GW_MAX_SOCKS];
+        int n = epoll_wait(gw->epfd, evs, P2P_GW_MAX_SOCKS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (int i = 0; i < n && gw->running; i++)
+            read_socket(gw, (uint16_t)evs[i].data.u32);
+    }
+    return 0;
+}
+
+void p2p_gw_stop(struct p2p_gateway *gw)
+{
+    gw->running = 0;
+}
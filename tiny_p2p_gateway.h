@@ -0,0 +1,150 @@
+#ifndef TINY_P2P_GATEWAY_H
+#define TINY_P2P_GATEWAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "mm_pool.h"
+#include "tiny_timer_wheel.h"
+
+/*
+ * 1プロセスで数千のpeer IDを受け持つゲートウェイ。
+ * IDは少数のUDPソケットに割り振り、各ソケットから登録するのでサーバには
+ * 「同じ外向きアドレスに多数のID」が載る。サーバは PUNCH / KEEPALIVE に宛先IDを付けるので、
+ * それで受け持ちのIDへ振り分ける。相手とのPROBE/PROBE_ACKは宛先IDを持ち、データは
+ * (受信ソケット, 相手アドレス) の索引でセッションを引く。
+ *
+ *   - 登録: 未登録のIDを待ち行列に積み、1目盛りごとに最大 P2P_GW_SERVER_BATCH 件を
+ *     ソケットごとの sendmmsg でまとめて送る。応答が無ければ倍々の間隔で積み直す。
+ *     サーバは全IDの KEEPALIVE を一度に送ってくることがあるので、KEEPALIVE_ACK も
+ *     別の待ち行列に積んで同じ上限の中で（登録より先に）返す。
+ *   - タイマ: 登録の再送・サーバの KEEPALIVE 監視(IDごと)と、PROBE再送・keep-alive・
+ *     生存確認(セッションごと)を1つのタイマホイールで回す。
+ *   - メモリ: ID・セッションはそれぞれ固定長のプールから取る。IDあたりは数十バイト。
+ *
+ * 同じソケットの2つのIDが同じ相手アドレスとセッションを持つとデータを振り分けられないので、
+ * 後から来た方は受け付けない（相手も多数のIDを1アドレスで持つ場合。addr_conflicts で数える）。
+ * セッションの振る舞い(PROBEの間隔、keep-alive、切断)は tiny_p2p_session.h の定数に合わせる。
+ */
+
+#define P2P_GW_MAX_SOCKS    64
+#define P2P_GW_TICK_MS      10    /* タイマホイールの目盛り */
+#define P2P_GW_SERVER_BATCH 64    /* 1目盛りにサーバへ送る上限（サーバの受信バッファを溢れさせない） */
+#define P2P_GW_REG_RTO_MS   500   /* 登録応答の待ち時間の初期値（倍々） */
+#define P2P_GW_REG_RTO_MAX_MS 8000
+#define P2P_GW_RECV_BATCH   32    /* recvmmsg 1回で読む最大数 */
+#define P2P_GW_BUF_SIZE     1500
+
+struct p2p_gateway;
+struct p2p_gw_session;
+
+/* 受け持つ1つのID */
+struct p2p_gw_ident {
+    uint32_t id;
+    uint16_t sock_idx;               /* 登録・通信に使うソケット */
+    uint8_t registered;
+    uint8_t reg_queued;              /* 登録の待ち行列に入っている */
+    uint8_t ack_queued;              /* KEEPALIVE_ACK の待ち行列に入っている */
+    uint8_t reg_tries;
+    uint32_t server_expect_ms;       /* サーバが最後に予告したKEEPALIVE間隔（0は未受信） */
+    struct tw_timer timer;           /* 未登録: 登録の再送 / 登録済み: KEEPALIVE監視 */
+    struct p2p_gateway *gw;
+    struct p2p_gw_ident *hnext;      /* ID索引の次 */
+    struct p2p_gw_session *sessions; /* このIDのセッション */
+};
+
+/* IDの待ち行列（リングバッファ）。各IDは1つの待ち行列に高々1回だけ入る */
+struct p2p_gw_queue {
+    struct p2p_gw_ident **q;
+    size_t cap;
+    size_t head;
+    size_t len;
+};
+
+enum p2p_gw_state { P2P_GW_PUNCHING, P2P_GW_ESTABLISHED };
+
+struct p2p_gw_session {
+    struct p2p_gw_ident *ident;
+    uint32_t peer_id;
+    struct sockaddr_in addr;
+    uint8_t state;
+    uint32_t nonce;
+    uint32_t probe_interval_ms;
+    unsigned probes;
+    uint64_t start_us;
+    uint64_t established_us;
+    uint64_t next_probe_us;
+    uint64_t last_rx_us;
+    uint64_t last_tx_us;
+    struct tw_timer timer;
+    struct p2p_gw_session *hnext;    /* アドレス索引の次 */
+    struct p2p_gw_session *inext;    /* 同じIDのセッションの次 */
+    void *user;
+};
+
+MM_POOL_DEFINE(p2p_gw_ident_pool, struct p2p_gw_ident)
+MM_POOL_DEFINE(p2p_gw_session_pool, struct p2p_gw_session)
+
+struct p2p_gw_ops {
+    void (*on_established)(struct p2p_gateway *gw, struct p2p_gw_session *s);
+    void (*on_data)(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *buf, size_t len);
+    void (*on_closed)(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *reason);
+};
+
+struct p2p_gw_stats {
+    uint64_t reg_sent;
+    uint64_t reg_batches;            /* サーバ宛て sendmmsg の呼び出し数 */
+    uint64_t acks_sent;              /* KEEPALIVE_ACK */
+    uint64_t registered;             /* 現在登録済みのID数 */
+    uint64_t reregisters;            /* KEEPALIVEが途絶えて登録し直した数 */
+    uint64_t punches;                /* 受けたPUNCH通知 */
+    uint64_t established;
+    uint64_t closed;
+    uint64_t rx_pkts;
+    uint64_t rx_batches;             /* recvmmsg の呼び出し数 */
+    uint64_t tx_pkts;
+    uint64_t unknown_id;             /* 受け持っていないID宛て */
+    uint64_t addr_conflicts;
+    uint64_t timers_fired;
+};
+
+struct p2p_gateway {
+    int socks[P2P_GW_MAX_SOCKS];
+    size_t nsocks;
+    int epfd;
+    struct sockaddr_in server;
+    struct p2p_gw_ident_pool ident_pool;
+    struct p2p_gw_session_pool sess_pool;
+    size_t nidents;
+    size_t nsessions;
+    struct p2p_gw_ident **id_index;  /* ID → ID (2のべき乗個のバケット) */
+    size_t id_mask;
+    struct p2p_gw_session **addr_index; /* (ソケット, 相手アドレス) → セッション */
+    size_t addr_mask;
+    struct p2p_gw_queue regq;        /* 登録待ち */
+    struct p2p_gw_queue ackq;        /* KEEPALIVE_ACK 待ち */
+    uint64_t send_tick;              /* 最後にサーバへまとめて送った目盛り */
+    struct tw_wheel wheel;
+    int running;
+    struct p2p_gw_stats st;
+    const struct p2p_gw_ops *ops;
+    void *user;
+};
+
+/*
+ * nsocks 個のソケットを開き、最大 max_ids 個のID・max_sessions 個のセッションを持てるようにする。
+ * 失敗で-1
+ */
+int p2p_gw_init(struct p2p_gateway *gw, size_t nsocks, const struct sockaddr_in *server,
+                size_t max_ids, size_t max_sessions, const struct p2p_gw_ops *ops, void *user);
+void p2p_gw_dispose(struct p2p_gateway *gw);
+/* IDを追加して登録の待ち行列に積む。既にあれば0、満杯で-1 */
+int p2p_gw_add_ident(struct p2p_gateway *gw, uint32_t id);
+struct p2p_gw_ident *p2p_gw_find_ident(struct p2p_gateway *gw, uint32_t id);
+int p2p_gw_send(struct p2p_gateway *gw, struct p2p_gw_session *s, const void *buf, size_t len);
+void p2p_gw_close(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *reason);
+/* p2p_gw_stop まで回す。エラーで-1 */
+int p2p_gw_run(struct p2p_gateway *gw);
+void p2p_gw_stop(struct p2p_gateway *gw);
+
+#endif
@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "tiny_p2p_gateway.h"
+#include "tiny_p2p_session.h"
+
+/*
+ * ゲートウェイの実行ファイル: first_id から count 個のIDを受け持ち、
+ * 相手からのpunchを受けてセッションを張る。受けた行は表示し、-e なら送り返す。
+ */
+
+#define REPORT_MS 10000 /* 統計の表示間隔 */
+#define CHECK_MS  200   /* 終了要求と実行時間を見る間隔 */
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+struct gw_app {
+    struct p2p_gateway gw;
+    int echo;
+    int quiet;
+    uint64_t start_us;
+    uint64_t end_us;            /* 0なら無期限 */
+    struct tw_timer report_timer;
+    struct tw_timer check_timer;
+};
+
+static void on_established(struct p2p_gateway *gw, struct p2p_gw_session *s)
+{
+    struct gw_app *app = (struct gw_app *)gw->user;
+    if (app->quiet)
+        return;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &s->addr.sin_addr, ip, sizeof(ip));
+    printf("id=%u established with peer=%u %s:%u in %.1f ms (%u probes)\n",
+           s->ident->id, s->peer_id, ip, ntohs(s->addr.sin_port),
+           (double)(s->established_us - s->start_us) / 1000.0, s->probes);
+}
+
+static void on_data(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *buf, size_t len)
+{
+    struct gw_app *app = (struct gw_app *)gw->user;
+    if (!app->quiet)
+        printf("[id %u <- peer %u] %.*s%s", s->ident->id, s->peer_id, (int)len, buf,
+               len > 0 && buf[len - 1] == '\n' ? "" : "\n");
+    if (app->echo)
+        p2p_gw_send(gw, s, buf, len);
+}
+
+static void on_closed(struct p2p_gateway *gw, struct p2p_gw_session *s, const char *reason)
+{
+    struct gw_app *app = (struct gw_app *)gw->user;
+    if (!app->quiet)
+        printf("id=%u peer=%u closed (%s)\n", s->ident->id, s->peer_id, reason);
+}
+
+static const struct p2p_gw_ops app_ops = {
+    .on_established = on_established,
+    .on_data = on_data,
+    .on_closed = on_closed,
+};
+
+static void report(struct gw_app *app)
+{
+    struct p2p_gateway *gw = &app->gw;
+    struct p2p_gw_stats *st = &gw->st;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu_s = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6 +
+                   (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    double elapsed = (double)(p2p_now_us() - app->start_us) / 1e6;
+
+    /* 受け持ちIDあたりの状態: ID本体 + ID索引 + 待ち行列2つの1枠ずつ */
+    size_t per_ident = sizeof(struct p2p_gw_ident) + sizeof(*gw->regq.q) + sizeof(*gw->ackq.q) +
+                       (gw->id_mask + 1) * sizeof(*gw->id_index) / (gw->nidents ? gw->nidents : 1);
+    printf("gateway: ids=%zu registered=%llu sessions=%zu sockets=%zu | reg sent=%llu in %llu batches, "
+           "reregisters=%llu acks=%llu | punches=%llu established=%llu closed=%llu | rx=%llu in %llu batches tx=%llu | "
+           "unknown_id=%llu addr_conflicts=%llu timers=%llu\n",
+           gw->nidents, (unsigned long long)st->registered, gw->nsessions, gw->nsocks,
+           (unsigned long long)st->reg_sent, (unsigned long long)st->reg_batches,
+           (unsigned long long)st->reregisters, (unsigned long long)st->acks_sent,
+           (unsigned long long)st->punches,
+           (unsigned long long)st->established, (unsigned long long)st->closed,
+           (unsigned long long)st->rx_pkts, (unsigned long long)st->rx_batches,
+           (unsigned long long)st->tx_pkts, (unsigned long long)st->unknown_id,
+           (unsigned long long)st->addr_conflicts, (unsigned long long)st->timers_fired);
+    printf("gateway: state %zu B/id + %zu B/session, maxrss=%ld KiB, cpu=%.3f s over %.1f s (%.2f us/id/s)\n",
+           per_ident, sizeof(struct p2p_gw_session), ru.ru_maxrss, cpu_s, elapsed,
+           elapsed > 0 && gw->nidents ? cpu_s * 1e6 / elapsed / (double)gw->nidents : 0.0);
+}
+
+static void report_timer(struct tw_timer *t, void *arg)
+{
+    struct gw_app *app = (struct gw_app *)arg;
+    report(app);
+    tw_schedule(&app->gw.wheel, t, p2p_now_us() + (uint64_t)REPORT_MS * 1000u);
+}
+
+static void check_timer(struct tw_timer *t, void *arg)
+{
+    struct gw_app *app = (struct gw_app *)arg;
+    uint64_t now = p2p_now_us();
+    if (stop_requested || (app->end_us && now >= app->end_us)) {
+        p2p_gw_stop(&app->gw);
+        return;
+    }
+    tw_schedule(&app->gw.wheel, t, now + (uint64_t)CHECK_MS * 1000u);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <first_id> <count> <server_host> <server_port> [-S sockets] [-e] [-q] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+        usage(argv[0]);
+
+    static struct gw_app app;
+    size_t nsocks = 4;
+    unsigned duration_s = 0;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            nsocks = (size_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-e") == 0)
+            app.echo = 1;
+        else if (strcmp(argv[i], "-q") == 0)
+            app.quiet = 1;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            duration_s = (unsigned)strtoul(argv[++i], NULL, 10);
+        else
+            usage(argv[0]);
+    }
+
+    uint32_t first_id = (uint32_t)strtoul(argv[1], NULL, 10);
+    size_t count = (size_t)strtoul(argv[2], NULL, 10);
+    char *end = NULL;
+    errno = 0;
+    unsigned long port = strtoul(argv[4], &end, 10);
+    if (count == 0 || errno != 0 || end == argv[4] || *end != '\0' || port == 0 || port > UINT16_MAX)
+        usage(argv[0]);
+
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, argv[3], &srv.sin_addr) != 1) {
+        fprintf(stderr, "invalid server_host\n");
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    p2p_rand_seed((uint32_t)(p2p_now_us() ^ ((uint64_t)getpid() * 2654435761u) ^ first_id));
+
+    /* セッションはIDあたり平均1つを見込み、少し余裕を持たせる */
+    if (p2p_gw_init(&app.gw, nsocks, &srv, count, count + 64, &app_ops, &app) != 0) {
+        perror("gateway init");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (p2p_gw_add_ident(&app.gw, first_id + (uint32_t)i) != 0) {
+            fprintf(stderr, "cannot add id %u\n", first_id + (uint32_t)i);
+            break;
+        }
+    }
+    printf("gateway: hosting ids %u..%u over %zu sockets\n",
+           first_id, first_id + (uint32_t)count - 1, app.gw.nsocks);
+
+    app.start_us = p2p_now_us();
+    app.end_us = duration_s ? app.start_us + (uint64_t)duration_s * 1000000u : 0;
+    tw_timer_init(&app.report_timer, report_timer, &app);
+    tw_timer_init(&app.check_timer, check_timer, &app);
+    tw_schedule(&app.gw.wheel, &app.report_timer, app.start_us + (uint64_t)REPORT_MS * 1000u);
+    tw_schedule(&app.gw.wheel, &app.check_timer, app.start_us + (uint64_t)CHECK_MS * 1000u);
+
+    int rc = p2p_gw_run(&app.gw);
+    report(&app);
+    p2p_gw_dispose(&app.gw);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,507 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tiny_p2p_rel.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REL_MASK (REL_WINDOW - 1)
+
+/* 送信スロットの状態 */
+enum { SLOT_EMPTY, SLOT_QUEUED, SLOT_INFLIGHT, SLOT_LOST, SLOT_SACKED };
+
+struct rel_slot {
+    uint8_t state;
+    uint8_t retx;       /* 再送回数 */
+    uint16_t len;
+    uint64_t sent_us;
+    unsigned char data[REL_MSS];
+};
+
+struct rel_conn {
+    const struct rel_ops *ops;
+    void *arg;
+    uint32_t epoch;       /* 自分のepoch */
+    uint32_t peer_epoch;  /* 相手のepoch。0は未知 */
+    uint32_t prev_epoch;  /* 直前の相手のepoch（遅れて届いたフレームを捨てる） */
+
+    /* --- 送信側 --- */
+    struct rel_slot *snd;
+    uint32_t snd_una;     /* 未ACKの先頭 */
+    uint32_t snd_nxt;     /* 次に初送するseq */
+    uint32_t snd_end;     /* 次にキューへ積むseq */
+    uint32_t isn;         /* 今の相手への流れの最初のseq */
+    uint32_t high_sacked; /* 受信済みと分かっている最大seq+1 */
+    uint32_t inflight;    /* INFLIGHT状態の数 */
+    uint32_t lost;        /* LOST状態の数 */
+    uint32_t recover;     /* このseqがACKされるまで輻輳イベントを重ねない */
+    double cwnd;          /* パケット数 */
+    double ssthresh;
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t rto;
+    uint64_t progress_us; /* 最後に新しくACK/SACKされた時刻 */
+    double next_send_us;  /* ペーシング: 次に送ってよい時刻 */
+
+    /* --- 受信側 --- */
+    struct rel_slot *rcv;
+    uint32_t rcv_nxt;
+    int rcv_started;      /* 相手の isn から受け取り始めた */
+    unsigned ack_pending;
+    uint64_t ack_due_us;
+    uint32_t ts_echo;
+
+    struct rel_stats st;
+};
+
+static int seq_lt(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+static void put16(unsigned char *p, uint16_t v) { v = htons(v); memcpy(p, &v, 2); }
+static void put32(unsigned char *p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+static uint16_t get16(const unsigned char *p) { uint16_t v; memcpy(&v, p, 2); return ntohs(v); }
+static uint32_t get32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+/* 0以外の乱数。同じプロセスで続けて作っても、起動し直しても別の値になる */
+static uint32_t new_epoch(void)
+{
+    static uint32_t counter;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint32_t x = (uint32_t)ts.tv_nsec ^ (uint32_t)ts.tv_sec * 2246822519u ^
+                 (uint32_t)getpid() * 2654435761u ^ ++counter * 0x9e3779b9u;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x ? x : 1;
+}
+
+struct rel_conn *rel_create(const struct rel_ops *ops, void *arg)
+{
+    struct rel_conn *c = (struct rel_conn *)calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->snd = (struct rel_slot *)calloc(REL_WINDOW, sizeof(struct rel_slot));
+    c->rcv = (struct rel_slot *)calloc(REL_WINDOW, sizeof(struct rel_slot));
+    if (!c->snd || !c->rcv) {
+        rel_destroy(c);
+        return NULL;
+    }
+    c->ops = ops;
+    c->arg = arg;
+    c->epoch = new_epoch();
+    c->cwnd = REL_INIT_CWND;
+    c->ssthresh = REL_WINDOW;
+    c->rto = REL_RTO_INIT_US;
+    return c;
+}
+
+void rel_destroy(struct rel_conn *c)
+{
+    if (!c) return;
+    free(c->snd);
+    free(c->rcv);
+    free(c);
+}
+
+int rel_is_frame(const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    if (len < REL_HDR_SIZE || p[0] != 0)
+        return 0;
+    return p[1] == REL_DATA || (p[1] == REL_ACK && len >= REL_ACK_SIZE);
+}
+
+/* 相手が起動し直した: 受信の状態と未ACKの送信データを捨て、次のseqから新しい流れを始める */
+static void peer_reset(struct rel_conn *c, uint32_t epoch)
+{
+    uint32_t dropped = c->snd_end - c->snd_una;
+    for (uint32_t seq = c->snd_una; seq_lt(seq, c->snd_end); seq++)
+        c->snd[seq & REL_MASK].state = SLOT_EMPTY;
+    for (size_t i = 0; i < REL_WINDOW; i++)
+        c->rcv[i].state = SLOT_EMPTY;
+    c->prev_epoch = c->peer_epoch;
+    c->peer_epoch = epoch;
+    c->isn = c->snd_una = c->snd_nxt = c->high_sacked = c->recover = c->snd_end;
+    c->inflight = 0;
+    c->lost = 0;
+    c->cwnd = REL_INIT_CWND;
+    c->ssthresh = REL_WINDOW;
+    c->progress_us = 0;
+    c->next_send_us = 0;
+    c->rcv_started = 0;
+    c->ack_pending = 0;
+    c->ack_due_us = 0;
+    c->st.peer_resets++;
+    if (c->ops->peer_reset)
+        c->ops->peer_reset(c->arg, dropped);
+}
+
+int rel_send(struct rel_conn *c, const void *buf, size_t len, uint64_t now)
+{
+    (void)now;
+    if (len > REL_MSS || rel_send_space(c) == 0)
+        return -1;
+    struct rel_slot *sl = &c->snd[c->snd_end & REL_MASK];
+    memcpy(sl->data, buf, len);
+    sl->len = (uint16_t)len;
+    sl->state = SLOT_QUEUED;
+    sl->retx = 0;
+    c->snd_end++;
+    return 0;
+}
+
+size_t rel_send_space(const struct rel_conn *c)
+{
+    return REL_WINDOW - (size_t)(c->snd_end - c->snd_una);
+}
+
+int rel_send_idle(const struct rel_conn *c)
+{
+    return c->snd_una == c->snd_end;
+}
+
+/* ---------- 送信 ---------- */
+
+static void transmit(struct rel_conn *c, uint32_t seq, uint64_t now)
+{
+    struct rel_slot *sl = &c->snd[seq & REL_MASK];
+    unsigned char frame[REL_HDR_SIZE + REL_MSS];
+    frame[0] = 0;
+    frame[1] = REL_DATA;
+    put16(frame + 2, sl->len);
+    put32(frame + 4, seq);
+    put32(frame + 8, (uint32_t)now);
+    put32(frame + 12, c->epoch);
+    put32(frame + 16, c->peer_epoch);
+    put32(frame + 20, c->isn);
+    memcpy(frame + REL_HDR_SIZE, sl->data, sl->len);
+    c->ops->output(c->arg, frame, REL_HDR_SIZE + (size_t)sl->len);
+
+    sl->state = SLOT_INFLIGHT;
+    sl->sent_us = now;
+    c->inflight++;
+    c->st.data_sent++;
+
+    /* ペーシング: cwnd分をsrttで送り切る速度(スロースタート中は2倍、以降1.25倍) */
+    if (c->srtt) {
+        double gain = c->cwnd < c->ssthresh ? 2.0 : 1.25;
+        double rate = gain * c->cwnd * REL_MSS / (double)c->srtt; /* bytes/us */
+        double base = c->next_send_us > (double)now ? c->next_send_us : (double)now;
+        c->next_send_us = base + (double)(REL_HDR_SIZE + sl->len) / rate;
+    }
+}
+
+/* 喪失扱いのものを優先して再送し、cwndとペーシングの許す範囲で新規データを送る */
+static void flush(struct rel_conn *c, uint64_t now)
+{
+    uint32_t scan = c->snd_una;
+    while (c->inflight < (uint32_t)c->cwnd && c->next_send_us <= (double)now) {
+        if (c->lost) {
+            while (seq_lt(scan, c->snd_nxt) && c->snd[scan & REL_MASK].state != SLOT_LOST)
+                scan++;
+            if (seq_lt(scan, c->snd_nxt)) {
+                c->lost--;
+                c->snd[scan & REL_MASK].retx++;
+                c->st.retransmits++;
+                transmit(c, scan, now);
+                continue;
+            }
+            c->lost = 0; /* 数え違いの保険 */
+        }
+        if (!seq_lt(c->snd_nxt, c->snd_end))
+            break;
+        transmit(c, c->snd_nxt, now);
+        c->snd_nxt++;
+    }
+}
+
+static void rtt_sample(struct rel_conn *c, uint64_t rtt)
+{
+    if (c->srtt == 0) {
+        c->srtt = rtt ? rtt : 1;
+        c->rttvar = rtt / 2;
+    } else {
+        uint64_t diff = rtt > c->srtt ? rtt - c->srtt : c->srtt - rtt;
+        c->rttvar = (3 * c->rttvar + diff) / 4;
+        c->srtt = (7 * c->srtt + rtt) / 8;
+        if (c->srtt == 0) c->srtt = 1;
+    }
+    c->rto = c->srtt + 4 * c->rttvar;
+    if (c->rto < REL_RTO_MIN_US) c->rto = REL_RTO_MIN_US;
+    if (c->rto > REL_RTO_MAX_US) c->rto = REL_RTO_MAX_US;
+}
+
+/* 輻輳イベント: 1ウィンドウにつき1回だけcwndを半分にする */
+static void on_congestion(struct rel_conn *c, uint32_t seq)
+{
+    if (seq_lt(seq, c->recover))
+        return;
+    c->ssthresh = c->cwnd / 2 < 2 ? 2 : c->cwnd / 2;
+    c->cwnd = c->ssthresh;
+    c->recover = c->snd_nxt;
+}
+
+static void on_acked(struct rel_conn *c, struct rel_slot *sl, uint64_t now)
+{
+    c->progress_us = now;
+    if (sl->state == SLOT_INFLIGHT)
+        c->inflight--;
+    else if (sl->state == SLOT_LOST)
+        c->lost--;
+    c->st.acked++;
+    c->st.bytes_acked += sl->len;
+    if (c->cwnd < c->ssthresh)
+        c->cwnd += 1;
+    else
+        c->cwnd += 1.0 / c->cwnd;
+    if (c->cwnd > REL_WINDOW)
+        c->cwnd = REL_WINDOW;
+}
+
+static void handle_ack(struct rel_conn *c, const unsigned char *p, uint64_t now)
+{
+    uint32_t cum = get32(p + 4);
+    uint32_t ts = get32(p + 8);
+    uint64_t sack = ((uint64_t)get32(p + 12) << 32) | get32(p + 16);
+
+    if (seq_lt(c->snd_nxt, cum))
+        return; /* 送っていない範囲へのACKは無視 */
+
+    uint32_t rtt = (uint32_t)now - ts;
+    if (rtt < REL_RTO_MAX_US * 4u)
+        rtt_sample(c, rtt);
+
+    /* 累積ACK */
+    while (seq_lt(c->snd_una, cum)) {
+        struct rel_slot *sl = &c->snd[c->snd_una & REL_MASK];
+        if (sl->state != SLOT_SACKED)
+            on_acked(c, sl, now);
+        sl->state = SLOT_EMPTY;
+        c->snd_una++;
+    }
+    if (seq_lt(c->high_sacked, cum))
+        c->high_sacked = cum;
+
+    /*
+     * 選択ACK。snd_una より古い cum のACK（遅れて届いた・入れ替わった）のビットは、
+     * ウィンドウを一周した後の別のseqのスロットを指しうるので使わない
+     */
+    if (seq_lt(cum, c->snd_una))
+        sack = 0;
+    for (unsigned i = 0; i < 64 && sack; i++) {
+        if (!(sack & ((uint64_t)1 << i)))
+            continue;
+        uint32_t seq = cum + 1 + i;
+        if (seq_lt(seq, c->snd_una))
+            continue;
+        if (!seq_lt(seq, c->snd_nxt))
+            break;
+        struct rel_slot *sl = &c->snd[seq & REL_MASK];
+        if (sl->state == SLOT_INFLIGHT || sl->state == SLOT_LOST) {
+            on_acked(c, sl, now);
+            sl->state = SLOT_SACKED;
+        }
+        if (seq_lt(c->high_sacked, seq + 1))
+            c->high_sacked = seq + 1;
+    }
+
+    /* 後続が REL_DUPTHRESH 個以上届いているのに未ACKのものは喪失とみなす */
+    for (uint32_t seq = c->snd_una; seq_lt(seq + REL_DUPTHRESH, c->high_sacked); seq++) {
+        struct rel_slot *sl = &c->snd[seq & REL_MASK];
+        /* 直近srtt以内に再送したものは結果を待つ */
+        if (sl->state == SLOT_INFLIGHT && (sl->retx == 0 || now - sl->sent_us > c->srtt)) {
+            sl->state = SLOT_LOST;
+            c->inflight--;
+            c->lost++;
+            on_congestion(c, seq);
+        }
+    }
+}
+
+/* ---------- 受信 ---------- */
+
+static void send_ack(struct rel_conn *c)
+{
+    unsigned char frame[REL_ACK_SIZE];
+    uint64_t sack = 0;
+    for (unsigned i = 0; i < 64; i++) {
+        if (c->rcv[(c->rcv_nxt + 1 + i) & REL_MASK].state != SLOT_EMPTY)
+            sack |= (uint64_t)1 << i;
+    }
+    frame[0] = 0;
+    frame[1] = REL_ACK;
+    put16(frame + 2, 0);
+    put32(frame + 4, c->rcv_nxt);
+    put32(frame + 8, c->ts_echo);
+    put32(frame + 12, (uint32_t)(sack >> 32));
+    put32(frame + 16, (uint32_t)sack);
+    put32(frame + 20, c->epoch);
+    put32(frame + 24, c->peer_epoch);
+    c->ops->output(c->arg, frame, sizeof(frame));
+    c->ack_pending = 0;
+    c->ack_due_us = 0;
+}
+
+static void handle_data(struct rel_conn *c, const unsigned char *p, size_t len, uint64_t now)
+{
+    uint16_t dlen = get16(p + 2);
+    uint32_t seq = get32(p + 4);
+    if (dlen > REL_MSS || REL_HDR_SIZE + (size_t)dlen > len)
+        return;
+    c->ts_echo = get32(p + 8);
+    if (!c->rcv_started) {
+        c->rcv_nxt = get32(p + 20);
+        c->rcv_started = 1;
+    }
+
+    int in_order = seq == c->rcv_nxt;
+    if (seq_lt(seq, c->rcv_nxt) || !seq_lt(seq, c->rcv_nxt + REL_WINDOW)) {
+        send_ack(c); /* 重複: ACKが失われた可能性があるので即返す */
+        return;
+    }
+
+    struct rel_slot *sl = &c->rcv[seq & REL_MASK];
+    if (sl->state == SLOT_EMPTY) {
+        if (c->ops->deliver_seg &&
+            c->ops->deliver_seg(c->arg, seq, p + REL_HDR_SIZE, dlen)) {
+            sl->len = 0;
+            sl->state = SLOT_INFLIGHT; /* 受信済みだが渡し済み */
+        } else {
+            memcpy(sl->data, p + REL_HDR_SIZE, dlen);
+            sl->len = dlen;
+            sl->state = SLOT_SACKED;
+        }
+    }
+
+    /* 先頭から連続したものを順に渡す */
+    while (c->rcv[c->rcv_nxt & REL_MASK].state != SLOT_EMPTY) {
+        struct rel_slot *d = &c->rcv[c->rcv_nxt & REL_MASK];
+        if (d->state == SLOT_SACKED && c->ops->deliver)
+            c->ops->deliver(c->arg, d->data, d->len);
+        d->state = SLOT_EMPTY;
+        c->rcv_nxt++;
+        c->st.delivered++;
+    }
+
+    /*
+     * 順序が乱れたら即ACK。そうでなければ REL_ACK_EVERY 個ごとか、
+     * 受信をひとまとまり処理し終えて rel_timer が呼ばれた時点でまとめて返す
+     */
+    if (!in_order || ++c->ack_pending >= REL_ACK_EVERY) {
+        send_ack(c);
+    } else if (c->ack_due_us == 0) {
+        c->ack_due_us = now;
+    }
+}
+
+int rel_input(struct rel_conn *c, const void *buf, size_t len, uint64_t now)
+{
+    if (!rel_is_frame(buf, len))
+        return -1;
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t ep = p[1] == REL_DATA ? 12 : 20; /* 送信側・宛先のepochの位置 */
+    uint32_t from = get32(p + ep);
+    uint32_t to = get32(p + ep + 4);
+    if (from == 0 || from == c->prev_epoch)
+        return 0; /* 前の相手が送ったフレームが遅れて届いた */
+    int reset = 0;
+    if (c->peer_epoch == 0) {
+        c->peer_epoch = from;
+    } else if (from != c->peer_epoch) {
+        peer_reset(c, from);
+        reset = 1;
+    }
+
+    if (to != 0 && to != c->epoch) {
+        /* 起動し直す前の自分宛て。こちらのepochを知らせ、相手に新しい流れを始めさせる */
+        if (p[1] == REL_DATA)
+            send_ack(c);
+    } else if (p[1] == REL_DATA) {
+        handle_data(c, p, len, now);
+    } else if (!reset) {
+        handle_ack(c, p, now); /* 新しい相手のACKはまだ何も受け取っていない時のもの */
+    }
+    flush(c, now);
+    if (c->ops->output_flush)
+        c->ops->output_flush(c->arg);
+    return 0;
+}
+
+uint64_t rel_timer(struct rel_conn *c, uint64_t now)
+{
+    uint64_t wake = UINT64_MAX;
+
+    if (c->ack_due_us && now >= c->ack_due_us)
+        send_ack(c);
+    if (c->ack_due_us)
+        wake = c->ack_due_us;
+
+    /*
+     * RTO: 最古の未ACKが期限切れなら送信中のものを全て喪失扱いにし、cwndを絞る。
+     * ACK/SACKが進んでいる間は最後に進んだ時刻から数え直す (RFC 6298 5.3)。
+     * そうしないとRTOがsrttの少し上しかないとき、後続3個のSACKで喪失を検出する前にRTOが先に切れ、
+     * cwndが1に落ちてはまた小さな窓で喪失を待つことを繰り返す
+     */
+    if (seq_lt(c->snd_una, c->snd_nxt)) {
+        uint64_t oldest = UINT64_MAX;
+        for (uint32_t seq = c->snd_una; seq_lt(seq, c->snd_nxt); seq++) {
+            struct rel_slot *sl = &c->snd[seq & REL_MASK];
+            if (sl->state == SLOT_INFLIGHT) {
+                oldest = sl->sent_us;
+                break;
+            }
+        }
+        if (oldest != UINT64_MAX && oldest < c->progress_us)
+            oldest = c->progress_us;
+        if (oldest != UINT64_MAX && now >= oldest + c->rto) {
+            for (uint32_t seq = c->snd_una; seq_lt(seq, c->snd_nxt); seq++) {
+                struct rel_slot *sl = &c->snd[seq & REL_MASK];
+                if (sl->state == SLOT_INFLIGHT) {
+                    sl->state = SLOT_LOST;
+                    c->lost++;
+                }
+            }
+            c->inflight = 0;
+            c->ssthresh = c->cwnd / 2 < 2 ? 2 : c->cwnd / 2;
+            c->cwnd = 1;
+            c->recover = c->snd_nxt;
+            c->rto = c->rto * 2 > REL_RTO_MAX_US ? REL_RTO_MAX_US : c->rto * 2;
+            c->next_send_us = (double)now;
+        }
+    }
+
+    flush(c, now);
+
+    if (c->inflight || c->lost) {
+        for (uint32_t seq = c->snd_una; seq_lt(seq, c->snd_nxt); seq++) {
+            struct rel_slot *sl = &c->snd[seq & REL_MASK];
+            if (sl->state == SLOT_INFLIGHT) {
+                uint64_t base = sl->sent_us > c->progress_us ? sl->sent_us : c->progress_us;
+                if (base + c->rto < wake)
+                    wake = base + c->rto;
+                break;
+            }
+        }
+    }
+    /* ペーシングで止めているなら解除時刻に起こしてもらう */
+    int can_more = c->lost || seq_lt(c->snd_nxt, c->snd_end);
+    if (can_more && c->inflight < (uint32_t)c->cwnd && c->next_send_us > (double)now) {
+        uint64_t t = (uint64_t)c->next_send_us + 1;
+        if (t < wake)
+            wake = t;
+    }
+    if (c->ops->output_flush)
+        c->ops->output_flush(c->arg);
+    return wake;
+}
+
+void rel_get_stats(const struct rel_conn *c, struct rel_stats *out)
+{
+    *out = c->st;
+    out->srtt_us = c->srtt;
+    out->rto_us = c->rto;
+    out->cwnd = c->cwnd;
+}
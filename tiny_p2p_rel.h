@@ -0,0 +1,93 @@
+#ifndef TINY_P2P_REL_H
+#define TINY_P2P_REL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * punch済みUDP経路の上に載せる信頼性レイヤ。
+ * 連番・スライディングウィンドウ・選択ACK(SACK)・RTTから求めたRTOによる再送と、
+ * cwndベースの輻輳制御 + ペーシングで送る。
+ *
+ * フレーム(network byte order)。先頭が0x00なのでテキストのチャット行とは区別できる:
+ *   DATA: [0]=0 [1]=REL_DATA [2..3]=len [4..7]=seq [8..11]=送信時刻(us, 下位32bit)
+ *         [12..15]=送信側のepoch [16..19]=宛先のepoch(まだ知らなければ0) [20..23]=isn [24..]=payload
+ *   ACK : [0]=0 [1]=REL_ACK  [2..3]=0   [4..7]=次に欲しいseq [8..11]=DATAの時刻をそのまま返す
+ *         [12..19]=SACKビットマップ (bit i: seq=cum+1+i を受信済み)
+ *         [20..23]=送信側のepoch [24..27]=宛先のepoch
+ *
+ * epoch は rel_create ごとの乱数で、プロセスを起動し直すと変わる。相手が同じアドレスのまま
+ * 起動し直すと、seq 0 から送り直すDATAは古い rcv_nxt より前なので重複扱いになり、
+ * 返すACKは相手が送っていない範囲なので捨てられて止まってしまう。そこで:
+ *   - 知っているのと違うepochのフレームが届いたら、相手が替わったとみなして接続の状態を捨てる
+ *     （未ACKの送信データも捨てる。新しい相手はその前の流れを知らない）。
+ *     以降の送信は isn = その時点の次のseq から始まる新しい流れになる
+ *   - 受信側は宛先が自分(か0)の最初のDATAの isn から受け取り始める
+ *   - 宛先が自分でないDATAは前の自分宛てなので受け取らず、ACKだけ返して自分のepochを知らせる
+ * 直前の相手のepochは覚えておき、遅れて届いたそのフレームで戻らないようにする。
+ */
+
+#define REL_MSS          1200  /* 1フレームのpayload上限 */
+#define REL_HDR_SIZE     24
+#define REL_ACK_SIZE     28
+#define REL_WINDOW       1024  /* 送受信ウィンドウ(パケット数, 2の冪) */
+#define REL_DUPTHRESH    3     /* これだけ後ろのseqがSACKされたら喪失とみなす */
+#define REL_RTO_INIT_US  200000
+#define REL_RTO_MIN_US   20000
+#define REL_RTO_MAX_US   2000000
+#define REL_ACK_EVERY    16    /* 順序通りの受信はこの数ごとか、次の rel_timer でまとめてACK */
+#define REL_INIT_CWND    10
+
+enum rel_frame_type { REL_DATA = 1, REL_ACK = 2 };
+
+struct rel_ops {
+    /* 1データグラムを送る。失敗で-1 */
+    int (*output)(void *arg, const void *buf, size_t len);
+    /* 受信データを順序通りに渡す */
+    void (*deliver)(void *arg, const void *buf, size_t len);
+    /*
+     * (任意) 到着した時点で順序を待たずに渡す。1を返すとその場で消費したとみなし、
+     * 受信バッファへのコピーも deliver も行わない。0なら通常通り順序待ちにする
+     */
+    int (*deliver_seg)(void *arg, uint32_t seq, const void *buf, size_t len);
+    /* (任意) rel_input / rel_timer が出力を終えるたびに呼ばれる（まとめ送り用） */
+    void (*output_flush)(void *arg);
+    /* (任意) 相手が起動し直した（別のepochのフレームが届いた）。dropped は捨てた未ACKの送信数 */
+    void (*peer_reset)(void *arg, uint32_t dropped);
+};
+
+struct rel_stats {
+    uint64_t data_sent;      /* 送ったDATA(再送含む) */
+    uint64_t retransmits;
+    uint64_t acked;          /* 相手に届いたことが確定したDATA */
+    uint64_t delivered;      /* こちらが順序通りに受け取ったDATA */
+    uint64_t bytes_acked;
+    uint64_t peer_resets;    /* 相手の起動し直しで状態を捨てた回数 */
+    uint64_t srtt_us;
+    uint64_t rto_us;
+    double cwnd;
+};
+
+struct rel_conn;
+
+struct rel_conn *rel_create(const struct rel_ops *ops, void *arg);
+void rel_destroy(struct rel_conn *c);
+
+/* フレームの先頭か判定する（0x00 + 既知の種別） */
+int rel_is_frame(const void *buf, size_t len);
+
+/* 送信キューへ積む。len<=REL_MSS。ウィンドウが満杯なら-1 */
+int rel_send(struct rel_conn *c, const void *buf, size_t len, uint64_t now);
+/* 送信キューに積める残りパケット数 */
+size_t rel_send_space(const struct rel_conn *c);
+/* 送ったデータがすべてACKされたら1 */
+int rel_send_idle(const struct rel_conn *c);
+
+int rel_input(struct rel_conn *c, const void *buf, size_t len, uint64_t now);
+
+/* 送信・再送・遅延ACKを進め、次に呼ぶべき時刻を返す（無ければUINT64_MAX） */
+uint64_t rel_timer(struct rel_conn *c, uint64_t now);
+
+void rel_get_stats(const struct rel_conn *c, struct rel_stats *out);
+
+#endif
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tiny_p2p_req.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tiny_p2p_session.h"
+#include "tiny_trace.h"
+
+void p2p_rtt_init(struct p2p_rtt *e)
+{
+    e->srtt = 0;
+    e->rttvar = 0;
+    e->rto = P2P_REQ_RTO_INIT_MS * 1000u;
+}
+
+void p2p_rtt_sample(struct p2p_rtt *e, uint64_t rtt)
+{
+    if (e->srtt == 0) {
+        e->srtt = rtt;
+        e->rttvar = rtt / 2;
+    } else {
+        uint64_t diff = rtt > e->srtt ? rtt - e->srtt : e->srtt - rtt;
+        e->rttvar = (3 * e->rttvar + diff) / 4;
+        e->srtt = (7 * e->srtt + rtt) / 8;
+    }
+    e->rto = e->srtt + 4 * e->rttvar;
+    if (e->rto < P2P_REQ_RTO_MIN_MS * 1000u) e->rto = P2P_REQ_RTO_MIN_MS * 1000u;
+    if (e->rto > P2P_REQ_RTO_MAX_MS * 1000u) e->rto = P2P_REQ_RTO_MAX_MS * 1000u;
+}
+
+/* 間隔に±25%のジッタをかける（同時起動したクライアントの再送を散らす） */
+static uint64_t jitter(uint64_t us)
+{
+    uint64_t span = us / 2;
+    if (span == 0) return us;
+    return us - us / 4 + p2p_rand() % span;
+}
+
+void p2p_req_reset(struct p2p_request *rq, const struct p2p_rtt *est)
+{
+    rq->tries = 0;
+    rq->notfound = 0;
+    rq->done = 0;
+    rq->backoff = est->rto;
+    rq->next_at = 0;
+    rq->first_sent_at = 0;
+    rq->sends = 0;
+    rq->srvlen = 0;
+}
+
+int p2p_req_transmit(const struct tiny_transport *tp, int sock, struct p2p_request *rq, uint32_t self_id,
+                     const struct sockaddr *srv, socklen_t srvlen, uint64_t now)
+{
+    ssize_t len, sent;
+    if (rq->kind == P2P_REQ_REGISTER) {
+        uint32_t id = htonl(self_id);
+        len = sizeof(id);
+        sent = tiny_tp_sendto(tp, sock, &id, sizeof(id), srv, srvlen);
+    } else {
+        rq->txid = p2p_rand();
+        uint32_t q[4] = { htonl(self_id), htonl(rq->peer_id), htonl(rq->txid), htonl(rq->trace) };
+        len = rq->trace ? sizeof(q) : sizeof(q) - sizeof(q[3]);
+        sent = tiny_tp_sendto(tp, sock, q, (size_t)len, srv, srvlen);
+    }
+    if (srvlen <= sizeof(rq->srv)) {
+        memcpy(&rq->srv, srv, srvlen);
+        rq->srvlen = srvlen;
+    }
+    if (rq->sends++ == 0)
+        rq->first_sent_at = now;
+    rq->sent_at = now;
+    rq->tries++;
+    rq->next_at = now + jitter(rq->backoff);
+    rq->backoff *= 2;
+    if (rq->backoff > P2P_REQ_RTO_MAX_MS * 1000u)
+        rq->backoff = P2P_REQ_RTO_MAX_MS * 1000u;
+    return sent == len ? 0 : -1;
+}
+
+int p2p_req_match(struct p2p_request *rqs, size_t n, const char *buf,
+                  const struct sockaddr *src, socklen_t srclen,
+                  uint32_t self_id, struct p2p_rtt *est, uint64_t now)
+{
+    char tag[16], ip[64];
+    unsigned a = 0, b = 0, c = 0;
+    int f = sscanf(buf, "%15s %63s %u %u", tag, ip, &b, &c);
+    if (f < 1)
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct p2p_request *rq = &rqs[i];
+        if (rq->done || rq->srvlen == 0)
+            continue;
+        if (!p2p_addr_equal(src, srclen, (const struct sockaddr *)&rq->srv, rq->srvlen))
+            continue; /* 要求を送っていない相手からのデータ */
+
+        if (rq->kind == P2P_REQ_REGISTER && strcmp(tag, "TABLE_REGISTER") == 0 &&
+            sscanf(buf, "%*s %u", &a) == 1 && a == self_id) {
+            if (rq->tries == 1)
+                p2p_rtt_sample(est, now - rq->sent_at);
+            rq->done = P2P_REQ_OK;
+            ttr_span(TTR_REGISTER, rq->trace, self_id, rq->first_sent_at, now, rq->sends);
+            return 1;
+        }
+
+        if (rq->kind != P2P_REQ_QUERY)
+            continue;
+
+        if (strcmp(tag, "PEER") == 0 && f == 4) {
+            if (c != rq->txid)
+                continue; /* 別の要求（古い応答）への返事 */
+            p2p_rtt_sample(est, now - rq->sent_at);
+            snprintf(rq->ip, sizeof(rq->ip), "%s", ip);
+            rq->port = b;
+            rq->done = P2P_REQ_OK;
+            ttr_span(TTR_QUERY, rq->trace, rq->peer_id, rq->first_sent_at, now, rq->sends);
+            return 1;
+        }
+
+        if (strcmp(tag, "NOTFOUND") == 0) {
+            unsigned t;
+            if (sscanf(buf, "%*s %u", &t) != 1 || t != rq->txid)
+                continue;
+            p2p_rtt_sample(est, now - rq->sent_at);
+            /* 相手が未登録: 少し待って新しいtxidで問い合わせ直す */
+            if (++rq->notfound >= P2P_QUERY_NOTFOUND_MAX) {
+                rq->done = P2P_REQ_NOTFOUND;
+            } else {
+                rq->tries = 0;
+                rq->backoff = est->rto;
+                rq->next_at = now + jitter(P2P_QUERY_NOTFOUND_RETRY_MS * 1000u);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
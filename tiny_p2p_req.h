@@ -0,0 +1,76 @@
+#ifndef TINY_P2P_REQ_H
+#define TINY_P2P_REQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include "tiny_transport.h"
+
+/*
+ * サーバへの register / query を非同期に扱う要求/応答レイヤ。
+ * 各要求は再送タイマを持ち、RTT推定(RFC 6298相当)から求めたRTOに
+ * 指数バックオフと±25%のジッタをかけて再送する。
+ * query は送信ごとに新しい txid を付け、サーバが応答末尾に返す txid で対応付ける。
+ * register は "TABLE_REGISTER <self_id>" で対応付ける（txidを載せる余地がないため）。
+ * どちらも要求を送ったサーバのアドレスから届いた応答だけを受け付ける。
+ * trace が0でなければ query の4つ目のuint32_tに載せ、完了した要求の所要時間を
+ * tiny_trace.h に記録する。
+ * 受信待ちは持たないので、チャットは poll で、仮想網は配送イベントで駆動する。
+ */
+
+#define P2P_REQ_RTO_INIT_MS  250  /* RTT未計測時の初期RTO */
+#define P2P_REQ_RTO_MIN_MS   20
+#define P2P_REQ_RTO_MAX_MS   2000 /* バックオフの上限 */
+#define P2P_REQ_MAX_TRIES    6    /* 応答の無い連続送信の上限 */
+#define P2P_QUERY_NOTFOUND_RETRY_MS 100 /* 相手未登録時の再問い合わせ間隔 */
+#define P2P_QUERY_NOTFOUND_MAX      50
+
+struct p2p_rtt {
+    uint64_t srtt;    /* 平滑化RTT (us)。0なら未計測 */
+    uint64_t rttvar;  /* RTTのばらつき (us) */
+    uint64_t rto;     /* 現在のRTO (us) */
+};
+
+enum p2p_req_kind { P2P_REQ_REGISTER, P2P_REQ_QUERY };
+enum p2p_req_result { P2P_REQ_OK = 1, P2P_REQ_NOTFOUND = 2, P2P_REQ_FAILED = -1 };
+
+struct p2p_request {
+    enum p2p_req_kind kind;
+    uint32_t peer_id;     /* query対象 */
+    uint32_t txid;        /* 最後に送ったquery のtxid */
+    uint32_t trace;       /* トレースID（0は載せない） */
+    uint64_t first_sent_at; /* 最初に送った時刻（トレース用） */
+    unsigned sends;       /* 送信した総数（トレース用） */
+    uint64_t sent_at;     /* 最後に送った時刻 */
+    uint64_t next_at;     /* 次に送る時刻 */
+    uint64_t backoff;     /* 現在の再送間隔 (us) */
+    unsigned tries;       /* 応答の無い連続送信回数 */
+    unsigned notfound;    /* NOTFOUND を受けた回数 */
+    int done;             /* P2P_REQ_OK / P2P_REQ_NOTFOUND / P2P_REQ_FAILED、0は未完了 */
+    char ip[64];          /* query結果 */
+    unsigned port;
+    struct sockaddr_storage srv; /* 最後に送ったサーバのアドレス（応答の送信元と照合する） */
+    socklen_t srvlen;     /* 0は未送信 */
+};
+
+void p2p_rtt_init(struct p2p_rtt *e);
+void p2p_rtt_sample(struct p2p_rtt *e, uint64_t rtt);
+
+/* 要求を未送信の状態に戻す（すぐ送る） */
+void p2p_req_reset(struct p2p_request *rq, const struct p2p_rtt *est);
+/*
+ * 要求を1回送り、次の再送時刻を決める。送信失敗で-1
+ * （一時的な失敗もあるので、失敗しても1回の送信として数え、再送時刻は決める）。
+ */
+int p2p_req_transmit(const struct tiny_transport *tp, int sock, struct p2p_request *rq, uint32_t self_id,
+                     const struct sockaddr *srv, socklen_t srvlen, uint64_t now);
+/*
+ * src から届いたデータを未完了の要求に照合する。照合できたら1。
+ * 要求を送ったサーバ以外からのデータや、query の txid が最後の送信と一致しない応答は照合しない。
+ * RTTは再送していない register (Karn)、またはtxidが最後の送信と一致した query の応答からのみ計測する。
+ */
+int p2p_req_match(struct p2p_request *rqs, size_t n, const char *buf,
+                  const struct sockaddr *src, socklen_t srclen,
+                  uint32_t self_id, struct p2p_rtt *est, uint64_t now);
+
+#endif
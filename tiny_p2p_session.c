@@ -0,0 +1,950 @@
+#define _GNU_SOURCE
+#include "tiny_p2p_session.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tiny_trace.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 /* linux/udp.h */
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* ---------- 共通ユーティリティ ---------- */
+
+/* 単調増加時計（マイクロ秒） */
+uint64_t p2p_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint32_t rng_state;
+
+void p2p_rand_seed(uint32_t seed)
+{
+    rng_state = seed ? seed : 2463534242u;
+}
+
+/* xorshift32。再送ジッタとnonce用で暗号強度は不要 */
+uint32_t p2p_rand(void)
+{
+    uint32_t x = rng_state ? rng_state : 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+int p2p_addr_map(int family, const struct sockaddr *in, socklen_t inlen,
+                 struct sockaddr_storage *out, socklen_t *outlen)
+{
+    static const unsigned char mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    if (in->sa_family == family) {
+        memcpy(out, in, inlen);
+        *outlen = inlen;
+        return 0;
+    }
+    memset(out, 0, sizeof(*out));
+    if (family == AF_INET6 && in->sa_family == AF_INET) {
+        /* デュアルスタックのソケットではIPv4の相手を ::ffff:a.b.c.d で表す */
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *)in;
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)out;
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = v4->sin_port;
+        memcpy(v6->sin6_addr.s6_addr, mapped, sizeof(mapped));
+        memcpy(v6->sin6_addr.s6_addr + 12, &v4->sin_addr, 4);
+        *outlen = sizeof(*v6);
+        return 0;
+    }
+    if (family == AF_INET && in->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *v6 = (const struct sockaddr_in6 *)in;
+        if (memcmp(v6->sin6_addr.s6_addr, mapped, sizeof(mapped)) != 0)
+            return -1; /* IPv4のソケットからIPv6の相手へは送れない */
+        struct sockaddr_in *v4 = (struct sockaddr_in *)out;
+        v4->sin_family = AF_INET;
+        v4->sin_port = v6->sin6_port;
+        memcpy(&v4->sin_addr, v6->sin6_addr.s6_addr + 12, 4);
+        *outlen = sizeof(*v4);
+        return 0;
+    }
+    return -1;
+}
+
+int p2p_make_addr(const char *ip, unsigned port, int family,
+                  struct sockaddr_storage *out, socklen_t *outlen)
+{
+    struct addrinfo hints = {0}, *ai = NULL;
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%u", port);
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    if (getaddrinfo(ip, portstr, &hints, &ai) != 0)
+        return -1;
+
+    int rc = p2p_addr_map(family, ai->ai_addr, ai->ai_addrlen, out, outlen);
+    freeaddrinfo(ai);
+    return rc;
+}
+
+int p2p_addr_equal(const struct sockaddr *a, socklen_t alen,
+                   const struct sockaddr *b, socklen_t blen)
+{
+    if (a->sa_family != b->sa_family)
+        return 0;
+    if (a->sa_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+        return x->sin6_port == y->sin6_port &&
+               memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+    }
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/* FNV-1aでアドレス(ポート+IP)をハッシュする */
+static unsigned addr_hash(const struct sockaddr *a)
+{
+    const unsigned char *p = NULL;
+    size_t n = 0;
+    uint16_t port = 0;
+    if (a->sa_family == AF_INET) {
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *)a;
+        p = (const unsigned char *)&v4->sin_addr;
+        n = sizeof(v4->sin_addr);
+        port = v4->sin_port;
+    } else if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *v6 = (const struct sockaddr_in6 *)a;
+        p = (const unsigned char *)&v6->sin6_addr;
+        n = sizeof(v6->sin6_addr);
+        port = v6->sin6_port;
+    }
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    h ^= port;
+    h *= 16777619u;
+    return h % P2P_HASH_BUCKETS;
+}
+
+/* 時計と送信はトランスポートがあればそちらを使う（仮想網から動かすため） */
+static uint64_t eng_now(const struct p2p_engine *eng)
+{
+    return eng->tp ? tiny_tp_now_us(eng->tp) : p2p_now_us();
+}
+
+static ssize_t eng_sendto(struct p2p_engine *eng, const void *buf, size_t len,
+                          const struct sockaddr *to, socklen_t tolen)
+{
+    if (eng->tp)
+        return tiny_tp_sendto(eng->tp, eng->sock, buf, len, to, tolen);
+    return sendto(eng->sock, buf, len, 0, to, tolen);
+}
+
+/* ---------- PROBE ---------- */
+
+/*
+ * hole punch / keep-alive 用プローブ:
+ *   "PROBE <from> <to> <nonce>"     : punch中は倍々の間隔で、確立後は無送信が続いたら送る
+ *   "PROBE_ACK <from> <to> <nonce>" : PROBEを受けた側が即返信（nonceはPROBEのものを返す）
+ * to が自分のIDと一致するものだけを扱う。
+ */
+static void send_probe_to(struct p2p_engine *eng, struct p2p_session *s, const char *tag, uint32_t nonce,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "%s %u %u %u\n", tag, eng->self_id, s->peer_id, nonce);
+    eng_sendto(eng, msg, (size_t)len, addr, addrlen);
+    s->last_tx_us = eng_now(eng);
+}
+
+static void send_probe(struct p2p_engine *eng, struct p2p_session *s, const char *tag, uint32_t nonce)
+{
+    send_probe_to(eng, s, tag, nonce, (struct sockaddr *)&s->addr, s->addrlen);
+}
+
+int p2p_parse_probe(const char *buf, int *is_ack, uint32_t *from, uint32_t *to, uint32_t *nonce)
+{
+    char tag[16];
+    unsigned f, t, n;
+    if (sscanf(buf, "%15s %u %u %u", tag, &f, &t, &n) != 4)
+        return 0;
+    if (strcmp(tag, "PROBE") == 0)
+        *is_ack = 0;
+    else if (strcmp(tag, "PROBE_ACK") == 0)
+        *is_ack = 1;
+    else
+        return 0;
+    *from = f;
+    *to = t;
+    *nonce = n;
+    return 1;
+}
+
+enum p2p_probe_action p2p_probe_decide(int known_addr, int established, int is_ack,
+                                       uint32_t nonce, uint32_t our_nonce)
+{
+    if (known_addr)
+        return is_ack && nonce != our_nonce ? P2P_PROBE_IGNORE : P2P_PROBE_ACCEPT;
+    if (is_ack)
+        return nonce == our_nonce ? P2P_PROBE_REKEY : P2P_PROBE_IGNORE;
+    /* 未知のアドレスからのPROBEは誰でも送れるので、それだけでは付け替えない */
+    return established ? P2P_PROBE_ANSWER : P2P_PROBE_CHALLENGE;
+}
+
+/* ---------- セッション表 ---------- */
+
+static void hash_insert(struct p2p_engine *eng, struct p2p_session *s)
+{
+    unsigned h = addr_hash((struct sockaddr *)&s->addr);
+    s->hnext = eng->buckets[h];
+    eng->buckets[h] = s;
+}
+
+static void hash_remove(struct p2p_engine *eng, struct p2p_session *s)
+{
+    struct p2p_session **pp = &eng->buckets[addr_hash((struct sockaddr *)&s->addr)];
+    while (*pp && *pp != s)
+        pp = &(*pp)->hnext;
+    if (*pp)
+        *pp = s->hnext;
+    s->hnext = NULL;
+}
+
+/* peer-reflexive: 相手が想定と別のアドレスから応答してきたらそちらへ付け替える */
+static void rekey(struct p2p_engine *eng, struct p2p_session *s,
+                  const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (p2p_addr_equal((struct sockaddr *)&s->addr, s->addrlen, addr, addrlen))
+        return;
+    hash_remove(eng, s);
+    memcpy(&s->addr, addr, addrlen);
+    s->addrlen = addrlen;
+    hash_insert(eng, s);
+}
+
+struct p2p_session *p2p_engine_find(struct p2p_engine *eng,
+                                    const struct sockaddr *addr, socklen_t addrlen)
+{
+    for (struct p2p_session *s = eng->buckets[addr_hash(addr)]; s; s = s->hnext) {
+        if (p2p_addr_equal((struct sockaddr *)&s->addr, s->addrlen, addr, addrlen))
+            return s;
+    }
+    return NULL;
+}
+
+/* IDでの検索はアドレスが変わった時などの稀な経路なので線形探索 */
+struct p2p_session *p2p_engine_find_id(struct p2p_engine *eng, uint32_t peer_id)
+{
+    for (struct p2p_session *s = eng->head; s; s = s->next) {
+        if (s->peer_id == peer_id)
+            return s;
+    }
+    return NULL;
+}
+
+static struct p2p_session *session_new(struct p2p_engine *eng, uint32_t peer_id,
+                                       const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct p2p_session *s = p2p_session_pool_alloc(&eng->pool);
+    if (!s)
+        return NULL;
+    uint64_t now = eng_now(eng);
+    s->peer_id = peer_id;
+    memcpy(&s->addr, addr, addrlen);
+    s->addrlen = addrlen;
+    s->state = P2P_PUNCHING;
+    s->nonce = p2p_rand();
+    s->start_us = now;
+    s->next_probe_us = now;
+    s->probe_interval_us = P2P_PUNCH_INTERVAL_MIN_MS * 1000u;
+    s->last_rx_us = now;
+    s->last_tx_us = now;
+
+    s->next = eng->head;
+    if (eng->head)
+        eng->head->prev = s;
+    eng->head = s;
+    hash_insert(eng, s);
+    eng->count++;
+    return s;
+}
+
+void p2p_engine_close(struct p2p_engine *eng, struct p2p_session *s, const char *reason)
+{
+    if (eng->ops && eng->ops->on_closed)
+        eng->ops->on_closed(eng, s, reason);
+    hash_remove(eng, s);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        eng->head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    eng->count--;
+    p2p_session_pool_free(&eng->pool, s);
+}
+
+static void set_established(struct p2p_engine *eng, struct p2p_session *s)
+{
+    if (s->state == P2P_ESTABLISHED)
+        return;
+    s->state = P2P_ESTABLISHED;
+    s->established_us = eng_now(eng);
+    ttr_span(TTR_PUNCH, s->trace, s->peer_id, s->start_us, s->established_us, s->probes);
+    if (eng->ops && eng->ops->on_established)
+        eng->ops->on_established(eng, s);
+}
+
+/* ---------- エンジン ---------- */
+
+static int engine_setup(struct p2p_engine *eng, int sock, uint32_t self_id,
+                        const struct sockaddr *server, socklen_t serverlen,
+                        size_t capacity, const struct p2p_engine_ops *ops, void *user)
+{
+    memset(eng, 0, sizeof(*eng));
+    eng->sock = sock;
+    eng->epfd = -1;
+    eng->tfd = -1;
+    eng->probe_sock = -1;
+    eng->self_id = self_id;
+    eng->capacity = capacity;
+    eng->ops = ops;
+    eng->user = user;
+    eng->family = AF_INET;
+    if (server) {
+        memcpy(&eng->server, server, serverlen);
+        eng->serverlen = serverlen;
+        eng->family = server->sa_family;
+    }
+    struct sockaddr_storage me;
+    socklen_t melen = sizeof(me);
+    if (sock >= 0 && getsockname(sock, (struct sockaddr *)&me, &melen) == 0)
+        eng->family = me.ss_family;
+    return p2p_session_pool_init(&eng->pool, capacity);
+}
+
+int p2p_engine_init(struct p2p_engine *eng, int sock, uint32_t self_id,
+                    const struct sockaddr *server, socklen_t serverlen,
+                    size_t capacity, const struct p2p_engine_ops *ops, void *user)
+{
+    if (!eng || sock < 0 || capacity == 0) return -1;
+    if (engine_setup(eng, sock, self_id, server, serverlen, capacity, ops, user) != 0)
+        return -1;
+
+    eng->epfd = epoll_create1(EPOLL_CLOEXEC);
+    eng->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (eng->epfd < 0 || eng->tfd < 0)
+        goto fail;
+
+    /* GROで同じ相手からの連続データグラムをまとめて受け取る（非対応カーネルなら無視） */
+    int on = 1;
+    eng->gro = setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    eng->gso = 1; /* 最初の送信で失敗したら落とす */
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = sock;
+    if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, sock, &ev) != 0)
+        goto fail;
+    ev.data.fd = eng->tfd;
+    if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, eng->tfd, &ev) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    if (eng->epfd >= 0) close(eng->epfd);
+    if (eng->tfd >= 0) close(eng->tfd);
+    p2p_session_pool_destroy(&eng->pool);
+    return -1;
+}
+
+int p2p_engine_init_transport(struct p2p_engine *eng, const struct tiny_transport *tp, uint32_t self_id,
+                              const struct sockaddr *server, socklen_t serverlen,
+                              size_t capacity, const struct p2p_engine_ops *ops, void *user)
+{
+    if (!eng || !tp || capacity == 0) return -1;
+    if (engine_setup(eng, -1, self_id, server, serverlen, capacity, ops, user) != 0)
+        return -1;
+    eng->tp = tp;
+    return 0;
+}
+
+void p2p_engine_set_server_alt(struct p2p_engine *eng, const struct sockaddr *server, socklen_t serverlen)
+{
+    memcpy(&eng->server_alt, server, serverlen);
+    eng->server_altlen = serverlen;
+}
+
+void p2p_engine_dispose(struct p2p_engine *eng)
+{
+    if (!eng) return;
+    if (eng->epfd >= 0) close(eng->epfd);
+    if (eng->tfd >= 0) close(eng->tfd);
+    if (eng->probe_sock >= 0) close(eng->probe_sock);
+    /* 残っているセッションも on_closed を通して、利用者が s->user に持たせた状態を解放させる */
+    while (eng->head)
+        p2p_engine_close(eng, eng->head, "dispose");
+    p2p_session_pool_destroy(&eng->pool);
+    eng->head = NULL;
+    eng->count = 0;
+}
+
+int p2p_engine_watch_fd(struct p2p_engine *eng, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = fd;
+    return epoll_ctl(eng->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+struct p2p_session *p2p_engine_connect(struct p2p_engine *eng, uint32_t peer_id,
+                                       const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct p2p_session *s = p2p_engine_find_id(eng, peer_id);
+    if (!s)
+        return session_new(eng, peer_id, addr, addrlen);
+    /*
+     * punch中に別のアドレスを知らされた（起動時に試したキャッシュのアドレスが古かった等）:
+     * 新しい方へ付け替えて最初の間隔から送り直す。古いアドレスへ送ったPROBEの応答も
+     * IDとnonceで照合されるので、先に応答した経路が残る
+     */
+    if (s->state == P2P_PUNCHING && !p2p_addr_equal((struct sockaddr *)&s->addr, s->addrlen, addr, addrlen)) {
+        rekey(eng, s, addr, addrlen);
+        s->next_probe_us = eng_now(eng);
+        s->probe_interval_us = P2P_PUNCH_INTERVAL_MIN_MS * 1000u;
+    }
+    return s;
+}
+
+int p2p_engine_send(struct p2p_engine *eng, struct p2p_session *s, const void *buf, size_t len)
+{
+    ssize_t n = eng_sendto(eng, buf, len, (struct sockaddr *)&s->addr, s->addrlen);
+    if (n < 0)
+        return -1;
+    s->last_tx_us = eng_now(eng);
+    return 0;
+}
+
+int p2p_engine_send_gso(struct p2p_engine *eng, struct p2p_session *s,
+                        const void *buf, size_t len, uint16_t seg_size)
+{
+    if (len <= seg_size)
+        return p2p_engine_send(eng, s, buf, len);
+
+    if (eng->gso && !eng->tp) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } ctrl;
+        struct msghdr msg = {0};
+        msg.msg_name = &s->addr;
+        msg.msg_namelen = s->addrlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+
+        if (sendmsg(eng->sock, &msg, 0) >= 0) {
+            s->last_tx_us = eng_now(eng);
+            return 0;
+        }
+        if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+            return -1;
+        eng->gso = 0; /* GSO非対応: 以降は1つずつ送る */
+    }
+
+    const char *p = (const char *)buf;
+    for (size_t off = 0; off < len; off += seg_size) {
+        size_t n = len - off < seg_size ? len - off : seg_size;
+        if (p2p_engine_send(eng, s, p + off, n) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+size_t p2p_engine_broadcast(struct p2p_engine *eng, const void *buf, size_t len)
+{
+    struct mmsghdr msgs[P2P_SENDMMSG_BATCH];
+    struct p2p_session *batch[P2P_SENDMMSG_BATCH];
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    size_t total = 0;
+    struct p2p_session *s = eng->head;
+
+    if (eng->tp) {
+        for (; s; s = s->next) {
+            if (s->state == P2P_ESTABLISHED && p2p_engine_send(eng, s, buf, len) == 0)
+                total++;
+        }
+        return total;
+    }
+
+    while (s) {
+        unsigned n = 0;
+        for (; s && n < P2P_SENDMMSG_BATCH; s = s->next) {
+            if (s->state != P2P_ESTABLISHED)
+                continue;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = &s->addr;
+            msgs[n].msg_hdr.msg_namelen = s->addrlen;
+            msgs[n].msg_hdr.msg_iov = &iov;
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            batch[n++] = s;
+        }
+        unsigned off = 0;
+        while (off < n) {
+            int r = sendmmsg(eng->sock, msgs + off, n - off, 0);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR)
+                    continue;
+                off++; /* 先頭の1件が送れない: 飛ばして残りを送る */
+                continue;
+            }
+            uint64_t now = eng_now(eng);
+            for (int i = 0; i < r; i++)
+                batch[off + (unsigned)i]->last_tx_us = now;
+            off += (unsigned)r;
+            total += (size_t)r;
+        }
+    }
+    return total;
+}
+
+/*
+ * サーバへ4バイトのIDを送り直して登録を更新する（マッピングが変わっていれば新しいポートが載る）。
+ * もう一方のファミリのサーバアドレスがあればそちらにも送り、両方のアドレスを登録し直す。
+ */
+static void send_register(struct p2p_engine *eng)
+{
+    uint32_t net_id = htonl(eng->self_id);
+    eng_sendto(eng, &net_id, sizeof(net_id), (struct sockaddr *)&eng->server, eng->serverlen);
+    if (eng->server_altlen)
+        eng_sendto(eng, &net_id, sizeof(net_id), (struct sockaddr *)&eng->server_alt, eng->server_altlen);
+}
+
+static int from_server(const struct p2p_engine *eng, const struct sockaddr *src, socklen_t srclen)
+{
+    return (eng->serverlen &&
+            p2p_addr_equal(src, srclen, (const struct sockaddr *)&eng->server, eng->serverlen)) ||
+           (eng->server_altlen &&
+            p2p_addr_equal(src, srclen, (const struct sockaddr *)&eng->server_alt, eng->server_altlen));
+}
+
+/*
+ * サーバが寿命の探索用マッピングを頼んできた: 別のソケットから "KAPROBE <id>" を送る。
+ * サーバは以後の探索をこのソケットのマッピングで行い、登録したマッピングは切らさない。
+ * 仮想網のエンジンはソケットを持たないので応じない（サーバは探索せず短い間隔で送り続ける）。
+ */
+static void open_probe(struct p2p_engine *eng, const struct sockaddr *server, socklen_t serverlen)
+{
+    if (eng->tp || eng->epfd < 0)
+        return;
+    if (eng->probe_sock < 0) {
+        int fd = socket(eng->family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return;
+        if (p2p_engine_watch_fd(eng, fd) != 0) {
+            close(fd);
+            return;
+        }
+        eng->probe_sock = fd;
+    }
+    char msg[32];
+    int len = snprintf(msg, sizeof(msg), "KAPROBE %u\n", eng->self_id);
+    sendto(eng->probe_sock, msg, (size_t)len, 0, server, serverlen);
+    /* 次の主KEEPALIVEまでに探索が始まらなければ閉じる（まだ要るならまた頼まれる） */
+    eng->probe_watch_us = eng_now(eng) + ((uint64_t)eng->server_expect_ms + P2P_SERVER_GRACE_MS) * 1000u;
+}
+
+/* 探索用ソケットはサーバのKEEPALIVEに同じソケットから応答するだけ */
+static void read_probe_socket(struct p2p_engine *eng)
+{
+    char buf[128];
+    for (;;) {
+        struct sockaddr_storage src;
+        socklen_t srclen = sizeof(src);
+        ssize_t r = recvfrom(eng->probe_sock, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&src, &srclen);
+        if (r < 0)
+            return;
+        buf[r] = '\0';
+        unsigned expect_s;
+        if (!from_server(eng, (struct sockaddr *)&src, srclen) || sscanf(buf, "KEEPALIVE %u", &expect_s) != 1)
+            continue;
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "KEEPALIVE_ACK %u\n", eng->self_id);
+        sendto(eng->probe_sock, ack, (size_t)len, 0, (struct sockaddr *)&src, srclen);
+        eng->probe_watch_us = eng_now(eng) + ((uint64_t)expect_s * 1000u + P2P_SERVER_GRACE_MS) * 1000u;
+    }
+}
+
+/* サーバからの通知: "PUNCH <ip> <port> <peer_id> [<target_id> [<trace>]]" を受けたら相手へのpunchを始める */
+static void handle_server_line(struct p2p_engine *eng, const char *buf,
+                               const struct sockaddr *src, socklen_t srclen)
+{
+    char tag[16], ip[64];
+    unsigned port, rid;
+
+    /*
+     * "KEEPALIVE <秒> [<id> [PROBE]]": 応答を返してサーバに寿命の推定をさせる（届いたファミリのマッピングを確かめるので同じ宛先へ返す）。
+     * 予告された秒数(+猶予)を過ぎても次が来なければマッピングが切れたとみなして再登録する。
+     * PROBE が付いていれば探索用マッピングを作る。
+     */
+    unsigned expect_s;
+    char flag[8] = "";
+    if (sscanf(buf, "KEEPALIVE %u %*u %7s", &expect_s, flag) >= 1) {
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "KEEPALIVE_ACK %u\n", eng->self_id);
+        eng_sendto(eng, ack, (size_t)len, src, srclen);
+        eng->server_expect_ms = expect_s * 1000u;
+        eng->server_watch_us = eng_now(eng) +
+            ((uint64_t)eng->server_expect_ms + P2P_SERVER_GRACE_MS) * 1000u;
+        if (strcmp(flag, "PROBE") == 0)
+            open_probe(eng, src, srclen);
+        return;
+    }
+    if (strncmp(buf, "TABLE_REGISTER ", 15) == 0) {
+        /* 再登録が通った: 次のKEEPALIVEを同じ間隔で待つ */
+        if (eng->server_watch_us)
+            eng->server_watch_us = eng_now(eng) +
+                ((uint64_t)eng->server_expect_ms + P2P_SERVER_GRACE_MS) * 1000u;
+        return;
+    }
+
+    /*
+     * 末尾の対象IDは新しいサーバだけが付ける（ゲートウェイ用）。付いていれば自分宛てか確かめる。
+     * その後ろは相手の問い合わせに載っていたトレースID
+     */
+    unsigned target, trace = 0;
+    int fields = sscanf(buf, "%15s %63s %u %u %u %u", tag, ip, &port, &rid, &target, &trace);
+    if (fields < 4 || strcmp(tag, "PUNCH") != 0)
+        return; /* 重複応答などは読み捨て */
+    if (fields >= 5 && target != eng->self_id)
+        return;
+
+    struct p2p_session *s = p2p_engine_find_id(eng, rid);
+    if (trace)
+        ttr_instant(TTR_NOTIFY, trace, rid, eng_now(eng), s ? (uint32_t)s->state + 1 : 0);
+    if (s && s->state == P2P_ESTABLISHED)
+        return;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    if (p2p_make_addr(ip, port, eng->family, &addr, &addrlen) != 0)
+        return;
+    if (!eng->quiet)
+        printf("server notify: peer=%u %s:%u\n", rid, ip, port);
+    if (s) {
+        rekey(eng, s, (struct sockaddr *)&addr, addrlen);
+        s->next_probe_us = eng_now(eng);
+    } else {
+        s = p2p_engine_connect(eng, rid, (struct sockaddr *)&addr, addrlen);
+    }
+    if (s && !s->trace)
+        s->trace = trace;
+}
+
+/* サーバは同じ相手宛てのPUNCHを複数行まとめて送ってくるので1行ずつ処理する */
+static void handle_server(struct p2p_engine *eng, const char *buf,
+                          const struct sockaddr *src, socklen_t srclen)
+{
+    char line[128];
+    while (*buf) {
+        size_t n = strcspn(buf, "\n");
+        if (n > 0 && n < sizeof(line)) {
+            memcpy(line, buf, n);
+            line[n] = '\0';
+            handle_server_line(eng, line, src, srclen);
+        }
+        buf += n;
+        if (*buf == '\n')
+            buf++;
+    }
+}
+
+void p2p_engine_input(struct p2p_engine *eng, const char *buf, size_t len,
+                      const struct sockaddr *src, socklen_t srclen)
+{
+    if (from_server(eng, src, srclen)) {
+        handle_server(eng, buf, src, srclen);
+        return;
+    }
+
+    struct p2p_session *s = p2p_engine_find(eng, src, srclen);
+
+    int is_ack;
+    uint32_t from, to, nonce;
+    if (p2p_parse_probe(buf, &is_ack, &from, &to, &nonce)) {
+        if (to != eng->self_id)
+            return;
+        int known = s && s->peer_id == from;
+        if (!known) {
+            s = p2p_engine_find_id(eng, from);
+            if (!s) {
+                /* 未知のID: 相手発のセッションとして作る */
+                if (is_ack || !(s = session_new(eng, from, src, srclen)))
+                    return;
+                known = 1;
+            }
+        }
+
+        switch (p2p_probe_decide(known, s->state == P2P_ESTABLISHED, is_ack, nonce, s->nonce)) {
+        case P2P_PROBE_IGNORE:
+            return; /* 古いセッションのACK、またはこちらのnonceを知らない送信元 */
+        case P2P_PROBE_CHALLENGE:
+            /*
+             * 相手が別のマッピングから送ってきたのかもしれない。こちらのnonceのPROBEで確かめ、
+             * ACKが返ってきたら付け替える（相手はこのPROBEを受けて確立する）。
+             */
+            send_probe_to(eng, s, "PROBE", s->nonce, src, srclen);
+            return;
+        case P2P_PROBE_ANSWER:
+            send_probe(eng, s, "PROBE_ACK", nonce);
+            return;
+        case P2P_PROBE_REKEY:
+            rekey(eng, s, src, srclen);
+            break;
+        case P2P_PROBE_ACCEPT:
+            break;
+        }
+
+        s->last_rx_us = eng_now(eng);
+        if (!is_ack)
+            send_probe(eng, s, "PROBE_ACK", nonce);
+        set_established(eng, s);
+        return;
+    }
+
+    if (!s)
+        return;
+    s->last_rx_us = eng_now(eng);
+    /* 相手のデータが届いた = 経路は開いている */
+    set_established(eng, s);
+    if (!s->got_data) {
+        s->got_data = 1;
+        ttr_span(TTR_FIRST_DATA, s->trace, s->peer_id, s->established_us, s->last_rx_us, 0);
+    }
+    if (eng->ops && eng->ops->on_data)
+        eng->ops->on_data(eng, s, buf, len);
+}
+
+/*
+ * ソケットを読み切る。GRO有効時は1回の受信に同じ送信元の複数データグラムが連結され、
+ * cmsg の UDP_GRO に1個あたりのサイズが入るので、それで切り分けて1つずつ処理する。
+ */
+static void read_socket(struct p2p_engine *eng)
+{
+    static char rxbuf[P2P_GRO_BUF_SIZE];
+
+    for (;;) {
+        struct sockaddr_storage src;
+        struct iovec iov = { .iov_base = rxbuf, .iov_len = sizeof(rxbuf) - 1 };
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } ctrl;
+        struct msghdr msg = {0};
+        msg.msg_name = &src;
+        msg.msg_namelen = sizeof(src);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+
+        ssize_t r = recvmsg(eng->sock, &msg, MSG_DONTWAIT);
+        if (r < 0)
+            return;
+
+        size_t seg = (size_t)r;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                if (gso_size > 0)
+                    seg = (size_t)gso_size;
+            }
+        }
+
+        if (seg >= (size_t)r) {
+            rxbuf[r] = '\0';
+            p2p_engine_input(eng, rxbuf, (size_t)r, (struct sockaddr *)&src, msg.msg_namelen);
+            continue;
+        }
+        for (size_t off = 0; off < (size_t)r; off += seg) {
+            size_t n = (size_t)r - off < seg ? (size_t)r - off : seg;
+            char *p = rxbuf + off;
+            char line[P2P_BUF_SIZE];
+            if (p[0] != 0) {
+                /* テキストはsscanfで読むので終端付きのコピーを渡す */
+                if (n >= sizeof(line))
+                    n = sizeof(line) - 1;
+                memcpy(line, p, n);
+                line[n] = '\0';
+                p = line;
+            }
+            p2p_engine_input(eng, p, n, (struct sockaddr *)&src, msg.msg_namelen);
+        }
+    }
+}
+
+/*
+ * 期限の来たセッションを処理し、次に起きるべき時刻を返す。
+ *   punch中 : PROBE再送（間隔を倍々）、P2P_PUNCH_TIMEOUT_MS で打ち切り
+ *   確立後  : 送信が P2P_KEEPALIVE_MS 途絶えたらPROBE、受信が P2P_DEAD_MS 途絶えたら切断。
+ *             ops->on_timer があれば上位レイヤ(再送など)の期限もここでまとめる
+ */
+static uint64_t run_timers(struct p2p_engine *eng)
+{
+    uint64_t now = eng_now(eng);
+    uint64_t wake = UINT64_MAX;
+    struct p2p_session *s = eng->head;
+
+    if (eng->server_watch_us) {
+        if (now >= eng->server_watch_us) {
+            if (!eng->quiet)
+                printf("server keepalive lost, re-registering\n");
+            send_register(eng);
+            eng->server_watch_us = now + (uint64_t)P2P_REREGISTER_MS * 1000u;
+        }
+        wake = eng->server_watch_us;
+    }
+    if (eng->probe_sock >= 0) {
+        /* 探索が終わった、または探索用マッピングが切れた: 閉じる（サーバは要るときにまた頼む） */
+        if (now >= eng->probe_watch_us) {
+            close(eng->probe_sock);
+            eng->probe_sock = -1;
+        } else if (eng->probe_watch_us < wake) {
+            wake = eng->probe_watch_us;
+        }
+    }
+
+    while (s) {
+        struct p2p_session *next = s->next;
+        uint64_t due;
+
+        if (s->state == P2P_PUNCHING) {
+            uint64_t deadline = s->start_us + (uint64_t)P2P_PUNCH_TIMEOUT_MS * 1000u;
+            if (now >= deadline) {
+                p2p_engine_close(eng, s, "punch timeout");
+                s = next;
+                continue;
+            }
+            if (now >= s->next_probe_us) {
+                send_probe(eng, s, "PROBE", s->nonce);
+                s->probes++;
+                s->next_probe_us = now + s->probe_interval_us;
+                s->probe_interval_us *= 2;
+                if (s->probe_interval_us > P2P_PUNCH_INTERVAL_MAX_MS * 1000u)
+                    s->probe_interval_us = P2P_PUNCH_INTERVAL_MAX_MS * 1000u;
+            }
+            due = s->next_probe_us < deadline ? s->next_probe_us : deadline;
+        } else {
+            uint64_t dead_at = s->last_rx_us + (uint64_t)P2P_DEAD_MS * 1000u;
+            if (now >= dead_at) {
+                p2p_engine_close(eng, s, "timeout");
+                s = next;
+                continue;
+            }
+            uint64_t ka_at = s->last_tx_us + (uint64_t)P2P_KEEPALIVE_MS * 1000u;
+            if (now >= ka_at) {
+                send_probe(eng, s, "PROBE", s->nonce);
+                ka_at = s->last_tx_us + (uint64_t)P2P_KEEPALIVE_MS * 1000u;
+            }
+            due = ka_at < dead_at ? ka_at : dead_at;
+            if (eng->ops && eng->ops->on_timer) {
+                uint64_t t = eng->ops->on_timer(eng, s, now);
+                if (t < due)
+                    due = t;
+            }
+        }
+        if (due < wake)
+            wake = due;
+        s = next;
+    }
+    return wake;
+}
+
+uint64_t p2p_engine_timers(struct p2p_engine *eng)
+{
+    return run_timers(eng);
+}
+
+static void arm_timer(struct p2p_engine *eng, uint64_t wake)
+{
+    struct itimerspec its = {0};
+    if (wake != UINT64_MAX) {
+        if (wake == 0)
+            wake = 1; /* 0は解除の意味になるため */
+        its.it_value.tv_sec = (time_t)(wake / 1000000u);
+        its.it_value.tv_nsec = (long)(wake % 1000000u) * 1000;
+    }
+    timerfd_settime(eng->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int p2p_engine_run(struct p2p_engine *eng)
+{
+    eng->running = 1;
+    arm_timer(eng, run_timers(eng));
+
+    while (eng->running) {
+        struct epoll_event evs[16];
+        int n = epoll_wait(eng->epfd, evs, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (int i = 0; i < n && eng->running; i++) {
+            int fd = evs[i].data.fd;
+            if (fd == eng->sock) {
+                read_socket(eng);
+            } else if (fd == eng->probe_sock) {
+                read_probe_socket(eng);
+            } else if (fd == eng->tfd) {
+                uint64_t expirations;
+                if (read(eng->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    return -1;
+            } else if (eng->ops && eng->ops->on_fd) {
+                eng->ops->on_fd(eng, fd);
+            }
+        }
+        /* 受信や送信で期限が動くので、毎回最も近い期限で張り直す */
+        arm_timer(eng, run_timers(eng));
+    }
+    return 0;
+}
+
+void p2p_engine_stop(struct p2p_engine *eng)
+{
+    eng->running = 0;
+}
@@ -0,0 +1,172 @@
+#ifndef TINY_P2P_SESSION_H
+#define TINY_P2P_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include "mm_pool.h"
+#include "tiny_config.h"
+#include "tiny_transport.h"
+
+#define P2P_PUNCH_TIMEOUT_MS      5000  /* この時間内に疎通しなければ失敗 */
+#define P2P_PUNCH_INTERVAL_MIN_MS 10    /* 最初のプローブ間隔 */
+#define P2P_PUNCH_INTERVAL_MAX_MS 250   /* プローブ間隔の上限（倍々で伸ばす） */
+#define P2P_DEAD_MS               20000 /* この時間受信が無ければ切断とみなす */
+#define P2P_SERVER_GRACE_MS       10000 /* サーバが予告したKEEPALIVE間隔に足す猶予 */
+#define P2P_REREGISTER_MS         5000  /* 再登録しても反応が無いときの再送間隔 */
+#define P2P_SENDMMSG_BATCH        64    /* sendmmsg 1回で送る最大数 */
+#define P2P_BUF_SIZE              1500
+#define P2P_GRO_BUF_SIZE          65536 /* GRO/GSOでまとめて扱う最大サイズ */
+
+enum p2p_state {
+    P2P_PUNCHING,    /* プローブ送信中 */
+    P2P_ESTABLISHED, /* 相手から正しいPROBE/PROBE_ACKを受信済み */
+};
+
+/* 相手peerごとのセッション（プール上に配置） */
+struct p2p_session {
+    uint32_t peer_id;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    enum p2p_state state;
+    uint32_t nonce;              /* こちらのPROBEに載せる値。ACKで返ってくる */
+    uint64_t start_us;           /* punch開始時刻 */
+    uint64_t established_us;     /* 確立時刻 */
+    uint64_t next_probe_us;      /* punch中: 次のPROBE送信時刻 */
+    uint64_t probe_interval_us;  /* punch中: 現在のPROBE間隔 */
+    unsigned probes;             /* punch中に送ったPROBE数 */
+    uint32_t trace;              /* トレースID (tiny_trace.h)。0なら接続の他の段階と結び付けない */
+    int got_data;                /* 確立後にデータを受信した（トレースの first_data 用） */
+    uint64_t last_rx_us;
+    uint64_t last_tx_us;
+    void *user;                  /* 上位レイヤ用 */
+    struct p2p_session *hnext;   /* 同じハッシュバケットの次 */
+    struct p2p_session *next;    /* 全セッションの双方向リスト */
+    struct p2p_session *prev;
+};
+
+MM_POOL_DEFINE(p2p_session_pool, struct p2p_session)
+
+struct p2p_engine;
+
+/* エンジンからの通知。不要なものはNULLでよい */
+struct p2p_engine_ops {
+    void (*on_established)(struct p2p_engine *eng, struct p2p_session *s);
+    void (*on_data)(struct p2p_engine *eng, struct p2p_session *s, const char *buf, size_t len);
+    void (*on_closed)(struct p2p_engine *eng, struct p2p_session *s, const char *reason);
+    void (*on_fd)(struct p2p_engine *eng, int fd); /* p2p_engine_watch_fd で登録したfdが読める */
+    /* 確立済みセッションごとのタイマ処理。次に呼ぶべき時刻(無ければUINT64_MAX)を返す */
+    uint64_t (*on_timer)(struct p2p_engine *eng, struct p2p_session *s, uint64_t now);
+};
+
+/*
+ * 1つのUDPソケットで複数peerを扱うセッションエンジン。
+ * epoll でソケットと利用者fdを待ち、timerfd に最も近いセッションの期限を設定して
+ * punch のPROBE再送・keep-alive・生存確認を行う。
+ */
+struct p2p_engine {
+    int sock;
+    int epfd;
+    int tfd;
+    uint32_t self_id;
+    int family;                      /* ソケットのファミリ。AF_INET6 ならIPv4の相手も ::ffff: の形で扱う */
+    struct sockaddr_storage server;  /* このアドレスからのPUNCH通知を受け付ける */
+    socklen_t serverlen;
+    struct sockaddr_storage server_alt; /* もう一方のファミリのサーバアドレス（デュアルスタック。無ければ長さ0） */
+    socklen_t server_altlen;
+    uint64_t server_watch_us;        /* この時刻までにサーバから何も来なければ再登録する (0は無効) */
+    uint32_t server_expect_ms;       /* サーバが最後に予告したKEEPALIVE間隔 */
+    int probe_sock;                  /* サーバが寿命の探索に使う別マッピングのソケット（無ければ-1） */
+    uint64_t probe_watch_us;         /* この時刻までに探索用のKEEPALIVEが来なければ閉じる */
+    struct p2p_session_pool pool;    /* セッション用メモリプール */
+    struct p2p_session *buckets[P2P_HASH_BUCKETS];
+    struct p2p_session *head;
+    size_t count;
+    size_t capacity;
+    int running;
+    int gro;                         /* UDP_GRO が有効 */
+    int gso;                         /* UDP_SEGMENT が使える（失敗したら0にする） */
+    const struct tiny_transport *tp; /* NULLなら sock を直接使う */
+    int quiet;                       /* 1なら通知などのログを出さない */
+    const struct p2p_engine_ops *ops;
+    void *user;
+};
+
+int p2p_engine_init(struct p2p_engine *eng, int sock, uint32_t self_id,
+                    const struct sockaddr *server, socklen_t serverlen,
+                    size_t capacity, const struct p2p_engine_ops *ops, void *user);
+/*
+ * ソケットを持たず tp で送受信するエンジン（仮想網用）。epoll/timerfd は使わないので
+ * 受信は p2p_engine_input で渡し、タイマは p2p_engine_timers を呼び出し側が駆動する。
+ */
+int p2p_engine_init_transport(struct p2p_engine *eng, const struct tiny_transport *tp, uint32_t self_id,
+                              const struct sockaddr *server, socklen_t serverlen,
+                              size_t capacity, const struct p2p_engine_ops *ops, void *user);
+/* もう一方のファミリのサーバアドレスを設定する。再登録は両方へ送り、どちらからの通知も受け付ける */
+void p2p_engine_set_server_alt(struct p2p_engine *eng, const struct sockaddr *server, socklen_t serverlen);
+void p2p_engine_dispose(struct p2p_engine *eng);
+int p2p_engine_watch_fd(struct p2p_engine *eng, int fd);
+
+/* peer_idへのpunchを開始する。既にセッションがあればそれを返す（punch中でアドレスが違えば付け替える） */
+struct p2p_session *p2p_engine_connect(struct p2p_engine *eng, uint32_t peer_id,
+                                       const struct sockaddr *addr, socklen_t addrlen);
+void p2p_engine_close(struct p2p_engine *eng, struct p2p_session *s, const char *reason);
+struct p2p_session *p2p_engine_find(struct p2p_engine *eng, const struct sockaddr *addr, socklen_t addrlen);
+struct p2p_session *p2p_engine_find_id(struct p2p_engine *eng, uint32_t peer_id);
+
+/* ソケット外から得たパケット（register待ちの間に退避したもの等）を処理させる */
+void p2p_engine_input(struct p2p_engine *eng, const char *buf, size_t len,
+                      const struct sockaddr *src, socklen_t srclen);
+
+int p2p_engine_send(struct p2p_engine *eng, struct p2p_session *s, const void *buf, size_t len);
+/*
+ * seg_size ごとに区切られた連続データグラム列を UDP_SEGMENT(GSO) で1回の sendmsg にまとめて送る。
+ * 最後の1個だけは seg_size より短くてよい。GSO非対応なら1個ずつ送る
+ */
+int p2p_engine_send_gso(struct p2p_engine *eng, struct p2p_session *s,
+                        const void *buf, size_t len, uint16_t seg_size);
+/* 確立済みの全セッションへ sendmmsg でまとめて送る。送れた数を返す */
+size_t p2p_engine_broadcast(struct p2p_engine *eng, const void *buf, size_t len);
+
+/* p2p_engine_stop が呼ばれるまでイベントを処理する。エラーで-1 */
+int p2p_engine_run(struct p2p_engine *eng);
+/* 期限の来たタイマ処理を行い、次に呼ぶべき時刻(無ければUINT64_MAX)を返す */
+uint64_t p2p_engine_timers(struct p2p_engine *eng);
+void p2p_engine_stop(struct p2p_engine *eng);
+
+/* ---------- 共通ユーティリティ ---------- */
+uint64_t p2p_now_us(void);
+void p2p_rand_seed(uint32_t seed);
+uint32_t p2p_rand(void);
+/*
+ * 数値表記のIPとポートから、family のソケットで使えるアドレスを作る。
+ * AF_INET6 ならIPv4は ::ffff:a.b.c.d になり、AF_INET でIPv6しか無ければ-1
+ */
+int p2p_make_addr(const char *ip, unsigned port, int family, struct sockaddr_storage *out, socklen_t *outlen);
+/* in を family のソケットで使える形にする（IPv4 ⇔ IPv4-mapped IPv6）。表せなければ-1 */
+int p2p_addr_map(int family, const struct sockaddr *in, socklen_t inlen,
+                 struct sockaddr_storage *out, socklen_t *outlen);
+int p2p_addr_equal(const struct sockaddr *a, socklen_t alen, const struct sockaddr *b, socklen_t blen);
+
+/* ---------- PROBE (エンジンとゲートウェイで共通) ---------- */
+
+/* PROBE/PROBE_ACKなら1を返し、from/to/nonceを取り出す */
+int p2p_parse_probe(const char *buf, int *is_ack, uint32_t *from, uint32_t *to, uint32_t *nonce);
+
+enum p2p_probe_action {
+    P2P_PROBE_IGNORE,    /* 捨てる */
+    P2P_PROBE_ACCEPT,    /* 登録済みのアドレスから: 受理する（PROBEならACKを返す） */
+    P2P_PROBE_REKEY,     /* こちらのnonceを返したACK: 送信元へ付け替えて受理する */
+    P2P_PROBE_CHALLENGE, /* punch中に未知のアドレスからPROBE: 送信元へこちらのnonceのPROBEを送るだけ */
+    P2P_PROBE_ANSWER,    /* 確立済みに未知のアドレスからPROBE: 登録済みのアドレスへACKを返すだけ */
+};
+
+/*
+ * 既存セッションに届いたPROBE/PROBE_ACKの扱いを決める。known_addr は送信元がセッションのアドレスと一致するか、
+ * established はセッションが確立済みか。
+ * アドレスの付け替えはこちらのnonceを返したACKでだけ行う（nonceを知らない第三者に乗っ取らせない）。
+ */
+enum p2p_probe_action p2p_probe_decide(int known_addr, int established, int is_ack,
+                                       uint32_t nonce, uint32_t our_nonce);
+
+#endif
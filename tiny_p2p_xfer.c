@@ -0,0 +1,249 @@
+#define _DEFAULT_SOURCE
+#include "tiny_p2p_xfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+/* パスからファイル名部分だけを取り出す（受信側でディレクトリを辿らせない） */
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* ---------- 送信 ---------- */
+
+int xfer_send_open(struct xfer_send *x, const char *path)
+{
+    memset(x, 0, sizeof(*x));
+    x->fd = open(path, O_RDONLY);
+    if (x->fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(x->fd, &st) != 0) {
+        close(x->fd);
+        return -1;
+    }
+    x->size = (uint64_t)st.st_size;
+    if (x->size > 0) {
+        void *m = mmap(NULL, (size_t)x->size, PROT_READ, MAP_PRIVATE, x->fd, 0);
+        if (m == MAP_FAILED) {
+            close(x->fd);
+            return -1;
+        }
+        madvise(m, (size_t)x->size, MADV_SEQUENTIAL);
+        x->map = (const unsigned char *)m;
+    }
+    snprintf(x->name, sizeof(x->name), "%s", base_name(path));
+    return 0;
+}
+
+int xfer_send_pump(struct xfer_send *x, struct rel_conn *c, uint64_t now)
+{
+    if (x->done)
+        return 1;
+
+    unsigned char msg[REL_MSS];
+    if (!x->meta_queued) {
+        size_t nlen = strlen(x->name);
+        msg[0] = XFER_META;
+        put64(msg + 1, x->size);
+        memcpy(msg + XFER_HDR, x->name, nlen);
+        if (rel_send(c, msg, XFER_HDR + nlen, now) != 0)
+            return 0;
+        x->meta_queued = 1;
+    }
+
+    /* 受信側がMETAでファイルを用意してからDATAを流す */
+    if (x->off == 0 && !rel_send_idle(c))
+        return 0;
+    if (x->start_us == 0)
+        x->start_us = now;
+
+    while (x->off < x->size && rel_send_space(c) > 0) {
+        size_t n = x->size - x->off < XFER_CHUNK ? (size_t)(x->size - x->off) : XFER_CHUNK;
+        msg[0] = XFER_DATA;
+        put64(msg + 1, x->off);
+        memcpy(msg + XFER_HDR, x->map + x->off, n);
+        if (rel_send(c, msg, XFER_HDR + n, now) != 0)
+            break;
+        x->off += n;
+    }
+
+    if (x->off >= x->size && rel_send_idle(c)) {
+        x->done = 1;
+        x->end_us = now;
+        return 1;
+    }
+    return 0;
+}
+
+void xfer_send_close(struct xfer_send *x)
+{
+    if (x->map)
+        munmap((void *)x->map, (size_t)x->size);
+    if (x->fd >= 0)
+        close(x->fd);
+    x->map = NULL;
+    x->fd = -1;
+}
+
+/* ---------- 受信 ---------- */
+
+int xfer_is_msg(const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    return len >= XFER_HDR && (p[0] == XFER_META || p[0] == XFER_DATA);
+}
+
+/* path を置くファイルシステムに size バイトと予備の空きがあるか。調べられなければ書いてみる */
+static int has_room(const char *path, uint64_t size)
+{
+    char dir[sizeof(((struct xfer_recv *)0)->path)];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        dir[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    struct statvfs vfs;
+    if (statvfs(dir, &vfs) != 0)
+        return 1;
+    uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+    return avail >= XFER_RECV_RESERVE && avail - XFER_RECV_RESERVE >= size;
+}
+
+static int recv_open(struct xfer_recv *x, const char *out_path,
+                     const unsigned char *p, size_t len, uint64_t now)
+{
+    char name[XFER_NAME_MAX + 1];
+    size_t nlen = len - XFER_HDR;
+    if (nlen > XFER_NAME_MAX)
+        nlen = XFER_NAME_MAX;
+    memcpy(name, p + XFER_HDR, nlen);
+    name[nlen] = '\0';
+
+    x->size = get64(p + 1);
+    if (out_path)
+        snprintf(x->path, sizeof(x->path), "%s", out_path);
+    else
+        snprintf(x->path, sizeof(x->path), "recv_%s", nlen ? base_name(name) : "file");
+
+    /* 相手の申告したサイズをそのまま ftruncate しない */
+    if (x->size > XFER_RECV_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (!has_room(x->path, x->size)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    x->fd = open(x->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (x->fd < 0)
+        return -1;
+    if (x->size > 0) {
+        if (ftruncate(x->fd, (off_t)x->size) != 0)
+            goto fail;
+        void *m = mmap(NULL, (size_t)x->size, PROT_READ | PROT_WRITE, MAP_SHARED, x->fd, 0);
+        if (m == MAP_FAILED)
+            goto fail;
+        x->map = (unsigned char *)m;
+    }
+    x->active = 1;
+    x->start_us = now;
+    return 0;
+
+fail:
+    close(x->fd);
+    x->fd = -1;
+    return -1;
+}
+
+int xfer_recv_input(struct xfer_recv *x, const char *out_path,
+                    const void *buf, size_t len, uint64_t now)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    if (p[0] == XFER_META) {
+        if (x->active)
+            xfer_recv_close(x);
+        memset(x, 0, sizeof(*x));
+        x->fd = -1;
+        if (recv_open(x, out_path, p, len, now) != 0) {
+            x->refused = 1;
+            return -1;
+        }
+    } else {
+        if (!x->active)
+            return x->refused ? 0 : -1;
+        uint64_t off = get64(p + 1);
+        size_t n = len - XFER_HDR;
+        if (off > x->size || n > x->size - off)
+            return -1;
+        if (x->first_us == 0)
+            x->first_us = now;
+        memcpy(x->map + off, p + XFER_HDR, n);
+        x->received += n;
+    }
+
+    if (!x->done && x->received >= x->size) {
+        x->done = 1;
+        x->end_us = now;
+        return 1;
+    }
+    return 0;
+}
+
+void xfer_recv_close(struct xfer_recv *x)
+{
+    if (x->map) {
+        msync(x->map, (size_t)x->size, MS_ASYNC);
+        munmap(x->map, (size_t)x->size);
+    }
+    if (x->fd >= 0)
+        close(x->fd);
+    x->map = NULL;
+    x->fd = -1;
+    x->active = 0;
+}
+
+void xfer_report(const char *what, const char *name, uint64_t bytes, uint64_t elapsed_us,
+                 const struct rel_stats *st)
+{
+    double sec = (double)elapsed_us / 1e6;
+    double mbps = sec > 0 ? (double)bytes / 1e6 / sec : 0.0;
+    printf("xfer %s '%s': %llu bytes in %.3f s = %.1f MB/s (%.1f Mbit/s)\n",
+           what, name, (unsigned long long)bytes, sec, mbps, mbps * 8);
+    if (st)
+        printf("  packets=%llu retx=%llu (%.2f%%) srtt=%.3f ms rto=%.1f ms cwnd=%.1f\n",
+               (unsigned long long)st->data_sent, (unsigned long long)st->retransmits,
+               st->data_sent ? 100.0 * (double)st->retransmits / (double)st->data_sent : 0.0,
+               (double)st->srtt_us / 1000.0, (double)st->rto_us / 1000.0, st->cwnd);
+}
@@ -0,0 +1,74 @@
+#ifndef TINY_P2P_XFER_H
+#define TINY_P2P_XFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tiny_p2p_rel.h"
+
+/*
+ * 信頼性レイヤの上で1ファイルを送るための転送モード。
+ * 送信側はファイルを mmap してチャンクを送信キューへ積み、受信側は先に届くMETAで
+ * 出力ファイルを ftruncate + mmap し、DATAを到着順のまま offset の位置へ書き込む。
+ *
+ * relのpayload(先頭1バイトが種別。チャット行とは先頭バイトで区別する):
+ *   META: [0]=XFER_META [1..8]=ファイルサイズ [9..]=ファイル名(終端なし)
+ *   DATA: [0]=XFER_DATA [1..8]=offset        [9..]=データ
+ */
+
+#define XFER_META     0x01
+#define XFER_DATA     0x02
+#define XFER_HDR      9
+#define XFER_CHUNK    (REL_MSS - XFER_HDR)
+#define XFER_NAME_MAX 255
+#ifndef XFER_RECV_MAX
+#define XFER_RECV_MAX     (4ull << 30)  /* 受け付けるファイルサイズの上限 */
+#endif
+#ifndef XFER_RECV_RESERVE
+#define XFER_RECV_RESERVE (64ull << 20) /* 受信後も保存先に残す空き容量 */
+#endif
+
+struct xfer_send {
+    int fd;
+    const unsigned char *map;
+    uint64_t size;
+    uint64_t off;          /* 次に積むoffset */
+    char name[XFER_NAME_MAX + 1];
+    int meta_queued;
+    int done;
+    uint64_t start_us;     /* 最初のDATAを積んだ時刻 */
+    uint64_t end_us;       /* 全てACKされた時刻 */
+};
+
+struct xfer_recv {
+    int fd;
+    unsigned char *map;
+    uint64_t size;
+    uint64_t received;
+    char path[XFER_NAME_MAX + 16];
+    int active;
+    int refused;           /* METAを断った。続くDATAは黙って捨てる */
+    int done;
+    uint64_t start_us;     /* METAを受けた時刻 */
+    uint64_t first_us;     /* 最初のDATAを受けた時刻 */
+    uint64_t end_us;
+};
+
+int xfer_send_open(struct xfer_send *x, const char *path);
+/* 送信キューに積めるだけ積む。全てACKされたら1 */
+int xfer_send_pump(struct xfer_send *x, struct rel_conn *c, uint64_t now);
+void xfer_send_close(struct xfer_send *x);
+
+/* relのpayloadが転送用メッセージか */
+int xfer_is_msg(const void *buf, size_t len);
+/*
+ * 転送用メッセージを処理する。out_path がNULLならMETAのファイル名に "recv_" を付けて保存。
+ * 受信完了で1、継続中は0、エラーで-1。METAのサイズが XFER_RECV_MAX を超える・保存先の空きが
+ * 足りない場合はファイルを作らずに-1 (errno = EFBIG / ENOSPC) を返し、その転送のDATAは捨てる
+ */
+int xfer_recv_input(struct xfer_recv *x, const char *out_path, const void *buf, size_t len, uint64_t now);
+void xfer_recv_close(struct xfer_recv *x);
+
+void xfer_report(const char *what, const char *name, uint64_t bytes, uint64_t elapsed_us,
+                 const struct rel_stats *st);
+
+#endif
@@ -15,77 +15,78 @@ static void safe_copy(char *dst, size_t dst_size, const char *src) {
     dst[dst_size - 1] = '\0';
 }
 
-/* プールからノードを取得（確保失敗ならNULL） */
-static struct client_node *alloc_node(struct nts_ctx *ctx) {
-    return (struct client_node *)mm_pool_alloc(&ctx->pool);
-}
+/* 索引のキー: IDを NTS_ID_MAX 文字で切り、残りを0で埋めた固定長 */
+typedef char nts_id_key[NTS_ID_MAX + 1];
 
-/* ノードをプールに返却して再利用可能にする */
-static void free_node(struct nts_ctx *ctx, struct client_node *node) {
-    mm_pool_free(&ctx->pool, node);
+static void make_key(nts_id_key key, const char *id) {
+    safe_copy(key, sizeof(nts_id_key), id);
 }
 
-/* コンテキスト初期化: 指定容量でメモリプールを構築 */
+/* コンテキスト初期化: 指定容量でメモリプールとID索引を構築 */
 int nts_init(struct nts_ctx *ctx, size_t capacity) {
     if (!ctx || capacity == 0) return -1;
     memset(ctx, 0, sizeof(*ctx));
-    if (mm_pool_init(&ctx->pool, sizeof(struct client_node), capacity) != 0) {
+    if (nts_node_pool_init(&ctx->pool, capacity) != 0) {
+        return -1;
+    }
+    if (nts_id_index_init(&ctx->index) != 0) {
+        nts_node_pool_destroy(&ctx->pool);
         return -1;
     }
     ctx->capacity = capacity;
-    ctx->head = NULL;
     ctx->count = 0;
     if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
-        mm_pool_destroy(&ctx->pool);
+        nts_id_index_destroy(&ctx->index);
+        nts_node_pool_destroy(&ctx->pool);
         return -1;
     }
     return 0;
 }
 
-/* 全ノードを解放し、メモリプールを破棄 */
+/* ノードはすべてプール上にあるので、プールと索引を捨てれば解放される */
 void nts_dispose(struct nts_ctx *ctx) {
     if (!ctx) return;
     pthread_mutex_lock(&ctx->lock);
-    struct client_node *cur = ctx->head;
-    while (cur) {
-        struct client_node *next = cur->next;
-        free_node(ctx, cur);
-        cur = next;
-    }
-    ctx->head = NULL;
     ctx->count = 0;
     pthread_mutex_unlock(&ctx->lock);
     pthread_mutex_destroy(&ctx->lock);
-    mm_pool_destroy(&ctx->pool);
+    nts_id_index_destroy(&ctx->index);
+    nts_node_pool_destroy(&ctx->pool);
 }
 
-/* IDでノードを検索し、必要なら前ノードも返す（線形探索） */
-static struct client_node *find_node(struct nts_ctx *ctx, const char *id, struct client_node **prev_out) {
-    struct client_node *prev = NULL;
-    struct client_node *cur = ctx->head;
-    while (cur) {
-        if (strncmp(cur->info.id, id, NTS_ID_MAX) == 0) {
-            if (prev_out) *prev_out = prev;
-            return cur;
-        }
-        prev = cur;
-        cur = cur->next;
-    }
-    if (prev_out) *prev_out = NULL;
-    return NULL;
+/* 追加/更新: 既存IDなら上書き、空きがあれば新規挿入 */
+int nts_add_client(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr) {
+    return nts_upsert_client(ctx, id, addr, nts_ka_now_ms());
 }
 
-/* 追加/更新: 既存IDなら上書き、空きがあれば新規挿入 */
-int nts_add_client(struct nts_ctx *ctx, const char *id, const char *ip, uint16_t port) {
-    if (!ctx || !id || !ip) return -1;
+/* addr と同じファミリのアドレス欄 */
+static struct nts_addr *family_slot(struct client_info *info, const struct nts_addr *addr) {
+    return nts_addr_is_v4(addr) ? &info->v4 : &info->v6;
+}
 
+/*
+ * 追加/更新の本体。IDごとにIPv4とIPv6のアドレスを別々に持ち、登録が届いたファミリの欄だけを書き換える。
+ * keep-alive は IPv4 があればそちら（NATのマッピング）を、無ければIPv6を維持するので、
+ * そのアドレスが変わったときだけ推定へ伝える。
+ */
+int nts_upsert_client(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, uint64_t now_ms) {
+    if (!ctx || !id || !addr) return -1;
+
+    nts_id_key key;
+    make_key(key, id);
     pthread_mutex_lock(&ctx->lock);
 
-    struct client_node *prev = NULL;
-    struct client_node *existing = find_node(ctx, id, &prev);
+    struct client_node *existing = nts_id_index_find(&ctx->index, key);
     if (existing) {
-        safe_copy(existing->info.ip, sizeof(existing->info.ip), ip);
-        existing->info.port = port;
+        struct nts_addr *slot = family_slot(&existing->info, addr);
+        if (!nts_addr_equal(slot, addr)) {
+            *slot = *addr;
+            existing->ver = ++ctx->version;
+            if (nts_client_ka_addr(&existing->info) == slot)
+                nts_ka_on_rebind(&existing->info.ka, addr, now_ms, &ctx->ka_stats);
+        } else if (nts_client_ka_addr(&existing->info) == slot) {
+            nts_ka_on_seen(&existing->info.ka, now_ms);
+        }
         pthread_mutex_unlock(&ctx->lock);
         return 0;
     }
@@ -95,50 +96,116 @@ int nts_add_client(struct nts_ctx *ctx, const char *id, const char *ip, uint16_t
         return -1;
     }
 
-    struct client_node *node = alloc_node(ctx);
+    struct client_node *node = nts_node_pool_alloc(&ctx->pool);
     if (!node) {
         pthread_mutex_unlock(&ctx->lock);
         return -1;
     }
 
-    safe_copy(node->info.id, sizeof(node->info.id), id);
-    safe_copy(node->info.ip, sizeof(node->info.ip), ip);
-    node->info.port = port;
+    memcpy(node->info.id, key, sizeof(node->info.id));
+    *family_slot(&node->info, addr) = *addr;
+    nts_ka_init(&node->info.ka, addr, now_ms);
+    node->ver = ++ctx->version;
+    node->live = 1;
 
-    node->next = ctx->head;
-    ctx->head = node;
+    nts_id_index_insert(&ctx->index, node);
     ctx->count += 1;
     pthread_mutex_unlock(&ctx->lock);
     return 0;
 }
 
-/* 削除: リストから外しプールに返却 */
+/* 同じマッピングからの通信を keep-alive推定へ反映する（もう一方のファミリからなら記録だけ確かめる） */
+int nts_client_seen(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, int is_ack, uint64_t now_ms) {
+    if (!ctx || !id || !addr) return -1;
+    nts_id_key key;
+    make_key(key, id);
+    pthread_mutex_lock(&ctx->lock);
+    struct client_node *node = nts_id_index_find(&ctx->index, key);
+    if (node && is_ack && nts_addr_equal(&node->info.ka.probe_addr, addr)) {
+        nts_ka_on_probe_ack(&node->info.ka, now_ms, &ctx->ka_stats);
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    if (!node || !nts_addr_equal(family_slot(&node->info, addr), addr)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    if (nts_addr_equal(nts_client_ka_addr(&node->info), addr)) {
+        if (is_ack) {
+            nts_ka_on_ack(&node->info.ka, now_ms, &ctx->ka_stats);
+        } else {
+            nts_ka_on_seen(&node->info.ka, now_ms);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+int nts_client_probe_open(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, uint64_t now_ms,
+                          uint32_t *expect_ms) {
+    if (!ctx || !id || !addr) return -1;
+    nts_id_key key;
+    make_key(key, id);
+    pthread_mutex_lock(&ctx->lock);
+    struct client_node *node = nts_id_index_find(&ctx->index, key);
+    const struct nts_addr *ka_addr = node ? nts_client_ka_addr(&node->info) : NULL;
+    /*
+     * 主マッピングと同じNAT(同じ外側IP)の別ポートでなければ寿命の代わりにならない。
+     * 別のIPを受け付けると、送信元を偽った KAPROBE で任意の宛先へKEEPALIVEを送らせられる
+     */
+    int ok = ka_addr && memcmp(ka_addr->ip, addr->ip, sizeof(addr->ip)) == 0 && ka_addr->port != addr->port;
+    if (ok) {
+        nts_ka_on_probe_open(&node->info.ka, addr, now_ms, &ctx->ka_stats);
+        ok = nts_addr_equal(&node->info.ka.probe_addr, addr);
+        if (ok && expect_ms) *expect_ms = nts_ka_probe_expect_ms(&node->info.ka);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return ok ? 0 : -1;
+}
+
+/* 削除: 索引から外しプールに返却 */
 int nts_remove_client(struct nts_ctx *ctx, const char *id) {
     if (!ctx || !id) return -1;
+    nts_id_key key;
+    make_key(key, id);
     pthread_mutex_lock(&ctx->lock);
-    struct client_node *prev = NULL;
-    struct client_node *node = find_node(ctx, id, &prev);
+    struct client_node *node = nts_id_index_find(&ctx->index, key);
     if (!node) {
         pthread_mutex_unlock(&ctx->lock);
         return -1;
     }
 
-    if (prev) {
-        prev->next = node->next;
-    } else {
-        ctx->head = node->next;
-    }
-    free_node(ctx, node);
+    nts_id_index_remove(&ctx->index, node);
+    node->live = 0;
+    ctx->version++;
+    nts_node_pool_free(&ctx->pool, node);
     ctx->count -= 1;
     pthread_mutex_unlock(&ctx->lock);
     return 0;
 }
 
 /* 検索: ヒット時はクライアント情報へのポインタを返す */
+/* ロック下で両ファミリのアドレスを写し出す。未登録なら-1 */
+int nts_get_client_addrs(struct nts_ctx *ctx, const char *id, struct nts_addr *v4, struct nts_addr *v6) {
+    if (!ctx || !id) return -1;
+    nts_id_key key;
+    make_key(key, id);
+    pthread_mutex_lock(&ctx->lock);
+    struct client_node *node = nts_id_index_find(&ctx->index, key);
+    if (node) {
+        if (v4) *v4 = node->info.v4;
+        if (v6) *v6 = node->info.v6;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return node ? 0 : -1;
+}
+
 struct client_info *nts_find_client(struct nts_ctx *ctx, const char *id) {
     if (!ctx || !id) return NULL;
+    nts_id_key key;
+    make_key(key, id);
     pthread_mutex_lock(&ctx->lock);
-    struct client_node *node = find_node(ctx, id, NULL);
+    struct client_node *node = nts_id_index_find(&ctx->index, key);
     struct client_info *res = node ? &node->info : NULL;
     pthread_mutex_unlock(&ctx->lock);
     return res;
@@ -152,3 +219,26 @@ size_t nts_count(const struct nts_ctx *ctx) {
     pthread_mutex_unlock((pthread_mutex_t *)&ctx->lock);
     return c;
 }
+
+void nts_iter_init(struct nts_iter *it, size_t slot, uint64_t since) {
+    it->slot = slot;
+    it->since = since;
+    it->version = 0;
+}
+
+/* プールの配列をスロット順に見る（リストをたどらないので途中から再開できる） */
+int nts_iter_step(struct nts_ctx *ctx, struct nts_iter *it, nts_visit_fn fn, void *arg) {
+    if (!ctx || !it || !fn) return 0;
+    pthread_mutex_lock(&ctx->lock);
+    size_t end = it->slot + NTS_ITER_SLOTS;
+    if (end > ctx->pool.capacity) end = ctx->pool.capacity;
+    for (; it->slot < end; it->slot++) {
+        struct client_node *node = nts_node_pool_at(&ctx->pool, it->slot);
+        if (!node->live || node->ver <= it->since) continue;
+        if (!fn(node, arg)) break;
+    }
+    it->version = ctx->version;
+    int more = it->slot < ctx->pool.capacity;
+    pthread_mutex_unlock(&ctx->lock);
+    return more;
+}
@@ -5,37 +5,96 @@
 #include <stddef.h>
 #include <pthread.h>
 #include "mm_pool.h"
+#include "tiny_config.h"
+#include "tiny_htable.h"
+#include "tiny_keepalive.h"
 
-#define NTS_ID_MAX   63
-#define NTS_IP_MAX   63
+#define NTS_ITER_SLOTS 256 /* nts_iter_step が1回のロックで見るスロット数の上限 */
 
-/* クライアント情報: IDとグローバルIP/ポートを保持 */
+/*
+ * クライアント情報: IDと、ファミリごとのグローバルIP/ポートを保持。
+ * デュアルスタックのクライアントはIPv4とIPv6の両方のサーバアドレスへ登録するので、両方の欄が埋まる。
+ */
 struct client_info {
-    char id[NTS_ID_MAX + 1];
-    char ip[NTS_IP_MAX + 1];
-    uint16_t port; /* host byte order */
+    char id[NTS_ID_MAX + 1];    /* 末尾は0で埋める（索引はこの幅全体をキーにする） */
+    struct nts_addr v4;     /* IPv4で登録した外向きアドレス（port 0 は無し） */
+    struct nts_addr v6;     /* IPv6で登録したアドレス（同上） */
+    struct nts_ka_state ka; /* keep-alive間隔の推定状態（nts_client_ka_addr のアドレスについて） */
 };
 
-/* 単方向リストのノード（プール上に配置） */
+/* keep-alive を送るアドレス: IPv4があればそのNATマッピング、無ければIPv6 */
+static inline const struct nts_addr *nts_client_ka_addr(const struct client_info *c) {
+    return nts_addr_is_set(&c->v4) ? &c->v4 : &c->v6;
+}
+
+/* 表のノード（プール上に配置） */
 struct client_node {
     struct client_info info;
-    struct client_node *next;
+    struct client_node *hnext;    /* 同じバケットの次 */
+    uint64_t ver;                 /* 最後に追加/アドレス変更された時の ctx->version */
+    uint8_t live;                 /* 使用中（空きスロットは0。スロット順の走査で見分ける） */
 };
 
+/* ノード用のプールとID索引（要素の大きさ・キーの幅・バケット数は tiny_config.h で決まる） */
+MM_POOL_DEFINE(nts_node_pool, struct client_node)
+NTS_HTABLE_DEFINE(nts_id_index, struct client_node, info.id, hnext, NTS_TABLE_BUCKETS)
+
 /* サーバ側のクライアント管理コンテキスト */
 struct nts_ctx {
-    struct mm_pool pool;          /* ノード用メモリプール */
-    struct client_node *head;     /* 先頭ノード */
+    struct nts_node_pool pool;    /* ノード用メモリプール */
+    struct nts_id_index index;    /* ID → ノード */
     size_t capacity;              /* 最大クライアント数 */
     size_t count;                 /* 現在の登録数 */
     pthread_mutex_t lock;         /* スレッドセーフ用ロック */
+    struct nts_ka_stats ka_stats; /* keep-alive集計（lock下で更新） */
+    uint64_t version;             /* 追加・アドレス変更・削除のたびに進める */
+};
+
+/*
+ * テーブルを少しずつ走査するカーソル。ノードはプールの配列上で動かないので、
+ * 位置はスロット番号で表し、1回の nts_iter_step では最大 NTS_ITER_SLOTS スロットだけ
+ * ロックを持って見る（登録・問い合わせを長く止めない）。
+ * 走査の間ずっと登録されていたIDはちょうど1回ずつ返る。途中で追加/削除されたIDは返るとは限らない。
+ * since を指定すると ver がそれより新しいノードだけを返す（前回の version からの差分）。
+ */
+struct nts_iter {
+    size_t slot;                  /* 次に見るスロット */
+    uint64_t since;
+    uint64_t version;             /* 最後の nts_iter_step 時点の ctx->version */
 };
 
+/* ロック下で呼ばれる。0を返すとそのノードの手前で止まり、次回はそのノードから続ける */
+typedef int (*nts_visit_fn)(struct client_node *node, void *arg);
+
 int nts_init(struct nts_ctx *ctx, size_t capacity);
 void nts_dispose(struct nts_ctx *ctx);
-int nts_add_client(struct nts_ctx *ctx, const char *id, const char *ip, uint16_t port);
+/* id の addr と同じファミリの欄を addr にする（無ければ追加）。満杯で-1 */
+int nts_add_client(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr);
+/* nts_add_client と同じだが、keep-alive推定に使う時刻を指定する */
+int nts_upsert_client(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, uint64_t now_ms);
+/*
+ * idが addr から通信してきたことを記録する。is_ack なら KEEPALIVE_ACK として扱う
+ * （探索用マッピングから届いたACKはそちらの応答として扱う）。未登録/不一致で-1
+ */
+int nts_client_seen(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, int is_ack, uint64_t now_ms);
+/*
+ * idが addr に寿命の探索用マッピングを作った ("KAPROBE")。*expect_ms に次の探索までの最大の間隔を返す。
+ * 未登録/主マッピングと別IP・同じポート/探索中でなければ-1
+ */
+int nts_client_probe_open(struct nts_ctx *ctx, const char *id, const struct nts_addr *addr, uint64_t now_ms,
+                          uint32_t *expect_ms);
 int nts_remove_client(struct nts_ctx *ctx, const char *id);
+/*
+ * 返したポインタはロックの外で読むことになり、別スレッドの登録が書き換え途中のアドレスを見うる。
+ * 応答に使うアドレスは nts_get_client_addrs でロック下の写しを取ること
+ */
 struct client_info *nts_find_client(struct nts_ctx *ctx, const char *id);
+/* id の IPv4/IPv6 のアドレスをロック下で写す（NULLの欄は写さない）。未登録なら-1 */
+int nts_get_client_addrs(struct nts_ctx *ctx, const char *id, struct nts_addr *v4, struct nts_addr *v6);
 size_t nts_count(const struct nts_ctx *ctx);
 
+void nts_iter_init(struct nts_iter *it, size_t slot, uint64_t since);
+/* 続きのスロットを見て生きているノードごとに fn を呼ぶ。まだ続きがあれば1、末尾まで見たら0 */
+int nts_iter_step(struct nts_ctx *ctx, struct nts_iter *it, nts_visit_fn fn, void *arg);
+
 #endif
@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200112L
+#include "tiny_query_cache.h"
+
+#include <string.h>
+
+/* FNV-1a でキーを混ぜてスロットを決める */
+static size_t entry_slot(uint32_t req_id, uint32_t target_id, const struct nts_addr *from) {
+    uint32_t h = nts_addr_hash(from);
+    const uint32_t words[2] = {req_id, target_id};
+    for (size_t i = 0; i < 2; i++) {
+        for (int b = 0; b < 4; b++) {
+            h ^= (words[i] >> (b * 8)) & 0xffu;
+            h *= 16777619u;
+        }
+    }
+    return h % NTS_QC_SLOTS;
+}
+
+int nts_qc_init(struct nts_qcache *qc) {
+    if (!qc) return -1;
+    memset(qc, 0, sizeof(*qc));
+    if (pthread_mutex_init(&qc->lock, NULL) != 0) return -1;
+    return 0;
+}
+
+void nts_qc_dispose(struct nts_qcache *qc) {
+    if (!qc) return;
+    pthread_mutex_destroy(&qc->lock);
+}
+
+int nts_qc_lookup(struct nts_qcache *qc, uint32_t req_id, uint32_t target_id,
+                  const struct nts_addr *from, uint64_t now_ms, char *reply, size_t cap) {
+    if (!qc || !from || !reply) return 0;
+    int len = 0;
+
+    pthread_mutex_lock(&qc->lock);
+    struct nts_qc_entry *e = &qc->q[entry_slot(req_id, target_id, from)];
+    if (e->used && e->req_id == req_id && e->target_id == target_id && nts_addr_equal(&e->addr, from) &&
+        e->gen == qc->target_gen[target_id % NTS_QC_SLOTS] &&
+        now_ms - e->at_ms < NTS_QC_WINDOW_MS && e->reply_len < cap) {
+        memcpy(reply, e->reply, e->reply_len);
+        reply[e->reply_len] = '\0';
+        len = e->reply_len;
+        qc->stats.hits++;
+    } else {
+        qc->stats.misses++;
+    }
+    pthread_mutex_unlock(&qc->lock);
+    return len;
+}
+
+void nts_qc_store(struct nts_qcache *qc, uint32_t req_id, uint32_t target_id,
+                  const struct nts_addr *from, uint64_t now_ms, const char *reply, size_t len) {
+    if (!qc || !from || !reply || len >= NTS_QC_REPLY_MAX) return;
+
+    pthread_mutex_lock(&qc->lock);
+    /* 直接写像なので衝突したら上書きする（古い方は次の問い合わせでテーブルから引き直される） */
+    struct nts_qc_entry *e = &qc->q[entry_slot(req_id, target_id, from)];
+    e->used = 1;
+    e->req_id = req_id;
+    e->target_id = target_id;
+    e->addr = *from;
+    e->gen = qc->target_gen[target_id % NTS_QC_SLOTS];
+    e->at_ms = now_ms;
+    memcpy(e->reply, reply, len);
+    e->reply_len = (uint8_t)len;
+    pthread_mutex_unlock(&qc->lock);
+}
+
+void nts_qc_invalidate_target(struct nts_qcache *qc, uint32_t target_id) {
+    if (!qc) return;
+    /* 全スロットを見ずに済むよう、世代を進めて保存済みの応答をまとめて無効にする */
+    pthread_mutex_lock(&qc->lock);
+    qc->target_gen[target_id % NTS_QC_SLOTS]++;
+    pthread_mutex_unlock(&qc->lock);
+}
+
+/* 溜まっている行を1データグラムで送る（lock下で呼ぶ） */
+static void send_batch(struct nts_qcache *qc, const struct tiny_transport *tp,
+                       struct nts_qc_notify *n, uint64_t now_ms) {
+    if (n->len > 0) {
+        tiny_tp_sendto(tp, n->sock, n->buf, n->len, (struct sockaddr *)&n->addr, n->addrlen);
+        qc->stats.notify_datagrams++;
+        n->last_sent_ms = now_ms;
+    }
+    n->len = 0;
+    n->lines = 0;
+    n->seq++;
+}
+
+/* 溜まっている行の中に line と同じ行があるか */
+static int has_line(const struct nts_qc_notify *n, const char *line, size_t len) {
+    size_t off = 0;
+    while (off < n->len) {
+        const char *p = n->buf + off;
+        const char *nl = memchr(p, '\n', n->len - off);
+        size_t l = nl ? (size_t)(nl - p) + 1 : n->len - off;
+        if (l == len && memcmp(p, line, len) == 0) return 1;
+        off += l;
+    }
+    return 0;
+}
+
+int nts_qc_notify(struct nts_qcache *qc, const struct tiny_transport *tp, int sock, uint32_t target_id,
+                  const struct sockaddr *addr, socklen_t addrlen,
+                  const char *line, size_t len, uint64_t now_ms,
+                  uint64_t *seq, unsigned *wait_ms) {
+    if (!qc || !tp || !addr || !line || len == 0 || len > NTS_QC_NOTIFY_MAX ||
+        addrlen > sizeof(struct sockaddr_storage)) return -1;
+
+    pthread_mutex_lock(&qc->lock);
+    struct nts_qc_notify *n = &qc->n[target_id % NTS_QC_NOTIFY_SLOTS];
+    if (!n->used || n->target_id != target_id) {
+        /* 別の対象が使っていたら、その分を先に送ってから譲り受ける */
+        if (n->used) send_batch(qc, tp, n, now_ms);
+        n->used = 1;
+        n->target_id = target_id;
+        n->last_sent_ms = 0;
+    }
+    /* 対象が移動していても最新の宛先へ送る */
+    memcpy(&n->addr, addr, addrlen);
+    n->addrlen = addrlen;
+    n->sock = sock;
+    qc->stats.notify_lines++;
+
+    /* しばらく送っていなければ待たずに送る（単発の問い合わせは遅らせない） */
+    if (n->len == 0 && (n->last_sent_ms == 0 || now_ms - n->last_sent_ms >= NTS_QC_NOTIFY_HOLD_MS)) {
+        tiny_tp_sendto(tp, sock, line, len, addr, addrlen);
+        qc->stats.notify_datagrams++;
+        n->last_sent_ms = now_ms;
+        pthread_mutex_unlock(&qc->lock);
+        return NTS_QC_SENT;
+    }
+
+    if (has_line(n, line, len)) {
+        qc->stats.notify_dups++;
+        pthread_mutex_unlock(&qc->lock);
+        return NTS_QC_DUP;
+    }
+
+    if (n->len + len > NTS_QC_NOTIFY_MAX) send_batch(qc, tp, n, now_ms);
+
+    int leader = n->len == 0;
+    memcpy(n->buf + n->len, line, len);
+    n->len += len;
+    n->lines++;
+    if (seq) *seq = n->seq;
+    if (wait_ms) {
+        uint64_t due = n->last_sent_ms + NTS_QC_NOTIFY_HOLD_MS;
+        *wait_ms = due > now_ms ? (unsigned)(due - now_ms) : 0;
+    }
+    pthread_mutex_unlock(&qc->lock);
+    return leader ? NTS_QC_LEADER : NTS_QC_QUEUED;
+}
+
+unsigned nts_qc_flush(struct nts_qcache *qc, const struct tiny_transport *tp,
+                      uint32_t target_id, uint64_t seq, uint64_t now_ms) {
+    if (!qc || !tp) return 0;
+    unsigned lines = 0;
+    pthread_mutex_lock(&qc->lock);
+    struct nts_qc_notify *n = &qc->n[target_id % NTS_QC_NOTIFY_SLOTS];
+    /* 満杯や追い出しで既に送られていれば何もしない */
+    if (n->used && n->target_id == target_id && n->seq == seq && n->len > 0) {
+        lines = n->lines;
+        send_batch(qc, tp, n, now_ms);
+    }
+    pthread_mutex_unlock(&qc->lock);
+    return lines;
+}
+
+void nts_qc_get_stats(struct nts_qcache *qc, struct nts_qc_stats *out) {
+    if (!qc || !out) return;
+    pthread_mutex_lock(&qc->lock);
+    *out = qc->stats;
+    pthread_mutex_unlock(&qc->lock);
+}
@@ -0,0 +1,100 @@
+#ifndef TINY_QUERY_CACHE_H
+#define TINY_QUERY_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "tiny_peer_table.h"
+#include "tiny_transport.h"
+
+/*
+ * 問い合わせ応答の短期キャッシュと PUNCH 通知のまとめ送り。
+ *
+ * 問い合わせ: (要求者ID, 対象ID, 要求者のアドレス) をキーに、直近の応答本文(txid無し)を
+ *   NTS_QC_WINDOW_MS だけ覚える。再送や連打はテーブルを引かずにこの応答を返し、PUNCHも送り直さない。
+ *   対象が登録し直したら nts_qc_invalidate_target でその対象の世代を進め、古い世代の応答は使わない。
+ * 通知: 対象ごとに最初のPUNCHは即送り、その後 NTS_QC_NOTIFY_HOLD_MS の間に来た分は
+ *   1つのデータグラムに複数行 ("PUNCH ip port id\n" の連続) でまとめて送る。
+ *   まだ送っていない同じ行が溜まっていれば重複として捨てる。
+ */
+
+#define NTS_QC_WINDOW_MS       500  /* 同じ問い合わせを重複とみなす時間 */
+#define NTS_QC_REPLY_MAX       96
+#define NTS_QC_NOTIFY_HOLD_MS  10   /* 送った直後の通知をまとめる時間 */
+#define NTS_QC_NOTIFY_MAX      1200 /* まとめた通知1データグラムの上限 */
+
+struct nts_qc_entry {
+    uint32_t req_id;
+    uint32_t target_id;
+    struct nts_addr addr;
+    uint8_t used;
+    uint8_t reply_len;
+    uint32_t gen;                 /* 保存時の対象の世代 (target_gen) */
+    uint64_t at_ms;
+    char reply[NTS_QC_REPLY_MAX]; /* "PEER ip port" / "NOTFOUND"（txidと改行は付けない） */
+};
+
+struct nts_qc_notify {
+    uint32_t target_id;
+    uint8_t used;
+    int sock;               /* 宛先のファミリのソケット */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t last_sent_ms;  /* 最後に送った時刻 */
+    uint64_t seq;           /* まとめ中のバッチ番号（送ったら進める） */
+    unsigned lines;         /* buf に溜まった行数 */
+    size_t len;
+    char buf[NTS_QC_NOTIFY_MAX];
+};
+
+struct nts_qc_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t notify_lines;     /* PUNCHを送るよう頼まれた行数 */
+    uint64_t notify_dups;      /* 重複として捨てた行数 */
+    uint64_t notify_datagrams; /* 実際に送ったデータグラム数 */
+};
+
+struct nts_qcache {
+    pthread_mutex_t lock;
+    struct nts_qc_entry q[NTS_QC_SLOTS];
+    uint32_t target_gen[NTS_QC_SLOTS]; /* 対象IDごと(直接写像)の世代。衝突しても余計に捨てるだけ */
+    struct nts_qc_notify n[NTS_QC_NOTIFY_SLOTS];
+    struct nts_qc_stats stats;
+};
+
+/* nts_qc_notify の結果 */
+enum {
+    NTS_QC_SENT,   /* すぐ送った */
+    NTS_QC_QUEUED, /* 溜めた。別の呼び出しが送る */
+    NTS_QC_LEADER, /* 溜めた。呼び出し側が待ち時間の後に nts_qc_flush を呼ぶ */
+    NTS_QC_DUP,    /* 同じ行が既に溜まっていた */
+};
+
+int nts_qc_init(struct nts_qcache *qc);
+void nts_qc_dispose(struct nts_qcache *qc);
+
+/* キャッシュにあれば応答本文を reply へ写して長さを返す。無ければ0 */
+int nts_qc_lookup(struct nts_qcache *qc, uint32_t req_id, uint32_t target_id,
+                  const struct nts_addr *from, uint64_t now_ms, char *reply, size_t cap);
+void nts_qc_store(struct nts_qcache *qc, uint32_t req_id, uint32_t target_id,
+                  const struct nts_addr *from, uint64_t now_ms, const char *reply, size_t len);
+/* 対象が登録し直した: その対象への応答を全て捨てる */
+void nts_qc_invalidate_target(struct nts_qcache *qc, uint32_t target_id);
+
+/*
+ * 対象への PUNCH 行を sock から送る/溜める。NTS_QC_LEADER が返ったら *wait_ms 待ってから
+ * nts_qc_flush(qc, tp, target_id, *seq, now) を呼ぶこと（溜めた分は最後に渡された sock で送る）。
+ */
+int nts_qc_notify(struct nts_qcache *qc, const struct tiny_transport *tp, int sock, uint32_t target_id,
+                  const struct sockaddr *addr, socklen_t addrlen,
+                  const char *line, size_t len, uint64_t now_ms,
+                  uint64_t *seq, unsigned *wait_ms);
+/* seq のバッチがまだ残っていれば送る。送った行数を返す */
+unsigned nts_qc_flush(struct nts_qcache *qc, const struct tiny_transport *tp,
+                      uint32_t target_id, uint64_t seq, uint64_t now_ms);
+
+void nts_qc_get_stats(struct nts_qcache *qc, struct nts_qc_stats *out);
+
+#endif
@@ -0,0 +1,111 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tiny_roster.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+static void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    put_u16(p, (uint16_t)(v >> 16));
+    put_u16(p + 2, (uint16_t)v);
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t)get_u16(p) << 16) | get_u16(p + 2);
+}
+
+void nts_roster_chunk_begin(struct nts_roster_chunk *c) {
+    c->len = NTS_ROSTER_HDR_LEN;
+    c->count = 0;
+}
+
+static unsigned char *put_entry(unsigned char *p, const char *id, size_t idlen, const struct nts_addr *a) {
+    *p++ = (unsigned char)idlen;
+    memcpy(p, id, idlen);
+    p += idlen;
+    if (nts_addr_is_v4(a)) {
+        *p++ = 4;
+        memcpy(p, a->ip + 12, 4);
+        p += 4;
+    } else {
+        *p++ = 6;
+        memcpy(p, a->ip, 16);
+        p += 16;
+    }
+    put_u16(p, a->port);
+    return p + 2;
+}
+
+static size_t entry_len(size_t idlen, const struct nts_addr *a) {
+    if (!nts_addr_is_set(a)) return 0;
+    return 1 + idlen + 1 + (nts_addr_is_v4(a) ? 4 : 16) + 2;
+}
+
+int nts_roster_chunk_add(struct nts_roster_chunk *c, const struct client_info *info) {
+    size_t idlen = strnlen(info->id, NTS_ID_MAX);
+    size_t need4 = entry_len(idlen, &info->v4);
+    size_t need6 = entry_len(idlen, &info->v6);
+    unsigned n = (need4 ? 1u : 0u) + (need6 ? 1u : 0u);
+    if (c->len + need4 + need6 > sizeof(c->buf) || c->count + n > UINT16_MAX) return -1;
+
+    unsigned char *p = c->buf + c->len;
+    if (need4) p = put_entry(p, info->id, idlen, &info->v4);
+    if (need6) p = put_entry(p, info->id, idlen, &info->v6);
+    c->len += need4 + need6;
+    c->count = (uint16_t)(c->count + n);
+    return 0;
+}
+
+size_t nts_roster_chunk_finish(struct nts_roster_chunk *c, uint32_t cursor, uint32_t next_cursor,
+                               uint64_t version, uint16_t seq) {
+    unsigned char *p = c->buf;
+    memcpy(p, NTS_ROSTER_MAGIC, 4);
+    put_u32(p + 4, cursor);
+    put_u32(p + 8, next_cursor);
+    put_u32(p + 12, (uint32_t)(version >> 32));
+    put_u32(p + 16, (uint32_t)version);
+    put_u16(p + 20, c->count);
+    put_u16(p + 22, seq);
+    return c->len;
+}
+
+int nts_roster_parse_hdr(const void *buf, size_t len, struct nts_roster_hdr *h) {
+    const unsigned char *p = (const unsigned char *)buf;
+    if (len < NTS_ROSTER_HDR_LEN || memcmp(p, NTS_ROSTER_MAGIC, 4) != 0) return -1;
+    h->cursor = get_u32(p + 4);
+    h->next_cursor = get_u32(p + 8);
+    h->version = ((uint64_t)get_u32(p + 12) << 32) | get_u32(p + 16);
+    h->count = get_u16(p + 20);
+    h->seq = get_u16(p + 22);
+    return 0;
+}
+
+int nts_roster_next(const void *buf, size_t len, size_t *off, struct nts_roster_item *out) {
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t o = *off;
+    if (o + 1 > len) return -1;
+    size_t idlen = p[o++];
+    if (idlen > NTS_ID_MAX || o + idlen + 1 > len) return -1;
+    memcpy(out->id, p + o, idlen);
+    out->id[idlen] = '\0';
+    o += idlen;
+    size_t alen = p[o] == 4 ? 4 : p[o] == 6 ? 16 : 0;
+    if (alen == 0) return -1;
+    out->family = alen == 4 ? AF_INET : AF_INET6;
+    o++;
+    if (o + alen + 2 > len) return -1;
+    memset(out->addr, 0, sizeof(out->addr));
+    memcpy(out->addr, p + o, alen);
+    o += alen;
+    out->port = get_u16(p + o);
+    *off = o + 2;
+    return 0;
+}
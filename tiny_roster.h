@@ -0,0 +1,67 @@
+#ifndef TINY_ROSTER_H
+#define TINY_ROSTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tiny_peer_table.h"
+
+/*
+ * 登録中のpeer一覧(ROSTER)の転送形式。
+ *
+ * 要求 (テキスト): "ROSTER <cursor> <max_chunks> [<since>]\n"
+ *   cursor は0から始め、応答の next_cursor を次の要求に渡す。since を付けると
+ *   その version より後に追加/アドレス変更されたIDだけを返す（差分の取得）。
+ * 応答 (バイナリ): 1データグラムが1つの塊で、最大 max_chunks 個 (上限 NTS_ROSTER_MAX_CHUNKS)。
+ *   ヘッダ (network byte order, NTS_ROSTER_HDR_LEN バイト):
+ *     magic "RST1" | cursor u32 | next_cursor u32 | version u64 | count u16 | seq u16
+ *   cursor はこの塊の先頭のスロット、next_cursor は続きのスロット (NTS_ROSTER_END なら最後)。
+ *   受け手は塊の cursor が前の塊の next_cursor と一致するかで取りこぼしを検出できる。
+ *   その後に count 個のエントリ: id_len u8 | id | family u8 (4/6) | addr 4/16バイト | port u16
+ *   IPv4とIPv6の両方で登録しているIDは、同じ塊の中にファミリごとの2エントリが続く。
+ * 塊は NTS_ROSTER_CHUNK_MAX バイトに収める（IPv6の最小MTUでも分割されない）。
+ */
+
+#define NTS_ROSTER_TAG         "ROSTER "
+#define NTS_ROSTER_MAGIC       "RST1"
+#define NTS_ROSTER_HDR_LEN     24
+#define NTS_ROSTER_CHUNK_MAX   1200
+#define NTS_ROSTER_MAX_CHUNKS  64
+#define NTS_ROSTER_END         0xffffffffu
+
+/* 組み立て中の塊 */
+struct nts_roster_chunk {
+    size_t len;
+    uint16_t count;
+    unsigned char buf[NTS_ROSTER_CHUNK_MAX];
+};
+
+/* 読み取ったヘッダ */
+struct nts_roster_hdr {
+    uint32_t cursor;
+    uint32_t next_cursor;
+    uint64_t version;
+    uint16_t count;
+    uint16_t seq;
+};
+
+/* 読み取った1エントリ */
+struct nts_roster_item {
+    char id[NTS_ID_MAX + 1];
+    int family;                /* AF_INET / AF_INET6 */
+    unsigned char addr[16];
+    uint16_t port;
+};
+
+void nts_roster_chunk_begin(struct nts_roster_chunk *c);
+/* IDのエントリ（登録済みのファミリごとに1つ）を追加する。入りきらなければ-1（塊はそのまま） */
+int nts_roster_chunk_add(struct nts_roster_chunk *c, const struct client_info *info);
+/* ヘッダを書き込んで塊の長さを返す */
+size_t nts_roster_chunk_finish(struct nts_roster_chunk *c, uint32_t cursor, uint32_t next_cursor,
+                               uint64_t version, uint16_t seq);
+
+/* 塊のヘッダを読む。ROSTERの塊でなければ-1 */
+int nts_roster_parse_hdr(const void *buf, size_t len, struct nts_roster_hdr *h);
+/* *off (最初は NTS_ROSTER_HDR_LEN) からエントリを1つ読み、*off を進める。壊れていれば-1 */
+int nts_roster_next(const void *buf, size_t len, size_t *off, struct nts_roster_item *out);
+
+#endif
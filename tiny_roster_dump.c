@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tiny_roster.h"
+
+/*
+ * サーバから登録中のpeer一覧を取り出して表示する運用ツール。
+ * next_cursor をたどって塊を順に受け取り、cursor が期待と違う塊（取りこぼし・重複）は捨てて、
+ * 進まなくなったら最後に受け取れた位置から要求し直す。
+ * サーバはループバック/プライベートアドレスからの要求にしか応じない。
+ */
+
+#define DUMP_TIMEOUT_MS 500 /* 塊が届かなくなってから要求し直すまで */
+#define DUMP_RETRIES    5   /* 同じ位置で要求し直す回数の上限 */
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <server_host> <server_port> [-c chunks_per_request] [-s since_version] [-q]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int send_request(int fd, const struct sockaddr_in *srv, uint32_t cursor, unsigned chunks,
+                        unsigned long long since)
+{
+    char req[64];
+    int n = snprintf(req, sizeof(req), NTS_ROSTER_TAG "%u %u %llu\n", cursor, chunks, since);
+    if (sendto(fd, req, (size_t)n, 0, (const struct sockaddr *)srv, sizeof(*srv)) < 0) {
+        perror("sendto");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        usage(argv[0]);
+
+    unsigned chunks = 16;
+    unsigned long long since = 0;
+    int quiet = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            chunks = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            since = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-q") == 0)
+            quiet = 1;
+        else
+            usage(argv[0]);
+    }
+    if (chunks == 0 || chunks > NTS_ROSTER_MAX_CHUNKS)
+        chunks = NTS_ROSTER_MAX_CHUNKS;
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long port = strtoul(argv[2], &end, 10);
+    if (errno != 0 || end == argv[2] || *end != '\0' || port == 0 || port > UINT16_MAX)
+        usage(argv[0]);
+
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, argv[1], &srv.sin_addr) != 1) {
+        fprintf(stderr, "invalid server_host\n");
+        return 1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    /* 1回の要求で最大 chunks 個の塊がまとめて届くので、受信バッファに余裕を持たせる */
+    int rcvbuf = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    uint32_t want = 0;
+    unsigned requests = 0, retries = 0;
+    unsigned long long entries = 0, accepted = 0, discarded = 0, bytes = 0, version = 0;
+    uint64_t start = now_us();
+    if (send_request(fd, &srv, want, chunks, since) != 0)
+        return 1;
+    requests++;
+
+    unsigned char buf[NTS_ROSTER_CHUNK_MAX + 64];
+    int done = 0;
+    while (!done) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int pr = poll(&pfd, 1, DUMP_TIMEOUT_MS);
+        if (pr < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (pr == 0) {
+            if (++retries > DUMP_RETRIES) {
+                fprintf(stderr, "no response from server at cursor %u\n", want);
+                break;
+            }
+            if (send_request(fd, &srv, want, chunks, since) != 0)
+                break;
+            requests++;
+            continue;
+        }
+
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0)
+            continue;
+        struct nts_roster_hdr h;
+        if (from.sin_addr.s_addr != srv.sin_addr.s_addr || from.sin_port != srv.sin_port ||
+            nts_roster_parse_hdr(buf, (size_t)n, &h) != 0)
+            continue;
+        if (h.cursor != want) {
+            discarded++; /* 前の要求の残りか、間の塊を取りこぼした */
+            continue;
+        }
+
+        size_t off = NTS_ROSTER_HDR_LEN;
+        struct nts_roster_item item;
+        for (uint16_t i = 0; i < h.count; i++) {
+            if (nts_roster_next(buf, (size_t)n, &off, &item) != 0) {
+                fprintf(stderr, "malformed roster chunk at cursor %u\n", h.cursor);
+                break;
+            }
+            entries++;
+            if (!quiet) {
+                char ip[INET6_ADDRSTRLEN];
+                inet_ntop(item.family, item.addr, ip, sizeof(ip));
+                printf("%s %s %u\n", item.id, ip, item.port);
+            }
+        }
+        accepted++;
+        bytes += (unsigned long long)n;
+        version = h.version;
+        retries = 0;
+        want = h.next_cursor;
+        if (want == NTS_ROSTER_END) {
+            done = 1;
+        } else if (h.seq + 1u >= chunks) {
+            /* この要求の分を受け取りきったので続きを頼む */
+            if (send_request(fd, &srv, want, chunks, since) != 0)
+                break;
+            requests++;
+        }
+    }
+
+    double ms = (double)(now_us() - start) / 1000.0;
+    fprintf(stderr, "roster: %s, %llu entries in %llu chunk(s) (%llu B) over %u request(s), "
+            "%llu discarded, %.1f ms, version=%llu\n",
+            done ? "complete" : "incomplete", entries, accepted, bytes, requests, discarded, ms, version);
+    close(fd);
+    return done ? 0 : 1;
+}
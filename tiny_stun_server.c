@@ -1,9 +1,12 @@
 #define _POSIX_C_SOURCE 200112L
 #include "tiny_stun_server.h"
+#include "tiny_query_cache.h"
+#include "tiny_trace.h"
+#include "tiny_roster.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
-#include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,163 +15,550 @@
 #include <time.h>
 #include <unistd.h>
 
-#ifndef NI_MAXHOST
-#define NI_MAXHOST 1025
-#endif
-#ifndef NI_MAXSERV
-#define NI_MAXSERV 32
-#endif
-
-#define NTS_KEEPALIVE_INTERVAL_SEC 15
-#define NTS_KEEPALIVE_PAYLOAD "KEEPALIVE"
-
-/* 安全にaddrを文字列へ変換（失敗時は"?"と"0"を入れる） */
-static void addr_to_str(const struct sockaddr_storage *addr, socklen_t addrlen, char *host, size_t hostlen, char *serv, size_t servlen) {
-    if (!addr) return;
-    int rc = getnameinfo((const struct sockaddr *)addr, addrlen, host, hostlen, serv, servlen, NI_NUMERICHOST | NI_NUMERICSERV);
-    if (rc != 0) {
-        snprintf(host, hostlen, "?");
-        snprintf(serv, servlen, "0");
+#define NTS_KEEPALIVE_ACK_TAG "KEEPALIVE_ACK "
+#define NTS_KA_PROBE_TAG "KAPROBE "
+#define NTS_KEEPALIVE_STATS_SEC 60 /* keep-alive集計をログに出す間隔 */
+#define NTS_TRACE_WRITE_MS 1000    /* トレースを有効にしたときにファイルへ書き出す間隔 */
+
+/* ログは verbose のときだけ出す（シミュレーションでは数千クライアント分になるため） */
+#define NTS_LOG(srv, ...) do { if ((srv)->verbose) printf(__VA_ARGS__); } while (0)
+
+static uint64_t srv_now_ms(const struct nts_server *srv) {
+    return tiny_tp_now_us(srv->tp) / 1000u;
+}
+
+/* 宛先のファミリのソケット（IPv6用が無ければIPv4用。仮想網ではどちらも使われない） */
+static int srv_sock_for(const struct nts_server *srv, const struct sockaddr *to) {
+    return to->sa_family == AF_INET6 && srv->sock6 >= 0 ? srv->sock6 : srv->sock;
+}
+
+static void srv_send(struct nts_server *srv, const void *buf, size_t len, const struct sockaddr *to, socklen_t tolen) {
+    tiny_tp_sendto(srv->tp, srv_sock_for(srv, to), buf, len, to, tolen);
+}
+
+static void srv_send_addr(struct nts_server *srv, const void *buf, size_t len, const struct nts_addr *to) {
+    struct sockaddr_storage ss;
+    socklen_t sslen = nts_addr_to_sockaddr(to, &ss);
+    srv_send(srv, buf, len, (const struct sockaddr *)&ss, sslen);
+}
+
+int nts_server_init(struct nts_server *srv, int sock, struct nts_ctx *table, const struct tiny_transport *tp) {
+    if (!srv || !table || !tp) return -1;
+    memset(srv, 0, sizeof(*srv));
+    srv->sock = sock;
+    srv->sock6 = -1;
+    srv->table = table;
+    srv->tp = tp;
+
+    /* 問い合わせキャッシュ/通知まとめ（ワーカー間で共有。大きいのでヒープに置く） */
+    srv->qc = (struct nts_qcache *)malloc(sizeof(*srv->qc));
+    if (!srv->qc || nts_qc_init(srv->qc) != 0) {
+        free(srv->qc);
+        srv->qc = NULL;
+        return -1;
     }
+    srv->next_report_ms = srv_now_ms(srv) + NTS_KEEPALIVE_STATS_SEC * 1000u;
+    srv->next_trace_ms = srv_now_ms(srv) + NTS_TRACE_WRITE_MS;
+    return 0;
 }
 
-struct nts_worker_arg {
-    int sock;
-    struct nts_ctx *table;
-    size_t data_len;
-    struct sockaddr_storage src;
-    socklen_t srclen;
-    char data[];
+void nts_server_dispose(struct nts_server *srv) {
+    if (!srv || !srv->qc) return;
+    nts_qc_dispose(srv->qc);
+    free(srv->qc);
+    srv->qc = NULL;
+}
+
+/* まとめ役が待ち時間の後に送り出すための引数 */
+struct nts_flush_arg {
+    struct nts_server *srv;
+    uint32_t target_id;
+    uint64_t seq;
+    uint32_t trace;     /* まとめ役の問い合わせのトレースID */
+    uint64_t rx_us;     /* その問い合わせを受けた時刻 */
 };
 
-static void *nts_worker(void *p) {
-    struct nts_worker_arg *w = (struct nts_worker_arg *)p;
+static void nts_flush_notify(void *p) {
+    struct nts_flush_arg *f = (struct nts_flush_arg *)p;
+    unsigned lines = nts_qc_flush(f->srv->qc, f->srv->tp, f->target_id, f->seq, srv_now_ms(f->srv));
+    if (lines > 0) {
+        NTS_LOG(f->srv, "server -> notify target_id=%u coalesced %u punch(es)\n", f->target_id, lines);
+        if (f->trace) ttr_span(TTR_SERVER_NOTIFY, f->trace, f->target_id, f->rx_us, tiny_tp_now_us(f->srv->tp), lines);
+    }
+    free(f);
+}
+
+/*
+ * 対象(peer)へ、要求者のグローバルIP/ポートとIDを通知してパンチ開始を促す。
+ * 1つのソケットで多数のIDを持つゲートウェイが宛先を振り分けられるよう、末尾に対象IDを付ける。
+ * 問い合わせにトレースIDが載っていれば、さらにその後ろへ付けて相手にも同じIDで記録させる。
+ * 同じ対象への通知が続いたときはまとめて1データグラムにする(tiny_query_cache.h)。
+ * まとめ役になった呼び出しは、トランスポートの after で待ち時間の後に送り出す。
+ */
+static void nts_notify_punch(struct nts_server *srv, const struct nts_addr *peer, uint32_t target_id,
+                             uint32_t req_id, const struct nts_addr *req, uint64_t now,
+                             uint32_t trace, uint64_t rx_us) {
+    char req_ip[NTS_ADDR_STRLEN];
+    nts_addr_ntop(req, req_ip, sizeof(req_ip));
+    char notify[128];
+    int nlen = trace ? snprintf(notify, sizeof(notify), "PUNCH %s %u %u %u %u\n", req_ip, req->port, req_id, target_id, trace)
+                     : snprintf(notify, sizeof(notify), "PUNCH %s %u %u %u\n", req_ip, req->port, req_id, target_id);
+    struct sockaddr_storage to;
+    socklen_t tolen = nts_addr_to_sockaddr(peer, &to);
+
+    uint64_t seq = 0;
+    unsigned wait_ms = 0;
+    int rc = nts_qc_notify(srv->qc, srv->tp, srv_sock_for(srv, (const struct sockaddr *)&to), target_id,
+                           (const struct sockaddr *)&to, tolen, notify, (size_t)nlen, now, &seq, &wait_ms);
+
+    if (rc == NTS_QC_SENT && srv->verbose) {
+        char peer_ip[NTS_ADDR_STRLEN];
+        NTS_LOG(srv, "server -> notify target_id=%u (%s:%u) to punch req_id=%u '%.*s'\n",
+                target_id, nts_addr_ntop(peer, peer_ip, sizeof(peer_ip)), peer->port, req_id, nlen, notify);
+    }
+    if (rc == NTS_QC_SENT) {
+        if (trace) ttr_span(TTR_SERVER_NOTIFY, trace, target_id, rx_us, tiny_tp_now_us(srv->tp), 1);
+    } else if (rc == NTS_QC_LEADER) {
+        struct nts_flush_arg *f = (struct nts_flush_arg *)malloc(sizeof(*f));
+        if (!f) return;
+        f->srv = srv;
+        f->target_id = target_id;
+        f->seq = seq;
+        f->trace = trace;
+        f->rx_us = rx_us;
+        srv->tp->after(srv->tp->ctx, wait_ms, nts_flush_notify, f);
+    } else if (trace) {
+        /* 他の呼び出しのまとめ送りに乗った/重複: 送られる時刻はまとめ役の区間で分かる */
+        ttr_instant(TTR_SERVER_NOTIFY, trace, target_id, rx_us, (uint32_t)rc);
+    }
+}
+
+/* 名簿の塊を組み立てる走査の状態 */
+struct nts_roster_walk {
+    struct nts_roster_chunk chunk;
+    int full;
+};
+
+static int nts_roster_visit(struct client_node *node, void *arg) {
+    struct nts_roster_walk *w = (struct nts_roster_walk *)arg;
+    if (nts_roster_chunk_add(&w->chunk, &node->info) != 0) {
+        w->full = 1;
+        return 0; /* このノードは次の塊の先頭にする */
+    }
+    return 1;
+}
+
+/*
+ * 名簿の要求 "ROSTER <cursor> <max_chunks> [<since>]" に、cursor から最大 max_chunks 個の塊を返す
+ * (tiny_roster.h)。テーブルは nts_iter_step で少しずつ読むので、大きな名簿を返している間も
+ * 登録・問い合わせはほとんど待たされない。
+ * 小さな要求に大きな応答を返すので、踏み台にされないようループバック/プライベートアドレスからの
+ * 要求にだけ応じる（運用ツールやpresenceサービスは内側から問い合わせる想定）。
+ */
+static void nts_serve_roster(struct nts_server *srv, const char *pkt, size_t data_len,
+                             const struct sockaddr *from, socklen_t fromlen,
+                             const struct nts_addr *src, const char *host) {
+    if (nts_ka_classify(src) != NTS_NAT_NONE) {
+        NTS_LOG(srv, "server <- roster request from %s:%u refused (not a private address)\n", host, src->port);
+        return;
+    }
+    char line[96];
+    size_t n = data_len < sizeof(line) - 1 ? data_len : sizeof(line) - 1;
+    memcpy(line, pkt, n);
+    line[n] = '\0';
+    unsigned cursor = 0, max_chunks = 0;
+    unsigned long long since = 0;
+    if (sscanf(line, "ROSTER %u %u %llu", &cursor, &max_chunks, &since) < 2) return;
+    if (max_chunks == 0 || max_chunks > NTS_ROSTER_MAX_CHUNKS) max_chunks = NTS_ROSTER_MAX_CHUNKS;
+
+    struct nts_iter it;
+    nts_iter_init(&it, cursor, since);
+    struct nts_roster_walk w;
+    size_t entries = 0;
+    unsigned chunks = 0;
+    int more = 1;
+    while (more && chunks < max_chunks) {
+        uint32_t start = (uint32_t)it.slot;
+        nts_roster_chunk_begin(&w.chunk);
+        w.full = 0;
+        do {
+            more = nts_iter_step(srv->table, &it, nts_roster_visit, &w);
+        } while (more && !w.full);
+        size_t len = nts_roster_chunk_finish(&w.chunk, start, more ? (uint32_t)it.slot : NTS_ROSTER_END,
+                                             it.version, (uint16_t)chunks);
+        srv_send(srv, w.chunk.buf, len, from, fromlen);
+        entries += w.chunk.count;
+        chunks++;
+    }
+    NTS_LOG(srv, "server -> roster to %s:%u from cursor=%u since=%llu: %u chunk(s), %zu entries%s\n",
+            host, src->port, cursor, since, chunks, entries, more ? "" : " (end)");
+}
+
+/*
+ * 要求者と対象の間で使う経路を選ぶ。対象がIPv6を持ち、要求者もIPv6を持っていればIPv6
+ * （NAT64などを通らない直通）、そうでなければIPv4を使う。
+ * 要求者のアドレスは問い合わせの送信元を優先し（登録より新しい）、もう一方のファミリはテーブルから引く。
+ * どちらのファミリでも揃わなければ、対象の持つアドレスと問い合わせの送信元をそのまま使う。
+ */
+static void nts_pick_path(struct nts_server *srv, uint32_t req_id, const struct nts_addr *src,
+                          const struct nts_addr *peer_v4, const struct nts_addr *peer_v6,
+                          struct nts_addr *req_out, struct nts_addr *peer_out) {
+    const int src_v4 = nts_addr_is_v4(src);
+    struct nts_addr req_v4, req_v6;
+    int req_found = 0, req_looked_up = 0;
+    char req_str[32];
+
+    if (nts_addr_is_set(peer_v6)) {
+        if (!src_v4) {
+            *req_out = *src;
+            *peer_out = *peer_v6;
+            return;
+        }
+        snprintf(req_str, sizeof(req_str), "%u", req_id);
+        req_found = nts_get_client_addrs(srv->table, req_str, &req_v4, &req_v6) == 0;
+        req_looked_up = 1;
+        if (req_found && nts_addr_is_set(&req_v6)) {
+            *req_out = req_v6;
+            *peer_out = *peer_v6;
+            return;
+        }
+    }
+    if (nts_addr_is_set(peer_v4)) {
+        *peer_out = *peer_v4;
+        if (src_v4) {
+            *req_out = *src;
+            return;
+        }
+        if (!req_looked_up) {
+            snprintf(req_str, sizeof(req_str), "%u", req_id);
+            req_found = nts_get_client_addrs(srv->table, req_str, &req_v4, &req_v6) == 0;
+        }
+        *req_out = req_found && nts_addr_is_set(&req_v4) ? req_v4 : *src;
+        return;
+    }
+    *peer_out = *peer_v6;
+    *req_out = *src;
+}
+
+/*
+ * 1パケット分の処理。nts_server_run では受信ごとのスレッドから、
+ * シミュレーションでは配送イベントから同期的に呼ばれる。
+ * 送信元は nts_addr (16バイト+ポート) にしてから扱い、文字列にするのは応答の本文とログだけ。
+ */
+void nts_server_dispatch(struct nts_server *srv, const void *data, size_t data_len,
+                         const struct sockaddr *src, socklen_t srclen) {
+    const char *pkt = (const char *)data;
     const size_t min_register = sizeof(uint32_t);
     const size_t min_query = sizeof(uint32_t) * 2;
+    const size_t ka_tag_len = sizeof(NTS_KEEPALIVE_ACK_TAG) - 1;
+    const size_t probe_tag_len = sizeof(NTS_KA_PROBE_TAG) - 1;
+    const size_t roster_tag_len = sizeof(NTS_ROSTER_TAG) - 1;
+
+    struct nts_addr from;
+    if (nts_addr_from_sockaddr(&from, src, srclen) != 0) return;
+    char host[NTS_ADDR_STRLEN] = "";
+    if (srv->verbose) nts_addr_ntop(&from, host, sizeof(host));
+    uint64_t now = srv_now_ms(srv);
+
+    /*
+     * KEEPALIVEへの応答: "KEEPALIVE_ACK <id>\n"。長さでは問い合わせと区別できないので先に判定する。
+     * 登録済みのIP/ポートか探索用マッピングから届いたときだけ、その無通信時間でもマッピングが生きていた証拠として扱う。
+     */
+    if (data_len > ka_tag_len && memcmp(pkt, NTS_KEEPALIVE_ACK_TAG, ka_tag_len) == 0) {
+        char id_str[32];
+        size_t idlen = data_len - ka_tag_len;
+        if (idlen >= sizeof(id_str)) idlen = sizeof(id_str) - 1;
+        memcpy(id_str, pkt + ka_tag_len, idlen);
+        id_str[idlen] = '\0';
+        id_str[strcspn(id_str, "\r\n")] = '\0';
+
+        if (nts_client_seen(srv->table, id_str, &from, 1, now) != 0) {
+            NTS_LOG(srv, "server <- stale keepalive ack id=%s from %s:%u\n", id_str, host, from.port);
+        }
+    }
 
-    /* 問い合わせパケット: 先頭8バイト (要求者ID, 対象ID) を読み取り、対象の接続情報を返す */
-    if (w->data_len >= min_query) {
+    /*
+     * 寿命の探索用マッピングの通知: "KAPROBE <id>\n"。クライアントが主マッピングとは別のソケットから送ってくる
+     * (tiny_keepalive.h)。以後の探索はこのアドレスで行い、登録したマッピングは失わせない。
+     * 受け付けたら、最初の探索までの最大秒数を載せたKEEPALIVEを探索用マッピングへ返す
+     * （クライアントはそれまで探索用ソケットを閉じずに待つ。そのACKは無通信時間の起点になるだけ）。
+     */
+    else if (data_len > probe_tag_len && memcmp(pkt, NTS_KA_PROBE_TAG, probe_tag_len) == 0) {
+        char id_str[32];
+        size_t idlen = data_len - probe_tag_len;
+        if (idlen >= sizeof(id_str)) idlen = sizeof(id_str) - 1;
+        memcpy(id_str, pkt + probe_tag_len, idlen);
+        id_str[idlen] = '\0';
+        id_str[strcspn(id_str, "\r\n")] = '\0';
+
+        uint32_t expect_ms = 0;
+        if (nts_client_probe_open(srv->table, id_str, &from, now, &expect_ms) != 0) {
+            NTS_LOG(srv, "server <- probe mapping refused id=%s from %s:%u\n", id_str, host, from.port);
+        } else {
+            NTS_LOG(srv, "server <- probe mapping id=%s at %s:%u\n", id_str, host, from.port);
+            char payload[64];
+            int len = snprintf(payload, sizeof(payload), "KEEPALIVE %u %s\n", (expect_ms + 999) / 1000, id_str);
+            srv_send(srv, payload, (size_t)len, src, srclen);
+        }
+    }
+
+    /* 名簿の要求もテキストなので長さで判定する前に見る */
+    else if (data_len > roster_tag_len && memcmp(pkt, NTS_ROSTER_TAG, roster_tag_len) == 0) {
+        nts_serve_roster(srv, pkt, data_len, src, srclen, &from, host);
+    }
+
+    /*
+     * 問い合わせパケット: 先頭8バイト (要求者ID, 対象ID) を読み取り、対象の接続情報を返す。
+     * 続く4バイトがあれば要求番号(txid)とみなし、応答末尾にそのまま付けて返す。
+     * さらに4バイトあればトレースID(tiny_trace.h)とみなしてPUNCHにも載せ、トレースが有効なら処理の区間を記録する。
+     */
+    else if (data_len >= min_query) {
         uint32_t net_req_id = 0;
         uint32_t net_target_id = 0;
-        memcpy(&net_req_id, w->data, sizeof(uint32_t));
-        memcpy(&net_target_id, w->data + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&net_req_id, pkt, sizeof(uint32_t));
+        memcpy(&net_target_id, pkt + sizeof(uint32_t), sizeof(uint32_t));
+
+        char txid_str[16] = "";
+        if (data_len >= min_query + sizeof(uint32_t)) {
+            uint32_t net_txid = 0;
+            memcpy(&net_txid, pkt + min_query, sizeof(uint32_t));
+            snprintf(txid_str, sizeof(txid_str), " %u", ntohl(net_txid));
+        }
+        uint32_t trace = 0;
+        uint64_t rx_us = 0;
+        if (data_len >= min_query + sizeof(uint32_t) * 2) {
+            uint32_t net_trace = 0;
+            memcpy(&net_trace, pkt + min_query + sizeof(uint32_t), sizeof(uint32_t));
+            trace = ntohl(net_trace);
+            rx_us = tiny_tp_now_us(srv->tp);
+        }
 
+        uint32_t req_id = ntohl(net_req_id);
         uint32_t target_id = ntohl(net_target_id);
         char target_str[32];
         snprintf(target_str, sizeof(target_str), "%u", target_id);
 
-        char host[NI_MAXHOST];
-        char serv[NI_MAXSERV];
-        addr_to_str(&w->src, w->srclen, host, sizeof(host), serv, sizeof(serv));
-
-        printf("server <- query req_id=%u target_id=%u from %s:%s (%zu bytes)\n", ntohl(net_req_id), target_id, host, serv, w->data_len);
+        NTS_LOG(srv, "server <- query req_id=%u target_id=%u from %s:%u (%zu bytes)\n", req_id, target_id, host, from.port, data_len);
 
-        struct client_info *peer = nts_find_client(w->table, target_str);
-        char resp[128];
-        int resp_len = 0;
-        if (peer) {
-            /* --- 対象が見つかった場合: 要求元へ応答し、同時に対象(peer)へ通知を送る --- */
-            resp_len = snprintf(resp, sizeof(resp), "PEER %s %u\n", peer->ip, peer->port);
-
-            /* 対象(peer)へ、要求者のグローバルIP/ポートとIDを通知してパンチ開始を促す */
-            char notify[128];
-            int nlen = snprintf(notify, sizeof(notify), "PUNCH %s %s %u\n", host, serv, ntohl(net_req_id));
-            char portstr[16];
-            snprintf(portstr, sizeof(portstr), "%u", peer->port);
-
-            struct addrinfo hints = {0};
-            struct addrinfo *ai = NULL;
-            hints.ai_family = AF_UNSPEC;
-            hints.ai_socktype = SOCK_DGRAM;
-            hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
-
-            if (getaddrinfo(peer->ip, portstr, &hints, &ai) == 0 && ai) {
-                sendto(w->sock, notify, (size_t)nlen, 0, ai->ai_addr, ai->ai_addrlen);
-                printf("server -> notify target_id=%u (%s:%s) to punch req_id=%u at %s:%s '%.*s'\n",
-                       target_id, peer->ip, portstr, ntohl(net_req_id), host, serv, nlen, notify);
-                freeaddrinfo(ai);
-            }
+        /* 同じ要求者・同じ送信元からの同じ問い合わせが直前にあれば、テーブルを引かずに同じ応答を返す */
+        char body[NTS_QC_REPLY_MAX];
+        int body_len = nts_qc_lookup(srv->qc, req_id, target_id, &from, now, body, sizeof(body));
+        int cache_hit = body_len > 0;
+        int notify = 0;
+        struct nts_addr req_addr, peer_addr;
+        if (cache_hit) {
+            NTS_LOG(srv, "server -> query cache hit req_id=%u target_id=%u\n", req_id, target_id);
         } else {
-            /* --- 見つからない場合: NOTFOUNDを返信 --- */
-            resp_len = snprintf(resp, sizeof(resp), "NOTFOUND\n");
+            /* 要求者が登録時と同じマッピングから来ていれば、keep-aliveの無通信時間をリセットする */
+            char req_str[32];
+            snprintf(req_str, sizeof(req_str), "%u", req_id);
+            nts_client_seen(srv->table, req_str, &from, 0, now);
+
+            /* アドレスは別ファミリの登録が書き換えうるので、ロック下で写したものを使う */
+            struct nts_addr peer_v4, peer_v6;
+            if (nts_get_client_addrs(srv->table, target_str, &peer_v4, &peer_v6) == 0) {
+                /* --- 対象が見つかった場合: 要求元へ応答し、続けて対象(peer)へ通知を送る --- */
+                nts_pick_path(srv, req_id, &from, &peer_v4, &peer_v6, &req_addr, &peer_addr);
+                char peer_ip[NTS_ADDR_STRLEN];
+                body_len = snprintf(body, sizeof(body), "PEER %s %u",
+                                    nts_addr_ntop(&peer_addr, peer_ip, sizeof(peer_ip)), peer_addr.port);
+                notify = 1;
+            } else {
+                /* --- 見つからない場合: NOTFOUNDを返信 --- */
+                body_len = snprintf(body, sizeof(body), "NOTFOUND");
+            }
+            nts_qc_store(srv->qc, req_id, target_id, &from, now, body, (size_t)body_len);
         }
 
-        sendto(w->sock, resp, (size_t)resp_len, 0, (struct sockaddr *)&w->src, w->srclen);
-        printf("server -> query resp to %s:%s '%.*s' (%d bytes)\n", host, serv, resp_len, resp, resp_len);
-        (void)net_req_id; /* 未使用警告回避 */
+        char resp[128];
+        int resp_len = snprintf(resp, sizeof(resp), "%s%s\n", body, txid_str);
+
+        srv_send(srv, resp, (size_t)resp_len, src, srclen);
+        NTS_LOG(srv, "server -> query resp to %s:%u '%.*s' (%d bytes)\n", host, from.port, resp_len, resp, resp_len);
+        if (trace) ttr_span(TTR_SERVER_QUERY, trace, target_id, rx_us, tiny_tp_now_us(srv->tp), (uint32_t)cache_hit);
+
+        /* 通知はまとめ送りで待たされることがあるので、要求者への応答を先に出してから渡す */
+        if (notify) nts_notify_punch(srv, &peer_addr, target_id, req_id, &req_addr, now, trace, rx_us);
     }
 
-    /* 登録パケット: 先頭4バイト (クライアントID) を読み取り、送信元の外向きIP/ポートをテーブルへ保存 */
-    else if (w->data_len >= min_register) {
+    /*
+     * 登録パケット: 先頭4バイト (クライアントID) を読み取り、送信元の外向きIP/ポートをテーブルへ保存する。
+     * IPv4とIPv6のどちらで届いたかで、そのファミリの欄だけを更新する。
+     */
+    else if (data_len >= min_register) {
         uint32_t net_id = 0;
-        memcpy(&net_id, w->data, sizeof(uint32_t));
+        memcpy(&net_id, pkt, sizeof(uint32_t));
         uint32_t id = ntohl(net_id);
 
-        char host[NI_MAXHOST];
-        char serv[NI_MAXSERV];
-        addr_to_str(&w->src, w->srclen, host, sizeof(host), serv, sizeof(serv));
-        uint16_t port_host = (uint16_t)atoi(serv);
-
         char id_str[32];
         snprintf(id_str, sizeof(id_str), "%u", id);
-        nts_add_client(w->table, id_str, host, port_host);
-        printf("server <- register id=%u from %s:%s (%zu bytes)\n", id, host, serv, w->data_len);
-		
+        NTS_LOG(srv, "server <- register id=%u from %s:%u (%zu bytes)\n", id, host, from.port, data_len);
+        if (nts_upsert_client(srv->table, id_str, &from, now) != 0) {
+            /* テーブルが満杯: 応答しないのでクライアントは再送し、いずれ諦める */
+            NTS_LOG(srv, "server -> register rejected id=%u (table full)\n", id);
+            return;
+        }
+        nts_qc_invalidate_target(srv->qc, id); /* 古いアドレスを返さないように */
+
         /* --- テーブル登録完了: TABLE_REGISTER を返信 --- */
         char ack[128];
         int ack_len = snprintf(ack, sizeof(ack), "TABLE_REGISTER %u\n", id);
         if (ack_len > 0) {
-            sendto(w->sock, ack, (size_t)ack_len, 0,
-                   (struct sockaddr *)&w->src, w->srclen);
-            printf("server -> register ack to %s:%s '%.*s' (%d bytes)\n",
-                   host, serv, ack_len, ack, ack_len);
+            srv_send(srv, ack, (size_t)ack_len, src, srclen);
+            NTS_LOG(srv, "server -> register ack to %s:%u '%.*s' (%d bytes)\n",
+                    host, from.port, ack_len, ack, ack_len);
         }
     }
 
     /* 先頭4バイトすら無いパケットは無視する */
+}
+
+struct nts_worker_arg {
+    struct nts_server *srv;
+    size_t data_len;
+    struct sockaddr_storage src;
+    socklen_t srclen;
+    char data[];
+};
 
+static void *nts_worker(void *p) {
+    struct nts_worker_arg *w = (struct nts_worker_arg *)p;
+    nts_server_dispatch(w->srv, w->data, w->data_len, (struct sockaddr *)&w->src, w->srclen);
     free(w);
     return NULL;
 }
 
-/* keep-alive送信用スレッドに渡すパラメータ */
-struct nts_keepalive_arg {
-    int sock;             /* 送信に使うサーバソケット */
-    struct nts_ctx *table;/* 登録済みクライアントテーブル（ロック済みでアクセス） */
+/* KEEPALIVE を送るpeer。送信はテーブルのロックの外で行うので写しておく */
+struct nts_ka_target {
+    char id[NTS_ID_MAX + 1];
+    struct nts_addr addr;
+    uint32_t expect_ms;
+    int want_probe; /* 探索用マッピングを作るよう頼む */
+};
+
+/*
+ * KEEPALIVE を1つ送る。本文は次のKEEPALIVEまでの最大秒数（クライアントはこれを過ぎたら再登録する）と宛先ID。
+ * 同じアドレスに複数のIDがいる（ゲートウェイ）ときは、IDで応答すべき相手が分かる。
+ * 探索用マッピングが欲しいときは末尾に " PROBE" を付ける（知らないクライアントは読み飛ばす）。
+ */
+static void nts_keepalive_send(struct nts_server *srv, const struct nts_ka_target *t) {
+    char payload[64];
+    int len = snprintf(payload, sizeof(payload), "KEEPALIVE %u %s%s\n", (t->expect_ms + 999) / 1000, t->id,
+                       t->want_probe ? " PROBE" : "");
+    srv_send_addr(srv, payload, (size_t)len, &t->addr);
+}
+
+/* keep-aliveの1周の走査状態（nts_iter_step 1回分の送り先と、集計） */
+struct nts_ka_walk {
+    uint64_t now;
+    struct nts_ka_stats *st;
+    size_t n;
+    struct nts_ka_target due[NTS_ITER_SLOTS * 2]; /* 主マッピングと探索用マッピングの分 */
+    size_t peers;
+    size_t learned;
+    size_t no_ack;
+    uint64_t sum_ms;
+    uint64_t expired;
 };
 
+/* テーブルのロック下で1ノードを見る: 期限が来ていれば送信済みとして記録し、送り先を写す */
+static int nts_ka_visit(struct client_node *node, void *arg) {
+    struct nts_ka_walk *w = (struct nts_ka_walk *)arg;
+    struct nts_ka_state *k = &node->info.ka;
+    uint64_t expired_before = w->st->expired;
+    int resend = nts_ka_check_timeout(k, w->now, w->st);
+    int probe_resend = nts_ka_check_probe_timeout(k, w->now, w->st);
+    w->expired += w->st->expired - expired_before;
+    if (resend || nts_ka_due(k, w->now)) {
+        struct nts_ka_target *t = &w->due[w->n++];
+        memcpy(t->id, node->info.id, sizeof(t->id));
+        t->addr = *nts_client_ka_addr(&node->info);
+        t->expect_ms = nts_ka_expect_ms(k);
+        t->want_probe = nts_ka_want_probe(k);
+        nts_ka_on_sent(k, w->now, w->st);
+    }
+    if (probe_resend || nts_ka_probe_due(k, w->now)) {
+        struct nts_ka_target *t = &w->due[w->n++];
+        memcpy(t->id, node->info.id, sizeof(t->id));
+        t->addr = k->probe_addr;
+        t->expect_ms = nts_ka_probe_expect_ms(k);
+        t->want_probe = 0;
+        nts_ka_on_probe_sent(k, w->now, w->st);
+    }
+    w->peers++;
+    w->sum_ms += k->interval_ms;
+    if (k->phase == NTS_KA_LEARNED) w->learned++;
+    if (k->phase == NTS_KA_NO_ACK) w->no_ack++;
+    return 1;
+}
+
+/* keep-alive と問い合わせキャッシュの集計をログに出す */
+static void nts_report(struct nts_server *srv, const struct nts_ka_walk *w) {
+    pthread_mutex_lock(&srv->table->lock);
+    struct nts_ka_stats st = srv->table->ka_stats;
+    pthread_mutex_unlock(&srv->table->lock);
+    printf("server keepalive stats: peers=%zu learned=%zu no_ack=%zu avg_interval=%.1fs sent=%llu acked=%llu expired=%llu\n",
+           w->peers, w->learned, w->no_ack, w->peers ? (double)w->sum_ms / (double)w->peers / 1000.0 : 0.0,
+           (unsigned long long)st.sent, (unsigned long long)st.acked,
+           (unsigned long long)st.expired);
+    struct nts_qc_stats qs;
+    nts_qc_get_stats(srv->qc, &qs);
+    printf("server query cache stats: hits=%llu misses=%llu punch_lines=%llu dups=%llu datagrams=%llu\n",
+           (unsigned long long)qs.hits, (unsigned long long)qs.misses,
+           (unsigned long long)qs.notify_lines, (unsigned long long)qs.notify_dups,
+           (unsigned long long)qs.notify_datagrams);
+    ttr_print_histograms(stdout);
+}
+
 /*
- * keep-aliveループ:
- *   一定間隔ごと(NTS_KEEPALIVE_INTERVAL_SEC)に、テーブル内の全クライアントへ
- *   "KEEPALIVE" をUDPで送信し、NATマッピングの継続を狙う。
+ * keep-aliveの1周分:
+ *   テーブルを走査し、peerごとに学習した間隔(tiny_keepalive.h)が過ぎたものにだけ
+ *   "KEEPALIVE <秒>" を送る。応答(KEEPALIVE_ACK)は nts_server_dispatch が記録し、
+ *   応答が無ければ1回再送したうえでその間隔をマッピングの寿命の上限とみなす。
+ *   走査は nts_iter_step で NTS_ITER_SLOTS スロットずつロックを取り直し、送信はロックの外で行う
+ *   （大きなテーブルでも登録・問い合わせを止めない）。
  */
+void nts_server_tick(struct nts_server *srv) {
+    struct nts_ka_walk w;
+    memset(&w, 0, sizeof(w));
+    w.now = srv_now_ms(srv);
+    w.st = &srv->table->ka_stats;
+
+    struct nts_iter it;
+    nts_iter_init(&it, 0, 0);
+    int more;
+    do {
+        w.n = 0;
+        more = nts_iter_step(srv->table, &it, nts_ka_visit, &w);
+        for (size_t i = 0; i < w.n; i++)
+            nts_keepalive_send(srv, &w.due[i]);
+    } while (more);
+
+    if (w.expired) {
+        NTS_LOG(srv, "server keepalive: %llu mapping(s) expired, shortening intervals\n",
+                (unsigned long long)w.expired);
+    }
+
+    if (srv->verbose && w.now >= srv->next_report_ms) {
+        nts_report(srv, &w);
+        srv->next_report_ms = w.now + NTS_KEEPALIVE_STATS_SEC * 1000u;
+    }
+
+    /* サーバは止める手段が無いので、トレースは増えていれば一定間隔で書き出し直す */
+    if (ttr_enabled() && w.now >= srv->next_trace_ms) {
+        ttr_write();
+        srv->next_trace_ms = w.now + NTS_TRACE_WRITE_MS;
+    }
+}
+
+/* keep-aliveループ: NTS_KA_TICK_MS ごとに nts_server_tick を呼ぶ */
 static void *nts_keepalive_loop(void *p) {
-    struct nts_keepalive_arg *ka = (struct nts_keepalive_arg *)p;
-    const char payload[] = NTS_KEEPALIVE_PAYLOAD;
-    struct timespec ts = {.tv_sec = NTS_KEEPALIVE_INTERVAL_SEC, .tv_nsec = 0};
+    struct nts_server *srv = (struct nts_server *)p;
+    struct timespec ts = {.tv_sec = NTS_KA_TICK_MS / 1000, .tv_nsec = (NTS_KA_TICK_MS % 1000) * 1000000L};
 
     for (;;) {
-        /* 送信間隔待ち */
         nanosleep(&ts, NULL);
-
-        /* テーブルをロックして全エントリを走査し、各peerへ送信 */
-        pthread_mutex_lock(&ka->table->lock);
-        for (struct client_node *n = ka->table->head; n; n = n->next) {
-            char portstr[16];
-            snprintf(portstr, sizeof(portstr), "%u", n->info.port);
-
-            struct addrinfo hints = {0};
-            struct addrinfo *ai = NULL;
-            hints.ai_family = AF_UNSPEC;       /* IPv4/IPv6どちらでも解決 */
-            hints.ai_socktype = SOCK_DGRAM;
-            hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
-
-            if (getaddrinfo(n->info.ip, portstr, &hints, &ai) == 0 && ai) {
-                sendto(ka->sock, payload, sizeof(payload), 0, ai->ai_addr, ai->ai_addrlen);
-                freeaddrinfo(ai);
-            }
-        }
-        pthread_mutex_unlock(&ka->table->lock);
+        nts_server_tick(srv);
     }
 
     return NULL;
@@ -177,44 +567,39 @@ static void *nts_keepalive_loop(void *p) {
 /*
  * 1パケット受信し、Full Cone NAT 前提で送信元グローバルIP/ポートを取得して登録する。
  * フォーマット: 先頭4バイトがクライアントID (network byte orderのuint32_t)、以降は任意ペイロード。
- * buf_pool: 受信バッファを確保するためのメモリプール。
+ * buf_pool: 受信バッファ(NTS_BUF_SIZE)を確保するためのメモリプール。
  */
-int nts_server_handle_once(int sock, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size) {
-    if (!table || !buf_pool || buf_size < sizeof(uint32_t)) return -1;
+int nts_server_handle_once(int sock, struct nts_ctx *table, struct nts_buf_pool *buf_pool) {
+    if (!table || !buf_pool) return -1;
 
     /* 受信用バッファをプールから取得 */
-    void *buf = mm_pool_alloc(buf_pool);
+    struct nts_buf *buf = nts_buf_pool_alloc(buf_pool);
     if (!buf) return -1;
 
     struct sockaddr_storage src;
     socklen_t srclen = sizeof(src);
 
     /* UDPを1パケット受信。Full Cone NATでは送信元IP/ポートがそのまま外向き公開情報 */
-    ssize_t n = recvfrom(sock, buf, buf_size, 0, (struct sockaddr *)&src, &srclen);
+    ssize_t n = recvfrom(sock, buf->data, sizeof(buf->data), 0, (struct sockaddr *)&src, &srclen);
     if (n < (ssize_t)sizeof(uint32_t)) {
-        mm_pool_free(buf_pool, buf);
+        nts_buf_pool_free(buf_pool, buf);
         return -1;
     }
 
     /* 先頭4バイトがクライアントID (network byte order) */
     uint32_t net_id;
-    memcpy(&net_id, buf, sizeof(uint32_t));
+    memcpy(&net_id, buf->data, sizeof(uint32_t));
     uint32_t id = ntohl(net_id);
 
     char id_str[32];
     snprintf(id_str, sizeof(id_str), "%u", id);
 
-    /* 送信元アドレスを文字列化し、ポートは数値化する */
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-    addr_to_str(&src, srclen, host, sizeof(host), serv, sizeof(serv));
-
-    uint16_t port_host = (uint16_t)atoi(serv);
+    /* 送信元アドレスを固定長の形にしてテーブルへ登録（既存なら上書き） */
+    struct nts_addr from;
+    int rc = nts_addr_from_sockaddr(&from, (struct sockaddr *)&src, srclen);
+    if (rc == 0) rc = nts_add_client(table, id_str, &from);
 
-    /* テーブルへ登録（既存なら上書き） */
-    int rc = nts_add_client(table, id_str, host, port_host);
-
-    mm_pool_free(buf_pool, buf);
+    nts_buf_pool_free(buf_pool, buf);
     return rc;
 }
 
@@ -222,37 +607,40 @@ int nts_server_handle_once(int sock, struct nts_ctx *table, struct mm_pool *buf_
  * クライアントからの問い合わせ(要求者ID, 対象IDの2つのuint32_t)を受け付け、
  * 対象のIP/ポートを文字列で応答する。Full Cone NAT では受信元が見えていれば十分。
  */
-int nts_server_handle_query_once(int sock, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size) {
-    if (!table || !buf_pool || buf_size < sizeof(uint32_t) * 2) return -1;
+int nts_server_handle_query_once(int sock, struct nts_ctx *table, struct nts_buf_pool *buf_pool) {
+    if (!table || !buf_pool) return -1;
 
-    void *buf = mm_pool_alloc(buf_pool);
+    struct nts_buf *buf = nts_buf_pool_alloc(buf_pool);
     if (!buf) return -1;
 
     struct sockaddr_storage src;
     socklen_t srclen = sizeof(src);
-    ssize_t n = recvfrom(sock, buf, buf_size, 0, (struct sockaddr *)&src, &srclen);
+    ssize_t n = recvfrom(sock, buf->data, sizeof(buf->data), 0, (struct sockaddr *)&src, &srclen);
     if (n < (ssize_t)(sizeof(uint32_t) * 2)) {
-        mm_pool_free(buf_pool, buf);
+        nts_buf_pool_free(buf_pool, buf);
         return -1;
     }
 
     /* 先頭: 要求者ID、次: 対象ID (ともに network byte order) */
     uint32_t net_req;
     uint32_t net_target;
-    memcpy(&net_req, buf, sizeof(uint32_t));
-    memcpy(&net_target, (char *)buf + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&net_req, buf->data, sizeof(uint32_t));
+    memcpy(&net_target, buf->data + sizeof(uint32_t), sizeof(uint32_t));
     uint32_t req_id = ntohl(net_req);
     uint32_t target_id = ntohl(net_target);
 
     char target_str[32];
     snprintf(target_str, sizeof(target_str), "%u", target_id);
 
-    struct client_info *peer = nts_find_client(table, target_str);
+    struct nts_addr v4, v6;
+    int found = nts_get_client_addrs(table, target_str, &v4, &v6) == 0;
 
     char resp[128];
     int resp_len = 0;
-    if (peer) {
-        resp_len = snprintf(resp, sizeof(resp), "PEER %s %u\n", peer->ip, peer->port);
+    if (found) {
+        const struct nts_addr *a = nts_addr_is_set(&v4) ? &v4 : &v6;
+        char ip[NTS_ADDR_STRLEN];
+        resp_len = snprintf(resp, sizeof(resp), "PEER %s %u\n", nts_addr_ntop(a, ip, sizeof(ip)), a->port);
     } else {
         resp_len = snprintf(resp, sizeof(resp), "NOTFOUND\n");
     }
@@ -262,12 +650,30 @@ int nts_server_handle_query_once(int sock, struct nts_ctx *table, struct mm_pool
     /* ログ用に要求者IDを未使用警告なく利用 (不要ならキャストのみ) */
     (void)req_id;
 
-    mm_pool_free(buf_pool, buf);
+    nts_buf_pool_free(buf_pool, buf);
     return 0;
 }
 
-int nts_server_run(int port, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size) {
-    if (!table || !buf_pool || buf_size < sizeof(uint32_t)) return -1;
+/* IPv6専用(IPV6_V6ONLY)のソケットを [::]:port にバインドする。IPv6が使えなければ-1 */
+static int nts_open_v6(int port) {
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    int on = 1;
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_addr = in6addr_any;
+    addr6.sin6_port = htons((uint16_t)port);
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0 ||
+        bind(sock, (struct sockaddr *)&addr6, sizeof(addr6)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int nts_server_run(int port, struct nts_ctx *table, struct nts_buf_pool *buf_pool) {
+    if (!table || !buf_pool) return -1;
 
     FILE *logf = stdout; /* ログは端末へ出力 */
     setvbuf(logf, NULL, _IONBF, 0);
@@ -286,55 +692,86 @@ int nts_server_run(int port, struct nts_ctx *table, struct mm_pool *buf_pool, si
         return -1;
     }
 
+    /*
+     * IPv6は別のソケットで同じポートを待ち受ける（IPv4-mappedにせず、ファミリごとに分ける）。
+     * IPv6の無い環境ではIPv4だけで動く。
+     */
+    int sock6 = nts_open_v6(port);
+    if (sock6 < 0) fprintf(logf, "server: IPv6 unavailable, serving IPv4 only\n");
+
+    /* 実ソケットで動かすサーバ本体（ワーカー間で共有） */
+    struct nts_server srv;
+    if (nts_server_init(&srv, sock, table, &tiny_transport_udp) != 0) {
+        close(sock);
+        if (sock6 >= 0) close(sock6);
+        return -1;
+    }
+    srv.sock6 = sock6;
+    srv.verbose = 1;
+
     /* keep-alive送信スレッドを起動 */
-    struct nts_keepalive_arg ka = {
-        .sock = sock,
-        .table = table,
-    };
     pthread_t ka_th;
-    if (pthread_create(&ka_th, NULL, nts_keepalive_loop, &ka) == 0) {
+    if (pthread_create(&ka_th, NULL, nts_keepalive_loop, &srv) == 0) {
         pthread_detach(ka_th);
     }
 
+    /*
+     * 両方のソケットを1つのループで待つ。先頭は遅延実行(PUNCHのまとめ送り)の起床用で、
+     * 期限はワーカーで眠らずにこのスレッドが poll のタイムアウトとして待つ(tiny_transport.h)
+     */
+    struct pollfd pfds[3] = {{.fd = tiny_tp_udp_wake_fd(), .events = POLLIN},
+                             {.fd = sock, .events = POLLIN}, {.fd = sock6, .events = POLLIN}};
+    nfds_t npfds = sock6 >= 0 ? 3 : 2;
     for (;;) {
-        void *buf = mm_pool_alloc(buf_pool);
-        if (!buf) return -1;
-
-        struct sockaddr_storage src;
-        socklen_t srclen = sizeof(src);
-        ssize_t n = recvfrom(sock, buf, buf_size, 0, (struct sockaddr *)&src, &srclen);
-        if (n < 0) {
-            mm_pool_free(buf_pool, buf);
+        int timeout_ms = tiny_tp_udp_run_due();
+        if (poll(pfds, npfds, timeout_ms) < 0) {
+            if (errno == EINTR) continue;
             return -1;
         }
+        for (nfds_t i = 1; i < npfds; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+
+            struct nts_buf *buf = nts_buf_pool_alloc(buf_pool);
+            if (!buf) return -1;
+
+            struct sockaddr_storage src;
+            socklen_t srclen = sizeof(src);
+            ssize_t n = recvfrom(pfds[i].fd, buf->data, sizeof(buf->data), 0, (struct sockaddr *)&src, &srclen);
+            if (n < 0) {
+                nts_buf_pool_free(buf_pool, buf);
+                return -1;
+            }
 
-        /* 受信データをログ出力（送信元とバイト数） */
-        char host[NI_MAXHOST];
-        char serv[NI_MAXSERV];
-        addr_to_str(&src, srclen, host, sizeof(host), serv, sizeof(serv));
-        fprintf(logf, "server <- pkt from %s:%s (%zd bytes)\n", host, serv, n);
-
-        size_t wsize = sizeof(struct nts_worker_arg) + (size_t)n;
-        struct nts_worker_arg *w = (struct nts_worker_arg *)malloc(wsize);
-        if (!w) {
-            mm_pool_free(buf_pool, buf);
-            return -1;
-        }
-        w->sock = sock;
-        w->table = table;
-        w->data_len = (size_t)n;
-        w->src = src;
-        w->srclen = srclen;
-        memcpy(w->data, buf, (size_t)n);
-
-        mm_pool_free(buf_pool, buf);
-
-        pthread_t th;
-        if (pthread_create(&th, NULL, nts_worker, w) == 0) {
-            pthread_detach(th);
-        } else {
-            free(w);
-            return -1;
+            /* 受信データをログ出力（送信元とバイト数） */
+            struct nts_addr from;
+            char host[NTS_ADDR_STRLEN] = "?";
+            if (nts_addr_from_sockaddr(&from, (struct sockaddr *)&src, srclen) == 0)
+                nts_addr_ntop(&from, host, sizeof(host));
+            else
+                from.port = 0;
+            fprintf(logf, "server <- pkt from %s:%u (%zd bytes)\n", host, from.port, n);
+
+            size_t wsize = sizeof(struct nts_worker_arg) + (size_t)n;
+            struct nts_worker_arg *w = (struct nts_worker_arg *)malloc(wsize);
+            if (!w) {
+                nts_buf_pool_free(buf_pool, buf);
+                return -1;
+            }
+            w->srv = &srv;
+            w->data_len = (size_t)n;
+            w->src = src;
+            w->srclen = srclen;
+            memcpy(w->data, buf->data, (size_t)n);
+
+            nts_buf_pool_free(buf_pool, buf);
+
+            pthread_t th;
+            if (pthread_create(&th, NULL, nts_worker, w) == 0) {
+                pthread_detach(th);
+            } else {
+                free(w);
+                return -1;
+            }
         }
     }
 }
@@ -4,23 +4,64 @@
 #include <stddef.h>
 #include "tiny_peer_table.h"
 #include "mm_pool.h"
+#include "tiny_transport.h"
+
+struct nts_qcache;
+
+/* 受信バッファ1つ（大きさは NTS_BUF_SIZE） */
+struct nts_buf {
+    unsigned char data[NTS_BUF_SIZE];
+};
+
+MM_POOL_DEFINE(nts_buf_pool, struct nts_buf)
+
+/*
+ * サーバ本体。送信と時計は tp を通すので、実ソケット(nts_server_run)でも
+ * 仮想網(tiny_netsim.c)でも同じ処理が動く。
+ */
+struct nts_server {
+    int sock;                         /* tp->sendto に渡すIPv4のソケット（仮想網では未使用） */
+    int sock6;                        /* IPv6宛てに使うソケット。-1なら sock を使う */
+    struct nts_ctx *table;
+    struct nts_qcache *qc;            /* 問い合わせキャッシュ/通知まとめ */
+    const struct tiny_transport *tp;
+    int verbose;                      /* 1ならパケットごとのログを出す */
+    uint64_t next_report_ms;
+    uint64_t next_trace_ms;           /* 次にトレースを書き出す時刻 (tiny_trace.h) */
+};
+
+int nts_server_init(struct nts_server *srv, int sock, struct nts_ctx *table, const struct tiny_transport *tp);
+void nts_server_dispose(struct nts_server *srv);
+/* 受信した1パケットを処理し、応答/通知を tp で送る */
+void nts_server_dispatch(struct nts_server *srv, const void *data, size_t len,
+                         const struct sockaddr *src, socklen_t srclen);
+/* keep-alive送信の1周分。NTS_KA_TICK_MS ごとに呼ぶ */
+void nts_server_tick(struct nts_server *srv);
 
 /* 単発でUDPパケットを受信し、クライアント情報をテーブルに反映する */
-int nts_server_handle_once(int sock, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size);
+int nts_server_handle_once(int sock, struct nts_ctx *table, struct nts_buf_pool *buf_pool);
 
 /*
  * クライアントからの問い合わせ(要求者ID, 対象IDの2つのuint32_t, network byte order)を受け付け、
  * 対象クライアント(bob等)のIP/ポートを文字列でレスポンスする。
  * 見つかった場合: "PEER <ip> <port>\n"
  * 見つからない場合: "NOTFOUND\n"
+ * nts_server_run では3つ目のuint32_t(txid)があれば応答末尾に " <txid>" を付ける。
+ * 4つ目のuint32_tはトレースIDで、PUNCH 通知の末尾に付けて相手へ渡す（トレースが有効なら処理の区間も記録する）。
+ * また直前の同じ問い合わせへの応答をキャッシュし、対象へのPUNCH通知は複数行にまとめて送る
+ * (tiny_query_cache.h)。
  */
-int nts_server_handle_query_once(int sock, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size);
+int nts_server_handle_query_once(int sock, struct nts_ctx *table, struct nts_buf_pool *buf_pool);
 
 /*
- * シンプルなイベントループ。portで指定したUDPポートを::でlistenし、
- * 受信パケットの長さで登録/問い合わせを判定して処理する。
+ * シンプルなイベントループ。portで指定したUDPポートを 0.0.0.0 と [::] (IPV6_V6ONLY) の
+ * 2つのソケットでlistenし、どちらも同じループで受けて、受信パケットの長さで登録/問い合わせを判定して処理する。
+ * peerのアドレスはファミリごとに持ち、両者がIPv6を持っていれば PEER/PUNCH にはIPv6のアドレスを使う。
+ * 別スレッドで登録済みpeerへ "KEEPALIVE <秒>\n" を送り、"KEEPALIVE_ACK <id>\n" の応答から
+ * peerごとのNATマッピング寿命を推定して送信間隔を調整する(tiny_keepalive.h)。
+ * "ROSTER <cursor> <max_chunks> [<since>]" には登録中のpeer一覧をバイナリの塊で返す(tiny_roster.h)。
  * エラーで-1。ループは終了しない設計なので、呼び出し側でプロセス終了を管理する。
  */
-int nts_server_run(int port, struct nts_ctx *table, struct mm_pool *buf_pool, size_t buf_size);
+int nts_server_run(int port, struct nts_ctx *table, struct nts_buf_pool *buf_pool);
 
 #endif
@@ -1,6 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include "tiny_stun_server.h"
-#include "mm_pool.h"
+#include "tiny_trace.h"
 #include <errno.h>
 #include <assert.h>
 #include <signal.h>
@@ -17,12 +17,23 @@ static void on_alarm(int sig) {
 
 int main(int argc, char **argv) {
     uint16_t server_port = 12345;
+    size_t capacity = NTS_TABLE_CAPACITY;
+    if (argc >= 3) {
+        char *end = NULL;
+        errno = 0;
+        unsigned long cap = strtoul(argv[2], &end, 10);
+        if (errno != 0 || end == argv[2] || *end != '\0' || cap == 0) {
+            fprintf(stderr, "usage: %s [port] [capacity]\n", argv[0]);
+            return 1;
+        }
+        capacity = (size_t)cap;
+    }
     if (argc >= 2) {
         char *end = NULL;
         errno = 0;
         unsigned long port = strtoul(argv[1], &end, 10);
         if (errno != 0 || end == argv[1] || *end != '\0' || port == 0 || port > UINT16_MAX) {
-            fprintf(stderr, "usage: %s [port]\n", argv[0]);
+            fprintf(stderr, "usage: %s [port] [capacity]\n", argv[0]);
             return 1;
         }
         server_port = (uint16_t)port;
@@ -32,17 +43,22 @@ int main(int argc, char **argv) {
     setvbuf(stdout, NULL, _IOLBF, 0);
     printf("server starting on %u (UDP)\n", server_port);
 
+    /* TINY_TRACE=<dir> なら <dir>/server-<port>.json へ段階ごとのトレースを書き出す */
+    char trace_name[32];
+    snprintf(trace_name, sizeof(trace_name), "server-%u", server_port);
+    if (ttr_open_env(trace_name) == 0)
+        printf("tracing to %s/%s.json\n", getenv(TTR_ENV), trace_name);
+
     struct nts_ctx table;
-    assert(nts_init(&table, 16) == 0 && "init table");
+    assert(nts_init(&table, capacity) == 0 && "init table");
 
-    struct mm_pool bufpool;
-    size_t buf_size = 1024;
-    assert(mm_pool_init(&bufpool, buf_size, 8) == 0 && "init pool");
+    struct nts_buf_pool bufpool;
+    assert(nts_buf_pool_init(&bufpool, NTS_BUF_POOL_COUNT) == 0 && "init pool");
 
     /* サーバループ（戻らない設計）。SIGALRMで強制終了させる */
-    (void)nts_server_run(server_port, &table, &bufpool, buf_size);
+    (void)nts_server_run(server_port, &table, &bufpool);
 
-    mm_pool_destroy(&bufpool);
+    nts_buf_pool_destroy(&bufpool);
     nts_dispose(&table);
     return 0;
 }
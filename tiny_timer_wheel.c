@@ -0,0 +1,171 @@
+#include "tiny_timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static void list_init(struct tw_timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(struct tw_timer *head, struct tw_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_del(struct tw_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* スロット i に t をつなぎ、最も早い期限と空でないビットを更新する */
+static void slot_add(struct tw_wheel *w, size_t i, struct tw_timer *t)
+{
+    list_add(&w->slots[i], t);
+    if (t->expire < w->slot_min[i])
+        w->slot_min[i] = t->expire;
+    w->occupied[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+/* スロット i からタイマが外れた後に、最も早い期限と空でないビットを直す */
+static void slot_update(struct tw_wheel *w, size_t i, uint64_t removed_expire)
+{
+    const struct tw_timer *head = &w->slots[i];
+    if (head->next == head) {
+        w->slot_min[i] = UINT64_MAX;
+        w->occupied[i / 64] &= ~((uint64_t)1 << (i % 64));
+        return;
+    }
+    if (removed_expire != w->slot_min[i])
+        return;
+    uint64_t m = UINT64_MAX;
+    for (const struct tw_timer *t = head->next; t != head; t = t->next) {
+        if (t->expire < m)
+            m = t->expire;
+    }
+    w->slot_min[i] = m;
+}
+
+void tw_init(struct tw_wheel *w, uint64_t tick_us, uint64_t now_us)
+{
+    w->tick_us = tick_us ? tick_us : 1;
+    w->now = now_us / w->tick_us;
+    w->count = 0;
+    for (size_t i = 0; i < TW_SLOTS; i++) {
+        list_init(&w->slots[i]);
+        w->slot_min[i] = UINT64_MAX;
+    }
+    for (size_t i = 0; i < TW_SLOTS / 64; i++)
+        w->occupied[i] = 0;
+}
+
+void tw_timer_init(struct tw_timer *t, void (*fn)(struct tw_timer *t, void *arg), void *arg)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->expire = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void tw_schedule(struct tw_wheel *w, struct tw_timer *t, uint64_t at_us)
+{
+    if (tw_pending(t))
+        tw_cancel(w, t);
+    /* 切り上げて、期限より前には呼ばない */
+    uint64_t expire = (at_us + w->tick_us - 1) / w->tick_us;
+    if (expire <= w->now)
+        expire = w->now + 1;
+    t->expire = expire;
+    slot_add(w, expire & TW_MASK, t);
+    w->count++;
+}
+
+void tw_cancel(struct tw_wheel *w, struct tw_timer *t)
+{
+    if (!tw_pending(t))
+        return;
+    list_del(t);
+    slot_update(w, t->expire & TW_MASK, t->expire);
+    w->count--;
+}
+
+size_t tw_advance(struct tw_wheel *w, uint64_t now_us)
+{
+    uint64_t target = now_us / w->tick_us;
+    size_t fired = 0;
+
+    /* 1周以上飛んだら最後の1周だけ回せば全スロットを1度ずつ見られる */
+    if (target > w->now + TW_SLOTS)
+        w->now = target - TW_SLOTS;
+
+    while (w->now < target) {
+        w->now++;
+        size_t slot = w->now & TW_MASK;
+        struct tw_timer *head = &w->slots[slot];
+        /*
+         * スロットを手元のリストへ移してから1つずつ取り出す。
+         * コールバックが他のタイマを取り消したり同じスロットへ登録し直しても壊れない
+         */
+        struct tw_timer local;
+        list_init(&local);
+        if (head->next != head) {
+            local.next = head->next;
+            local.prev = head->prev;
+            local.next->prev = &local;
+            local.prev->next = &local;
+            list_init(head);
+            slot_update(w, slot, UINT64_MAX);
+        }
+        while (local.next != &local) {
+            struct tw_timer *t = local.next;
+            list_del(t);
+            if (t->expire > w->now) {
+                slot_add(w, slot, t); /* まだ先の周 */
+                continue;
+            }
+            w->count--;
+            fired++;
+            t->fn(t, t->arg);
+        }
+    }
+    return fired;
+}
+
+/*
+ * 空でないスロットだけを目盛り順に1周見る。スロットの最も早い期限がその周の目盛りと一致すれば
+ * それが次の期限。1周以内に無ければ、各スロットの最も早い期限の最小（1周より先）を返す
+ */
+uint64_t tw_next_us(const struct tw_wheel *w)
+{
+    if (w->count == 0)
+        return UINT64_MAX;
+    uint64_t best = UINT64_MAX;
+    size_t start = (size_t)((w->now + 1) & TW_MASK);
+    size_t n = 0;
+    while (n < TW_SLOTS) {
+        size_t i = (start + n) & TW_MASK;
+        uint64_t bits = w->occupied[i / 64] >> (i % 64);
+        if (bits == 0) {
+            n += 64 - i % 64; /* この語の残りは空 */
+            continue;
+        }
+        n += (size_t)__builtin_ctzll(bits);
+        if (n >= TW_SLOTS)
+            break;
+        i = (start + n) & TW_MASK;
+        uint64_t tick = w->now + 1 + n;
+        if (w->slot_min[i] <= tick)
+            return tick * w->tick_us;
+        if (w->slot_min[i] < best)
+            best = w->slot_min[i];
+        n++;
+    }
+    return best * w->tick_us;
+}
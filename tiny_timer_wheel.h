@@ -0,0 +1,49 @@
+#ifndef TINY_TIMER_WHEEL_H
+#define TINY_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * 多数のタイマを1つの時計で回すハッシュ型タイマホイール。
+ * 時刻を tick_us 単位の目盛りに丸め、目盛り % TW_SLOTS のスロットに双方向リストでつなぐ。
+ * 1周より先のタイマも同じスロットに入れ、期限の目盛りが来るまで読み飛ばす。
+ * 登録・取り消しは O(1)、tw_advance は進めた目盛りの数(最大1周)とその間に期限の来た数に比例する。
+ * スロットごとに最も早い期限と空でないスロットのビットを持ち、tw_next_us はタイマのリストを辿らずに
+ * 空でないスロットだけを目盛り順に見る。
+ *
+ * タイマは呼び出し側の構造体に埋め込み、コールバックで自分の構造体へ戻る。
+ * スレッドセーフではない（1つのイベントループから使う）。
+ */
+
+#define TW_SLOTS 512 /* 2のべき乗（64の倍数） */
+
+struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer *prev;
+    uint64_t expire;                 /* 期限の目盛り */
+    void (*fn)(struct tw_timer *t, void *arg);
+    void *arg;
+};
+
+struct tw_wheel {
+    uint64_t tick_us;
+    uint64_t now;                    /* 処理済みの目盛り */
+    size_t count;                    /* 登録中のタイマ数 */
+    struct tw_timer slots[TW_SLOTS]; /* 各スロットの番兵 */
+    uint64_t slot_min[TW_SLOTS];     /* スロット内の最も早い期限の目盛り（空なら UINT64_MAX） */
+    uint64_t occupied[TW_SLOTS / 64]; /* 空でないスロットのビット */
+};
+
+void tw_init(struct tw_wheel *w, uint64_t tick_us, uint64_t now_us);
+void tw_timer_init(struct tw_timer *t, void (*fn)(struct tw_timer *t, void *arg), void *arg);
+/* at_us に呼ぶよう登録する（登録済みなら付け替える）。過去の時刻なら次の目盛りで呼ぶ */
+void tw_schedule(struct tw_wheel *w, struct tw_timer *t, uint64_t at_us);
+void tw_cancel(struct tw_wheel *w, struct tw_timer *t);
+static inline int tw_pending(const struct tw_timer *t) { return t->next != NULL; }
+/* now_us までの目盛りを進めて期限の来たタイマを呼ぶ。呼んだ数を返す */
+size_t tw_advance(struct tw_wheel *w, uint64_t now_us);
+/* 次に tw_advance を呼ぶべき時刻（最も早い期限の目盛り）。タイマが無ければ UINT64_MAX */
+uint64_t tw_next_us(const struct tw_wheel *w);
+
+#endif
@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tiny_trace.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct ttr_event {
+    atomic_uint ready;   /* 書き終わったら1（書き出し側はこれを見てから読む） */
+    uint8_t phase;
+    uint8_t instant;
+    uint32_t trace;
+    uint32_t peer;
+    uint32_t arg;
+    uint64_t ts_us;
+    uint64_t dur_us;
+};
+
+static struct {
+    int on;
+    char path[PATH_MAX];
+    char name[64];
+    struct ttr_event *ev;
+    atomic_size_t head;              /* 次に書く位置（TTR_MAX_EVENTS を超えたら捨てる） */
+    atomic_ullong dropped;
+    size_t written;                  /* 前回書き出した時のイベント数 */
+    atomic_uint next_id;
+    uint32_t id_salt;
+    atomic_ullong hist[TTR_PHASES][TTR_BUCKETS];
+    atomic_ullong max_us[TTR_PHASES];
+} g;
+
+static const char *const phase_names[TTR_PHASES] = {
+    "register", "query", "server_query", "server_notify", "notify_rx", "punch", "first_data",
+};
+
+const char *ttr_phase_name(enum ttr_phase ph)
+{
+    return (unsigned)ph < TTR_PHASES ? phase_names[ph] : "?";
+}
+
+int ttr_enabled(void)
+{
+    return g.on;
+}
+
+int ttr_open(const char *dir, const char *name)
+{
+    if (g.on || !dir || !name)
+        return -1;
+    if (snprintf(g.path, sizeof(g.path), "%s/%s.json", dir, name) >= (int)sizeof(g.path))
+        return -1;
+    g.ev = (struct ttr_event *)calloc(TTR_MAX_EVENTS, sizeof(*g.ev));
+    if (!g.ev)
+        return -1;
+    snprintf(g.name, sizeof(g.name), "%s", name);
+    atomic_store(&g.head, 0);
+    atomic_store(&g.dropped, 0);
+    g.written = 0;
+    for (unsigned ph = 0; ph < TTR_PHASES; ph++) {
+        for (unsigned b = 0; b < TTR_BUCKETS; b++)
+            atomic_store(&g.hist[ph][b], 0);
+        atomic_store(&g.max_us[ph], 0);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    g.id_salt = (uint32_t)getpid() * 2654435761u ^ (uint32_t)ts.tv_nsec;
+    g.on = 1;
+    return 0;
+}
+
+int ttr_open_env(const char *name)
+{
+    const char *dir = getenv(TTR_ENV);
+    if (!dir || !*dir)
+        return -1;
+    return ttr_open(dir, name);
+}
+
+void ttr_close(void)
+{
+    g.on = 0;
+    free(g.ev);
+    g.ev = NULL;
+}
+
+/* 連番をかき混ぜて、別プロセスのIDとぶつかりにくくする */
+uint32_t ttr_new_id(void)
+{
+    if (!g.on)
+        return 0;
+    uint32_t x = atomic_fetch_add(&g.next_id, 1) + g.id_salt;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x ? x : 1;
+}
+
+/* 2のべきごとに 2^TTR_SUB_BITS 個へ分ける（相対誤差は最大1/8） */
+unsigned ttr_bucket_of(uint64_t v)
+{
+    if (v < (1u << TTR_SUB_BITS))
+        return (unsigned)v;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    unsigned sub = (unsigned)(v >> (msb - TTR_SUB_BITS)) & ((1u << TTR_SUB_BITS) - 1);
+    return ((msb - TTR_SUB_BITS + 1) << TTR_SUB_BITS) + sub;
+}
+
+/* バケットの中央の値 */
+uint64_t ttr_bucket_mid(unsigned b)
+{
+    if (b < (1u << TTR_SUB_BITS))
+        return b;
+    unsigned msb = (b >> TTR_SUB_BITS) + TTR_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << TTR_SUB_BITS) - 1);
+    uint64_t lo = ((uint64_t)(1u << TTR_SUB_BITS) + sub) << (msb - TTR_SUB_BITS);
+    return lo + ((1ull << (msb - TTR_SUB_BITS)) >> 1);
+}
+
+static void record(enum ttr_phase ph, int instant, uint32_t trace, uint32_t peer,
+                   uint64_t ts_us, uint64_t dur_us, uint32_t arg)
+{
+    if (!g.on || (unsigned)ph >= TTR_PHASES)
+        return;
+    if (!instant) {
+        atomic_fetch_add_explicit(&g.hist[ph][ttr_bucket_of(dur_us)], 1, memory_order_relaxed);
+        unsigned long long m = atomic_load_explicit(&g.max_us[ph], memory_order_relaxed);
+        while (dur_us > m &&
+               !atomic_compare_exchange_weak_explicit(&g.max_us[ph], &m, dur_us,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            ;
+    }
+
+    size_t i = atomic_fetch_add_explicit(&g.head, 1, memory_order_relaxed);
+    if (i >= TTR_MAX_EVENTS) {
+        atomic_fetch_add_explicit(&g.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct ttr_event *e = &g.ev[i];
+    e->phase = (uint8_t)ph;
+    e->instant = (uint8_t)instant;
+    e->trace = trace;
+    e->peer = peer;
+    e->arg = arg;
+    e->ts_us = ts_us;
+    e->dur_us = dur_us;
+    atomic_store_explicit(&e->ready, 1, memory_order_release);
+}
+
+void ttr_span(enum ttr_phase ph, uint32_t trace, uint32_t peer, uint64_t start_us, uint64_t end_us, uint32_t arg)
+{
+    record(ph, 0, trace, peer, start_us, end_us > start_us ? end_us - start_us : 0, arg);
+}
+
+void ttr_instant(enum ttr_phase ph, uint32_t trace, uint32_t peer, uint64_t at_us, uint32_t arg)
+{
+    record(ph, 1, trace, peer, at_us, 0, arg);
+}
+
+int ttr_write(void)
+{
+    if (!g.on)
+        return -1;
+    size_t n = atomic_load_explicit(&g.head, memory_order_acquire);
+    if (n > TTR_MAX_EVENTS)
+        n = TTR_MAX_EVENTS;
+    /*
+     * 書き込み途中のイベントから先は次回に回す。書き出せたのは先頭から続けて書き終わった分だけなので、
+     * その数を g.written に残す（飛ばした分を書き出し済みと数えると、後から書き終わっても出ない）
+     */
+    size_t ready = 0;
+    while (ready < n && atomic_load_explicit(&g.ev[ready].ready, memory_order_acquire))
+        ready++;
+    if (ready == g.written)
+        return 0;
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g.path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    long pid = (long)getpid();
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+            pid, g.name);
+    for (size_t i = 0; i < ready; i++) {
+        const struct ttr_event *e = &g.ev[i];
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"p2p\",\"ph\":\"%s\",\"ts\":%llu,",
+                phase_names[e->phase], e->instant ? "i\",\"s\":\"t" : "X", (unsigned long long)e->ts_us);
+        if (!e->instant)
+            fprintf(f, "\"dur\":%llu,", (unsigned long long)e->dur_us);
+        fprintf(f, "\"pid\":%ld,\"tid\":%u,\"args\":{\"trace\":\"%08x\",\"peer\":%u,\"arg\":%u}}",
+                pid, e->trace, e->trace, e->peer, e->arg);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%llu}}\n",
+            (unsigned long long)atomic_load(&g.dropped));
+    if (fclose(f) != 0 || rename(tmp, g.path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    g.written = ready;
+    return 0;
+}
+
+void ttr_print_histograms(FILE *out)
+{
+    if (!g.on)
+        return;
+    for (unsigned ph = 0; ph < TTR_PHASES; ph++) {
+        uint64_t counts[TTR_BUCKETS];
+        uint64_t total = 0;
+        for (unsigned b = 0; b < TTR_BUCKETS; b++) {
+            counts[b] = atomic_load_explicit(&g.hist[ph][b], memory_order_relaxed);
+            total += counts[b];
+        }
+        if (total == 0)
+            continue;
+        static const unsigned qs[3] = { 50, 90, 99 }; /* パーセント。整数で比べて丸めで1つずれないようにする */
+        uint64_t max = atomic_load(&g.max_us[ph]);
+        uint64_t pv[3] = { 0, 0, 0 };
+        uint64_t seen = 0;
+        unsigned qi = 0;
+        for (unsigned b = 0; b < TTR_BUCKETS && qi < 3; b++) {
+            seen += counts[b];
+            while (qi < 3 && seen * 100 >= qs[qi] * total) {
+                uint64_t v = ttr_bucket_mid(b);
+                pv[qi++] = v < max ? v : max; /* 最後のバケットの中央は実際の最大を超えうる */
+            }
+        }
+        fprintf(out, "trace %-13s n=%-6llu p50=%.3f ms p90=%.3f ms p99=%.3f ms max=%.3f ms\n",
+                phase_names[ph], (unsigned long long)total,
+                (double)pv[0] / 1000.0, (double)pv[1] / 1000.0, (double)pv[2] / 1000.0,
+                (double)max / 1000.0);
+    }
+    unsigned long long dropped = atomic_load(&g.dropped);
+    if (dropped)
+        fprintf(out, "trace: %llu event(s) dropped (buffer full)\n", dropped);
+}
@@ -0,0 +1,69 @@
+#ifndef TINY_TRACE_H
+#define TINY_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * 接続ごとの段階(phase)を計時するトレース。既定では無効で、環境変数 TINY_TRACE に
+ * 出力先のディレクトリを指定したプロセスだけが記録する。
+ *
+ * クライアントは問い合わせごとにトレースIDを作って query の4つ目のuint32_tに載せ、
+ * サーバはそれを PUNCH 通知の末尾に付けて相手へ渡す。3者が同じIDで記録するので、
+ * 1つの接続を register → query → サーバ処理 → PUNCH 通知 → punch → 最初のデータ の
+ * 時間軸として並べられる。
+ *
+ * 記録は固定長の配列への追記で、書き込み位置を atomic に進めるだけのロックフリー
+ * (サーバの受信スレッドから同時に呼ばれる)。満杯になったら以降は捨てて数える。
+ * 段階ごとの所要時間は対数ヒストグラム(2のべきを8分割)にも積む。
+ *
+ * 出力は Chrome の trace event 形式の JSON ("<dir>/<name>.json")。chrome://tracing や
+ * Perfetto で開ける。pid はプロセス、tid はトレースIDなので、1接続が1行に並ぶ。
+ * 時刻は CLOCK_MONOTONIC なので、別ホストのファイルを重ねても時刻は揃わない。
+ */
+
+#define TTR_ENV        "TINY_TRACE"
+#define TTR_MAX_EVENTS 65536 /* 1プロセスで記録するイベントの上限 */
+#define TTR_SUB_BITS   3     /* ヒストグラムの2のべきあたりの分割数(2^3) */
+#define TTR_BUCKETS    (64 << TTR_SUB_BITS)
+
+enum ttr_phase {
+    TTR_REGISTER,      /* クライアント: 登録の送信 → TABLE_REGISTER */
+    TTR_QUERY,         /* クライアント: 最初の問い合わせ → PEER（再送・NOTFOUND待ちを含む） */
+    TTR_SERVER_QUERY,  /* サーバ: 問い合わせの受信 → 応答の送信 */
+    TTR_SERVER_NOTIFY, /* サーバ: 問い合わせの受信 → PUNCH通知の送信（まとめ送りの待ちを含む。
+                          他のまとめ送りに乗った分は瞬間で、arg は nts_qc_notify の結果） */
+    TTR_NOTIFY,        /* 相手: PUNCH通知の受信（瞬間。arg は 0:新規 1:punch中 2:確立済み） */
+    TTR_PUNCH,         /* 両側: punch開始 → 確立 */
+    TTR_FIRST_DATA,    /* 両側: 確立 → 最初のデータ受信 */
+    TTR_PHASES
+};
+
+/* dir/name.json へ書き出すトレースを有効にする（記録とヒストグラムは空から始める）。失敗で-1 */
+int ttr_open(const char *dir, const char *name);
+/* TINY_TRACE が設定されていれば（空文字列でなければ）そのディレクトリで開く。無効なら-1 */
+int ttr_open_env(const char *name);
+void ttr_close(void);
+int ttr_enabled(void);
+
+/* 新しいトレースID（0以外）。無効なら0 */
+uint32_t ttr_new_id(void);
+/* 区間を記録する。arg は段階ごとの補足(送信回数など) */
+void ttr_span(enum ttr_phase ph, uint32_t trace, uint32_t peer, uint64_t start_us, uint64_t end_us, uint32_t arg);
+void ttr_instant(enum ttr_phase ph, uint32_t trace, uint32_t peer, uint64_t at_us, uint32_t arg);
+
+/*
+ * 記録済みのイベントを JSON に書き出す（一時ファイルから rename）。前回から増えていなければ何もしない。
+ * 別スレッドが書き込み途中のイベントがあれば、その手前までを書き、残りは次回に回す
+ */
+int ttr_write(void);
+/* 段階ごとの件数と p50/p90/p99/max を表示する */
+void ttr_print_histograms(FILE *out);
+const char *ttr_phase_name(enum ttr_phase ph);
+
+/* 所要時間(us)のヒストグラムのバケット(0..TTR_BUCKETS-1)と、バケットの中央の値 */
+unsigned ttr_bucket_of(uint64_t v);
+uint64_t ttr_bucket_mid(unsigned b);
+
+#endif
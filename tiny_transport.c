@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200112L
+#include "tiny_transport.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static ssize_t udp_sendto(void *ctx, int sock, const void *buf, size_t len,
+                          const struct sockaddr *to, socklen_t tolen)
+{
+    (void)ctx;
+    return sendto(sock, buf, len, 0, to, tolen);
+}
+
+static uint64_t udp_now_us(void *ctx)
+{
+    (void)ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* after で登録された期限。早い順に並べる */
+struct udp_timer {
+    struct udp_timer *next;
+    uint64_t due_us;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static pthread_mutex_t udp_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct udp_timer *udp_timers;
+static int udp_wake[2] = {-1, -1};
+static pthread_once_t udp_wake_once = PTHREAD_ONCE_INIT;
+
+static void udp_wake_init(void)
+{
+    if (pipe(udp_wake) != 0) {
+        udp_wake[0] = udp_wake[1] = -1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(udp_wake[i], F_SETFL, fcntl(udp_wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(udp_wake[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+int tiny_tp_udp_wake_fd(void)
+{
+    pthread_once(&udp_wake_once, udp_wake_init);
+    return udp_wake[0];
+}
+
+static void udp_after(void *ctx, unsigned ms, void (*fn)(void *arg), void *arg)
+{
+    struct udp_timer *t = (struct udp_timer *)malloc(sizeof(*t));
+    if (!t) {
+        /* 登録できなければその場で呼ぶ（まとめ送りが早まるだけ） */
+        fn(arg);
+        return;
+    }
+    t->due_us = udp_now_us(ctx) + (uint64_t)ms * 1000u;
+    t->fn = fn;
+    t->arg = arg;
+
+    int wake = tiny_tp_udp_wake_fd();
+    pthread_mutex_lock(&udp_timer_lock);
+    struct udp_timer **pp = &udp_timers;
+    while (*pp && (*pp)->due_us <= t->due_us)
+        pp = &(*pp)->next;
+    t->next = *pp;
+    *pp = t;
+    int earliest = udp_timers == t;
+    pthread_mutex_unlock(&udp_timer_lock);
+
+    /* 待っている poll のタイムアウトより早くなったので起こす */
+    if (earliest && wake >= 0) {
+        char c = 0;
+        ssize_t w = write(udp_wake[1], &c, 1);
+        (void)w;
+    }
+}
+
+int tiny_tp_udp_run_due(void)
+{
+    int wake = tiny_tp_udp_wake_fd();
+    if (wake >= 0) {
+        char drain[64];
+        while (read(wake, drain, sizeof(drain)) > 0) {
+        }
+    }
+
+    for (;;) {
+        uint64_t now = udp_now_us(NULL);
+        pthread_mutex_lock(&udp_timer_lock);
+        struct udp_timer *t = udp_timers;
+        if (!t || t->due_us > now) {
+            int ms = t ? (int)((t->due_us - now + 999u) / 1000u) : -1;
+            pthread_mutex_unlock(&udp_timer_lock);
+            return ms;
+        }
+        udp_timers = t->next;
+        pthread_mutex_unlock(&udp_timer_lock);
+        t->fn(t->arg);
+        free(t);
+    }
+}
+
+const struct tiny_transport tiny_transport_udp = {
+    .sendto = udp_sendto,
+    .now_us = udp_now_us,
+    .after = udp_after,
+    .ctx = NULL,
+};
@@ -0,0 +1,46 @@
+#ifndef TINY_TRANSPORT_H
+#define TINY_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * サーバとクライアントが使うデータグラム送信・時計・遅延実行の差し替え口。
+ * 実ソケット版(tiny_transport_udp)の他に、tiny_netsim.c が仮想時間の網を提供する。
+ * ctx は各関数にそのまま渡される（仮想網ではどのノードからの送信かを表す）。
+ */
+struct tiny_transport {
+    ssize_t (*sendto)(void *ctx, int sock, const void *buf, size_t len,
+                      const struct sockaddr *to, socklen_t tolen);
+    uint64_t (*now_us)(void *ctx);
+    /* ms 後に fn(arg) を呼ぶ。呼び出し側は待たされない */
+    void (*after)(void *ctx, unsigned ms, void (*fn)(void *arg), void *arg);
+    void *ctx;
+};
+
+/* sendto(2) / CLOCK_MONOTONIC による実装 */
+extern const struct tiny_transport tiny_transport_udp;
+
+/*
+ * 実ソケット版の after は期限を登録するだけで、fn は tiny_tp_udp_run_due を呼んだスレッドで走る。
+ * 受信ループは tiny_tp_udp_wake_fd を poll に加え、tiny_tp_udp_run_due の返す時間をタイムアウトにする。
+ */
+/* 今より早い期限が登録されたとき読めるようになるfd。作れなければ-1 */
+int tiny_tp_udp_wake_fd(void);
+/* 期限の来た fn を呼び、次の期限までのms（無ければ-1）を返す */
+int tiny_tp_udp_run_due(void);
+
+static inline ssize_t tiny_tp_sendto(const struct tiny_transport *tp, int sock, const void *buf, size_t len,
+                                     const struct sockaddr *to, socklen_t tolen)
+{
+    return tp->sendto(tp->ctx, sock, buf, len, to, tolen);
+}
+
+static inline uint64_t tiny_tp_now_us(const struct tiny_transport *tp)
+{
+    return tp->now_us(tp->ctx);
+}
+
+#endif